@@ -0,0 +1,89 @@
+/**
+ * @file        bench.c
+ * @author      Mathieu Allory
+ * @date        February 2018
+ * @brief       Derrick DFS: deep file search and indexing library
+ * @ref         https://github.com/thew44/derrick
+ *
+ * @details     Micro-benchmark of the substring search kernels used by Derrick DFS
+ *
+ * @license     MIT License
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "derrick.h"
+
+#define BENCH_BUFFER_SIZE   (64 * 1024 * 1024)
+#define BENCH_REPEAT        8
+
+// Fill the buffer with text-like random data: letters, spaces and line breaks
+void FillText(char* o_buffer, size_t i_size)
+{
+    uint32_t seed = 42;
+    for (size_t i = 0; i < i_size; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint32_t r = (seed >> 16) % 32;
+        o_buffer[i] = r < 26 ? (char)('a' + r) : (r < 31 ? ' ' : '\n');
+    }
+}
+
+double Seconds(LARGE_INTEGER i_start, LARGE_INTEGER i_end)
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return (double)(i_end.QuadPart - i_start.QuadPart) / (double)frequency.QuadPart;
+}
+
+int main(int argc, char *argv[])
+{
+    char* buffer = malloc(BENCH_BUFFER_SIZE);
+    FillText(buffer, BENCH_BUFFER_SIZE);
+
+    // The last byte never appears in the text, so every run scans the whole buffer
+    static const size_t lengths[] = { 2, 4, 8, 16, 32, 64 };
+    char needle[65];
+    for (size_t i = 0; i < sizeof(needle) - 1; ++i)
+    {
+        needle[i] = (char)('a' + (i * 7) % 26);
+    }
+
+    int best = derrick_get_kernel();
+    printf("kernel,case,length,GB/s\n");
+    for (int kernel = DERRICK_KERNEL_SCALAR; kernel <= DERRICK_KERNEL_AVX512; ++kernel)
+    {
+        if (derrick_set_kernel(kernel) != kernel) continue;
+
+        for (size_t l = 0; l < 2 * sizeof(lengths) / sizeof(lengths[0]); ++l)
+        {
+            // Every length is measured with and without case folding
+            int nocase = (l % 2) != 0;
+            size_t length = lengths[l / 2];
+            char saved = needle[length - 1];
+            needle[length - 1] = '#';
+
+            LARGE_INTEGER start, end;
+            QueryPerformanceCounter(&start);
+            size_t found = 0;
+            for (int r = 0; r < BENCH_REPEAT; ++r)
+            {
+                const char* where = nocase ? derrick_find_nocase(buffer, BENCH_BUFFER_SIZE, needle, length)
+                                           : derrick_find(buffer, BENCH_BUFFER_SIZE, needle, length);
+                if (where != 0) found++;
+            }
+            QueryPerformanceCounter(&end);
+
+            double bytes = (double)BENCH_BUFFER_SIZE * BENCH_REPEAT;
+            printf("%s,%s,%u,%.2f%s\n", derrick_kernel_name(kernel), nocase ? "nocase" : "exact", (unsigned)length,
+                   bytes / Seconds(start, end) / 1e9, found ? " (unexpected match)" : "");
+            needle[length - 1] = saved;
+        }
+    }
+
+    derrick_set_kernel(best);
+    free(buffer);
+    return 0;
+}
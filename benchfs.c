@@ -0,0 +1,361 @@
+/**
+ * @file        benchfs.c
+ * @author      Mathieu Allory
+ * @date        February 2018
+ * @brief       Derrick DFS: deep file search and indexing library
+ * @ref         https://github.com/thew44/derrick
+ *
+ * @details     Benchmark of the library on a synthetic tree of files
+ *
+ * @license     MIT License
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <windows.h>
+#include <psapi.h>
+#include "derrick.h"
+
+// Word inserted in the lines that must match, never produced by the vocabulary
+#define BENCH_NEEDLE        "qzxderrickqzx"
+#define BENCH_WORDS         4096
+#define BENCH_MAX_QUERIES   10000
+
+// Shape of the generated tree, set from the command line as name=value
+struct Bench_Config_s
+{
+    unsigned files;         // number of files, the nested ones excluded
+    unsigned min_size;      // sizes are spread evenly on a log scale between these two
+    unsigned max_size;
+    unsigned depth;         // levels of directories below the root
+    unsigned fanout;        // subdirectories of each directory
+    double density;         // ratio of the lines containing BENCH_NEEDLE
+    double binary;          // ratio of binary files
+    unsigned nest;          // length of a single chain of nested directories, one file in each
+    unsigned seed;
+    unsigned queries;       // number of index searches timed
+    int threads;
+    int cold;               // 1 to also time the runs after purging the files from the cache
+};
+
+// Same generator on every platform, so that a seed always gives the same tree
+uint32_t Random(uint32_t* io_seed)
+{
+    (*io_seed) = (*io_seed) * 1103515245 + 12345;
+    return (*io_seed) >> 8;
+}
+
+double RandomUnit(uint32_t* io_seed)
+{
+    return (double)Random(io_seed) / (double)(1 << 24);
+}
+
+double Seconds(LARGE_INTEGER i_start, LARGE_INTEGER i_end)
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return (double)(i_end.QuadPart - i_start.QuadPart) / (double)frequency.QuadPart;
+}
+
+// Pronounceable words of 3 to 10 letters, without the letter q so that they never contain the needle
+void MakeWords(char o_words[BENCH_WORDS][12], uint32_t* io_seed)
+{
+    static const char consonants[] = "bcdfghjklmnprstvwxz";
+    static const char vowels[] = "aeiouy";
+    for (int w = 0; w < BENCH_WORDS; ++w)
+    {
+        int length = 3 + (int)(Random(io_seed) % 8);
+        for (int i = 0; i < length; ++i)
+        {
+            o_words[w][i] = (i % 2) ? vowels[Random(io_seed) % 6] : consonants[Random(io_seed) % 19];
+        }
+        o_words[w][length] = '\0';
+    }
+}
+
+// Write a file of i_size bytes: lines of words, some containing the needle, or random bytes
+int WriteTestFile(const char* i_path, size_t i_size, int i_binary, double i_density, char i_words[BENCH_WORDS][12], uint32_t* io_seed)
+{
+    FILE* file = fopen(i_path, "wb");
+    if (file == 0) return DERRICK_ERROR;
+    char* data = malloc(i_size + 128);
+    size_t size = 0;
+    while (size < i_size)
+    {
+        if (i_binary)
+        {
+            // Mostly zeros and small values, like object files, with the needle here and there
+            if (RandomUnit(io_seed) < i_density)
+            {
+                memcpy(data + size, BENCH_NEEDLE, strlen(BENCH_NEEDLE));
+                size += strlen(BENCH_NEEDLE);
+            }
+            uint32_t r = Random(io_seed);
+            data[size++] = (r & 3) ? (char)0 : (char)(r >> 8);
+            continue;
+        }
+
+        // One line of 4 to 15 words
+        int count = 4 + (int)(Random(io_seed) % 12);
+        int needle = RandomUnit(io_seed) < i_density ? (int)(Random(io_seed) % count) : -1;
+        for (int i = 0; i < count; ++i)
+        {
+            const char* word = (i == needle) ? BENCH_NEEDLE : i_words[Random(io_seed) % BENCH_WORDS];
+            size_t length = strlen(word);
+            memcpy(data + size, word, length);
+            size += length;
+            data[size++] = (i + 1 == count) ? '\n' : ' ';
+        }
+    }
+    size_t written = fwrite(data, 1, i_size, file);
+    free(data);
+    fclose(file);
+    return written == i_size ? DERRICK_OK : DERRICK_ERROR;
+}
+
+// Generate the tree described by i_config in i_root, which must not exist yet
+int Generate(const char* i_root, const struct Bench_Config_s* i_config)
+{
+    uint32_t seed = i_config->seed;
+    static char words[BENCH_WORDS][12];
+    MakeWords(words, &seed);
+
+    // Directories in breadth-first order: the children of directory d are fanout * d + 1...
+    size_t number_of_directories = 1;
+    size_t level = 1;
+    for (unsigned d = 0; d < i_config->depth; ++d)
+    {
+        level *= i_config->fanout;
+        number_of_directories += level;
+    }
+    if (!CreateDirectoryA(i_root, NULL)) return DERRICK_PATH_NOT_FOUND;
+    char** directories = malloc(number_of_directories * sizeof(char*));
+    directories[0] = _strdup(i_root);
+    for (size_t d = 1; d < number_of_directories; ++d)
+    {
+        const char* parent = directories[(d - 1) / i_config->fanout];
+        directories[d] = malloc(strlen(parent) + 16);
+        sprintf(directories[d], "%s\\d%u", parent, (unsigned)((d - 1) % i_config->fanout));
+        CreateDirectoryA(directories[d], NULL);
+    }
+
+    int rc = DERRICK_OK;
+    char path[MAX_PATH];
+    double ratio = (double)i_config->max_size / (double)i_config->min_size;
+    for (unsigned f = 0; f < i_config->files && rc == DERRICK_OK; ++f)
+    {
+        int binary = RandomUnit(&seed) < i_config->binary;
+        size_t size = (size_t)(i_config->min_size * pow(ratio, RandomUnit(&seed)));
+        sprintf(path, "%s\\f%u.%s", directories[Random(&seed) % number_of_directories], f, binary ? "bin" : "txt");
+        rc = WriteTestFile(path, size, binary, i_config->density, words, &seed);
+    }
+
+    // A single chain of nested directories, with a small file at each level
+    size_t length = strlen(i_root);
+    memcpy(path, i_root, length + 1);
+    for (unsigned n = 0; n < i_config->nest && rc == DERRICK_OK && length + 16 < MAX_PATH; ++n)
+    {
+        memcpy(path + length, "\\n", 3);
+        length += 2;
+        CreateDirectoryA(path, NULL);
+        memcpy(path + length, "\\f.txt", 7);
+        rc = WriteTestFile(path, i_config->min_size, 0, i_config->density, words, &seed);
+        path[length] = '\0';
+    }
+
+    for (size_t d = 0; d < number_of_directories; ++d) free(directories[d]);
+    free(directories);
+    return rc;
+}
+
+// Number of files and bytes of a tree. With i_purge, every file is also opened without
+// buffering, which makes the system drop it from its cache when no one else has it open.
+void Measure(const char* i_path, int i_purge, uint64_t* io_files, uint64_t* io_bytes)
+{
+    char pattern[MAX_PATH];
+    snprintf(pattern, sizeof(pattern), "%s\\*", i_path);
+    WIN32_FIND_DATAA find;
+    HANDLE hFind = FindFirstFileA(pattern, &find);
+    if (hFind == INVALID_HANDLE_VALUE) return;
+    do
+    {
+        if (!strcmp(find.cFileName, ".") || !strcmp(find.cFileName, "..")) continue;
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "%s\\%s", i_path, find.cFileName);
+        if (find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            Measure(path, i_purge, io_files, io_bytes);
+            continue;
+        }
+        (*io_files)++;
+        (*io_bytes) += ((uint64_t)find.nFileSizeHigh << 32) | find.nFileSizeLow;
+        if (i_purge)
+        {
+            HANDLE hFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+            if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+        }
+    }
+    while (FindNextFileA(hFind, &find));
+    FindClose(hFind);
+}
+
+void Purge(const char* i_root)
+{
+    uint64_t files = 0, bytes = 0;
+    Measure(i_root, 1, &files, &bytes);
+}
+
+double PeakMegabytes(void)
+{
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return (double)counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+}
+
+int Callback_Found(void* ctx, const char* in, const char* where)
+{
+    (*(uint64_t*)ctx)++;
+    return 0;
+}
+
+int CompareDoubles(const void* i_a, const void* i_b)
+{
+    double a = *(const double*)i_a;
+    double b = *(const double*)i_b;
+    return (a > b) - (a < b);
+}
+
+// One line of the report. Latencies are only given for the queries.
+void Report(const char* i_operation, const char* i_cache, double i_seconds, uint64_t i_files, uint64_t i_bytes, uint64_t i_results,
+            const double* i_latencies, size_t i_count)
+{
+    printf("%s,%s,%.4f,%.0f,%.1f,%llu,", i_operation, i_cache, i_seconds, i_files / i_seconds,
+           i_bytes / i_seconds / (1024.0 * 1024.0), (unsigned long long)i_results);
+    if (i_count > 0) printf("%.3f,%.3f,", i_latencies[i_count / 2] * 1e3, i_latencies[(i_count * 99) / 100] * 1e3);
+    else printf(",,");
+    printf("%.1f\n", PeakMegabytes());
+}
+
+void Usage(void)
+{
+    printf("usage: benchfs <directory> [files=N] [min=BYTES] [max=BYTES] [depth=N] [fanout=N] [density=RATIO]\n"
+           "               [binary=RATIO] [nest=N] [seed=N] [queries=N] [threads=N] [cold=0|1]\n"
+           "The tree is generated if the directory does not exist, and reused as it is otherwise.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct Bench_Config_s config = { 10000, 256, 256 * 1024, 3, 8, 0.001, 0.05, 64, 42, 200, 0, 1 };
+    if (argc < 2)
+    {
+        Usage();
+        return 1;
+    }
+    for (int a = 2; a < argc; ++a)
+    {
+        const char* value = strchr(argv[a], '=');
+        if (value == 0) { Usage(); return 1; }
+        value++;
+        if (!strncmp(argv[a], "files=", 6)) config.files = (unsigned)atoi(value);
+        else if (!strncmp(argv[a], "min=", 4)) config.min_size = (unsigned)atoi(value);
+        else if (!strncmp(argv[a], "max=", 4)) config.max_size = (unsigned)atoi(value);
+        else if (!strncmp(argv[a], "depth=", 6)) config.depth = (unsigned)atoi(value);
+        else if (!strncmp(argv[a], "fanout=", 7)) config.fanout = (unsigned)atoi(value);
+        else if (!strncmp(argv[a], "density=", 8)) config.density = atof(value);
+        else if (!strncmp(argv[a], "binary=", 7)) config.binary = atof(value);
+        else if (!strncmp(argv[a], "nest=", 5)) config.nest = (unsigned)atoi(value);
+        else if (!strncmp(argv[a], "seed=", 5)) config.seed = (unsigned)atoi(value);
+        else if (!strncmp(argv[a], "queries=", 8)) config.queries = (unsigned)atoi(value);
+        else if (!strncmp(argv[a], "threads=", 8)) config.threads = atoi(value);
+        else if (!strncmp(argv[a], "cold=", 5)) config.cold = atoi(value);
+        else { Usage(); return 1; }
+    }
+    if (config.min_size == 0) config.min_size = 1;
+    if (config.max_size < config.min_size) config.max_size = config.min_size;
+    if (config.fanout == 0) config.depth = 0;
+    if (config.queries > BENCH_MAX_QUERIES) config.queries = BENCH_MAX_QUERIES;
+
+    const char* root = argv[1];
+    if (GetFileAttributesA(root) == INVALID_FILE_ATTRIBUTES)
+    {
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+        int rc = Generate(root, &config);
+        QueryPerformanceCounter(&end);
+        if (rc != DERRICK_OK)
+        {
+            fprintf(stderr, "Cannot generate the tree in %s\n", root);
+            return 1;
+        }
+        fprintf(stderr, "Tree generated in %.1fs\n", Seconds(start, end));
+    }
+    uint64_t files = 0, bytes = 0;
+    Measure(root, 0, &files, &bytes);
+
+    struct Derrick_Parameters_s cb;
+    derrick_init_parameters(&cb);
+    cb.param_threads = config.threads;
+    cb.cd_found = &Callback_Found;
+
+    // Every operation runs on a purged cache, then again on a warm one
+    printf("operation,cache,seconds,files/s,MB/s,results,p50 ms,p99 ms,peak MB\n");
+    DerrickIndex index = 0;
+    for (int pass = config.cold ? 0 : 1; pass < 2; ++pass)
+    {
+        const char* cache = pass == 0 ? "cold" : "warm";
+        LARGE_INTEGER start, end;
+        uint64_t results = 0;
+
+        if (pass == 0) Purge(root);
+        QueryPerformanceCounter(&start);
+        int count = derrick_count_files(root, &cb);
+        QueryPerformanceCounter(&end);
+        Report("count_files", cache, Seconds(start, end), files, 0, (uint64_t)(count > 0 ? count : 0), 0, 0);
+
+        if (pass == 0) Purge(root);
+        cb.ctx_found = &results;
+        QueryPerformanceCounter(&start);
+        derrick_deep_search(BENCH_NEEDLE, root, &cb);
+        QueryPerformanceCounter(&end);
+        Report("deep_search", cache, Seconds(start, end), files, bytes, results, 0, 0);
+
+        if (pass == 0) Purge(root);
+        derrick_index_free(index);
+        QueryPerformanceCounter(&start);
+        derrick_index_build_ex(&index, root, &cb);
+        QueryPerformanceCounter(&end);
+        Report("index_build", cache, Seconds(start, end), files, bytes, 0, 0, 0);
+    }
+
+    // Queries on the warm cache: the needle, and pairs of words of the vocabulary, which
+    // few files contain
+    uint32_t seed = config.seed;
+    static char words[BENCH_WORDS][12];
+    MakeWords(words, &seed);
+    double* latencies = malloc((config.queries + 1) * sizeof(double));
+    uint64_t results = 0;
+    cb.ctx_found = &results;
+    cb.param_threads = 1;
+    LARGE_INTEGER first, last;
+    QueryPerformanceCounter(&first);
+    for (unsigned q = 0; q < config.queries; ++q)
+    {
+        char query[32];
+        if (q % 4 == 0) strcpy(query, BENCH_NEEDLE);
+        else snprintf(query, sizeof(query), "%s %s", words[Random(&seed) % BENCH_WORDS], words[Random(&seed) % BENCH_WORDS]);
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+        derrick_index_search(index, query, &cb);
+        QueryPerformanceCounter(&end);
+        latencies[q] = Seconds(start, end);
+    }
+    QueryPerformanceCounter(&last);
+    qsort(latencies, config.queries, sizeof(double), &CompareDoubles);
+    if (config.queries > 0) Report("index_search", "warm", Seconds(first, last), 0, 0, results, latencies, config.queries);
+
+    free(latencies);
+    derrick_index_free(index);
+    return 0;
+}
@@ -11,450 +11,7596 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <windows.h>
 #include "derrick.h"
 
-char* derrick_internal_find_line(const char* i_where)
+// Vector kernels are only available on x86 processors
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+# define DERRICK_X86
+#endif
+
+#ifdef _MSC_VER
+# include <intrin.h>
+#endif
+
+#ifdef DERRICK_X86
+# include <immintrin.h>
+# ifdef _MSC_VER
+#  define DERRICK_TARGET(x)
+#  define derrick_internal_Cpuid(regs, leaf, sub) __cpuidex(regs, leaf, sub)
+#  define derrick_internal_Xgetbv() _xgetbv(0)
+# else
+#  include <cpuid.h>
+#  define DERRICK_TARGET(x) __attribute__((target(x)))
+#  define derrick_internal_Cpuid(regs, leaf, sub) __cpuid_count(leaf, sub, (regs)[0], (regs)[1], (regs)[2], (regs)[3])
+static uint64_t derrick_internal_Xgetbv(void)
+{
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+}
+# endif
+#endif
+
+// Size of the bitmap used to deduplicate the trigrams of one file (one bit per trigram)
+#define DERRICK_TRIGRAM_SPACE   (1 << 24)
+// Value marking an unused slot in the trigram hash table
+#define DERRICK_EMPTY_SLOT      0xFFFFFFFF
+
+// Size of the chunks of the arenas used during the build of an index
+#define DERRICK_CHUNK_SIZE      (2 << 20)
+// Largest block of a posting list during the build
+#define DERRICK_MAX_BLOCK       4096
+// Size of the chunks of the files read by chunks, a multiple of the sector size
+#define DERRICK_STREAM_CHUNK    (1 << 20)
+// Room before a chunk for the end of the previous one: the line being read, and the
+// beginning of an occurrence that may go on in the next chunk
+#define DERRICK_STREAM_CARRY    (64 << 10)
+// Files from this size on are read by chunks instead of being mapped, by default
+#define DERRICK_STREAM_SIZE     ((uint64_t)16 << 20)
+// Bytes looked at to tell a binary file from a text file
+#define DERRICK_SNIFF_SIZE      8192
+// Milliseconds between two calls of the progress callback, by default
+#define DERRICK_PROGRESS_PERIOD 100
+// Results kept by a thread before they are reported, when the caller gives no buffer
+#define DERRICK_RESULTS_BATCH   256
+// Room kept by a walk after the path of a directory, for the name of its ignore files
+#define DERRICK_WALK_ROOM       16
+// Line feeds of a newline table between two marks
+#define DERRICK_LINES_BLOCK     64
+// Newline table of a file whose content is not in the index
+#define DERRICK_NO_LINES        ((uint64_t)-1)
+// End of the list of the copies of a file
+#define DERRICK_NO_COPY         ((uint64_t)-1)
+// Parent of the first directory of a path, and directory of a name without separator
+#define DERRICK_NO_DIR          ((uint64_t)-1)
+// Bit of the trigrams of the file names, which never collide with those of the contents
+#define DERRICK_NAME_TRIGRAM    0x01000000u
+// Sections of an index image are aligned on 8 bytes
+#define DERRICK_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+// Chunk of memory of an arena, the data follows the header
+struct Derrick_Chunk_s
+{
+    struct Derrick_Chunk_s* next;
+    size_t size;            // bytes available after the header
+    size_t used;
+};
+
+// Append-only allocator made of chunks, released all at once
+struct Derrick_Arena_s
+{
+    struct Derrick_Chunk_s* first;
+    struct Derrick_Chunk_s* last;
+    size_t size;            // bytes used in all the chunks
+    int large_pages;        // try to back the chunks with large pages
+};
+
+// Block of a posting list during the build, the encoded ids follow the header
+struct Derrick_Block_s
+{
+    struct Derrick_Block_s* next;
+    uint32_t size;
+    uint32_t capacity;
+};
+
+// Posting list of one trigram during the build of an index
+struct Derrick_Posting_s
+{
+    uint32_t trigram;
+    uint32_t count;
+    uint32_t last;          // last file id appended
+    size_t size;            // bytes used in all the blocks
+    struct Derrick_Block_s* first;
+    struct Derrick_Block_s* tail;
+};
+
+// State of the index while it is being built
+struct Derrick_Builder_s
+{
+    size_t number_of_entries;
+    struct Derrick_Arena_s entries; // entries in order of their ids
+    struct Derrick_Arena_s names;   // names of the files and directories, without padding
+    struct Derrick_Arena_s dirs;    // directory table, in the order of the ids
+    size_t number_of_dirs;
+    struct Derrick_Arena_s dir_paths;   // whole path of each directory, to find them
+    struct Derrick_DirSlot_s* dir_slots;
+    size_t dir_slots_used;
+    size_t dir_slots_capacity;  // always a power of 2
+    struct Derrick_Arena_s blocks;  // blocks of the posting lists
+    struct Derrick_Posting_s* slots;
+    size_t slots_used;
+    size_t slots_capacity;  // always a power of 2
+    unsigned char* seen;    // trigrams already seen in the current file
+    uint32_t* touched;      // list of the bits set in seen
+    size_t touched_capacity;
+    size_t number_of_touched;
+    uint64_t content_size;  // bytes of the current file added so far
+    uint32_t trigram;       // last bytes of the current file
+    int large_pages;
+    char* stream;           // buffer of the files read by chunks, allocated when needed
+    uint64_t stream_size;   // files from this size on are read by chunks
+    int unbuffered;
+    int binary;             // DERRICK_BINARY_SKIP to leave the content of binary files out
+    struct Derrick_Arena_s lines;   // newline tables, in the order of the entries
+    struct Derrick_LineMark_s* marks;   // newline table of the current file
+    size_t marks_capacity;
+    unsigned char* gaps;
+    size_t gaps_size;
+    size_t gaps_capacity;
+    uint64_t newlines;      // line feeds of the current file so far
+    uint64_t newline;       // offset of the last one
+    struct Derrick_Copy_s* copies;  // content of the files indexed, to find their copies
+    size_t copies_used;
+    size_t copies_capacity; // always a power of 2
+};
+
+// Slot of the table of the contents indexed by a builder
+struct Derrick_Copy_s
+{
+    uint64_t hash;          // of the content, 0 if the slot is unused
+    uint64_t check;         // second hash of the content, see derrick_internal_Fingerprint
+    uint64_t size;
+    uint64_t mtime;         // of the file when it was indexed
+    uint64_t dir;           // of the entry
+    uint64_t name;          // offset of its name in the names pool
+    uint64_t lines;
+    uint32_t id;
+};
+
+// Slot of the table of the directories of a builder
+struct Derrick_DirSlot_s
+{
+    uint64_t hash;          // of the path, 0 if the slot is unused
+    uint64_t path;          // offset of the path in the dir_paths arena
+    uint64_t dir;
+};
+
+// Slot of the table giving the entry of a file name
+struct Derrick_LookupSlot_s
+{
+    uint32_t segment;       // DERRICK_EMPTY_SLOT if the slot is unused
+    uint32_t entry;
+};
+
+struct Derrick_Lookup_s
+{
+    struct Derrick_LookupSlot_s* slots;
+    size_t used;
+    size_t capacity;        // always a power of 2
+    char* path;             // path of the entry being added
+    size_t path_capacity;
+};
+
+// Content of a file kept by the cache of an index, with the size and write time it was read with
+struct Derrick_Cached_s
+{
+    struct Derrick_Cached_s* newer;     // list from the least recently used
+    struct Derrick_Cached_s* older;
+    struct Derrick_Cached_s* chain;     // next in the same bucket
+    char* path;
+    char* data;
+    uint64_t size;
+    uint64_t mtime;
+    long refs;                          // searches using the content
+    int detached;                       // out of the cache, freed by the last search using it
+};
+
+// Contents of the files verified by the searches of an index, see derrick_index_set_cache
+struct Derrick_Cache_s
+{
+    CRITICAL_SECTION lock;
+    struct Derrick_Cached_s** buckets;
+    size_t number_of_buckets;           // always a power of 2
+    size_t count;
+    uint64_t budget;
+    uint64_t used;                      // bytes of content
+    struct Derrick_Cached_s* newest;
+    struct Derrick_Cached_s* oldest;
+};
+
+// Paths added in order
+struct Derrick_Paths_s
+{
+    char** paths;
+    size_t count;
+    size_t capacity;
+};
+
+// State of a refresh while walking the tree
+struct Derrick_Refresh_s
+{
+    DerrickIndex index;
+    struct Derrick_Builder_s builder;   // files added or changed
+    unsigned char** seen;               // per segment, one bit per entry found in the tree
+};
+
+// Above this number of segments, a refresh or a build merges the smallest ones
+#define DERRICK_MAX_SEGMENTS    8
+// Milliseconds without change notifications before a watcher applies them, by default
+#define DERRICK_WATCH_DELAY     50
+// A watcher applies the changes at the latest after this number of delays, even if more keep coming
+#define DERRICK_WATCH_LATENCY   20
+// Size of the buffer of the change notifications, the largest that works on network shares too
+#define DERRICK_WATCH_BUFFER    (64 << 10)
+// Lock of an index, taken shared by the searches and exclusive by the updates. A SRWLOCK is a
+// pointer that is 0 when free, so an index allocated with calloc needs no initialization.
+#define DERRICK_INDEX_LOCK(index) ((PSRWLOCK)&(index)->lock)
+// Files larger than this share of the budget of a cache are not kept, so that one file
+// cannot evict all the others
+#define DERRICK_CACHE_SHARE     8
+// Directories of a segmented build above this depth are split: their own files, and each of
+// their subdirectories, go to segments of their own
+#define DERRICK_SPLIT_DEPTH     2
+
+const char* derrick_internal_FindScalar(const char* i_data, size_t i_size, const char* i_searchfor, size_t i_length)
+{
+    if (i_length == 0 || i_size < i_length) return 0;
+
+    const char* cur = i_data;
+    const char* last = i_data + i_size - i_length;
+    while (cur <= last)
+    {
+        cur = memchr(cur, i_searchfor[0], last - cur + 1);
+        if (cur == 0) return 0;
+        if (memcmp(cur, i_searchfor, i_length) == 0) return cur;
+        cur++;
+    }
+    return 0;
+}
+
+// ASCII lower case of every byte, other bytes are unchanged
+static unsigned char derrick_internal_fold[256];
+
+void derrick_internal_InitFold(void)
+{
+    for (int c = 0; c < 256; ++c)
+    {
+        derrick_internal_fold[c] = (unsigned char)((c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c);
+    }
+}
+
+int derrick_internal_EqualFold(const char* i_data, const char* i_folded, size_t i_length)
+{
+    for (size_t i = 0; i < i_length; ++i)
+    {
+        if (derrick_internal_fold[(unsigned char)i_data[i]] != (unsigned char)i_folded[i]) return 0;
+    }
+    return 1;
+}
+
+// Case-insensitive kernels expect the string to look for in lower case
+const char* derrick_internal_FindFoldScalar(const char* i_data, size_t i_size, const char* i_folded, size_t i_length)
+{
+    if (i_length == 0 || i_size < i_length) return 0;
+
+    const unsigned char first = (unsigned char)i_folded[0];
+    for (size_t i = 0; i + i_length <= i_size; ++i)
+    {
+        if (derrick_internal_fold[(unsigned char)i_data[i]] == first
+                && derrick_internal_EqualFold(i_data + i + 1, i_folded + 1, i_length - 1))
+        {
+            return i_data + i;
+        }
+    }
+    return 0;
+}
+
+int derrick_internal_Ctz(uint64_t i_mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+# ifdef _WIN64
+    _BitScanForward64(&index, i_mask);
+# else
+    if (_BitScanForward(&index, (unsigned long)i_mask) == 0)
+    {
+        _BitScanForward(&index, (unsigned long)(i_mask >> 32));
+        index += 32;
+    }
+# endif
+    return (int)index;
+#else
+    return __builtin_ctzll(i_mask);
+#endif
+}
+
+// The vector kernels compare the first and the last byte of the string at every position
+// of a block at once, and only call memcmp for the positions where both match.
+#ifdef DERRICK_X86
+
+DERRICK_TARGET("sse2")
+const char* derrick_internal_FindSSE2(const char* i_data, size_t i_size, const char* i_searchfor, size_t i_length)
+{
+    if (i_length < 2 || i_size < i_length) return derrick_internal_FindScalar(i_data, i_size, i_searchfor, i_length);
+
+    const __m128i first = _mm_set1_epi8(i_searchfor[0]);
+    const __m128i last = _mm_set1_epi8(i_searchfor[i_length - 1]);
+    size_t i = 0;
+    for (; i + 16 + i_length - 1 <= i_size; i += 16)
+    {
+        __m128i block_first = _mm_loadu_si128((const __m128i*)(i_data + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i*)(i_data + i + i_length - 1));
+        uint64_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+        while (mask != 0)
+        {
+            int bit = derrick_internal_Ctz(mask);
+            if (memcmp(i_data + i + bit + 1, i_searchfor + 1, i_length - 2) == 0) return i_data + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return derrick_internal_FindScalar(i_data + i, i_size - i, i_searchfor, i_length);
+}
+
+DERRICK_TARGET("avx2")
+const char* derrick_internal_FindAVX2(const char* i_data, size_t i_size, const char* i_searchfor, size_t i_length)
+{
+    if (i_length < 2 || i_size < i_length) return derrick_internal_FindScalar(i_data, i_size, i_searchfor, i_length);
+
+    const __m256i first = _mm256_set1_epi8(i_searchfor[0]);
+    const __m256i last = _mm256_set1_epi8(i_searchfor[i_length - 1]);
+    size_t i = 0;
+    for (; i + 32 + i_length - 1 <= i_size; i += 32)
+    {
+        __m256i block_first = _mm256_loadu_si256((const __m256i*)(i_data + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i*)(i_data + i + i_length - 1));
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+        while (mask != 0)
+        {
+            int bit = derrick_internal_Ctz(mask);
+            if (memcmp(i_data + i + bit + 1, i_searchfor + 1, i_length - 2) == 0) return i_data + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return derrick_internal_FindSSE2(i_data + i, i_size - i, i_searchfor, i_length);
+}
+
+DERRICK_TARGET("avx512f,avx512bw")
+const char* derrick_internal_FindAVX512(const char* i_data, size_t i_size, const char* i_searchfor, size_t i_length)
+{
+    if (i_length < 2 || i_size < i_length) return derrick_internal_FindScalar(i_data, i_size, i_searchfor, i_length);
+
+    const __m512i first = _mm512_set1_epi8(i_searchfor[0]);
+    const __m512i last = _mm512_set1_epi8(i_searchfor[i_length - 1]);
+    size_t i = 0;
+    for (; i + 64 + i_length - 1 <= i_size; i += 64)
+    {
+        __m512i block_first = _mm512_loadu_si512((const void*)(i_data + i));
+        __m512i block_last = _mm512_loadu_si512((const void*)(i_data + i + i_length - 1));
+        uint64_t mask = _mm512_cmpeq_epi8_mask(block_first, first) & _mm512_cmpeq_epi8_mask(block_last, last);
+        while (mask != 0)
+        {
+            int bit = derrick_internal_Ctz(mask);
+            if (memcmp(i_data + i + bit + 1, i_searchfor + 1, i_length - 2) == 0) return i_data + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return derrick_internal_FindAVX2(i_data + i, i_size - i, i_searchfor, i_length);
+}
+
+// Compare 16 bytes at a time, folding the ASCII upper case letters of i_data
+DERRICK_TARGET("sse2")
+int derrick_internal_EqualFoldSSE2(const char* i_data, const char* i_folded, size_t i_length)
+{
+    const __m128i shift = _mm_set1_epi8((char)(128 - 'A'));
+    const __m128i limit = _mm_set1_epi8((char)(-128 + 26));
+    const __m128i bit = _mm_set1_epi8(0x20);
+    size_t i = 0;
+    for (; i + 16 <= i_length; i += 16)
+    {
+        __m128i data = _mm_loadu_si128((const __m128i*)(i_data + i));
+        __m128i upper = _mm_cmplt_epi8(_mm_add_epi8(data, shift), limit);
+        __m128i folded = _mm_or_si128(data, _mm_and_si128(upper, bit));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(folded, _mm_loadu_si128((const __m128i*)(i_folded + i)))) != 0xFFFF) return 0;
+    }
+    return derrick_internal_EqualFold(i_data + i, i_folded + i, i_length - i);
+}
+
+DERRICK_TARGET("sse2")
+const char* derrick_internal_FindFoldSSE2(const char* i_data, size_t i_size, const char* i_folded, size_t i_length)
+{
+    if (i_length < 2 || i_size < i_length) return derrick_internal_FindFoldScalar(i_data, i_size, i_folded, i_length);
+
+    const char lower_first = i_folded[0];
+    const char lower_last = i_folded[i_length - 1];
+    const __m128i first_lo = _mm_set1_epi8(lower_first);
+    const __m128i first_up = _mm_set1_epi8((lower_first >= 'a' && lower_first <= 'z') ? lower_first - ('a' - 'A') : lower_first);
+    const __m128i last_lo = _mm_set1_epi8(lower_last);
+    const __m128i last_up = _mm_set1_epi8((lower_last >= 'a' && lower_last <= 'z') ? lower_last - ('a' - 'A') : lower_last);
+    size_t i = 0;
+    for (; i + 16 + i_length - 1 <= i_size; i += 16)
+    {
+        __m128i block_first = _mm_loadu_si128((const __m128i*)(i_data + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i*)(i_data + i + i_length - 1));
+        __m128i eq_first = _mm_or_si128(_mm_cmpeq_epi8(block_first, first_lo), _mm_cmpeq_epi8(block_first, first_up));
+        __m128i eq_last = _mm_or_si128(_mm_cmpeq_epi8(block_last, last_lo), _mm_cmpeq_epi8(block_last, last_up));
+        uint64_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(eq_first, eq_last));
+        while (mask != 0)
+        {
+            int bit = derrick_internal_Ctz(mask);
+            if (derrick_internal_EqualFoldSSE2(i_data + i + bit + 1, i_folded + 1, i_length - 2)) return i_data + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return derrick_internal_FindFoldScalar(i_data + i, i_size - i, i_folded, i_length);
+}
+
+DERRICK_TARGET("avx2")
+const char* derrick_internal_FindFoldAVX2(const char* i_data, size_t i_size, const char* i_folded, size_t i_length)
+{
+    if (i_length < 2 || i_size < i_length) return derrick_internal_FindFoldScalar(i_data, i_size, i_folded, i_length);
+
+    const char lower_first = i_folded[0];
+    const char lower_last = i_folded[i_length - 1];
+    const __m256i first_lo = _mm256_set1_epi8(lower_first);
+    const __m256i first_up = _mm256_set1_epi8((lower_first >= 'a' && lower_first <= 'z') ? lower_first - ('a' - 'A') : lower_first);
+    const __m256i last_lo = _mm256_set1_epi8(lower_last);
+    const __m256i last_up = _mm256_set1_epi8((lower_last >= 'a' && lower_last <= 'z') ? lower_last - ('a' - 'A') : lower_last);
+    size_t i = 0;
+    for (; i + 32 + i_length - 1 <= i_size; i += 32)
+    {
+        __m256i block_first = _mm256_loadu_si256((const __m256i*)(i_data + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i*)(i_data + i + i_length - 1));
+        __m256i eq_first = _mm256_or_si256(_mm256_cmpeq_epi8(block_first, first_lo), _mm256_cmpeq_epi8(block_first, first_up));
+        __m256i eq_last = _mm256_or_si256(_mm256_cmpeq_epi8(block_last, last_lo), _mm256_cmpeq_epi8(block_last, last_up));
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(eq_first, eq_last));
+        while (mask != 0)
+        {
+            int bit = derrick_internal_Ctz(mask);
+            if (derrick_internal_EqualFoldSSE2(i_data + i + bit + 1, i_folded + 1, i_length - 2)) return i_data + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return derrick_internal_FindFoldSSE2(i_data + i, i_size - i, i_folded, i_length);
+}
+
+DERRICK_TARGET("avx512f,avx512bw")
+const char* derrick_internal_FindFoldAVX512(const char* i_data, size_t i_size, const char* i_folded, size_t i_length)
+{
+    if (i_length < 2 || i_size < i_length) return derrick_internal_FindFoldScalar(i_data, i_size, i_folded, i_length);
+
+    const char lower_first = i_folded[0];
+    const char lower_last = i_folded[i_length - 1];
+    const __m512i first_lo = _mm512_set1_epi8(lower_first);
+    const __m512i first_up = _mm512_set1_epi8((lower_first >= 'a' && lower_first <= 'z') ? lower_first - ('a' - 'A') : lower_first);
+    const __m512i last_lo = _mm512_set1_epi8(lower_last);
+    const __m512i last_up = _mm512_set1_epi8((lower_last >= 'a' && lower_last <= 'z') ? lower_last - ('a' - 'A') : lower_last);
+    size_t i = 0;
+    for (; i + 64 + i_length - 1 <= i_size; i += 64)
+    {
+        __m512i block_first = _mm512_loadu_si512((const void*)(i_data + i));
+        __m512i block_last = _mm512_loadu_si512((const void*)(i_data + i + i_length - 1));
+        uint64_t mask = (_mm512_cmpeq_epi8_mask(block_first, first_lo) | _mm512_cmpeq_epi8_mask(block_first, first_up))
+                & (_mm512_cmpeq_epi8_mask(block_last, last_lo) | _mm512_cmpeq_epi8_mask(block_last, last_up));
+        while (mask != 0)
+        {
+            int bit = derrick_internal_Ctz(mask);
+            if (derrick_internal_EqualFoldSSE2(i_data + i + bit + 1, i_folded + 1, i_length - 2)) return i_data + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return derrick_internal_FindFoldAVX2(i_data + i, i_size - i, i_folded, i_length);
+}
+
+// Return the best kernel supported by the processor and the operating system
+int derrick_internal_DetectKernel(void)
+{
+    int regs[4];
+    int kernel = DERRICK_KERNEL_SCALAR;
+
+    derrick_internal_Cpuid(regs, 0, 0);
+    int max_leaf = regs[0];
+    derrick_internal_Cpuid(regs, 1, 0);
+    if (regs[3] & (1 << 26)) kernel = DERRICK_KERNEL_SSE2;
+
+    // The registers of AVX must also be saved by the OS
+    int osxsave = (regs[2] & (1 << 27)) != 0;
+    uint64_t xcr0 = osxsave ? derrick_internal_Xgetbv() : 0;
+    if (max_leaf >= 7 && (xcr0 & 0x6) == 0x6)
+    {
+        derrick_internal_Cpuid(regs, 7, 0);
+        if (regs[1] & (1 << 5)) kernel = DERRICK_KERNEL_AVX2;
+        if ((regs[1] & (1 << 16)) && (regs[1] & (1 << 30)) && (xcr0 & 0xE6) == 0xE6) kernel = DERRICK_KERNEL_AVX512;
+    }
+    return kernel;
+}
+
+#else
+
+int derrick_internal_DetectKernel(void)
+{
+    return DERRICK_KERNEL_SCALAR;
+}
+
+#endif
+
+typedef const char* (*derrick_find_t)(const char* i_data, size_t i_size, const char* i_searchfor, size_t i_length);
+
+static derrick_find_t derrick_internal_kernel = 0;
+static derrick_find_t derrick_internal_kernel_fold = 0;
+static int derrick_internal_kernel_id = DERRICK_KERNEL_AUTO;
+static int derrick_internal_kernel_best = DERRICK_KERNEL_AUTO;
+
+derrick_find_t derrick_internal_Kernel(int i_kernel, int i_fold)
+{
+    switch (i_kernel)
+    {
+#ifdef DERRICK_X86
+    case DERRICK_KERNEL_SSE2: return i_fold ? &derrick_internal_FindFoldSSE2 : &derrick_internal_FindSSE2;
+    case DERRICK_KERNEL_AVX2: return i_fold ? &derrick_internal_FindFoldAVX2 : &derrick_internal_FindAVX2;
+    case DERRICK_KERNEL_AVX512: return i_fold ? &derrick_internal_FindFoldAVX512 : &derrick_internal_FindAVX512;
+#endif
+    default: return i_fold ? &derrick_internal_FindFoldScalar : &derrick_internal_FindScalar;
+    }
+}
+
+// Select the kernels and fill the tables on first use
+void derrick_internal_Init(void)
+{
+    // Selecting twice from two threads gives the same result, no need for a lock
+    if (derrick_internal_kernel == 0)
+    {
+        derrick_set_kernel(DERRICK_KERNEL_AUTO);
+    }
+}
+
+const char* derrick_internal_find(const char* i_data, size_t i_size, const char* i_searchfor, size_t i_length)
+{
+    derrick_internal_Init();
+    return derrick_internal_kernel(i_data, i_size, i_searchfor, i_length);
+}
+
+// i_folded must be in lower case, see derrick_internal_FoldString
+const char* derrick_internal_find_fold(const char* i_data, size_t i_size, const char* i_folded, size_t i_length)
+{
+    derrick_internal_Init();
+    return derrick_internal_kernel_fold(i_data, i_size, i_folded, i_length);
+}
+
+// Return an allocated copy of the string in lower case
+char* derrick_internal_FoldString(const char* i_string, size_t i_length)
+{
+    derrick_internal_Init();
+    char* folded = malloc(i_length + 1);
+    for (size_t i = 0; i < i_length; ++i)
+    {
+        folded[i] = (char)derrick_internal_fold[(unsigned char)i_string[i]];
+    }
+    folded[i_length] = 0;
+    return folded;
+}
+
+int derrick_set_kernel(int i_kernel)
+{
+    if (derrick_internal_kernel_best == DERRICK_KERNEL_AUTO)
+    {
+        derrick_internal_InitFold();
+        derrick_internal_kernel_best = derrick_internal_DetectKernel();
+    }
+    if (i_kernel == DERRICK_KERNEL_AUTO)
+    {
+        i_kernel = derrick_internal_kernel_best;
+    }
+    if (i_kernel < DERRICK_KERNEL_SCALAR || i_kernel > derrick_internal_kernel_best)
+    {
+        return DERRICK_ERROR;
+    }
+    derrick_internal_kernel_id = i_kernel;
+    derrick_internal_kernel_fold = derrick_internal_Kernel(i_kernel, 1);
+    derrick_internal_kernel = derrick_internal_Kernel(i_kernel, 0);
+    return i_kernel;
+}
+
+int derrick_get_kernel(void)
+{
+    derrick_internal_Init();
+    return derrick_internal_kernel_id;
+}
+
+const char* derrick_kernel_name(int i_kernel)
+{
+    switch (i_kernel)
+    {
+    case DERRICK_KERNEL_AUTO: return "auto";
+    case DERRICK_KERNEL_SCALAR: return "scalar";
+    case DERRICK_KERNEL_SSE2: return "sse2";
+    case DERRICK_KERNEL_AVX2: return "avx2";
+    case DERRICK_KERNEL_AVX512: return "avx512";
+    default: return "unknown";
+    }
+}
+
+// String to look for, prepared once for a whole search
+struct Derrick_Literal_s
+{
+    const char* text;       // as given, or in lower case for a case-insensitive search
+    size_t length;
+    int fold;
+    char* folded;
+};
+
+void derrick_internal_LiteralInit(struct Derrick_Literal_s* o_literal, const char* i_searchfor, Derrick_Parameters i_cb)
+{
+    o_literal->length = strlen(i_searchfor);
+    o_literal->fold = (i_cb->param_case_sensitive <= 0);
+    o_literal->folded = o_literal->fold ? derrick_internal_FoldString(i_searchfor, o_literal->length) : 0;
+    o_literal->text = o_literal->fold ? o_literal->folded : i_searchfor;
+}
+
+void derrick_internal_LiteralFree(struct Derrick_Literal_s* io_literal)
+{
+    free(io_literal->folded);
+}
+
+const char* derrick_internal_LiteralFind(const struct Derrick_Literal_s* i_literal, const char* i_data, size_t i_size)
+{
+    if (i_literal->fold)
+    {
+        return derrick_internal_find_fold(i_data, i_size, i_literal->text, i_literal->length);
+    }
+    return derrick_internal_find(i_data, i_size, i_literal->text, i_literal->length);
+}
+
+const char* derrick_find(const char* i_data, size_t i_size, const char* i_searchfor, size_t i_length)
+{
+    if (i_data == 0 || i_searchfor == 0) return 0;
+    return derrick_internal_find(i_data, i_size, i_searchfor, i_length);
+}
+
+const char* derrick_find_nocase(const char* i_data, size_t i_size, const char* i_searchfor, size_t i_length)
+{
+    if (i_data == 0 || i_searchfor == 0) return 0;
+    char* folded = derrick_internal_FoldString(i_searchfor, i_length);
+    const char* where = derrick_internal_find_fold(i_data, i_size, folded, i_length);
+    free(folded);
+    return where;
+}
+
+// Aho-Corasick automaton recognizing a set of strings in one pass over the data. The
+// transitions form a dense table indexed by byte class: bytes that appear in none of the
+// strings share class 0, and both cases of a letter share a class for a case-insensitive search.
+struct Derrick_Automaton_s
+{
+    uint32_t* delta;            // per state and class: row of the next state << 1 | 1 if a string ends there
+    unsigned char classes[256];
+    size_t number_of_classes;
+    size_t number_of_states;
+    int32_t* output;            // per state, first string ending at this state, -1 if none
+    uint32_t* dictionary;       // per state, next state on the fail chain with an output, DERRICK_EMPTY_SLOT if none
+    int32_t* next_output;       // per string, next string ending at the same state, -1 if none
+    size_t* lengths;            // per string
+    size_t number_of_patterns;
+};
+
+void derrick_internal_AutomatonInit(struct Derrick_Automaton_s* o_automaton, const char* const* i_patterns, size_t i_count, int i_fold)
+{
+    memset(o_automaton, 0, sizeof(struct Derrick_Automaton_s));
+    o_automaton->number_of_patterns = i_count;
+    o_automaton->lengths = malloc((i_count + 1) * sizeof(size_t));
+    o_automaton->next_output = malloc((i_count + 1) * sizeof(int32_t));
+
+    // Give a class to every byte used by the strings
+    unsigned char used[256];
+    memset(used, 0, sizeof(used));
+    size_t max_states = 1;
+    for (size_t p = 0; p < i_count; ++p)
+    {
+        o_automaton->lengths[p] = strlen(i_patterns[p]);
+        max_states += o_automaton->lengths[p];
+        for (const unsigned char* c = (const unsigned char*)i_patterns[p]; *c; ++c)
+        {
+            used[i_fold ? derrick_internal_fold[*c] : *c] = 1;
+        }
+    }
+    unsigned char ids[256];
+    size_t nc = 1;
+    for (int b = 0; b < 256; ++b)
+    {
+        ids[b] = used[b] && nc < 256 ? (unsigned char)nc++ : 0;
+    }
+    if (nc == 256)
+    {
+        // Too many bytes are used to keep a class for the others: one class per byte
+        for (int b = 0; b < 256; ++b) ids[b] = (unsigned char)b;
+    }
+    for (int b = 0; b < 256; ++b)
+    {
+        o_automaton->classes[b] = ids[i_fold ? derrick_internal_fold[b] : b];
+    }
+    o_automaton->number_of_classes = nc;
+
+    // Trie of the strings. Strings are inserted from the last one so that the outputs of
+    // a state are listed in increasing order. Empty strings never match.
+    uint32_t* next = malloc(max_states * nc * sizeof(uint32_t));
+    int32_t* output = malloc(max_states * sizeof(int32_t));
+    for (size_t i = 0; i < max_states * nc; ++i) next[i] = DERRICK_EMPTY_SLOT;
+    for (size_t i = 0; i < max_states; ++i) output[i] = -1;
+    size_t states = 1;
+    for (size_t p = i_count; p-- > 0; )
+    {
+        o_automaton->next_output[p] = -1;
+        if (o_automaton->lengths[p] == 0) continue;
+        uint32_t state = 0;
+        for (const unsigned char* c = (const unsigned char*)i_patterns[p]; *c; ++c)
+        {
+            uint32_t* edge = &next[state * nc + o_automaton->classes[*c]];
+            if (*edge == DERRICK_EMPTY_SLOT) *edge = (uint32_t)states++;
+            state = *edge;
+        }
+        o_automaton->next_output[p] = output[state];
+        output[state] = (int32_t)p;
+    }
+
+    // Fail links in breadth-first order: the row of the fail state of a state is always
+    // complete when the state is reached, so missing edges are copied from it
+    uint32_t* fail = malloc(states * sizeof(uint32_t));
+    uint32_t* dictionary = malloc(states * sizeof(uint32_t));
+    uint32_t* queue = malloc(states * sizeof(uint32_t));
+    size_t head = 0;
+    size_t tail = 0;
+    fail[0] = 0;
+    dictionary[0] = DERRICK_EMPTY_SLOT;
+    for (size_t c = 0; c < nc; ++c)
+    {
+        if (next[c] == DERRICK_EMPTY_SLOT)
+        {
+            next[c] = 0;
+        }
+        else
+        {
+            fail[next[c]] = 0;
+            dictionary[next[c]] = DERRICK_EMPTY_SLOT;
+            queue[tail++] = next[c];
+        }
+    }
+    while (head < tail)
+    {
+        uint32_t state = queue[head++];
+        for (size_t c = 0; c < nc; ++c)
+        {
+            uint32_t* edge = &next[state * nc + c];
+            if (*edge == DERRICK_EMPTY_SLOT)
+            {
+                *edge = next[fail[state] * nc + c];
+            }
+            else
+            {
+                uint32_t child = *edge;
+                fail[child] = next[fail[state] * nc + c];
+                dictionary[child] = output[fail[child]] >= 0 ? fail[child] : dictionary[fail[child]];
+                queue[tail++] = child;
+            }
+        }
+    }
+
+    // Encode the table so that the scan loop needs a single load per byte
+    for (size_t i = 0; i < states * nc; ++i)
+    {
+        uint32_t target = next[i];
+        int final = output[target] >= 0 || dictionary[target] != DERRICK_EMPTY_SLOT;
+        next[i] = ((uint32_t)(target * nc) << 1) | (uint32_t)final;
+    }
+
+    o_automaton->delta = realloc(next, states * nc * sizeof(uint32_t));
+    o_automaton->output = realloc(output, states * sizeof(int32_t));
+    o_automaton->dictionary = dictionary;
+    o_automaton->number_of_states = states;
+    free(fail);
+    free(queue);
+}
+
+void derrick_internal_AutomatonFree(struct Derrick_Automaton_s* io_automaton)
+{
+    free(io_automaton->delta);
+    free(io_automaton->output);
+    free(io_automaton->dictionary);
+    free(io_automaton->next_output);
+    free(io_automaton->lengths);
+    memset(io_automaton, 0, sizeof(struct Derrick_Automaton_s));
+}
+
+// Run the automaton from the row *io_state over [i_data, i_end) up to the first byte where
+// some strings end. Return the address of that byte, or 0 if the end is reached first.
+// *io_state is kept, so the scan can go on from the next byte or from another block of data.
+const char* derrick_internal_AutomatonRun(const struct Derrick_Automaton_s* i_automaton, const char* i_data, const char* i_end, uint32_t* io_state)
+{
+    const uint32_t* delta = i_automaton->delta;
+    const unsigned char* classes = i_automaton->classes;
+    uint32_t row = *io_state;
+    for (const unsigned char* cur = (const unsigned char*)i_data; cur < (const unsigned char*)i_end; ++cur)
+    {
+        uint32_t target = delta[row + classes[*cur]];
+        row = target >> 1;
+        if (target & 1)
+        {
+            (*io_state) = row;
+            return (const char*)cur;
+        }
+    }
+    (*io_state) = row;
+    return 0;
+}
+
+// Regular expressions: the pattern is parsed into a tree, compiled into a Thompson NFA, and
+// run as a DFA whose states are built on demand. Matching is line based: '.' and negated
+// classes never match a line break, '^' and '$' match at the beginning and at the end of a
+// line, and a carriage return ends a line as well as a line feed.
+
+uint64_t derrick_internal_Checksum(const void* i_data, size_t i_size);
+
+// Memory given to the states of a lazy DFA before it starts again from scratch
+#define DERRICK_DFA_MEMORY      (1 << 20)
+// Largest NFA accepted, counted after the expansion of the repetitions
+#define DERRICK_REGEX_MAX_NODES (1 << 16)
+// Largest count in a repetition {m,n}
+#define DERRICK_REGEX_MAX_REPEAT 1000
+// Deepest nesting of groups and repetitions, which the compilation of the expression recurses into
+#define DERRICK_REGEX_MAX_DEPTH 100
+
+enum
+{
+    DERRICK_RE_EMPTY,
+    DERRICK_RE_CHAR,            // one byte of a set
+    DERRICK_RE_BOL,
+    DERRICK_RE_EOL,
+    DERRICK_RE_CAT,
+    DERRICK_RE_ALT,
+    DERRICK_RE_REPEAT,
+    DERRICK_RE_SPLIT,           // NFA only
+    DERRICK_RE_MATCH            // NFA only
+};
+
+// Node of the syntax tree
+struct Derrick_ReNode_s
+{
+    int type;
+    int set;                    // DERRICK_RE_CHAR
+    int literal;                // DERRICK_RE_CHAR matching a single character (both cases if folded), -1 otherwise
+    int min;                    // DERRICK_RE_REPEAT
+    int max;                    // DERRICK_RE_REPEAT, -1 if unbounded
+    int left;                   // DERRICK_RE_REPEAT: node repeated, DERRICK_RE_CAT and DERRICK_RE_ALT: first part in the items of the parser
+    int right;                  // DERRICK_RE_CAT and DERRICK_RE_ALT: number of parts
+};
+
+// Compiled expression, shared by all the threads of a search
+struct Derrick_Regex_s
+{
+    unsigned char* type;        // per NFA node
+    uint32_t* set;
+    uint32_t* out;
+    uint32_t* out1;             // DERRICK_RE_SPLIT
+    size_t number_of_nodes;
+    size_t capacity;
+    uint32_t start;
+    uint32_t (*sets)[8];        // byte sets, one bit per byte
+    size_t number_of_sets;
+    unsigned char classes[256]; // bytes that no set tells apart share a class
+    unsigned char representatives[256];
+    size_t number_of_classes;
+    char* literal;              // string present in every match, 0 if none
+};
+
+// State of the parser
+struct Derrick_ReParser_s
+{
+    const unsigned char* cur;
+    int fold;
+    struct Derrick_ReNode_s* nodes;
+    size_t number_of_nodes;
+    size_t capacity;
+    int* items;                 // parts of the concatenations and alternations, each one contiguous
+    size_t number_of_items;
+    size_t items_capacity;
+    int depth;                  // groups and repetitions around the current node
+    struct Derrick_Regex_s* regex;
+    int error;
+};
+
+// State of a lazy DFA: a set of NFA nodes and the transitions computed so far
+struct Derrick_DState_s
+{
+    struct Derrick_DState_s** next;     // per class, 0 until needed
+    uint32_t* nodes;                    // sorted
+    size_t size;
+    uint64_t hash;
+    int match;                          // a match ends here
+    int match_eol;                      // a match ends here if the line ends
+};
+
+// Lazy DFA of a regular expression, owned by a single thread
+struct Derrick_Dfa_s
+{
+    const struct Derrick_Regex_s* regex;
+    struct Derrick_DState_s** table;    // open addressing, always a power of 2
+    size_t capacity;
+    size_t used;
+    size_t memory;
+    struct Derrick_DState_s* start;
+    struct Derrick_DState_s matched;    // reached from a state with match_eol on a line break
+    uint32_t* list;                     // work areas of the size of the NFA
+    uint32_t* stack;
+    uint32_t* mark;
+    uint32_t generation;
+};
+
+int derrick_internal_ReIsBreak(unsigned char i_c)
+{
+    return i_c == '\n' || i_c == '\r';
+}
+
+int derrick_internal_ReNode(struct Derrick_ReParser_s* io_parser, int i_type, int i_left, int i_right)
+{
+    if (io_parser->number_of_nodes == io_parser->capacity)
+    {
+        io_parser->capacity = io_parser->capacity ? io_parser->capacity * 2 : 64;
+        io_parser->nodes = realloc(io_parser->nodes, io_parser->capacity * sizeof(struct Derrick_ReNode_s));
+    }
+    struct Derrick_ReNode_s* node = &io_parser->nodes[io_parser->number_of_nodes];
+    memset(node, 0, sizeof(struct Derrick_ReNode_s));
+    node->type = i_type;
+    node->literal = -1;
+    node->left = i_left;
+    node->right = i_right;
+    return (int)io_parser->number_of_nodes++;
+}
+
+// Add an empty byte set to the expression
+uint32_t* derrick_internal_ReSet(struct Derrick_ReParser_s* io_parser, int* o_index)
+{
+    struct Derrick_Regex_s* regex = io_parser->regex;
+    regex->sets = realloc(regex->sets, (regex->number_of_sets + 1) * sizeof(regex->sets[0]));
+    memset(regex->sets[regex->number_of_sets], 0, sizeof(regex->sets[0]));
+    (*o_index) = (int)regex->number_of_sets;
+    return regex->sets[regex->number_of_sets++];
+}
+
+void derrick_internal_ReAddByte(uint32_t* io_set, unsigned char i_c)
+{
+    io_set[i_c >> 5] |= (uint32_t)1 << (i_c & 31);
+}
+
+int derrick_internal_ReHasByte(const uint32_t* i_set, unsigned char i_c)
+{
+    return (i_set[i_c >> 5] >> (i_c & 31)) & 1;
+}
+
+// Add the set of a class escape like \d, return 0 if i_c is not one
+int derrick_internal_ReAddEscape(uint32_t* io_set, unsigned char i_c)
+{
+    uint32_t set[8];
+    memset(set, 0, sizeof(set));
+    switch (i_c | 0x20)
+    {
+    case 'd':
+        for (int c = '0'; c <= '9'; ++c) derrick_internal_ReAddByte(set, (unsigned char)c);
+        break;
+    case 'w':
+        for (int c = 0; c < 256; ++c)
+        {
+            if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_')
+            {
+                derrick_internal_ReAddByte(set, (unsigned char)c);
+            }
+        }
+        break;
+    case 's':
+        derrick_internal_ReAddByte(set, ' ');
+        derrick_internal_ReAddByte(set, '\t');
+        derrick_internal_ReAddByte(set, '\f');
+        derrick_internal_ReAddByte(set, '\v');
+        break;
+    default:
+        return 0;
+    }
+    int negate = (i_c >= 'A' && i_c <= 'Z');
+    for (int i = 0; i < 8; ++i)
+    {
+        io_set[i] |= negate ? ~set[i] : set[i];
+    }
+    return 1;
+}
+
+// Byte designated by an escape sequence that is not a class
+unsigned char derrick_internal_ReEscaped(unsigned char i_c)
+{
+    switch (i_c)
+    {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    default: return i_c;
+    }
+}
+
+// Make a set of bytes usable: both cases of the letters if folded, never a line break
+void derrick_internal_ReFinishSet(struct Derrick_ReParser_s* io_parser, uint32_t* io_set)
+{
+    if (io_parser->fold)
+    {
+        for (int c = 'a'; c <= 'z'; ++c)
+        {
+            if (derrick_internal_ReHasByte(io_set, (unsigned char)c) || derrick_internal_ReHasByte(io_set, (unsigned char)(c - 'a' + 'A')))
+            {
+                derrick_internal_ReAddByte(io_set, (unsigned char)c);
+                derrick_internal_ReAddByte(io_set, (unsigned char)(c - 'a' + 'A'));
+            }
+        }
+    }
+    io_set['\n' >> 5] &= ~((uint32_t)1 << ('\n' & 31));
+    io_set['\r' >> 5] &= ~((uint32_t)1 << ('\r' & 31));
+}
+
+int derrick_internal_ReChar(struct Derrick_ReParser_s* io_parser, unsigned char i_c)
+{
+    int node = derrick_internal_ReNode(io_parser, DERRICK_RE_CHAR, -1, -1);
+    uint32_t* set = derrick_internal_ReSet(io_parser, &io_parser->nodes[node].set);
+    derrick_internal_ReAddByte(set, i_c);
+    derrick_internal_ReFinishSet(io_parser, set);
+    io_parser->nodes[node].literal = derrick_internal_ReIsBreak(i_c) ? -1 : i_c;
+    return node;
+}
+
+// Add a named class like [:alpha:] to a set
+int derrick_internal_RePosixClass(struct Derrick_ReParser_s* io_parser, uint32_t* io_set)
+{
+    static const char* names[] = { "alpha", "digit", "alnum", "upper", "lower", "space", "xdigit", "punct" };
+    const char* name = (const char*)io_parser->cur + 2;
+    const char* end = strstr(name, ":]");
+    int which = -1;
+    for (int i = 0; end != 0 && i < (int)(sizeof(names) / sizeof(names[0])); ++i)
+    {
+        if ((size_t)(end - name) == strlen(names[i]) && strncmp(name, names[i], end - name) == 0) which = i;
+    }
+    if (which < 0)
+    {
+        io_parser->error = 1;
+        return 0;
+    }
+    for (int c = 0; c < 128; ++c)
+    {
+        int upper = (c >= 'A' && c <= 'Z');
+        int lower = (c >= 'a' && c <= 'z');
+        int digit = (c >= '0' && c <= '9');
+        int member = 0;
+        switch (which)
+        {
+        case 0: member = upper || lower; break;
+        case 1: member = digit; break;
+        case 2: member = upper || lower || digit; break;
+        case 3: member = upper; break;
+        case 4: member = lower; break;
+        case 5: member = (c == ' ' || (c >= '\t' && c <= '\r')); break;
+        case 6: member = digit || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'); break;
+        case 7: member = (c > ' ' && c < 127 && !upper && !lower && !digit); break;
+        }
+        if (member) derrick_internal_ReAddByte(io_set, (unsigned char)c);
+    }
+    io_parser->cur = (const unsigned char*)end + 2;
+    return 1;
+}
+
+int derrick_internal_ReClass(struct Derrick_ReParser_s* io_parser)
+{
+    int node = derrick_internal_ReNode(io_parser, DERRICK_RE_CHAR, -1, -1);
+    uint32_t* set = derrick_internal_ReSet(io_parser, &io_parser->nodes[node].set);
+    int negate = 0;
+    if (*io_parser->cur == '^')
+    {
+        negate = 1;
+        io_parser->cur++;
+    }
+
+    // A ']' right after the opening bracket is a member
+    int first = 1;
+    while (*io_parser->cur != 0 && (*io_parser->cur != ']' || first))
+    {
+        first = 0;
+        if (io_parser->cur[0] == '[' && io_parser->cur[1] == ':')
+        {
+            if (!derrick_internal_RePosixClass(io_parser, set)) return node;
+            continue;
+        }
+        unsigned char low = *io_parser->cur++;
+        if (low == '\\')
+        {
+            if (*io_parser->cur == 0) break;
+            if (derrick_internal_ReAddEscape(set, *io_parser->cur))
+            {
+                io_parser->cur++;
+                continue;
+            }
+            low = derrick_internal_ReEscaped(*io_parser->cur++);
+        }
+        unsigned char high = low;
+        if (io_parser->cur[0] == '-' && io_parser->cur[1] != ']' && io_parser->cur[1] != 0)
+        {
+            io_parser->cur++;
+            high = *io_parser->cur++;
+            if (high == '\\')
+            {
+                if (*io_parser->cur == 0) break;
+                high = derrick_internal_ReEscaped(*io_parser->cur++);
+            }
+            if (high < low)
+            {
+                io_parser->error = 1;
+                return node;
+            }
+        }
+        for (int c = low; c <= high; ++c)
+        {
+            derrick_internal_ReAddByte(set, (unsigned char)c);
+        }
+    }
+    if (*io_parser->cur != ']')
+    {
+        io_parser->error = 1;
+        return node;
+    }
+    io_parser->cur++;
+
+    derrick_internal_ReFinishSet(io_parser, set);
+    if (negate)
+    {
+        for (int i = 0; i < 8; ++i) set[i] = ~set[i];
+        derrick_internal_ReFinishSet(io_parser, set);
+    }
+    return node;
+}
+
+int derrick_internal_ReAlternation(struct Derrick_ReParser_s* io_parser);
+
+int derrick_internal_ReAtom(struct Derrick_ReParser_s* io_parser)
+{
+    unsigned char c = *io_parser->cur++;
+    switch (c)
+    {
+    case '(':
+    {
+        if (io_parser->cur[0] == '?' && io_parser->cur[1] == ':') io_parser->cur += 2;
+        if (++io_parser->depth > DERRICK_REGEX_MAX_DEPTH)
+        {
+            io_parser->error = 1;
+            return derrick_internal_ReNode(io_parser, DERRICK_RE_EMPTY, -1, -1);
+        }
+        int node = derrick_internal_ReAlternation(io_parser);
+        io_parser->depth--;
+        if (*io_parser->cur != ')')
+        {
+            io_parser->error = 1;
+            return node;
+        }
+        io_parser->cur++;
+        return node;
+    }
+    case '[':
+        return derrick_internal_ReClass(io_parser);
+    case '.':
+    {
+        int node = derrick_internal_ReNode(io_parser, DERRICK_RE_CHAR, -1, -1);
+        uint32_t* set = derrick_internal_ReSet(io_parser, &io_parser->nodes[node].set);
+        memset(set, 0xFF, sizeof(uint32_t) * 8);
+        derrick_internal_ReFinishSet(io_parser, set);
+        return node;
+    }
+    case '^':
+        return derrick_internal_ReNode(io_parser, DERRICK_RE_BOL, -1, -1);
+    case '$':
+        return derrick_internal_ReNode(io_parser, DERRICK_RE_EOL, -1, -1);
+    case '\\':
+    {
+        unsigned char e = *io_parser->cur;
+        if (e == 0 || e == 'b' || e == 'B')
+        {
+            // Word boundaries would need to look behind, which the DFA does not do
+            io_parser->error = 1;
+            return derrick_internal_ReNode(io_parser, DERRICK_RE_EMPTY, -1, -1);
+        }
+        io_parser->cur++;
+        int node = derrick_internal_ReNode(io_parser, DERRICK_RE_CHAR, -1, -1);
+        uint32_t* set = derrick_internal_ReSet(io_parser, &io_parser->nodes[node].set);
+        if (derrick_internal_ReAddEscape(set, e))
+        {
+            derrick_internal_ReFinishSet(io_parser, set);
+            return node;
+        }
+        io_parser->number_of_nodes--;
+        io_parser->regex->number_of_sets--;
+        return derrick_internal_ReChar(io_parser, derrick_internal_ReEscaped(e));
+    }
+    case '*': case '+': case '?': case '{': case ')': case '|':
+        // Nothing to repeat, or an unbalanced parenthesis
+        io_parser->error = 1;
+        return derrick_internal_ReNode(io_parser, DERRICK_RE_EMPTY, -1, -1);
+    default:
+        return derrick_internal_ReChar(io_parser, c);
+    }
+}
+
+// Parse a decimal count of a repetition
+int derrick_internal_ReCount(struct Derrick_ReParser_s* io_parser)
+{
+    if (*io_parser->cur < '0' || *io_parser->cur > '9')
+    {
+        io_parser->error = 1;
+        return 0;
+    }
+    int count = 0;
+    while (*io_parser->cur >= '0' && *io_parser->cur <= '9')
+    {
+        count = count * 10 + (*io_parser->cur++ - '0');
+        if (count > DERRICK_REGEX_MAX_REPEAT)
+        {
+            io_parser->error = 1;
+            return 0;
+        }
+    }
+    return count;
+}
+
+int derrick_internal_ReRepeat(struct Derrick_ReParser_s* io_parser)
+{
+    int node = derrick_internal_ReAtom(io_parser);
+    int depth = io_parser->depth;
+    while (!io_parser->error)
+    {
+        int min;
+        int max;
+        unsigned char c = *io_parser->cur;
+        if (c == '*') { min = 0; max = -1; }
+        else if (c == '+') { min = 1; max = -1; }
+        else if (c == '?') { min = 0; max = 1; }
+        else if (c == '{')
+        {
+            io_parser->cur++;
+            min = derrick_internal_ReCount(io_parser);
+            max = min;
+            if (*io_parser->cur == ',')
+            {
+                io_parser->cur++;
+                max = (*io_parser->cur == '}') ? -1 : derrick_internal_ReCount(io_parser);
+            }
+            if (*io_parser->cur != '}' || (max >= 0 && max < min))
+            {
+                io_parser->error = 1;
+                return node;
+            }
+        }
+        else break;
+        io_parser->cur++;
+        if (++io_parser->depth > DERRICK_REGEX_MAX_DEPTH)
+        {
+            io_parser->error = 1;
+            return node;
+        }
+
+        int repeat = derrick_internal_ReNode(io_parser, DERRICK_RE_REPEAT, node, -1);
+        io_parser->nodes[repeat].min = min;
+        io_parser->nodes[repeat].max = max;
+        node = repeat;
+    }
+    io_parser->depth = depth;
+    return node;
+}
+
+// Add a node to a list of parts being parsed
+void derrick_internal_RePush(int** io_parts, size_t* io_count, size_t* io_capacity, int i_node)
+{
+    if ((*io_count) == (*io_capacity))
+    {
+        (*io_capacity) = (*io_capacity) ? (*io_capacity) * 2 : 16;
+        (*io_parts) = realloc(*io_parts, (*io_capacity) * sizeof(int));
+    }
+    (*io_parts)[(*io_count)++] = i_node;
+}
+
+// Node of a concatenation or an alternation of the parts parsed, which are released. The parts
+// are kept in a flat list rather than in a chain of nodes, so that the compilation of long
+// expressions does not recurse once per part.
+int derrick_internal_ReList(struct Derrick_ReParser_s* io_parser, int i_type, int* i_parts, size_t i_count)
+{
+    if (i_count == 1)
+    {
+        int node = i_parts[0];
+        free(i_parts);
+        return node;
+    }
+    size_t first = io_parser->number_of_items;
+    for (size_t i = 0; i < i_count; ++i)
+    {
+        derrick_internal_RePush(&io_parser->items, &io_parser->number_of_items, &io_parser->items_capacity, i_parts[i]);
+    }
+    free(i_parts);
+    return derrick_internal_ReNode(io_parser, i_count == 0 ? DERRICK_RE_EMPTY : i_type, (int)first, (int)i_count);
+}
+
+int derrick_internal_ReConcatenation(struct Derrick_ReParser_s* io_parser)
+{
+    int* parts = 0;
+    size_t count = 0;
+    size_t capacity = 0;
+    while (!io_parser->error && *io_parser->cur != 0 && *io_parser->cur != '|' && *io_parser->cur != ')')
+    {
+        derrick_internal_RePush(&parts, &count, &capacity, derrick_internal_ReRepeat(io_parser));
+    }
+    return derrick_internal_ReList(io_parser, DERRICK_RE_CAT, parts, count);
+}
+
+int derrick_internal_ReAlternation(struct Derrick_ReParser_s* io_parser)
+{
+    int* parts = 0;
+    size_t count = 0;
+    size_t capacity = 0;
+    derrick_internal_RePush(&parts, &count, &capacity, derrick_internal_ReConcatenation(io_parser));
+    while (!io_parser->error && *io_parser->cur == '|')
+    {
+        io_parser->cur++;
+        derrick_internal_RePush(&parts, &count, &capacity, derrick_internal_ReConcatenation(io_parser));
+    }
+    return derrick_internal_ReList(io_parser, DERRICK_RE_ALT, parts, count);
+}
+
+uint32_t derrick_internal_ReState(struct Derrick_Regex_s* io_regex, int i_type, uint32_t i_set, uint32_t i_out, uint32_t i_out1)
+{
+    if (io_regex->number_of_nodes == io_regex->capacity)
+    {
+        io_regex->capacity = io_regex->capacity ? io_regex->capacity * 2 : 64;
+        io_regex->type = realloc(io_regex->type, io_regex->capacity);
+        io_regex->set = realloc(io_regex->set, io_regex->capacity * sizeof(uint32_t));
+        io_regex->out = realloc(io_regex->out, io_regex->capacity * sizeof(uint32_t));
+        io_regex->out1 = realloc(io_regex->out1, io_regex->capacity * sizeof(uint32_t));
+    }
+    size_t state = io_regex->number_of_nodes++;
+    io_regex->type[state] = (unsigned char)i_type;
+    io_regex->set[state] = i_set;
+    io_regex->out[state] = i_out;
+    io_regex->out1[state] = i_out1;
+    return (uint32_t)state;
+}
+
+// Compile a node of the tree into NFA states leading to i_next, return the first state.
+// Returns DERRICK_EMPTY_SLOT if the NFA grows too large.
+uint32_t derrick_internal_ReEmit(const struct Derrick_ReParser_s* i_parser, int i_node, uint32_t i_next)
+{
+    struct Derrick_Regex_s* regex = i_parser->regex;
+    if (i_next == DERRICK_EMPTY_SLOT || regex->number_of_nodes > DERRICK_REGEX_MAX_NODES) return DERRICK_EMPTY_SLOT;
+
+    const struct Derrick_ReNode_s* node = &i_parser->nodes[i_node];
+    switch (node->type)
+    {
+    case DERRICK_RE_CHAR:
+        return derrick_internal_ReState(regex, DERRICK_RE_CHAR, (uint32_t)node->set, i_next, 0);
+    case DERRICK_RE_BOL:
+    case DERRICK_RE_EOL:
+        return derrick_internal_ReState(regex, node->type, 0, i_next, 0);
+    case DERRICK_RE_CAT:
+    {
+        // Built from the end, each part leading to the next one
+        uint32_t cur = i_next;
+        for (int i = node->right - 1; i >= 0; --i)
+        {
+            cur = derrick_internal_ReEmit(i_parser, i_parser->items[node->left + i], cur);
+        }
+        return cur;
+    }
+    case DERRICK_RE_ALT:
+    {
+        // A chain of splits, the last one between the last two parts
+        uint32_t cur = derrick_internal_ReEmit(i_parser, i_parser->items[node->left + node->right - 1], i_next);
+        for (int i = node->right - 2; i >= 0; --i)
+        {
+            uint32_t part = derrick_internal_ReEmit(i_parser, i_parser->items[node->left + i], i_next);
+            if (part == DERRICK_EMPTY_SLOT || cur == DERRICK_EMPTY_SLOT) return DERRICK_EMPTY_SLOT;
+            cur = derrick_internal_ReState(regex, DERRICK_RE_SPLIT, 0, part, cur);
+        }
+        return cur;
+    }
+    case DERRICK_RE_REPEAT:
+    {
+        // x{2,4} is xx(x(x)?)? and x{2,} is xxx*, both built from the end
+        uint32_t cur = i_next;
+        if (node->max < 0)
+        {
+            uint32_t loop = derrick_internal_ReState(regex, DERRICK_RE_SPLIT, 0, 0, i_next);
+            uint32_t body = derrick_internal_ReEmit(i_parser, node->left, loop);
+            if (body == DERRICK_EMPTY_SLOT) return DERRICK_EMPTY_SLOT;
+            regex->out[loop] = body;
+            cur = loop;
+        }
+        else
+        {
+            for (int i = node->min; i < node->max; ++i)
+            {
+                uint32_t body = derrick_internal_ReEmit(i_parser, node->left, cur);
+                if (body == DERRICK_EMPTY_SLOT) return DERRICK_EMPTY_SLOT;
+                cur = derrick_internal_ReState(regex, DERRICK_RE_SPLIT, 0, body, i_next);
+            }
+        }
+        for (int i = 0; i < node->min; ++i)
+        {
+            cur = derrick_internal_ReEmit(i_parser, node->left, cur);
+        }
+        return cur;
+    }
+    default:
+        return i_next;
+    }
+}
+
+// String used to extract the literals of an expression
+struct Derrick_ReString_s
+{
+    char* text;     // 0 if there is no such string
+    size_t length;
+};
+
+// What is known of the matches of a node of the tree
+struct Derrick_ReLiterals_s
+{
+    struct Derrick_ReString_s exact;    // the only string the node matches
+    struct Derrick_ReString_s prefix;   // every match starts with it
+    struct Derrick_ReString_s suffix;   // every match ends with it
+    struct Derrick_ReString_s best;     // longest string found in every match
+};
+
+struct Derrick_ReString_s derrick_internal_ReConcat(const struct Derrick_ReString_s* i_head, const struct Derrick_ReString_s* i_tail)
+{
+    struct Derrick_ReString_s result;
+    result.length = i_head->length + (i_tail ? i_tail->length : 0);
+    result.text = malloc(result.length + 1);
+    memcpy(result.text, i_head->text, i_head->length);
+    if (i_tail) memcpy(result.text + i_head->length, i_tail->text, i_tail->length);
+    result.text[result.length] = 0;
+    return result;
+}
+
+// Append a string to another one, which grows by doubling its capacity, 0 when it was
+// allocated to its exact length
+void derrick_internal_ReAppend(struct Derrick_ReString_s* io_string, size_t* io_capacity, const struct Derrick_ReString_s* i_tail)
+{
+    if (io_string->length + i_tail->length + 1 > (*io_capacity))
+    {
+        (*io_capacity) = (io_string->length + i_tail->length + 1) * 2;
+        io_string->text = realloc(io_string->text, (*io_capacity));
+    }
+    memcpy(io_string->text + io_string->length, i_tail->text, i_tail->length);
+    io_string->length += i_tail->length;
+    io_string->text[io_string->length] = 0;
+}
+
+// Keep the longest of two strings in io_best, and release the other one
+void derrick_internal_ReKeepLongest(struct Derrick_ReString_s* io_best, struct Derrick_ReString_s i_other)
+{
+    if (i_other.text != 0 && (io_best->text == 0 || i_other.length > io_best->length))
+    {
+        free(io_best->text);
+        (*io_best) = i_other;
+    }
+    else
+    {
+        free(i_other.text);
+    }
+}
+
+void derrick_internal_ReLiteralsFree(struct Derrick_ReLiterals_s* io_literals)
+{
+    free(io_literals->exact.text);
+    free(io_literals->prefix.text);
+    free(io_literals->suffix.text);
+    free(io_literals->best.text);
+}
+
+void derrick_internal_ReLiterals(const struct Derrick_ReParser_s* i_parser, int i_node, struct Derrick_ReLiterals_s* o_literals)
+{
+    static const struct Derrick_ReString_s empty = { "", 0 };
+    const struct Derrick_ReNode_s* node = &i_parser->nodes[i_node];
+    memset(o_literals, 0, sizeof(struct Derrick_ReLiterals_s));
+    o_literals->prefix = derrick_internal_ReConcat(&empty, 0);
+    o_literals->suffix = derrick_internal_ReConcat(&empty, 0);
+
+    switch (node->type)
+    {
+    case DERRICK_RE_EMPTY:
+    case DERRICK_RE_BOL:
+    case DERRICK_RE_EOL:
+        o_literals->exact = derrick_internal_ReConcat(&empty, 0);
+        break;
+    case DERRICK_RE_CHAR:
+        if (node->literal >= 0)
+        {
+            char c = (char)node->literal;
+            struct Derrick_ReString_s one = { &c, 1 };
+            o_literals->exact = derrick_internal_ReConcat(&one, 0);
+            derrick_internal_ReKeepLongest(&o_literals->prefix, derrick_internal_ReConcat(&one, 0));
+            derrick_internal_ReKeepLongest(&o_literals->suffix, derrick_internal_ReConcat(&one, 0));
+            o_literals->best = derrick_internal_ReConcat(&one, 0);
+        }
+        break;
+    case DERRICK_RE_CAT:
+    {
+        // The parts with an exact string extend the run of contiguous text that started with the
+        // suffix of the last part without one, and that ends with the prefix of the next one
+        struct Derrick_ReString_s run = derrick_internal_ReConcat(&empty, 0);
+        size_t capacity = 0;
+        int exact = 1;
+        for (int i = 0; i < node->right; ++i)
+        {
+            struct Derrick_ReLiterals_s part;
+            derrick_internal_ReLiterals(i_parser, i_parser->items[node->left + i], &part);
+            if (part.exact.text != 0)
+            {
+                derrick_internal_ReAppend(&run, &capacity, &part.exact);
+            }
+            else
+            {
+                derrick_internal_ReAppend(&run, &capacity, &part.prefix);
+                if (exact) derrick_internal_ReKeepLongest(&o_literals->prefix, derrick_internal_ReConcat(&run, 0));
+                derrick_internal_ReKeepLongest(&o_literals->best, run);
+                run = derrick_internal_ReConcat(&part.suffix, 0);
+                capacity = 0;
+                exact = 0;
+            }
+            derrick_internal_ReKeepLongest(&o_literals->best, part.best);
+            part.best.text = 0;
+            derrick_internal_ReLiteralsFree(&part);
+        }
+        if (exact)
+        {
+            o_literals->exact = derrick_internal_ReConcat(&run, 0);
+            derrick_internal_ReKeepLongest(&o_literals->prefix, derrick_internal_ReConcat(&run, 0));
+        }
+        derrick_internal_ReKeepLongest(&o_literals->suffix, derrick_internal_ReConcat(&run, 0));
+        derrick_internal_ReKeepLongest(&o_literals->best, run);
+        break;
+    }
+    case DERRICK_RE_REPEAT:
+        if (node->min >= 1)
+        {
+            struct Derrick_ReLiterals_s child;
+            derrick_internal_ReLiterals(i_parser, node->left, &child);
+            if (node->min == 1 && node->max == 1)
+            {
+                o_literals->exact = child.exact;
+                child.exact.text = 0;
+            }
+            derrick_internal_ReKeepLongest(&o_literals->prefix, child.prefix);
+            derrick_internal_ReKeepLongest(&o_literals->suffix, child.suffix);
+            o_literals->best = child.best;
+            child.prefix.text = 0;
+            child.suffix.text = 0;
+            child.best.text = 0;
+            derrick_internal_ReLiteralsFree(&child);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void derrick_internal_RegexFree(struct Derrick_Regex_s* io_regex)
+{
+    free(io_regex->type);
+    free(io_regex->set);
+    free(io_regex->out);
+    free(io_regex->out1);
+    free(io_regex->sets);
+    free(io_regex->literal);
+    memset(io_regex, 0, sizeof(struct Derrick_Regex_s));
+}
+
+// Compile a regular expression, return DERRICK_BAD_PATTERN if it is not valid or too large
+int derrick_internal_RegexInit(struct Derrick_Regex_s* o_regex, const char* i_pattern, int i_fold)
+{
+    memset(o_regex, 0, sizeof(struct Derrick_Regex_s));
+
+    struct Derrick_ReParser_s parser;
+    memset(&parser, 0, sizeof(parser));
+    parser.cur = (const unsigned char*)i_pattern;
+    parser.fold = i_fold;
+    parser.regex = o_regex;
+    int root = derrick_internal_ReAlternation(&parser);
+    if (*parser.cur != 0) parser.error = 1;
+
+    if (!parser.error)
+    {
+        uint32_t match = derrick_internal_ReState(o_regex, DERRICK_RE_MATCH, 0, 0, 0);
+        o_regex->start = derrick_internal_ReEmit(&parser, root, match);
+        if (o_regex->start == DERRICK_EMPTY_SLOT || o_regex->number_of_nodes > DERRICK_REGEX_MAX_NODES) parser.error = 1;
+    }
+    if (!parser.error)
+    {
+        struct Derrick_ReLiterals_s literals;
+        derrick_internal_ReLiterals(&parser, root, &literals);
+        if (literals.best.length > 0)
+        {
+            o_regex->literal = literals.best.text;
+            literals.best.text = 0;
+        }
+        derrick_internal_ReLiteralsFree(&literals);
+    }
+    free(parser.nodes);
+    free(parser.items);
+    if (parser.error)
+    {
+        derrick_internal_RegexFree(o_regex);
+        return DERRICK_BAD_PATTERN;
+    }
+
+    // Split the bytes in classes: two bytes share a class if every set has both or none,
+    // and line breaks always have a class of their own
+    uint32_t breaks[8];
+    memset(breaks, 0, sizeof(breaks));
+    derrick_internal_ReAddByte(breaks, '\n');
+    derrick_internal_ReAddByte(breaks, '\r');
+    int classes[256];
+    memset(classes, 0, sizeof(classes));
+    size_t nc = 1;
+    for (size_t s = 0; s <= o_regex->number_of_sets; ++s)
+    {
+        const uint32_t* set = s < o_regex->number_of_sets ? o_regex->sets[s] : breaks;
+        int split[256];
+        for (int i = 0; i < 256; ++i) split[i] = -1;
+        int count = (int)nc;
+        for (int c = 0; c < 256; ++c)
+        {
+            if (!derrick_internal_ReHasByte(set, (unsigned char)c)) continue;
+            // Move the members of the set to a new class, one per class they come from
+            int from = classes[c];
+            if (split[from] < 0) split[from] = count++;
+            classes[c] = split[from];
+        }
+        // Renumber so that the classes stay dense
+        int renumber[512];
+        for (int i = 0; i < count; ++i) renumber[i] = -1;
+        nc = 0;
+        for (int c = 0; c < 256; ++c)
+        {
+            if (renumber[classes[c]] < 0) renumber[classes[c]] = (int)nc++;
+            classes[c] = renumber[classes[c]];
+        }
+    }
+    for (int c = 0; c < 256; ++c)
+    {
+        o_regex->classes[c] = (unsigned char)classes[c];
+    }
+    o_regex->number_of_classes = nc;
+    for (int c = 255; c >= 0; --c)
+    {
+        o_regex->representatives[o_regex->classes[c]] = (unsigned char)c;
+    }
+    return DERRICK_OK;
+}
+
+// Add to the work list the NFA nodes reachable from i_node without reading a byte. '^' is
+// passed only at the beginning of a line, '$' only if i_eol is set.
+void derrick_internal_DfaClosure(struct Derrick_Dfa_s* io_dfa, uint32_t i_node, int i_bol, int i_eol, size_t* io_size)
+{
+    const struct Derrick_Regex_s* regex = io_dfa->regex;
+    size_t depth = 0;
+    io_dfa->stack[depth++] = i_node;
+    while (depth > 0)
+    {
+        uint32_t node = io_dfa->stack[--depth];
+        if (io_dfa->mark[node] == io_dfa->generation) continue;
+        io_dfa->mark[node] = io_dfa->generation;
+        io_dfa->list[(*io_size)++] = node;
+        switch (regex->type[node])
+        {
+        case DERRICK_RE_SPLIT:
+            io_dfa->stack[depth++] = regex->out1[node];
+            io_dfa->stack[depth++] = regex->out[node];
+            break;
+        case DERRICK_RE_BOL:
+            if (i_bol) io_dfa->stack[depth++] = regex->out[node];
+            break;
+        case DERRICK_RE_EOL:
+            if (i_eol) io_dfa->stack[depth++] = regex->out[node];
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void derrick_internal_DfaNewGeneration(struct Derrick_Dfa_s* io_dfa)
+{
+    if (++io_dfa->generation == 0)
+    {
+        memset(io_dfa->mark, 0, io_dfa->regex->number_of_nodes * sizeof(uint32_t));
+        io_dfa->generation = 1;
+    }
+}
+
+void derrick_internal_DfaFlush(struct Derrick_Dfa_s* io_dfa)
+{
+    for (size_t i = 0; i < io_dfa->capacity; ++i)
+    {
+        free(io_dfa->table[i]);
+        io_dfa->table[i] = 0;
+    }
+    io_dfa->used = 0;
+    io_dfa->memory = 0;
+    io_dfa->start = 0;
+}
+
+void derrick_internal_DfaInit(struct Derrick_Dfa_s* o_dfa, const struct Derrick_Regex_s* i_regex)
+{
+    memset(o_dfa, 0, sizeof(struct Derrick_Dfa_s));
+    o_dfa->regex = i_regex;
+    o_dfa->capacity = 1024;
+    o_dfa->table = calloc(o_dfa->capacity, sizeof(struct Derrick_DState_s*));
+    o_dfa->list = malloc(i_regex->number_of_nodes * sizeof(uint32_t));
+    o_dfa->stack = malloc((i_regex->number_of_nodes * 2 + 2) * sizeof(uint32_t));
+    o_dfa->mark = calloc(i_regex->number_of_nodes, sizeof(uint32_t));
+    o_dfa->matched.match = 1;
+}
+
+void derrick_internal_DfaFree(struct Derrick_Dfa_s* io_dfa)
+{
+    derrick_internal_DfaFlush(io_dfa);
+    free(io_dfa->table);
+    free(io_dfa->list);
+    free(io_dfa->stack);
+    free(io_dfa->mark);
+    memset(io_dfa, 0, sizeof(struct Derrick_Dfa_s));
+}
+
+int derrick_internal_CompareNodes(const void* i_a, const void* i_b)
+{
+    uint32_t a = *(const uint32_t*)i_a;
+    uint32_t b = *(const uint32_t*)i_b;
+    return (a > b) - (a < b);
+}
+
+// Return the state made of the i_size nodes of the work list, creating it if needed.
+// The cache is emptied first when it is full: states obtained before are then released.
+struct Derrick_DState_s* derrick_internal_DfaState(struct Derrick_Dfa_s* io_dfa, size_t i_size, int* o_flushed)
+{
+    const struct Derrick_Regex_s* regex = io_dfa->regex;
+    qsort(io_dfa->list, i_size, sizeof(uint32_t), &derrick_internal_CompareNodes);
+    uint64_t hash = derrick_internal_Checksum(io_dfa->list, i_size * sizeof(uint32_t));
+
+    size_t slot = (size_t)hash & (io_dfa->capacity - 1);
+    while (io_dfa->table[slot] != 0)
+    {
+        struct Derrick_DState_s* state = io_dfa->table[slot];
+        if (state->hash == hash && state->size == i_size && memcmp(state->nodes, io_dfa->list, i_size * sizeof(uint32_t)) == 0)
+        {
+            return state;
+        }
+        slot = (slot + 1) & (io_dfa->capacity - 1);
+    }
+
+    size_t size = sizeof(struct Derrick_DState_s) + regex->number_of_classes * sizeof(struct Derrick_DState_s*) + i_size * sizeof(uint32_t);
+    if (io_dfa->memory + size > DERRICK_DFA_MEMORY || (io_dfa->used + 1) * 2 > io_dfa->capacity)
+    {
+        if (io_dfa->memory + size > DERRICK_DFA_MEMORY || io_dfa->capacity * sizeof(void*) * 2 > DERRICK_DFA_MEMORY)
+        {
+            derrick_internal_DfaFlush(io_dfa);
+            (*o_flushed) = 1;
+        }
+        else
+        {
+            // Grow the table, the states themselves stay in place
+            size_t old_capacity = io_dfa->capacity;
+            struct Derrick_DState_s** old_table = io_dfa->table;
+            io_dfa->capacity *= 2;
+            io_dfa->table = calloc(io_dfa->capacity, sizeof(struct Derrick_DState_s*));
+            for (size_t i = 0; i < old_capacity; ++i)
+            {
+                if (old_table[i] == 0) continue;
+                size_t s = (size_t)old_table[i]->hash & (io_dfa->capacity - 1);
+                while (io_dfa->table[s] != 0) s = (s + 1) & (io_dfa->capacity - 1);
+                io_dfa->table[s] = old_table[i];
+            }
+            free(old_table);
+        }
+        slot = (size_t)hash & (io_dfa->capacity - 1);
+        while (io_dfa->table[slot] != 0) slot = (slot + 1) & (io_dfa->capacity - 1);
+    }
+
+    struct Derrick_DState_s* state = calloc(1, size);
+    state->next = (struct Derrick_DState_s**)(state + 1);
+    state->nodes = (uint32_t*)(state->next + regex->number_of_classes);
+    state->size = i_size;
+    state->hash = hash;
+    memcpy(state->nodes, io_dfa->list, i_size * sizeof(uint32_t));
+    io_dfa->table[slot] = state;
+    io_dfa->used++;
+    io_dfa->memory += size;
+
+    // Does a match end here, or at the end of the line?
+    derrick_internal_DfaNewGeneration(io_dfa);
+    size_t closure = 0;
+    for (size_t i = 0; i < i_size; ++i)
+    {
+        if (regex->type[state->nodes[i]] == DERRICK_RE_MATCH) state->match = 1;
+        derrick_internal_DfaClosure(io_dfa, state->nodes[i], 0, 1, &closure);
+    }
+    for (size_t i = 0; i < closure; ++i)
+    {
+        if (regex->type[io_dfa->list[i]] == DERRICK_RE_MATCH) state->match_eol = 1;
+    }
+    return state;
+}
+
+// State at the beginning of a line
+struct Derrick_DState_s* derrick_internal_DfaStart(struct Derrick_Dfa_s* io_dfa, int* o_flushed)
+{
+    if (io_dfa->start == 0)
+    {
+        size_t size = 0;
+        derrick_internal_DfaNewGeneration(io_dfa);
+        derrick_internal_DfaClosure(io_dfa, io_dfa->regex->start, 1, 0, &size);
+        struct Derrick_DState_s* start = derrick_internal_DfaState(io_dfa, size, o_flushed);
+        io_dfa->start = start;
+    }
+    return io_dfa->start;
+}
+
+// Compute the transition of a state on a class of bytes
+struct Derrick_DState_s* derrick_internal_DfaStep(struct Derrick_Dfa_s* io_dfa, struct Derrick_DState_s* io_state, unsigned char i_class)
+{
+    const struct Derrick_Regex_s* regex = io_dfa->regex;
+    unsigned char c = regex->representatives[i_class];
+    struct Derrick_DState_s* next;
+    int flushed = 0;
+    if (derrick_internal_ReIsBreak(c))
+    {
+        // A line ends: report the match ending there, or start the next line
+        next = io_state->match_eol ? &io_dfa->matched : derrick_internal_DfaStart(io_dfa, &flushed);
+        if (!flushed) io_state->next[i_class] = next;
+        return next;
+    }
+
+    // Move the nodes accepting the byte, and start a new match at every position
+    derrick_internal_DfaNewGeneration(io_dfa);
+    size_t size = 0;
+    for (size_t i = 0; i < io_state->size; ++i)
+    {
+        uint32_t node = io_state->nodes[i];
+        if (regex->type[node] == DERRICK_RE_CHAR && derrick_internal_ReHasByte(regex->sets[regex->set[node]], c))
+        {
+            derrick_internal_DfaClosure(io_dfa, regex->out[node], 0, 0, &size);
+        }
+    }
+    derrick_internal_DfaClosure(io_dfa, regex->start, 0, 0, &size);
+
+    next = derrick_internal_DfaState(io_dfa, size, &flushed);
+    if (!flushed) io_state->next[i_class] = next;
+    return next;
+}
+
+// Run the DFA over the lines of [i_begin, i_end), i_begin being the beginning of a line.
+// Return the address of the byte where the first match ends (the line break for a match
+// ending with the line), or 0.
+const char* derrick_internal_DfaRun(struct Derrick_Dfa_s* io_dfa, const char* i_begin, const char* i_end)
+{
+    const unsigned char* classes = io_dfa->regex->classes;
+    int flushed = 0;
+    struct Derrick_DState_s* state = derrick_internal_DfaStart(io_dfa, &flushed);
+    if (state->match) return i_begin < i_end ? i_begin : 0;   // every line matches
+
+    for (const unsigned char* cur = (const unsigned char*)i_begin; cur < (const unsigned char*)i_end; ++cur)
+    {
+        struct Derrick_DState_s* next = state->next[classes[*cur]];
+        if (next == 0) next = derrick_internal_DfaStep(io_dfa, state, classes[*cur]);
+        state = next;
+        if (state->match) return (const char*)cur;
+    }
+    // The end of the data ends the last line, unless it is empty
+    if (state->match_eol && i_end > i_begin && !derrick_internal_ReIsBreak((unsigned char)i_end[-1])) return i_end;
+    return 0;
+}
+
+// Return an address in the first line of [i_begin, i_end) that matches the expression, or 0.
+// i_begin is the beginning of a line. If the expression contains a literal, only the lines
+// where the substring kernel finds it are given to the DFA.
+const char* derrick_internal_RegexFind(struct Derrick_Dfa_s* io_dfa, const struct Derrick_Literal_s* i_literal, const char* i_begin, const char* i_end)
+{
+    if (i_literal == 0) return derrick_internal_DfaRun(io_dfa, i_begin, i_end);
+
+    const char* from = i_begin;
+    const char* found;
+    while (from < i_end && (found = derrick_internal_LiteralFind(i_literal, from, i_end - from)) != 0)
+    {
+        const char* line = found;
+        while (line > from && !derrick_internal_ReIsBreak((unsigned char)line[-1])) line--;
+        const char* line_end = found;
+        while (line_end < i_end && !derrick_internal_ReIsBreak((unsigned char)*line_end)) line_end++;
+
+        const char* where = derrick_internal_DfaRun(io_dfa, line, line_end);
+        if (where != 0) return where;
+        from = line_end + 1;
+    }
+    return 0;
+}
+
+// Address of the beginning of the line after the one containing i_where
+const char* derrick_internal_NextLine(const char* i_where, const char* i_end)
+{
+    while (i_where < i_end && !derrick_internal_ReIsBreak((unsigned char)*i_where)) i_where++;
+    return i_where < i_end ? i_where + 1 : i_end;
+}
+
+// 1 if the beginning of a file looks like binary data: a NUL byte, or too many bytes that are
+// not text. A control that text does not use counts more than a byte that is not valid UTF-8:
+// text in a legacy code page has many of the latter, and none of the former.
+int derrick_internal_IsBinary(const char* i_data, size_t i_size)
+{
+    if (i_size > DERRICK_SNIFF_SIZE) i_size = DERRICK_SNIFF_SIZE;
+    if (memchr(i_data, 0, i_size) != 0) return 1;
+
+    const unsigned char* cur = (const unsigned char*)i_data;
+    const unsigned char* end = cur + i_size;
+    size_t suspicious = 0;      // 4 per control, 1 per invalid byte
+    while (cur < end)
+    {
+        unsigned char c = *cur++;
+        if (c < 0x80)
+        {
+            if ((c < 0x20 && c != '\t' && c != '\n' && c != '\r' && c != '\f' && c != '\v' && c != 0x1B) || c == 0x7F) suspicious += 4;
+            continue;
+        }
+
+        // A sequence cut by the end of the block is given the benefit of the doubt
+        size_t length = (c >= 0xC2 && c <= 0xDF) ? 1 : (c >= 0xE0 && c <= 0xEF) ? 2 : (c >= 0xF0 && c <= 0xF4) ? 3 : 0;
+        size_t valid = 0;
+        while (valid < length && cur + valid < end && (cur[valid] & 0xC0) == 0x80) valid++;
+        if (length == 0 || (valid < length && cur + valid < end))
+        {
+            suspicious++;
+            continue;
+        }
+        cur += valid;
+    }
+    return suspicious * 2 > i_size;
+}
+
+int derrick_internal_MapFile(const char* i_path, const char** o_data, size_t* o_size, uint64_t* o_inode, uint64_t* o_mtime)
+{
+    (*o_data) = 0;
+    (*o_size) = 0;
+
+    HANDLE hFile = CreateFileA(i_path,                 // name of the file
+                               GENERIC_READ,           // open for reading
+                               FILE_SHARE_READ,        // let other readers in
+                               NULL,                   // default security
+                               OPEN_EXISTING,          // existing file only
+                               FILE_ATTRIBUTE_NORMAL,  // normal file
+                               NULL);                  // no attr. template
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return DERRICK_ERROR;
+    }
+
+    LARGE_INTEGER this_size;
+    this_size.QuadPart = 0;
+    if (GetFileSizeEx(hFile, &this_size) == 0)
+    {
+        CloseHandle(hFile);
+        return DERRICK_ERROR;
+    }
+
+    if (o_inode || o_mtime)
+    {
+        BY_HANDLE_FILE_INFORMATION info;
+        memset(&info, 0, sizeof(info));
+        GetFileInformationByHandle(hFile, &info);
+        if (o_inode) (*o_inode) = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+        if (o_mtime) (*o_mtime) = ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+    }
+
+    // Empty files cannot be mapped, there is nothing to look at anyway
+    if (this_size.QuadPart == 0)
+    {
+        CloseHandle(hFile);
+        return DERRICK_OK;
+    }
+
+    HANDLE hMapFile = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapFile == NULL || hMapFile == INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hFile);
+        return DERRICK_ERROR;
+    }
+
+    LPCTSTR pBuf = (LPTSTR) MapViewOfFile(hMapFile, FILE_MAP_READ, 0, 0, 0);
+
+    // The view keeps a reference on the file, handles are not needed anymore
+    CloseHandle(hMapFile);
+    CloseHandle(hFile);
+
+    if (pBuf == NULL)
+    {
+        return DERRICK_ERROR;
+    }
+
+    (*o_data) = (const char*)pBuf;
+    (*o_size) = (size_t)this_size.QuadPart;
+    return DERRICK_OK;
+}
+
+void derrick_internal_UnmapFile(const char* i_data)
+{
+    if (i_data) UnmapViewOfFile(i_data);
+}
+
+// Allocate zeroed pages, backed by large pages when asked and allowed (the process needs
+// SeLockMemoryPrivilege), by normal pages otherwise
+void* derrick_internal_AllocPages(size_t i_size, int i_large_pages)
+{
+    void* data = 0;
+    if (i_large_pages)
+    {
+        size_t large_page = (size_t)GetLargePageMinimum();
+        if (large_page != 0)
+        {
+            data = VirtualAlloc(NULL, (i_size + large_page - 1) & ~(large_page - 1),
+                                MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        }
+    }
+    if (data == 0)
+    {
+        data = VirtualAlloc(NULL, i_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+    return data;
+}
+
+void derrick_internal_FreePages(void* i_data)
+{
+    if (i_data) VirtualFree(i_data, 0, MEM_RELEASE);
+}
+
+// Open a file to read it by chunks from the beginning to the end. With i_unbuffered, the
+// reads bypass the system cache: the chunks must then be aligned on the sector size.
+HANDLE derrick_internal_StreamOpen(const char* i_path, int i_unbuffered, uint64_t* o_inode)
+{
+    DWORD flags = FILE_FLAG_SEQUENTIAL_SCAN | (i_unbuffered ? FILE_FLAG_NO_BUFFERING : 0);
+    HANDLE hFile = CreateFileA(i_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, flags, NULL);
+    if (hFile != INVALID_HANDLE_VALUE && o_inode)
+    {
+        BY_HANDLE_FILE_INFORMATION info;
+        (*o_inode) = 0;
+        if (GetFileInformationByHandle(hFile, &info))
+        {
+            (*o_inode) = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+        }
+    }
+    return hFile;
+}
+
+// Read the next DERRICK_STREAM_CHUNK bytes of a file at most; *o_read is 0 at the end
+int derrick_internal_StreamRead(HANDLE i_file, char* o_chunk, size_t* o_read)
+{
+    DWORD read = 0;
+    (*o_read) = 0;
+    if (!ReadFile(i_file, o_chunk, DERRICK_STREAM_CHUNK, &read, NULL))
+    {
+        return DERRICK_ERROR;
+    }
+    (*o_read) = read;
+    return DERRICK_OK;
+}
+
+// Buffer of the streaming reads: DERRICK_STREAM_CARRY bytes kept from the previous chunk,
+// followed by the chunk itself, aligned on a page
+char* derrick_internal_StreamBuffer(void)
+{
+    return derrick_internal_AllocPages(DERRICK_STREAM_CARRY + DERRICK_STREAM_CHUNK, 0);
+}
+
+// Kinds of the tokens of a glob
+enum
+{
+    DERRICK_GLOB_SET,           // one byte of a set
+    DERRICK_GLOB_STAR,          // any bytes but '\\', possibly none
+    DERRICK_GLOB_ANY,           // any bytes, possibly none ("/**" at the end of a pattern)
+    DERRICK_GLOB_DIRS,          // "**/": any bytes ending with a '\\', or nothing
+    DERRICK_GLOB_END            // end of a glob, no byte is consumed
+};
+
+struct Derrick_GlobToken_s
+{
+    int type;
+    int rule;                   // DERRICK_GLOB_END only: the rule that matched
+    int directory_only;         // DERRICK_GLOB_END only
+    uint32_t set[8];            // DERRICK_GLOB_SET only
+};
+
+// Globs matched at once. Bit i of the state is set when the globs matched up to their token i,
+// so that a byte moves every glob forward with a few masks, like a bit-parallel NFA.
+struct Derrick_Glob_s
+{
+    size_t number_of_tokens;
+    size_t capacity;
+    struct Derrick_GlobToken_s* tokens;     // freed once the masks are built
+    size_t number_of_words;                 // of each mask
+    uint64_t* masks;                        // all the masks below, in one block
+    uint64_t* consume;                      // 256 masks: tokens that consume the byte and move on
+    uint64_t* stay;                         // 256 masks: stars that consume the byte and stay
+    uint64_t* empty;                        // tokens that may match nothing
+    uint64_t* dirs;                         // DERRICK_GLOB_DIRS tokens, skipped when they are reached
+    uint64_t* start;
+    uint64_t* final_file;                   // ends of the globs that apply to files
+    uint64_t* final_dir;                    // ends of the globs that apply to directories
+    int* rules;                             // rule of each position, for the ends
+};
+
+// Slot of a hash of literal names, extensions or paths
+struct Derrick_RuleSlot_s
+{
+    char* key;                  // 0 for an empty slot
+    int file_rule;              // last rule that applies to files, -1 if none
+    int dir_rule;               // last rule that applies to directories, -1 if none
+};
+
+struct Derrick_RuleHash_s
+{
+    struct Derrick_RuleSlot_s* slots;
+    size_t capacity;            // always a power of 2
+    size_t used;
+};
+
+// Patterns of a filter or of an ignore file. Most patterns are plain names, extensions or
+// paths, found with a hash; the others are matched together by a glob automaton.
+struct Derrick_Rules_s
+{
+    size_t number_of_rules;
+    unsigned char* negate;                  // per rule, 1 for the "!" patterns
+    struct Derrick_RuleHash_s names;        // matched against the name of the entry
+    struct Derrick_RuleHash_s extensions;   // "*.ext", matched against the end of the name
+    struct Derrick_RuleHash_s paths;        // matched against the path from the directory of the rules
+    struct Derrick_Glob_s name_globs;
+    struct Derrick_Glob_s path_globs;
+};
+
+// Compiled filter of derrick_filter_compile
+struct Derrick_Filter_s
+{
+    struct Derrick_Rules_s exclude;
+    struct Derrick_Rules_s include;
+    int flags;
+};
+
+// Rules of the ignore files of a directory, chained to those of its parents. A chain is
+// shared by the walks of the subdirectories, possibly on other threads.
+struct Derrick_Ignore_s
+{
+    struct Derrick_Rules_s rules;
+    size_t length;              // length of the path of the directory
+    struct Derrick_Ignore_s* parent;
+    volatile LONG references;
+};
+
+struct Derrick_RuleSlot_s* derrick_internal_RuleSlot(const struct Derrick_RuleHash_s* i_hash, const char* i_key, size_t i_length)
+{
+    size_t slot = (size_t)derrick_internal_Checksum(i_key, i_length) & (i_hash->capacity - 1);
+    while (i_hash->slots[slot].key != 0)
+    {
+        if (strncmp(i_hash->slots[slot].key, i_key, i_length) == 0 && i_hash->slots[slot].key[i_length] == '\0')
+        {
+            break;
+        }
+        slot = (slot + 1) & (i_hash->capacity - 1);
+    }
+    return &i_hash->slots[slot];
+}
+
+void derrick_internal_RuleHashAdd(struct Derrick_RuleHash_s* io_hash, const char* i_key, int i_rule, int i_directory_only)
+{
+    if ((io_hash->used + 1) * 2 > io_hash->capacity)
+    {
+        struct Derrick_RuleHash_s grown;
+        grown.capacity = io_hash->capacity ? io_hash->capacity * 2 : 16;
+        grown.slots = calloc(grown.capacity, sizeof(struct Derrick_RuleSlot_s));
+        grown.used = io_hash->used;
+        for (size_t s = 0; s < io_hash->capacity; ++s)
+        {
+            if (io_hash->slots[s].key == 0) continue;
+            (*derrick_internal_RuleSlot(&grown, io_hash->slots[s].key, strlen(io_hash->slots[s].key))) = io_hash->slots[s];
+        }
+        free(io_hash->slots);
+        (*io_hash) = grown;
+    }
+
+    struct Derrick_RuleSlot_s* slot = derrick_internal_RuleSlot(io_hash, i_key, strlen(i_key));
+    if (slot->key == 0)
+    {
+        slot->key = _strdup(i_key);
+        slot->file_rule = -1;
+        slot->dir_rule = -1;
+        io_hash->used++;
+    }
+    if (!i_directory_only) slot->file_rule = i_rule;
+    slot->dir_rule = i_rule;
+}
+
+// Last rule of a hash matching a key, -1 if none
+int derrick_internal_RuleHashFind(const struct Derrick_RuleHash_s* i_hash, const char* i_key, size_t i_length, int i_directory)
+{
+    if (i_hash->used == 0) return -1;
+    const struct Derrick_RuleSlot_s* slot = derrick_internal_RuleSlot(i_hash, i_key, i_length);
+    if (slot->key == 0) return -1;
+    return i_directory ? slot->dir_rule : slot->file_rule;
+}
+
+void derrick_internal_RuleHashFree(struct Derrick_RuleHash_s* io_hash)
+{
+    for (size_t s = 0; s < io_hash->capacity; ++s)
+    {
+        free(io_hash->slots[s].key);
+    }
+    free(io_hash->slots);
+}
+
+struct Derrick_GlobToken_s* derrick_internal_GlobToken(struct Derrick_Glob_s* io_glob, int i_type)
+{
+    if (io_glob->number_of_tokens == io_glob->capacity)
+    {
+        io_glob->capacity = io_glob->capacity ? io_glob->capacity * 2 : 16;
+        io_glob->tokens = realloc(io_glob->tokens, io_glob->capacity * sizeof(struct Derrick_GlobToken_s));
+    }
+    struct Derrick_GlobToken_s* token = &io_glob->tokens[io_glob->number_of_tokens++];
+    memset(token, 0, sizeof(struct Derrick_GlobToken_s));
+    token->type = i_type;
+    return token;
+}
+
+// Add a byte to a set, in both cases: file names are matched regardless of the case
+void derrick_internal_GlobAddByte(uint32_t* io_set, unsigned char i_c)
+{
+    derrick_internal_ReAddByte(io_set, derrick_internal_fold[i_c]);
+    if (i_c >= 'a' && i_c <= 'z') derrick_internal_ReAddByte(io_set, (unsigned char)(i_c - ('a' - 'A')));
+    if (i_c >= 'A' && i_c <= 'Z') derrick_internal_ReAddByte(io_set, i_c);
+}
+
+// Parse a bracket expression, return the position after it or 0 if it is not closed
+const char* derrick_internal_GlobClass(const char* i_cur, uint32_t* o_set)
+{
+    int negate = (*i_cur == '!' || *i_cur == '^');
+    if (negate) i_cur++;
+    int first = 1;
+    memset(o_set, 0, 8 * sizeof(uint32_t));
+    while (*i_cur != '\0' && (*i_cur != ']' || first))
+    {
+        unsigned char low = (unsigned char)*i_cur++;
+        if (low == '\\' && *i_cur != '\0') low = (unsigned char)*i_cur++;
+        unsigned char high = low;
+        if (i_cur[0] == '-' && i_cur[1] != ']' && i_cur[1] != '\0')
+        {
+            high = (unsigned char)i_cur[1];
+            i_cur += 2;
+            if (high == '\\' && *i_cur != '\0') high = (unsigned char)*i_cur++;
+        }
+        for (int c = low; c <= high; ++c) derrick_internal_GlobAddByte(o_set, (unsigned char)c);
+        first = 0;
+    }
+    if (*i_cur != ']') return 0;
+    if (negate)
+    {
+        for (int w = 0; w < 8; ++w) o_set[w] = ~o_set[w];
+    }
+    // A class never matches the separator of the path
+    o_set['\\' >> 5] &= ~((uint32_t)1 << ('\\' & 31));
+    return i_cur + 1;
+}
+
+// Add the tokens of a glob. A '/' of the pattern matches the '\\' of the paths.
+int derrick_internal_GlobAdd(struct Derrick_Glob_s* io_glob, const char* i_pattern, int i_rule, int i_directory_only)
+{
+    size_t first = io_glob->number_of_tokens;
+    const char* cur = i_pattern;
+    while (*cur != '\0')
+    {
+        int at_component = (cur == i_pattern || cur[-1] == '/');
+        if (cur[0] == '*' && cur[1] == '*' && at_component && (cur[2] == '/' || cur[2] == '\0'))
+        {
+            // "**/**/" is the same as "**/"
+            int type = cur[2] == '/' ? DERRICK_GLOB_DIRS : DERRICK_GLOB_ANY;
+            if (io_glob->number_of_tokens == first || io_glob->tokens[io_glob->number_of_tokens - 1].type != DERRICK_GLOB_DIRS)
+            {
+                derrick_internal_GlobToken(io_glob, type);
+            }
+            else if (type == DERRICK_GLOB_ANY)
+            {
+                io_glob->tokens[io_glob->number_of_tokens - 1].type = type;
+            }
+            cur += cur[2] == '/' ? 3 : 2;
+        }
+        else if (*cur == '*')
+        {
+            // Consecutive stars are a single one
+            while (*cur == '*') cur++;
+            derrick_internal_GlobToken(io_glob, DERRICK_GLOB_STAR);
+        }
+        else if (*cur == '?')
+        {
+            uint32_t* set = derrick_internal_GlobToken(io_glob, DERRICK_GLOB_SET)->set;
+            memset(set, 0xFF, 8 * sizeof(uint32_t));
+            set['\\' >> 5] &= ~((uint32_t)1 << ('\\' & 31));
+            cur++;
+        }
+        else if (*cur == '[')
+        {
+            uint32_t* set = derrick_internal_GlobToken(io_glob, DERRICK_GLOB_SET)->set;
+            cur = derrick_internal_GlobClass(cur + 1, set);
+            if (cur == 0)
+            {
+                io_glob->number_of_tokens = first;
+                return DERRICK_BAD_PATTERN;
+            }
+        }
+        else
+        {
+            if (cur[0] == '\\' && cur[1] != '\0') cur++;
+            uint32_t* set = derrick_internal_GlobToken(io_glob, DERRICK_GLOB_SET)->set;
+            derrick_internal_GlobAddByte(set, *cur == '/' ? '\\' : (unsigned char)*cur);
+            cur++;
+        }
+    }
+    struct Derrick_GlobToken_s* end = derrick_internal_GlobToken(io_glob, DERRICK_GLOB_END);
+    end->rule = i_rule;
+    end->directory_only = i_directory_only;
+    return DERRICK_OK;
+}
+
+// Turn the tokens into masks
+void derrick_internal_GlobSeal(struct Derrick_Glob_s* io_glob)
+{
+    size_t number_of_positions = io_glob->number_of_tokens;
+    if (number_of_positions == 0) return;
+    size_t words = (number_of_positions + 1 + 63) / 64;    // room for the shifts past the last end
+    io_glob->number_of_words = words;
+    io_glob->masks = calloc((256 * 2 + 5) * words, sizeof(uint64_t));
+    io_glob->consume = io_glob->masks;
+    io_glob->stay = io_glob->consume + 256 * words;
+    io_glob->empty = io_glob->stay + 256 * words;
+    io_glob->dirs = io_glob->empty + words;
+    io_glob->start = io_glob->dirs + words;
+    io_glob->final_file = io_glob->start + words;
+    io_glob->final_dir = io_glob->final_file + words;
+    io_glob->rules = malloc(number_of_positions * sizeof(int));
+
+    int at_start = 1;
+    for (size_t p = 0; p < number_of_positions; ++p)
+    {
+        const struct Derrick_GlobToken_s* token = &io_glob->tokens[p];
+        uint64_t bit = (uint64_t)1 << (p & 63);
+        size_t word = p >> 6;
+        io_glob->rules[p] = token->rule;
+        if (at_start) io_glob->start[word] |= bit;
+        at_start = 0;
+        switch (token->type)
+        {
+        case DERRICK_GLOB_SET:
+            for (int c = 0; c < 256; ++c)
+            {
+                if (derrick_internal_ReHasByte(token->set, (unsigned char)c)) io_glob->consume[c * words + word] |= bit;
+            }
+            break;
+        case DERRICK_GLOB_STAR:
+            for (int c = 0; c < 256; ++c)
+            {
+                if (c != '\\') io_glob->stay[c * words + word] |= bit;
+            }
+            io_glob->empty[word] |= bit;
+            break;
+        case DERRICK_GLOB_ANY:
+        case DERRICK_GLOB_DIRS:
+            for (int c = 0; c < 256; ++c)
+            {
+                io_glob->stay[c * words + word] |= bit;
+            }
+            if (token->type == DERRICK_GLOB_ANY)
+            {
+                io_glob->empty[word] |= bit;
+            }
+            else
+            {
+                io_glob->consume['\\' * words + word] |= bit;
+                io_glob->dirs[word] |= bit;
+            }
+            break;
+        case DERRICK_GLOB_END:
+            if (!token->directory_only) io_glob->final_file[word] |= bit;
+            io_glob->final_dir[word] |= bit;
+            at_start = 1;
+            break;
+        }
+    }
+    free(io_glob->tokens);
+    io_glob->tokens = 0;
+}
+
+void derrick_internal_GlobFree(struct Derrick_Glob_s* io_glob)
+{
+    free(io_glob->tokens);
+    free(io_glob->masks);
+    free(io_glob->rules);
+}
+
+// io_state |= (io_state & i_mask) << 1: move on the positions of i_mask that may match nothing.
+// A position reached this way is never in i_mask too, the tokens are laid out so.
+void derrick_internal_GlobSkip(uint64_t* io_state, const uint64_t* i_mask, size_t i_words)
+{
+    uint64_t carry = 0;
+    for (size_t w = 0; w < i_words; ++w)
+    {
+        uint64_t moved = io_state[w] & i_mask[w];
+        io_state[w] |= (moved << 1) | carry;
+        carry = moved >> 63;
+    }
+}
+
+// Last rule of the globs matching a whole string, -1 if none
+int derrick_internal_GlobMatch(const struct Derrick_Glob_s* i_glob, const char* i_string, size_t i_length, int i_directory)
+{
+    size_t words = i_glob->number_of_words;
+    if (words == 0) return -1;
+
+    // "**/" can only be skipped when it is reached, not after it consumed some bytes: the
+    // positions reached by the last byte are kept apart from those that stayed on a star
+    uint64_t small[32];
+    uint64_t* state = words <= 16 ? small : malloc(2 * words * sizeof(uint64_t));
+    uint64_t* reached = state + words;
+    memcpy(reached, i_glob->start, words * sizeof(uint64_t));
+    memset(state, 0, words * sizeof(uint64_t));
+
+    for (size_t i = 0; ; ++i)
+    {
+        derrick_internal_GlobSkip(reached, i_glob->dirs, words);
+        uint64_t alive = 0;
+        for (size_t w = 0; w < words; ++w)
+        {
+            state[w] |= reached[w];
+            alive |= state[w];
+        }
+        derrick_internal_GlobSkip(state, i_glob->empty, words);
+        if (i == i_length || alive == 0) break;
+
+        const uint64_t* consume = i_glob->consume + (unsigned char)i_string[i] * words;
+        const uint64_t* stay = i_glob->stay + (unsigned char)i_string[i] * words;
+        uint64_t carry = 0;
+        for (size_t w = 0; w < words; ++w)
+        {
+            uint64_t moved = state[w] & consume[w];
+            reached[w] = (moved << 1) | carry;
+            carry = moved >> 63;
+            state[w] &= stay[w];
+        }
+    }
+
+    // The globs are in the order of the rules: the last end reached is the last rule
+    const uint64_t* final = i_directory ? i_glob->final_dir : i_glob->final_file;
+    int rule = -1;
+    for (size_t w = words; w-- > 0 && rule < 0; )
+    {
+        uint64_t ends = state[w] & final[w];
+        if (ends != 0)
+        {
+            int bit = 63;
+            while (((ends >> bit) & 1) == 0) bit--;
+            rule = i_glob->rules[w * 64 + bit];
+        }
+    }
+    if (state != small) free(state);
+    return rule;
+}
+
+// Add the patterns of a text, one per line as in a .gitignore file
+int derrick_internal_RulesAdd(struct Derrick_Rules_s* io_rules, const char* i_text, size_t i_size)
+{
+    int rc = DERRICK_OK;
+    const char* end = i_text + i_size;
+    char* pattern = malloc(i_size + 1);
+    while (i_text < end)
+    {
+        const char* eol = i_text;
+        while (eol < end && *eol != '\n' && *eol != '\r') eol++;
+        size_t length = eol - i_text;
+        memcpy(pattern, i_text, length);
+        pattern[length] = '\0';
+        i_text = eol < end ? eol + 1 : end;
+
+        // Trailing spaces are ignored unless escaped, so are empty lines and comments
+        while (length > 0 && pattern[length - 1] == ' ' && (length < 2 || pattern[length - 2] != '\\')) pattern[--length] = '\0';
+        char* cur = pattern;
+        if (length == 0 || *cur == '#') continue;
+        int negate = (*cur == '!');
+        if (negate) cur++;
+        else if (cur[0] == '\\' && (cur[1] == '#' || cur[1] == '!')) cur++;
+
+        // "name/" only matches directories, a pattern with a '/' elsewhere is relative to the
+        // directory of the rules, any other pattern matches a name at any depth
+        int directory_only = 0;
+        length = strlen(cur);
+        if (length > 0 && cur[length - 1] == '/')
+        {
+            directory_only = 1;
+            cur[--length] = '\0';
+        }
+        if (length == 0) continue;
+        int anchored = (strchr(cur, '/') != 0);
+        if (*cur == '/') cur++;
+        if (*cur == '\0') continue;
+
+        int rule = (int)io_rules->number_of_rules;
+        int literal = (strpbrk(cur, "*?[\\") == 0);
+        int extension = (!anchored && cur[0] == '*' && cur[1] == '.' && cur[2] != '\0' && strpbrk(cur + 2, "*?[\\") == 0);
+        if (literal || extension)
+        {
+            // The keys are in lower case, with the separator of the paths
+            for (char* c = cur; *c; ++c) *c = (*c == '/') ? '\\' : (char)derrick_internal_fold[(unsigned char)*c];
+        }
+        if (literal)
+        {
+            derrick_internal_RuleHashAdd(anchored ? &io_rules->paths : &io_rules->names, cur, rule, directory_only);
+        }
+        else if (extension)
+        {
+            derrick_internal_RuleHashAdd(&io_rules->extensions, cur + 2, rule, directory_only);
+        }
+        else if (derrick_internal_GlobAdd(anchored ? &io_rules->path_globs : &io_rules->name_globs, cur, rule, directory_only) != DERRICK_OK)
+        {
+            rc = DERRICK_BAD_PATTERN;
+            continue;
+        }
+        io_rules->negate = realloc(io_rules->negate, (rule + 1) * sizeof(unsigned char));
+        io_rules->negate[rule] = (unsigned char)negate;
+        io_rules->number_of_rules++;
+    }
+    free(pattern);
+    return rc;
+}
+
+void derrick_internal_RulesSeal(struct Derrick_Rules_s* io_rules)
+{
+    derrick_internal_GlobSeal(&io_rules->name_globs);
+    derrick_internal_GlobSeal(&io_rules->path_globs);
+}
+
+void derrick_internal_RulesFree(struct Derrick_Rules_s* io_rules)
+{
+    free(io_rules->negate);
+    derrick_internal_RuleHashFree(&io_rules->names);
+    derrick_internal_RuleHashFree(&io_rules->extensions);
+    derrick_internal_RuleHashFree(&io_rules->paths);
+    derrick_internal_GlobFree(&io_rules->name_globs);
+    derrick_internal_GlobFree(&io_rules->path_globs);
+}
+
+// Last rule matching an entry, -1 if none. i_path is relative to the directory of the rules,
+// and its last component is the name of the entry.
+int derrick_internal_RulesMatch(const struct Derrick_Rules_s* i_rules, const char* i_path, size_t i_name, int i_directory)
+{
+    if (i_rules->number_of_rules == 0) return -1;
+
+    // The keys of the hashes are in lower case
+    char small[MAX_PATH];
+    size_t length = strlen(i_path);
+    char* folded = length < sizeof(small) ? small : malloc(length + 1);
+    for (size_t i = 0; i <= length; ++i) folded[i] = (char)derrick_internal_fold[(unsigned char)i_path[i]];
+    const char* name = folded + i_name;
+
+    int rule = derrick_internal_RuleHashFind(&i_rules->names, name, length - i_name, i_directory);
+    int other = derrick_internal_RuleHashFind(&i_rules->paths, folded, length, i_directory);
+    if (other > rule) rule = other;
+    if (i_rules->extensions.used > 0)
+    {
+        for (const char* dot = strchr(name, '.'); dot != 0; dot = strchr(dot + 1, '.'))
+        {
+            other = derrick_internal_RuleHashFind(&i_rules->extensions, dot + 1, folded + length - dot - 1, i_directory);
+            if (other > rule) rule = other;
+        }
+    }
+    other = derrick_internal_GlobMatch(&i_rules->name_globs, name, length - i_name, i_directory);
+    if (other > rule) rule = other;
+    other = derrick_internal_GlobMatch(&i_rules->path_globs, folded, length, i_directory);
+    if (other > rule) rule = other;
+
+    if (folded != small) free(folded);
+    return rule;
+}
+
+int derrick_filter_compile(DerrickFilter* o_filter, const char* i_exclude, const char* i_include, int i_flags)
+{
+    if (o_filter == 0) return DERRICK_ERROR;
+    derrick_internal_Init();
+
+    struct Derrick_Filter_s* filter = calloc(1, sizeof(struct Derrick_Filter_s));
+    filter->flags = i_flags;
+    int rc = DERRICK_OK;
+    if (i_exclude) rc = derrick_internal_RulesAdd(&filter->exclude, i_exclude, strlen(i_exclude));
+    if (i_include && rc == DERRICK_OK) rc = derrick_internal_RulesAdd(&filter->include, i_include, strlen(i_include));
+    if (rc != DERRICK_OK)
+    {
+        derrick_filter_free(filter);
+        (*o_filter) = 0;
+        return rc;
+    }
+    derrick_internal_RulesSeal(&filter->exclude);
+    derrick_internal_RulesSeal(&filter->include);
+    (*o_filter) = filter;
+    return DERRICK_OK;
+}
+
+void derrick_filter_free(DerrickFilter i_filter)
+{
+    if (i_filter == 0) return;
+    derrick_internal_RulesFree(&i_filter->exclude);
+    derrick_internal_RulesFree(&i_filter->include);
+    free(i_filter);
+}
+
+// Take a reference on a chain of ignore files
+struct Derrick_Ignore_s* derrick_internal_IgnoreKeep(struct Derrick_Ignore_s* io_ignore)
+{
+    if (io_ignore) InterlockedIncrement(&io_ignore->references);
+    return io_ignore;
+}
+
+void derrick_internal_IgnoreRelease(struct Derrick_Ignore_s* io_ignore)
+{
+    while (io_ignore && InterlockedDecrement(&io_ignore->references) == 0)
+    {
+        struct Derrick_Ignore_s* parent = io_ignore->parent;
+        derrick_internal_RulesFree(&io_ignore->rules);
+        free(io_ignore);
+        io_ignore = parent;
+    }
+}
+
+// Chain of the ignore files that apply to the entries of a directory, whose path is the i_length
+// first bytes of io_path, which must have room for DERRICK_WALK_ROOM more bytes. The patterns
+// of .ignore come after those of .gitignore, so that they win. Returns a new reference.
+struct Derrick_Ignore_s* derrick_internal_IgnoreEnter(DerrickFilter i_filter, struct Derrick_Ignore_s* io_parent, char* io_path, size_t i_length)
+{
+    if (i_filter == 0 || (i_filter->flags & DERRICK_FILTER_IGNORE_FILES) == 0) return 0;
+
+    static const char* const files[] = { "\\.gitignore", "\\.ignore" };
+    struct Derrick_Ignore_s* ignore = 0;
+    for (size_t f = 0; f < sizeof(files) / sizeof(files[0]); ++f)
+    {
+        const char* data = 0;
+        size_t size = 0;
+        strcpy(io_path + i_length, files[f]);
+        if (derrick_internal_MapFile(io_path, &data, &size, 0, 0) == DERRICK_OK && size > 0)
+        {
+            if (ignore == 0)
+            {
+                ignore = calloc(1, sizeof(struct Derrick_Ignore_s));
+                ignore->length = i_length;
+                ignore->references = 1;
+            }
+            // A bad line of an ignore file is skipped, the others still apply
+            derrick_internal_RulesAdd(&ignore->rules, data, size);
+        }
+        derrick_internal_UnmapFile(data);
+    }
+    io_path[i_length] = '\0';
+
+    if (ignore == 0) return derrick_internal_IgnoreKeep(io_parent);
+    derrick_internal_RulesSeal(&ignore->rules);
+    ignore->parent = derrick_internal_IgnoreKeep(io_parent);
+    return ignore;
+}
+
+// 1 if a filter leaves an entry out. i_path is the full path of the entry, i_root the length of
+// the path the walk started from, i_name the offset of the name of the entry.
+int derrick_internal_FilterExcludes(DerrickFilter i_filter, const struct Derrick_Ignore_s* i_ignore, const char* i_path, size_t i_root, size_t i_name, int i_directory)
+{
+    // The closest ignore file that has a say wins, then the patterns of the filter
+    int rule = -1;
+    const struct Derrick_Rules_s* rules = 0;
+    for (; i_ignore != 0 && rule < 0; i_ignore = i_ignore->parent)
+    {
+        rules = &i_ignore->rules;
+        rule = derrick_internal_RulesMatch(rules, i_path + i_ignore->length + 1, i_name - i_ignore->length - 1, i_directory);
+    }
+    if (rule < 0)
+    {
+        rules = &i_filter->exclude;
+        rule = derrick_internal_RulesMatch(rules, i_path + i_root + 1, i_name - i_root - 1, i_directory);
+    }
+    if (rule >= 0 && !rules->negate[rule]) return 1;
+
+    // When there are include patterns, the files must match one
+    if (i_directory || i_filter->include.number_of_rules == 0) return 0;
+    rule = derrick_internal_RulesMatch(&i_filter->include, i_path + i_root + 1, i_name - i_root - 1, 0);
+    return rule < 0 || i_filter->include.negate[rule];
+}
+
+// Tick count of the performance counter, only read when the statistics are wanted
+uint64_t derrick_internal_Now(const struct Derrick_Stats_s* i_stats)
+{
+    if (i_stats == 0) return 0;
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (uint64_t)now.QuadPart;
+}
+
+// Nanoseconds since i_start
+uint64_t derrick_internal_Since(const struct Derrick_Stats_s* i_stats, uint64_t i_start)
+{
+    static LONGLONG frequency = 0;
+    if (i_stats == 0) return 0;
+    if (frequency == 0)
+    {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency(&f);
+        frequency = f.QuadPart;
+    }
+    return (uint64_t)((double)(derrick_internal_Now(i_stats) - i_start) * 1e9 / (double)frequency);
+}
+
+// Add the time taken by one file, directory or batch to a phase
+void derrick_internal_Record(struct Derrick_Stats_s* io_stats, int i_phase, uint64_t i_nanoseconds)
+{
+    if (io_stats == 0) return;
+    io_stats->nanoseconds[i_phase] += i_nanoseconds;
+    int bucket = 0;
+    for (uint64_t us = i_nanoseconds / 1000; us > 0 && bucket < DERRICK_HISTOGRAM_SIZE - 1; us >>= 1) bucket++;
+    io_stats->histogram[i_phase][bucket]++;
+}
+
+void derrick_internal_Elapsed(struct Derrick_Stats_s* io_stats, int i_phase, uint64_t i_start)
+{
+    if (io_stats) derrick_internal_Record(io_stats, i_phase, derrick_internal_Since(io_stats, i_start));
+}
+
+// Count a file that could not be opened or read, and return DERRICK_ERROR
+int derrick_internal_Failed(struct Derrick_Stats_s* io_stats)
+{
+    if (io_stats)
+    {
+        io_stats->files_failed++;
+        io_stats->last_error = (uint32_t)GetLastError();
+    }
+    return DERRICK_ERROR;
+}
+
+// Merge the counters of a thread
+void derrick_internal_StatsAdd(struct Derrick_Stats_s* io_total, const struct Derrick_Stats_s* i_stats)
+{
+    io_total->directories += i_stats->directories;
+    io_total->files_opened += i_stats->files_opened;
+    io_total->files_cached += i_stats->files_cached;
+    io_total->files_skipped += i_stats->files_skipped;
+    io_total->files_failed += i_stats->files_failed;
+    if (i_stats->last_error) io_total->last_error = i_stats->last_error;
+    io_total->bytes_scanned += i_stats->bytes_scanned;
+    io_total->matches += i_stats->matches;
+    for (int p = 0; p < DERRICK_PHASES; ++p)
+    {
+        io_total->nanoseconds[p] += i_stats->nanoseconds[p];
+        for (int b = 0; b < DERRICK_HISTOGRAM_SIZE; ++b) io_total->histogram[p][b] += i_stats->histogram[p][b];
+    }
+}
+
+// Called by a walk for each file: anything else than DERRICK_OK stops the walk
+typedef int (*derrick_visit_t)(void* io_context, const char* i_path, const WIN32_FIND_DATAA* i_find);
+
+// Called by a walk that is not recursive for each directory, with the ignore files that apply
+// to its entries: anything else than DERRICK_OK stops the walk
+typedef int (*derrick_visit_dir_t)(void* io_context, const char* i_path, struct Derrick_Ignore_s* i_ignore);
+
+// Depth-first walk of a tree, without recursion
+struct Derrick_Walk_s
+{
+    derrick_visit_t visit_file;
+    derrick_visit_dir_t visit_directory; // only called when the walk is not recursive
+    void* context;
+    int recursive;                      // 0 to list the top directory only
+    size_t root_length;                 // length of the path the patterns of the filter are relative to, 0 for the top directory
+    DerrickFilter filter;
+    struct Derrick_Ignore_s* ignore;    // ignore files of the parents of the top directory
+    derrick_cb_exclude_t exclude;       // files
+    derrick_cb_exclude_t exclude_dir;   // directories, skipped with everything they contain
+    void* ctx_exclude;
+    CRITICAL_SECTION* lock;             // if set, taken around the exclude callbacks
+    struct Derrick_Stats_s* stats;      // if set, directories and skipped files are counted
+};
+
+// A directory being listed by a walk
+struct Derrick_WalkLevel_s
+{
+    HANDLE find;
+    size_t length;      // length of its path
+    struct Derrick_Ignore_s* ignore;
+    uint64_t nanoseconds;   // spent listing it
+};
+
+int derrick_internal_WalkExcluded(const struct Derrick_Walk_s* i_walk, derrick_cb_exclude_t i_exclude, const char* i_path)
+{
+    if (i_exclude == 0) return 0;
+    if (i_walk->lock) EnterCriticalSection(i_walk->lock);
+    int excluded = (i_exclude(i_walk->ctx_exclude, i_path) == 1);
+    if (i_walk->lock) LeaveCriticalSection(i_walk->lock);
+    return excluded;
+}
+
+// List a directory whose path is the i_length first bytes of io_path, which must have room
+// for DERRICK_WALK_ROOM more bytes. The short names are not needed, and the entries are fetched in batches.
+HANDLE derrick_internal_WalkOpen(char* io_path, size_t i_length, WIN32_FIND_DATAA* o_find)
+{
+    memcpy(io_path + i_length, "\\*", 3);
+    HANDLE hFind = FindFirstFileExA(io_path, FindExInfoBasic, o_find, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    io_path[i_length] = '\0';
+    return hFind;
+}
+
+// Visit the files below i_root, in the same order as a recursive listing. The directories that
+// cannot be listed are skipped. A single buffer holds the current path: each name is copied
+// after the path of its directory. The attributes, size and times of the listing are passed
+// to the visitors, so that the files do not need to be opened to know them.
+int derrick_internal_Walk(const char* i_root, const struct Derrick_Walk_s* i_walk)
+{
+    size_t capacity = strlen(i_root) + MAX_PATH + DERRICK_WALK_ROOM;
+    char* path = malloc(capacity);
+    strcpy(path, i_root);
+    size_t root_length = i_walk->root_length ? i_walk->root_length : strlen(i_root);
+
+    WIN32_FIND_DATAA fdFile;
+    struct Derrick_Stats_s* stats = i_walk->stats;
+    size_t max_depth = 16;
+    struct Derrick_WalkLevel_s* levels = malloc(max_depth * sizeof(struct Derrick_WalkLevel_s));
+    uint64_t start = derrick_internal_Now(stats);
+    levels[0].length = strlen(i_root);
+    levels[0].find = derrick_internal_WalkOpen(path, levels[0].length, &fdFile);
+    if (levels[0].find == INVALID_HANDLE_VALUE)
+    {
+        free(levels);
+        free(path);
+        return DERRICK_PATH_NOT_FOUND;
+    }
+    levels[0].ignore = derrick_internal_IgnoreEnter(i_walk->filter, i_walk->ignore, path, levels[0].length);
+    levels[0].nanoseconds = derrick_internal_Since(stats, start);
+    if (stats) stats->directories++;
+
+    int rc = DERRICK_OK;
+    size_t depth = 1;
+    int listed = 1;     // fdFile holds an entry not visited yet
+    while (depth > 0)
+    {
+        struct Derrick_WalkLevel_s* level = &levels[depth - 1];
+        if (!listed)
+        {
+            start = derrick_internal_Now(stats);
+            BOOL next = FindNextFileA(level->find, &fdFile);
+            level->nanoseconds += derrick_internal_Since(stats, start);
+            if (!next)
+            {
+                FindClose(level->find);
+                derrick_internal_IgnoreRelease(level->ignore);
+                derrick_internal_Record(stats, DERRICK_PHASE_WALK, level->nanoseconds);
+                depth--;
+                continue;
+            }
+        }
+        listed = 0;
+
+        // The listing always starts with "." and ".."
+        const char* name = fdFile.cFileName;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        {
+            continue;
+        }
+
+        size_t name_length = strlen(name);
+        size_t length = level->length + 1 + name_length;
+        if (length + DERRICK_WALK_ROOM > capacity)
+        {
+            capacity = (length + DERRICK_WALK_ROOM) * 2;
+            path = realloc(path, capacity);
+        }
+        path[level->length] = '\\';
+        memcpy(path + level->length + 1, name, name_length + 1);
+
+        int directory = (fdFile.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        if (i_walk->filter && derrick_internal_FilterExcludes(i_walk->filter, level->ignore, path, root_length, level->length + 1, directory))
+        {
+            if (stats && !directory) stats->files_skipped++;
+            continue;
+        }
+
+        if (directory)
+        {
+            if (derrick_internal_WalkExcluded(i_walk, i_walk->exclude_dir, path))
+            {
+                continue;
+            }
+            if (!i_walk->recursive)
+            {
+                if ((rc = i_walk->visit_directory(i_walk->context, path, level->ignore)) != DERRICK_OK) break;
+                continue;
+            }
+
+            start = derrick_internal_Now(stats);
+            HANDLE hFind = derrick_internal_WalkOpen(path, length, &fdFile);
+            if (hFind == INVALID_HANDLE_VALUE)
+            {
+                continue;
+            }
+            if (stats) stats->directories++;
+            if (depth == max_depth)
+            {
+                max_depth *= 2;
+                levels = realloc(levels, max_depth * sizeof(struct Derrick_WalkLevel_s));
+            }
+            levels[depth].find = hFind;
+            levels[depth].length = length;
+            levels[depth].ignore = derrick_internal_IgnoreEnter(i_walk->filter, levels[depth - 1].ignore, path, length);
+            levels[depth].nanoseconds = derrick_internal_Since(stats, start);
+            depth++;
+            listed = 1;
+        }
+        else if (derrick_internal_WalkExcluded(i_walk, i_walk->exclude, path))
+        {
+            if (stats) stats->files_skipped++;
+        }
+        else if ((rc = i_walk->visit_file(i_walk->context, path, &fdFile)) != DERRICK_OK)
+        {
+            break;
+        }
+    }
+
+    while (depth > 0)
+    {
+        depth--;
+        FindClose(levels[depth].find);
+        derrick_internal_IgnoreRelease(levels[depth].ignore);
+        derrick_internal_Record(stats, DERRICK_PHASE_WALK, levels[depth].nanoseconds);
+    }
+    free(levels);
+    free(path);
+    return rc;
+}
+
+// Prepare a walk that applies the exclusions of the parameters, if any
+void derrick_internal_WalkInit(struct Derrick_Walk_s* o_walk, Derrick_Parameters i_cb, derrick_visit_t i_visit_file, void* io_context)
+{
+    memset(o_walk, 0, sizeof(struct Derrick_Walk_s));
+    o_walk->visit_file = i_visit_file;
+    o_walk->context = io_context;
+    o_walk->recursive = 1;
+    if (i_cb)
+    {
+        o_walk->exclude = i_cb->cb_exclude;
+        o_walk->exclude_dir = i_cb->cb_exclude_dir;
+        o_walk->ctx_exclude = i_cb->ctx_exclude;
+        o_walk->filter = i_cb->param_filter;
+    }
+}
+
+void derrick_internal_ArenaInit(struct Derrick_Arena_s* io_arena, int i_large_pages)
+{
+    memset(io_arena, 0, sizeof(struct Derrick_Arena_s));
+    io_arena->large_pages = i_large_pages;
+}
+
+// Allocate i_size bytes at the end of the arena. A request that does not fit in the last
+// chunk starts a new one, so the used bytes of the chunks never need padding between them.
+void* derrick_internal_ArenaAlloc(struct Derrick_Arena_s* io_arena, size_t i_size)
+{
+    struct Derrick_Chunk_s* chunk = io_arena->last;
+    if (chunk == 0 || chunk->used + i_size > chunk->size)
+    {
+        size_t size = DERRICK_CHUNK_SIZE;
+        while (size - sizeof(struct Derrick_Chunk_s) < i_size) size *= 2;
+        chunk = derrick_internal_AllocPages(size, io_arena->large_pages);
+        if (chunk == 0) return 0;
+        chunk->next = 0;
+        chunk->size = size - sizeof(struct Derrick_Chunk_s);
+        chunk->used = 0;
+        if (io_arena->last) io_arena->last->next = chunk;
+        else io_arena->first = chunk;
+        io_arena->last = chunk;
+    }
+    void* data = (unsigned char*)(chunk + 1) + chunk->used;
+    chunk->used += i_size;
+    io_arena->size += i_size;
+    return data;
+}
+
+// Address of the byte at offset i_offset of the arena
+void* derrick_internal_ArenaAt(const struct Derrick_Arena_s* i_arena, uint64_t i_offset)
+{
+    for (const struct Derrick_Chunk_s* chunk = i_arena->first; chunk != 0; chunk = chunk->next)
+    {
+        if (i_offset < chunk->used) return (unsigned char*)(chunk + 1) + i_offset;
+        i_offset -= chunk->used;
+    }
+    return 0;
+}
+
+// Concatenate the used bytes of all the chunks
+void derrick_internal_ArenaCopy(const struct Derrick_Arena_s* i_arena, void* o_data)
+{
+    unsigned char* cur = (unsigned char*)o_data;
+    for (const struct Derrick_Chunk_s* chunk = i_arena->first; chunk != 0; chunk = chunk->next)
+    {
+        memcpy(cur, chunk + 1, chunk->used);
+        cur += chunk->used;
+    }
+}
+
+void derrick_internal_ArenaFree(struct Derrick_Arena_s* io_arena)
+{
+    struct Derrick_Chunk_s* chunk = io_arena->first;
+    while (chunk != 0)
+    {
+        struct Derrick_Chunk_s* next = chunk->next;
+        derrick_internal_FreePages(chunk);
+        chunk = next;
+    }
+    io_arena->first = 0;
+    io_arena->last = 0;
+    io_arena->size = 0;
+}
+
+void derrick_internal_PutVarint(struct Derrick_Builder_s* io_builder, struct Derrick_Posting_s* io_posting, uint32_t i_value)
+{
+    struct Derrick_Block_s* block = io_posting->tail;
+    if (block == 0 || block->size + 5 > block->capacity)
+    {
+        // Blocks grow with the list so that long lists are made of few blocks
+        uint32_t capacity = block == 0 ? 8 : block->capacity < DERRICK_MAX_BLOCK ? block->capacity * 2 : DERRICK_MAX_BLOCK;
+        struct Derrick_Block_s* next = derrick_internal_ArenaAlloc(&io_builder->blocks, DERRICK_ALIGN(sizeof(struct Derrick_Block_s) + capacity));
+        next->next = 0;
+        next->size = 0;
+        next->capacity = capacity;
+        if (block) block->next = next;
+        else io_posting->first = next;
+        io_posting->tail = next;
+        block = next;
+    }
+    unsigned char* data = (unsigned char*)(block + 1);
+    uint32_t size = block->size;
+    while (i_value >= 0x80)
+    {
+        data[size++] = (unsigned char)(i_value | 0x80);
+        i_value >>= 7;
+    }
+    data[size++] = (unsigned char)i_value;
+    io_posting->size += size - block->size;
+    block->size = size;
+}
+
+const unsigned char* derrick_internal_GetVarint(const unsigned char* i_data, uint32_t* o_value)
+{
+    uint32_t value = 0;
+    int shift = 0;
+    while (*i_data & 0x80)
+    {
+        value |= (uint32_t)(*i_data++ & 0x7F) << shift;
+        shift += 7;
+    }
+    (*o_value) = value | ((uint32_t)(*i_data++) << shift);
+    return i_data;
+}
+
+struct Derrick_Posting_s* derrick_internal_GetPosting(struct Derrick_Builder_s* io_builder, uint32_t i_trigram)
+{
+    // Keep the load factor under 1/2
+    if ((io_builder->slots_used + 1) * 2 > io_builder->slots_capacity)
+    {
+        size_t old_capacity = io_builder->slots_capacity;
+        struct Derrick_Posting_s* old_slots = io_builder->slots;
+        io_builder->slots_capacity = old_capacity ? old_capacity * 2 : 4096;
+        io_builder->slots = malloc(io_builder->slots_capacity * sizeof(struct Derrick_Posting_s));
+        for (size_t i = 0; i < io_builder->slots_capacity; ++i)
+        {
+            io_builder->slots[i].trigram = DERRICK_EMPTY_SLOT;
+        }
+        for (size_t i = 0; i < old_capacity; ++i)
+        {
+            if (old_slots[i].trigram == DERRICK_EMPTY_SLOT) continue;
+            size_t slot = (old_slots[i].trigram * 2654435761u) & (io_builder->slots_capacity - 1);
+            while (io_builder->slots[slot].trigram != DERRICK_EMPTY_SLOT)
+            {
+                slot = (slot + 1) & (io_builder->slots_capacity - 1);
+            }
+            io_builder->slots[slot] = old_slots[i];
+        }
+        free(old_slots);
+    }
+
+    size_t slot = (i_trigram * 2654435761u) & (io_builder->slots_capacity - 1);
+    while (io_builder->slots[slot].trigram != i_trigram)
+    {
+        if (io_builder->slots[slot].trigram == DERRICK_EMPTY_SLOT)
+        {
+            struct Derrick_Posting_s* posting = &io_builder->slots[slot];
+            posting->trigram = i_trigram;
+            posting->count = 0;
+            posting->last = (uint32_t)-1;
+            posting->size = 0;
+            posting->first = 0;
+            posting->tail = 0;
+            io_builder->slots_used++;
+            break;
+        }
+        slot = (slot + 1) & (io_builder->slots_capacity - 1);
+    }
+    return &io_builder->slots[slot];
+}
+
+// Record a line feed of the current file in its newline table
+void derrick_internal_NewlineAdd(struct Derrick_Builder_s* io_builder, uint64_t i_offset)
+{
+    if (io_builder->newlines % DERRICK_LINES_BLOCK == 0)
+    {
+        size_t mark = (size_t)(io_builder->newlines / DERRICK_LINES_BLOCK);
+        if (mark == io_builder->marks_capacity)
+        {
+            io_builder->marks_capacity = io_builder->marks_capacity ? io_builder->marks_capacity * 2 : 64;
+            io_builder->marks = realloc(io_builder->marks, io_builder->marks_capacity * sizeof(struct Derrick_LineMark_s));
+        }
+        io_builder->marks[mark].offset = i_offset;
+        io_builder->marks[mark].gaps = io_builder->gaps_size;
+    }
+    else
+    {
+        if (io_builder->gaps_size + 10 > io_builder->gaps_capacity)
+        {
+            io_builder->gaps_capacity = io_builder->gaps_capacity ? io_builder->gaps_capacity * 2 : 1024;
+            io_builder->gaps = realloc(io_builder->gaps, io_builder->gaps_capacity);
+        }
+        uint64_t gap = i_offset - io_builder->newline - 1;
+        while (gap >= 0x80)
+        {
+            io_builder->gaps[io_builder->gaps_size++] = (unsigned char)(gap | 0x80);
+            gap >>= 7;
+        }
+        io_builder->gaps[io_builder->gaps_size++] = (unsigned char)gap;
+    }
+    io_builder->newline = i_offset;
+    io_builder->newlines++;
+}
+
+size_t derrick_internal_LinesSize(const struct Derrick_Lines_s* i_lines)
+{
+    size_t number_of_marks = (size_t)((i_lines->count + DERRICK_LINES_BLOCK - 1) / DERRICK_LINES_BLOCK);
+    return sizeof(struct Derrick_Lines_s) + number_of_marks * sizeof(struct Derrick_LineMark_s) + DERRICK_ALIGN((size_t)i_lines->size);
+}
+
+// Append the newline table of the current file to the lines pool, and return its offset
+uint64_t derrick_internal_LinesPut(struct Derrick_Builder_s* io_builder)
+{
+    struct Derrick_Lines_s header;
+    header.count = io_builder->newlines;
+    header.size = io_builder->gaps_size;
+    uint64_t offset = io_builder->lines.size;
+    struct Derrick_Lines_s* lines = derrick_internal_ArenaAlloc(&io_builder->lines, derrick_internal_LinesSize(&header));
+    size_t number_of_marks = (size_t)((header.count + DERRICK_LINES_BLOCK - 1) / DERRICK_LINES_BLOCK);
+    (*lines) = header;
+    memcpy(lines + 1, io_builder->marks, number_of_marks * sizeof(struct Derrick_LineMark_s));
+    memcpy((struct Derrick_LineMark_s*)(lines + 1) + number_of_marks, io_builder->gaps, io_builder->gaps_size);
+    return offset;
+}
+
+// Append the newline table of a file of another segment to the lines pool
+uint64_t derrick_internal_LinesCopy(struct Derrick_Builder_s* io_builder, const struct Derrick_Lines_s* i_lines)
+{
+    uint64_t offset = io_builder->lines.size;
+    size_t size = derrick_internal_LinesSize(i_lines);
+    memcpy(derrick_internal_ArenaAlloc(&io_builder->lines, size), i_lines, size);
+    return offset;
+}
+
+// Offset of a line feed of a file, from its number
+uint64_t derrick_internal_NewlineAt(const struct Derrick_Lines_s* i_lines, uint64_t i_number)
+{
+    const struct Derrick_LineMark_s* marks = (const struct Derrick_LineMark_s*)(i_lines + 1);
+    const struct Derrick_LineMark_s* mark = &marks[i_number / DERRICK_LINES_BLOCK];
+    const unsigned char* gaps = (const unsigned char*)(marks + (i_lines->count + DERRICK_LINES_BLOCK - 1) / DERRICK_LINES_BLOCK) + mark->gaps;
+    uint64_t offset = mark->offset;
+    for (uint64_t i = 0; i < i_number % DERRICK_LINES_BLOCK; ++i)
+    {
+        uint64_t gap = 0;
+        int shift = 0;
+        while (*gaps & 0x80)
+        {
+            gap |= (uint64_t)(*gaps++ & 0x7F) << shift;
+            shift += 7;
+        }
+        gap |= (uint64_t)(*gaps++) << shift;
+        offset += gap + 1;
+    }
+    return offset;
+}
+
+// Number of the line feeds of a file before i_offset: a binary search on the marks, then
+// at most one block of gaps to decode
+uint64_t derrick_internal_NewlinesBefore(const struct Derrick_Lines_s* i_lines, uint64_t i_offset)
+{
+    const struct Derrick_LineMark_s* marks = (const struct Derrick_LineMark_s*)(i_lines + 1);
+    size_t number_of_marks = (size_t)((i_lines->count + DERRICK_LINES_BLOCK - 1) / DERRICK_LINES_BLOCK);
+    size_t low = 0;
+    size_t high = number_of_marks;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (marks[middle].offset < i_offset) low = middle + 1;
+        else high = middle;
+    }
+    if (low == 0) return 0;
+
+    uint64_t number = (uint64_t)(low - 1) * DERRICK_LINES_BLOCK;
+    uint64_t last = number + DERRICK_LINES_BLOCK < i_lines->count ? number + DERRICK_LINES_BLOCK : i_lines->count;
+    const unsigned char* gaps = (const unsigned char*)(marks + number_of_marks) + marks[low - 1].gaps;
+    uint64_t offset = marks[low - 1].offset;
+    for (number++; number < last; ++number)
+    {
+        uint64_t gap = 0;
+        int shift = 0;
+        while (*gaps & 0x80)
+        {
+            gap |= (uint64_t)(*gaps++ & 0x7F) << shift;
+            shift += 7;
+        }
+        gap |= (uint64_t)(*gaps++) << shift;
+        offset += gap + 1;
+        if (offset >= i_offset) break;
+    }
+    return number;
+}
+
+// Start collecting the trigrams of a file of i_size bytes
+void derrick_internal_ContentBegin(struct Derrick_Builder_s* io_builder, uint64_t i_size)
+{
+    // A file cannot contain more distinct trigrams than its size. It is the size listed, a file
+    // that grew since makes derrick_internal_ContentAdd grow the list.
+    size_t needed = i_size < DERRICK_TRIGRAM_SPACE ? (size_t)i_size : DERRICK_TRIGRAM_SPACE;
+    if (needed > io_builder->touched_capacity)
+    {
+        free(io_builder->touched);
+        io_builder->touched_capacity = needed;
+        io_builder->touched = malloc(needed * sizeof(uint32_t));
+    }
+    io_builder->number_of_touched = 0;
+    io_builder->content_size = 0;
+    io_builder->trigram = 0;
+    io_builder->newlines = 0;
+    io_builder->gaps_size = 0;
+}
+
+// Collect the distinct trigrams of the next bytes of the file, in lower case so that they
+// serve both case-sensitive and case-insensitive searches
+void derrick_internal_ContentAdd(struct Derrick_Builder_s* io_builder, const unsigned char* i_data, size_t i_size)
+{
+    for (const unsigned char* cur = i_data; cur < i_data + i_size && (cur = memchr(cur, '\n', i_data + i_size - cur)) != 0; ++cur)
+    {
+        derrick_internal_NewlineAdd(io_builder, io_builder->content_size + (cur - i_data));
+    }
+
+    const unsigned char* fold = derrick_internal_fold;
+    size_t number_of_touched = io_builder->number_of_touched;
+    size_t capacity = io_builder->touched_capacity;
+    uint32_t trigram = io_builder->trigram;
+    size_t i = 0;
+
+    // The first two bytes of the file do not end a trigram
+    for (; i < i_size && io_builder->content_size + i < 2; ++i)
+    {
+        trigram = (trigram << 8) | fold[i_data[i]];
+    }
+    for (; i < i_size; ++i)
+    {
+        trigram = ((trigram << 8) | fold[i_data[i]]) & (DERRICK_TRIGRAM_SPACE - 1);
+        unsigned char bit = (unsigned char)(1 << (trigram & 7));
+        if ((io_builder->seen[trigram >> 3] & bit) == 0)
+        {
+            if (number_of_touched == capacity)
+            {
+                // No more than DERRICK_TRIGRAM_SPACE trigrams are distinct, the list never outgrows it
+                capacity = (capacity < DERRICK_TRIGRAM_SPACE / 2) ? (capacity < 4096 ? 4096 : capacity * 2) : DERRICK_TRIGRAM_SPACE;
+                io_builder->touched = realloc(io_builder->touched, capacity * sizeof(uint32_t));
+                io_builder->touched_capacity = capacity;
+            }
+            io_builder->seen[trigram >> 3] |= bit;
+            io_builder->touched[number_of_touched++] = trigram;
+        }
+    }
+
+    io_builder->number_of_touched = number_of_touched;
+    io_builder->content_size += i_size;
+    io_builder->trigram = trigram;
+}
+
+// Append the file to the posting lists of its trigrams and reset the bitmap for the next file.
+// With DERRICK_EMPTY_SLOT as id, the trigrams are dropped.
+void derrick_internal_ContentEnd(struct Derrick_Builder_s* io_builder, uint32_t i_id)
+{
+    for (size_t i = 0; i < io_builder->number_of_touched; ++i)
+    {
+        if (i_id != DERRICK_EMPTY_SLOT)
+        {
+            struct Derrick_Posting_s* posting = derrick_internal_GetPosting(io_builder, io_builder->touched[i]);
+            derrick_internal_PutVarint(io_builder, posting, i_id - posting->last - 1);
+            posting->last = i_id;
+            posting->count++;
+        }
+        io_builder->seen[io_builder->touched[i] >> 3] = 0;
+    }
+    io_builder->number_of_touched = 0;
+}
+
+void derrick_internal_AddContent(struct Derrick_Builder_s* io_builder, uint32_t i_id, const unsigned char* i_data, size_t i_size)
+{
+    derrick_internal_ContentBegin(io_builder, i_size);
+    derrick_internal_ContentAdd(io_builder, i_data, i_size);
+    derrick_internal_ContentEnd(io_builder, i_id);
+}
+
+void derrick_internal_BuilderInit(struct Derrick_Builder_s* io_builder, int i_large_pages)
+{
+    memset(io_builder, 0, sizeof(struct Derrick_Builder_s));
+    derrick_internal_ArenaInit(&io_builder->entries, i_large_pages);
+    derrick_internal_ArenaInit(&io_builder->names, i_large_pages);
+    derrick_internal_ArenaInit(&io_builder->dirs, i_large_pages);
+    derrick_internal_ArenaInit(&io_builder->dir_paths, i_large_pages);
+    derrick_internal_ArenaInit(&io_builder->blocks, i_large_pages);
+    derrick_internal_ArenaInit(&io_builder->lines, i_large_pages);
+    io_builder->seen = calloc(DERRICK_TRIGRAM_SPACE / 8, 1);
+    io_builder->large_pages = i_large_pages;
+    io_builder->stream_size = DERRICK_STREAM_SIZE;
+    derrick_internal_Init();
+}
+
+void derrick_internal_BuilderFree(struct Derrick_Builder_s* io_builder)
+{
+    derrick_internal_ArenaFree(&io_builder->entries);
+    derrick_internal_ArenaFree(&io_builder->names);
+    derrick_internal_ArenaFree(&io_builder->dirs);
+    derrick_internal_ArenaFree(&io_builder->dir_paths);
+    derrick_internal_ArenaFree(&io_builder->blocks);
+    derrick_internal_ArenaFree(&io_builder->lines);
+    free(io_builder->marks);
+    free(io_builder->gaps);
+    free(io_builder->copies);
+    free(io_builder->dir_slots);
+    free(io_builder->slots);
+    free(io_builder->seen);
+    free(io_builder->touched);
+    derrick_internal_FreePages(io_builder->stream);
+    memset(io_builder, 0, sizeof(struct Derrick_Builder_s));
+}
+
+// Slot of a directory in the table of a builder, or the unused slot where it goes
+struct Derrick_DirSlot_s* derrick_internal_DirSlot(const struct Derrick_Builder_s* i_builder, uint64_t i_hash, const char* i_path, size_t i_length)
+{
+    size_t slot = (size_t)i_hash & (i_builder->dir_slots_capacity - 1);
+    for (; i_builder->dir_slots[slot].hash != 0; slot = (slot + 1) & (i_builder->dir_slots_capacity - 1))
+    {
+        const struct Derrick_DirSlot_s* known = &i_builder->dir_slots[slot];
+        if (known->hash != i_hash) continue;
+        const char* path = derrick_internal_ArenaAt(&i_builder->dir_paths, known->path);
+        if (strncmp(path, i_path, i_length) == 0 && path[i_length] == '\0') break;
+    }
+    return &i_builder->dir_slots[slot];
+}
+
+// Return the directory of the first i_length bytes of a path, which end with a separator,
+// adding it and its parents to the directory table if needed. DERRICK_NO_DIR if i_length is 0.
+uint64_t derrick_internal_AddDir(struct Derrick_Builder_s* io_builder, const char* i_path, size_t i_length)
+{
+    if (i_length == 0) return DERRICK_NO_DIR;
+    uint64_t hash = derrick_internal_Checksum(i_path, i_length) | 1;
+    if (io_builder->dir_slots_used > 0)
+    {
+        struct Derrick_DirSlot_s* slot = derrick_internal_DirSlot(io_builder, hash, i_path, i_length);
+        if (slot->hash != 0) return slot->dir;
+    }
+
+    size_t start = i_length - 1;
+    while (start > 0 && i_path[start - 1] != '\\' && i_path[start - 1] != '/') start--;
+    uint64_t parent = derrick_internal_AddDir(io_builder, i_path, start);
+
+    // Keep the load factor under 1/2
+    if ((io_builder->dir_slots_used + 1) * 2 > io_builder->dir_slots_capacity)
+    {
+        size_t capacity = io_builder->dir_slots_capacity ? io_builder->dir_slots_capacity * 2 : 1024;
+        struct Derrick_DirSlot_s* slots = calloc(capacity, sizeof(struct Derrick_DirSlot_s));
+        for (size_t i = 0; i < io_builder->dir_slots_capacity; ++i)
+        {
+            if (io_builder->dir_slots[i].hash == 0) continue;
+            size_t slot = (size_t)io_builder->dir_slots[i].hash & (capacity - 1);
+            while (slots[slot].hash != 0) slot = (slot + 1) & (capacity - 1);
+            slots[slot] = io_builder->dir_slots[i];
+        }
+        free(io_builder->dir_slots);
+        io_builder->dir_slots = slots;
+        io_builder->dir_slots_capacity = capacity;
+    }
+    struct Derrick_DirSlot_s* slot = derrick_internal_DirSlot(io_builder, hash, i_path, i_length);
+    slot->hash = hash;
+    slot->path = io_builder->dir_paths.size;
+    slot->dir = io_builder->number_of_dirs;
+    io_builder->dir_slots_used++;
+    char* path = derrick_internal_ArenaAlloc(&io_builder->dir_paths, i_length + 1);
+    memcpy(path, i_path, i_length);
+    path[i_length] = '\0';
+
+    struct Derrick_Dir_s* dir = derrick_internal_ArenaAlloc(&io_builder->dirs, sizeof(struct Derrick_Dir_s));
+    dir->parent = parent;
+    dir->name = io_builder->names.size;
+    dir->length = i_length;
+    char* name = derrick_internal_ArenaAlloc(&io_builder->names, i_length - start + 1);
+    memcpy(name, i_path + start, i_length - start);
+    name[i_length - start] = '\0';
+    return io_builder->number_of_dirs++;
+}
+
+// Append a file to the posting lists of the trigrams of its name
+void derrick_internal_NameAdd(struct Derrick_Builder_s* io_builder, uint32_t i_id, const char* i_name, size_t i_length)
+{
+    const unsigned char* fold = derrick_internal_fold;
+    for (size_t i = 0; i + 2 < i_length; ++i)
+    {
+        uint32_t trigram = DERRICK_NAME_TRIGRAM | ((uint32_t)fold[(unsigned char)i_name[i]] << 16)
+                | ((uint32_t)fold[(unsigned char)i_name[i + 1]] << 8) | (uint32_t)fold[(unsigned char)i_name[i + 2]];
+        struct Derrick_Posting_s* posting = derrick_internal_GetPosting(io_builder, trigram);
+        if (posting->count > 0 && posting->last == i_id) continue;  // already in the name
+        derrick_internal_PutVarint(io_builder, posting, i_id - posting->last - 1);
+        posting->last = i_id;
+        posting->count++;
+    }
+}
+
+// Add a file to a builder, i_copy_of being the entry with the same content or DERRICK_EMPTY_SLOT.
+// Its directory goes to the directory table, and its name to the trigrams of the names.
+uint32_t derrick_internal_AddEntry(struct Derrick_Builder_s* io_builder, const char* i_name, uint64_t i_size, uint64_t i_mtime, uint64_t i_inode,
+                                   uint64_t i_lines, uint32_t i_copy_of)
+{
+    size_t length = strlen(i_name);
+    size_t start = length;
+    while (start > 0 && i_name[start - 1] != '\\' && i_name[start - 1] != '/') start--;
+    uint64_t dir = derrick_internal_AddDir(io_builder, i_name, start);
+
+    uint32_t id = (uint32_t)io_builder->number_of_entries;
+    struct Derrick_Entry_s* entry = derrick_internal_ArenaAlloc(&io_builder->entries, sizeof(struct Derrick_Entry_s));
+    entry->name = io_builder->names.size;
+    entry->dir = dir;
+    entry->size = i_size;
+    entry->mtime = i_mtime;
+    entry->inode = i_inode;
+    entry->lines = i_lines;
+    entry->copy_of = i_copy_of == DERRICK_EMPTY_SLOT ? id : i_copy_of;
+    entry->next_copy = DERRICK_NO_COPY;     // linked by derrick_internal_Seal
+    memcpy(derrick_internal_ArenaAlloc(&io_builder->names, length - start + 1), i_name + start, length - start + 1);
+    derrick_internal_NameAdd(io_builder, id, i_name + start, length - start);
+    (io_builder->number_of_entries)++;
+    return id;
+}
+
+// Record the trigrams of a file read by chunks, return DERRICK_ERROR if it cannot be read.
+// *o_binary is set when the file is binary and its content is to be left out.
+int derrick_internal_AddStream(struct Derrick_Builder_s* io_builder, const char* i_path, uint64_t i_size, uint64_t* o_inode, int* o_binary)
+{
+    (*o_binary) = 0;
+    HANDLE hFile = derrick_internal_StreamOpen(i_path, io_builder->unbuffered, o_inode);
+    if (hFile == INVALID_HANDLE_VALUE) return DERRICK_ERROR;
+    if (io_builder->stream == 0) io_builder->stream = derrick_internal_StreamBuffer();
+
+    int rc;
+    size_t read;
+    derrick_internal_ContentBegin(io_builder, i_size);
+    while ((rc = derrick_internal_StreamRead(hFile, io_builder->stream, &read)) == DERRICK_OK && read > 0)
+    {
+        if (io_builder->content_size == 0 && io_builder->binary == DERRICK_BINARY_SKIP
+            && derrick_internal_IsBinary(io_builder->stream, read))
+        {
+            (*o_binary) = 1;
+            break;
+        }
+        derrick_internal_ContentAdd(io_builder, (const unsigned char*)io_builder->stream, read);
+    }
+    CloseHandle(hFile);
+    return rc;
+}
+
+// Second hash of a content, computed differently from derrick_internal_Checksum, so that a
+// file already indexed is only opened again when its content is almost surely the same
+uint64_t derrick_internal_Fingerprint(const void* i_data, size_t i_size)
+{
+    const unsigned char* cur = (const unsigned char*)i_data;
+    uint64_t hash = 0xCBF29CE484222325ull + i_size * 0x9E3779B97F4A7C15ull;
+    while (i_size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, cur, 8);
+        word ^= hash;
+        hash = ((word << 27) | (word >> 37)) * 0xC4CEB9FE1A85EC53ull;
+        cur += 8;
+        i_size -= 8;
+    }
+    while (i_size > 0)
+    {
+        hash = (hash ^ *cur++) * 0x100000001B3ull;
+        i_size--;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    return hash ^ (hash >> 33);
+}
+
+// Path of a file added to a builder, from its directory and the offset of its name, to free
+char* derrick_internal_BuilderPath(const struct Derrick_Builder_s* i_builder, uint64_t i_dir, uint64_t i_name)
+{
+    const char* name = derrick_internal_ArenaAt(&i_builder->names, i_name);
+    size_t length = strlen(name);
+    size_t start = 0;
+    if (i_dir != DERRICK_NO_DIR)
+    {
+        start = (size_t)((const struct Derrick_Dir_s*)derrick_internal_ArenaAt(&i_builder->dirs, i_dir * sizeof(struct Derrick_Dir_s)))->length;
+    }
+    char* path = malloc(start + length + 1);
+    memcpy(path + start, name, length + 1);
+    for (uint64_t d = i_dir; d != DERRICK_NO_DIR; )
+    {
+        const struct Derrick_Dir_s* dir = derrick_internal_ArenaAt(&i_builder->dirs, d * sizeof(struct Derrick_Dir_s));
+        const char* part = derrick_internal_ArenaAt(&i_builder->names, dir->name);
+        size_t part_length = strlen(part);
+        memcpy(path + dir->length - part_length, part, part_length);
+        d = dir->parent;
+    }
+    return path;
+}
+
+// Return the entry already indexed with the same content as [i_data, i_data + i_size), or 0.
+// The size and the two hashes only select the entry: the content of its file is compared, and
+// the file must not have changed since it was indexed.
+const struct Derrick_Copy_s* derrick_internal_FindCopy(const struct Derrick_Builder_s* i_builder, uint64_t i_hash, const char* i_data, size_t i_size)
+{
+    if (i_builder->copies_used == 0) return 0;
+    uint64_t check = 0;
+    size_t slot = (size_t)i_hash & (i_builder->copies_capacity - 1);
+    for (; i_builder->copies[slot].hash != 0; slot = (slot + 1) & (i_builder->copies_capacity - 1))
+    {
+        const struct Derrick_Copy_s* copy = &i_builder->copies[slot];
+        if (copy->hash != i_hash || copy->size != i_size) continue;
+        if (check == 0) check = derrick_internal_Fingerprint(i_data, i_size);
+        if (copy->check != check) continue;
+        const char* data = 0;
+        size_t size = 0;
+        uint64_t mtime = 0;
+        char* path = derrick_internal_BuilderPath(i_builder, copy->dir, copy->name);
+        int rc = derrick_internal_MapFile(path, &data, &size, 0, &mtime);
+        free(path);
+        if (rc != DERRICK_OK) continue;
+        int same = size == i_size && mtime == copy->mtime && memcmp(data, i_data, i_size) == 0;
+        derrick_internal_UnmapFile(data);
+        if (same) return copy;
+    }
+    return 0;
+}
+
+// Remember the content of a file just indexed, for its copies
+void derrick_internal_KeepCopy(struct Derrick_Builder_s* io_builder, uint64_t i_hash, const char* i_data, size_t i_size, uint64_t i_mtime, uint32_t i_id)
+{
+    if ((io_builder->copies_used + 1) * 2 > io_builder->copies_capacity)
+    {
+        size_t capacity = io_builder->copies_capacity ? io_builder->copies_capacity * 2 : 1024;
+        struct Derrick_Copy_s* copies = calloc(capacity, sizeof(struct Derrick_Copy_s));
+        for (size_t i = 0; i < io_builder->copies_capacity; ++i)
+        {
+            if (io_builder->copies[i].hash == 0) continue;
+            size_t slot = (size_t)io_builder->copies[i].hash & (capacity - 1);
+            while (copies[slot].hash != 0) slot = (slot + 1) & (capacity - 1);
+            copies[slot] = io_builder->copies[i];
+        }
+        free(io_builder->copies);
+        io_builder->copies = copies;
+        io_builder->copies_capacity = capacity;
+    }
+    size_t slot = (size_t)i_hash & (io_builder->copies_capacity - 1);
+    while (io_builder->copies[slot].hash != 0) slot = (slot + 1) & (io_builder->copies_capacity - 1);
+    struct Derrick_Copy_s* copy = &io_builder->copies[slot];
+    copy->hash = i_hash;
+    copy->check = derrick_internal_Fingerprint(i_data, i_size);
+    copy->size = i_size;
+    copy->mtime = i_mtime;
+    const struct Derrick_Entry_s* entry = derrick_internal_ArenaAt(&io_builder->entries, (uint64_t)i_id * sizeof(struct Derrick_Entry_s));
+    copy->dir = entry->dir;
+    copy->name = entry->name;
+    copy->lines = entry->lines;
+    copy->id = i_id;
+    io_builder->copies_used++;
+}
+
+// Add a file to the builder and record its trigrams
+uint32_t derrick_internal_AddFile(struct Derrick_Builder_s* io_builder, const char* i_path, const WIN32_FIND_DATAA* i_find)
+{
+    uint64_t size = ((uint64_t)i_find->nFileSizeHigh << 32) | i_find->nFileSizeLow;
+    uint64_t mtime = ((uint64_t)i_find->ftLastWriteTime.dwHighDateTime << 32) | i_find->ftLastWriteTime.dwLowDateTime;
+
+    // Large files, and those that cannot be mapped, are read by chunks. A file that cannot be
+    // read at all stays in the index, it will only match by its name, and so does a binary
+    // file unless the caller wants to search them.
+    const char* pBuf = 0;
+    size_t mapped_size = 0;
+    uint64_t inode = 0;
+    int rc = DERRICK_ERROR;
+    if (size < io_builder->stream_size)
+    {
+        rc = derrick_internal_MapFile(i_path, &pBuf, &mapped_size, &inode, 0);
+    }
+    if (rc == DERRICK_OK)
+    {
+        // A copy of a file already indexed shares its postings and its newline table
+        int text = io_builder->binary != DERRICK_BINARY_SKIP || !derrick_internal_IsBinary(pBuf, mapped_size);
+        uint64_t hash = 0;
+        if (text && mapped_size > 0)
+        {
+            hash = derrick_internal_Checksum(pBuf, mapped_size) | 1;
+            const struct Derrick_Copy_s* copy = derrick_internal_FindCopy(io_builder, hash, pBuf, mapped_size);
+            if (copy)
+            {
+                uint32_t id = derrick_internal_AddEntry(io_builder, i_path, size, mtime, inode, copy->lines, copy->id);
+                derrick_internal_UnmapFile(pBuf);
+                return id;
+            }
+        }
+
+        // The newline table of the file goes with its entry, so the content is read first
+        derrick_internal_ContentBegin(io_builder, text ? mapped_size : 0);
+        if (text)
+        {
+            derrick_internal_ContentAdd(io_builder, (const unsigned char*)pBuf, mapped_size);
+        }
+        uint64_t lines = text ? derrick_internal_LinesPut(io_builder) : DERRICK_NO_LINES;
+        uint32_t id = derrick_internal_AddEntry(io_builder, i_path, size, mtime, inode, lines, DERRICK_EMPTY_SLOT);
+        derrick_internal_ContentEnd(io_builder, text ? id : DERRICK_EMPTY_SLOT);
+        if (hash != 0)
+        {
+            derrick_internal_KeepCopy(io_builder, hash, pBuf, mapped_size, mtime, id);
+        }
+        derrick_internal_UnmapFile(pBuf);
+        return id;
+    }
+
+    int binary;
+    rc = derrick_internal_AddStream(io_builder, i_path, size, &inode, &binary);
+    int text = rc == DERRICK_OK && !binary;
+    uint32_t id = derrick_internal_AddEntry(io_builder, i_path, size, mtime, inode, text ? derrick_internal_LinesPut(io_builder) : DERRICK_NO_LINES, DERRICK_EMPTY_SLOT);
+    if (text)
+    {
+        derrick_internal_ContentEnd(io_builder, id);
+    }
+    else
+    {
+        // Forget what was read of the file
+        derrick_internal_ContentEnd(io_builder, DERRICK_EMPTY_SLOT);
+    }
+    return id;
+}
+
+int derrick_internal_VisitBuild(void* io_context, const char* i_path, const WIN32_FIND_DATAA* i_find)
+{
+    derrick_internal_AddFile((struct Derrick_Builder_s*)io_context, i_path, i_find);
+    return DERRICK_OK;
+}
+
+int derrick_internal_FillBuffer(const char *sDir, struct Derrick_Builder_s* io_builder, Derrick_Parameters i_cb)
+{
+    if (sDir == 0 || io_builder == 0) return DERRICK_ERROR;
+
+    struct Derrick_Walk_s walk;
+    derrick_internal_WalkInit(&walk, i_cb, &derrick_internal_VisitBuild, io_builder);
+    return derrick_internal_Walk(sDir, &walk);
+}
+
+int derrick_internal_CompareTrigrams(const void* i_a, const void* i_b)
+{
+    uint32_t a = ((const struct Derrick_Trigram_s*)i_a)->trigram;
+    uint32_t b = ((const struct Derrick_Trigram_s*)i_b)->trigram;
+    return (a > b) - (a < b);
+}
+
+uint64_t derrick_internal_Checksum(const void* i_data, size_t i_size)
+{
+    const unsigned char* cur = (const unsigned char*)i_data;
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ i_size;
+    while (i_size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, cur, 8);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
+        cur += 8;
+        i_size -= 8;
+    }
+    while (i_size > 0)
+    {
+        hash = (hash ^ *cur++) * 0x100000001B3ull;
+        i_size--;
+    }
+    return hash ^ (hash >> 29);
+}
+
+void derrick_internal_SetChecksums(struct Derrick_IndexHeader_s* io_header)
+{
+    io_header->checksum = derrick_internal_Checksum(io_header + 1, io_header->total_size - sizeof(struct Derrick_IndexHeader_s));
+    io_header->header_checksum = 0;
+    io_header->header_checksum = (uint32_t)derrick_internal_Checksum(io_header, sizeof(struct Derrick_IndexHeader_s));
+}
+
+// Point the sections of a segment into its image
+void derrick_internal_Attach(struct Derrick_Segment_s* io_segment, struct Derrick_IndexHeader_s* i_image)
+{
+    io_segment->image = i_image;
+    io_segment->number_of_entries = (size_t)i_image->number_of_entries;
+    io_segment->entries = (struct Derrick_Entry_s*)((BYTEP*)i_image + i_image->entries);
+    io_segment->names = (char*)((BYTEP*)i_image + i_image->names);
+    io_segment->number_of_dirs = (size_t)i_image->number_of_dirs;
+    io_segment->dirs = (struct Derrick_Dir_s*)((BYTEP*)i_image + i_image->dirs);
+    io_segment->number_of_trigrams = (size_t)i_image->number_of_trigrams;
+    io_segment->trigrams = (struct Derrick_Trigram_s*)((BYTEP*)i_image + i_image->trigrams);
+    io_segment->postings = (unsigned char*)((BYTEP*)i_image + i_image->postings);
+    io_segment->lines = (unsigned char*)((BYTEP*)i_image + i_image->lines);
+    io_segment->deleted = calloc(io_segment->number_of_entries / 8 + 1, 1);
+    io_segment->number_of_deleted = 0;
+}
+
+// Lay out the content of a builder as the image of a segment, and return DERRICK_ERROR if
+// there is no memory for the image
+int derrick_internal_Seal(struct Derrick_Builder_s* io_builder, struct Derrick_Segment_s* io_segment)
+{
+    // Sort the trigram table, dropping the lists left empty by a merge
+    struct Derrick_Trigram_s* trigrams = malloc((io_builder->slots_used + 1) * sizeof(struct Derrick_Trigram_s));
+    size_t postings_size = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < io_builder->slots_capacity; ++i)
+    {
+        struct Derrick_Posting_s* posting = &io_builder->slots[i];
+        if (posting->trigram == DERRICK_EMPTY_SLOT || posting->count == 0) continue;
+        trigrams[n].trigram = posting->trigram;
+        trigrams[n].count = posting->count;
+        trigrams[n].postings = i;   // slot, replaced by the offset below
+        postings_size += posting->size;
+        n++;
+    }
+    qsort(trigrams, n, sizeof(struct Derrick_Trigram_s), &derrick_internal_CompareTrigrams);
+
+    // Lay out the image
+    struct Derrick_IndexHeader_s header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DERRICK_INDEX_MAGIC, sizeof(DERRICK_INDEX_MAGIC));
+    header.version = DERRICK_INDEX_VERSION;
+    header.number_of_entries = io_builder->number_of_entries;
+    header.entries = DERRICK_ALIGN(sizeof(struct Derrick_IndexHeader_s));
+    header.names = DERRICK_ALIGN(header.entries + io_builder->entries.size);
+    header.number_of_dirs = io_builder->number_of_dirs;
+    header.dirs = DERRICK_ALIGN(header.names + io_builder->names.size);
+    header.number_of_trigrams = n;
+    header.trigrams = DERRICK_ALIGN(header.dirs + io_builder->dirs.size);
+    header.postings = DERRICK_ALIGN(header.trigrams + n * sizeof(struct Derrick_Trigram_s));
+    header.lines = DERRICK_ALIGN(header.postings + postings_size);
+    header.total_size = DERRICK_ALIGN(header.lines + io_builder->lines.size);
+
+    // The image is searched in place, large pages spare TLB misses on big indexes
+    struct Derrick_IndexHeader_s* image = derrick_internal_AllocPages((size_t)header.total_size, io_builder->large_pages);
+    memset(io_segment, 0, sizeof(struct Derrick_Segment_s));
+    if (image == 0)
+    {
+        free(trigrams);
+        return DERRICK_ERROR;
+    }
+    memcpy(image, &header, sizeof(header));
+    derrick_internal_Attach(io_segment, image);
+    derrick_internal_ArenaCopy(&io_builder->entries, io_segment->entries);
+    derrick_internal_ArenaCopy(&io_builder->names, io_segment->names);
+    derrick_internal_ArenaCopy(&io_builder->dirs, io_segment->dirs);
+    derrick_internal_ArenaCopy(&io_builder->lines, io_segment->lines);
+
+    // Link the copies of each file, in the order of the entries
+    uint32_t* last = malloc((io_segment->number_of_entries + 1) * sizeof(uint32_t));
+    for (size_t e = 0; e < io_segment->number_of_entries; ++e)
+    {
+        struct Derrick_Entry_s* entry = &io_segment->entries[e];
+        last[e] = (uint32_t)e;
+        if (entry->copy_of == e) continue;
+        io_segment->entries[last[entry->copy_of]].next_copy = e;
+        last[entry->copy_of] = (uint32_t)e;
+    }
+    free(last);
+
+    // Concatenate the posting lists in the order of the table
+    size_t offset = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        struct Derrick_Posting_s* posting = &io_builder->slots[trigrams[i].postings];
+        trigrams[i].postings = offset;
+        for (const struct Derrick_Block_s* block = posting->first; block != 0; block = block->next)
+        {
+            memcpy(io_segment->postings + offset, block + 1, block->size);
+            offset += block->size;
+        }
+    }
+    memcpy(io_segment->trigrams, trigrams, n * sizeof(struct Derrick_Trigram_s));
+    derrick_internal_SetChecksums(image);
+
+    free(trigrams);
+    return DERRICK_OK;
+}
+
+void derrick_internal_SegmentFree(struct Derrick_Segment_s* io_segment)
+{
+    if (io_segment->mapped)
+    {
+        UnmapViewOfFile(io_segment->image);
+    }
+    else
+    {
+        derrick_internal_FreePages(io_segment->image);
+    }
+    free(io_segment->deleted);
+    memset(io_segment, 0, sizeof(struct Derrick_Segment_s));
+}
+
+int derrick_internal_IsDeleted(const struct Derrick_Segment_s* i_segment, size_t i_entry)
+{
+    return (i_segment->deleted[i_entry >> 3] >> (i_entry & 7)) & 1;
+}
+
+void derrick_internal_Delete(DerrickIndex io_index, size_t i_segment, size_t i_entry)
+{
+    struct Derrick_Segment_s* segment = &io_index->segments[i_segment];
+    if (derrick_internal_IsDeleted(segment, i_entry)) return;
+    segment->deleted[i_entry >> 3] |= (unsigned char)(1 << (i_entry & 7));
+    segment->number_of_deleted++;
+    io_index->number_of_entries--;
+}
+
+// Write the path of a directory of a segment, without terminating it: the names of the
+// directories from the first component of the path to this one
+void derrick_internal_DirPath(const struct Derrick_Segment_s* i_segment, uint64_t i_dir, char* o_path)
+{
+    for (uint64_t d = i_dir; d != DERRICK_NO_DIR; d = i_segment->dirs[d].parent)
+    {
+        const struct Derrick_Dir_s* dir = &i_segment->dirs[d];
+        size_t start = dir->parent == DERRICK_NO_DIR ? 0 : (size_t)i_segment->dirs[dir->parent].length;
+        memcpy(o_path + start, i_segment->names + dir->name, (size_t)dir->length - start);
+    }
+}
+
+// Make room for i_size bytes in a buffer
+char* derrick_internal_Reserve(char** io_buffer, size_t* io_capacity, size_t i_size)
+{
+    if (i_size > (*io_capacity))
+    {
+        free(*io_buffer);
+        (*io_capacity) = i_size < MAX_PATH ? MAX_PATH : i_size * 2;
+        (*io_buffer) = malloc(*io_capacity);
+    }
+    return (*io_buffer);
+}
+
+// Path of an entry of a segment, its directory followed by its name, written in a buffer
+// that grows as needed
+const char* derrick_internal_EntryPath(const struct Derrick_Segment_s* i_segment, size_t i_entry, char** io_buffer, size_t* io_capacity)
+{
+    const struct Derrick_Entry_s* entry = &i_segment->entries[i_entry];
+    const char* name = i_segment->names + entry->name;
+    size_t start = entry->dir == DERRICK_NO_DIR ? 0 : (size_t)i_segment->dirs[entry->dir].length;
+    size_t length = strlen(name);
+    char* path = derrick_internal_Reserve(io_buffer, io_capacity, start + length + 1);
+    derrick_internal_DirPath(i_segment, entry->dir, path);
+    memcpy(path + start, name, length + 1);
+    return path;
+}
+
+// 1 if an entry of a segment has the path [i_path, i_path + i_length), compared by parts
+int derrick_internal_EntryIs(const struct Derrick_Segment_s* i_segment, size_t i_entry, const char* i_path, size_t i_length)
+{
+    const struct Derrick_Entry_s* entry = &i_segment->entries[i_entry];
+    size_t start = entry->dir == DERRICK_NO_DIR ? 0 : (size_t)i_segment->dirs[entry->dir].length;
+    if (start > i_length || strcmp(i_segment->names + entry->name, i_path + start) != 0) return 0;
+    for (uint64_t d = entry->dir; d != DERRICK_NO_DIR; d = i_segment->dirs[d].parent)
+    {
+        const struct Derrick_Dir_s* dir = &i_segment->dirs[d];
+        size_t begin = dir->parent == DERRICK_NO_DIR ? 0 : (size_t)i_segment->dirs[dir->parent].length;
+        if (memcmp(i_path + begin, i_segment->names + dir->name, (size_t)dir->length - begin) != 0) return 0;
+    }
+    return 1;
+}
+
+const struct Derrick_Trigram_s* derrick_internal_FindTrigram(const struct Derrick_Segment_s* i_segment, uint32_t i_trigram)
+{
+    size_t low = 0;
+    size_t high = i_segment->number_of_trigrams;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (i_segment->trigrams[mid].trigram < i_trigram) low = mid + 1;
+        else high = mid;
+    }
+    if (low < i_segment->number_of_trigrams && i_segment->trigrams[low].trigram == i_trigram)
+    {
+        return &i_segment->trigrams[low];
+    }
+    return 0;
+}
+
+int derrick_internal_CompareCounts(const void* i_a, const void* i_b)
+{
+    uint32_t a = (*(const struct Derrick_Trigram_s* const*)i_a)->count;
+    uint32_t b = (*(const struct Derrick_Trigram_s* const*)i_b)->count;
+    return (a > b) - (a < b);
+}
+
+int derrick_internal_CompareIds(const void* i_a, const void* i_b)
+{
+    uint32_t a = *(const uint32_t*)i_a;
+    uint32_t b = *(const uint32_t*)i_b;
+    return (a > b) - (a < b);
+}
+
+// Return the sorted list of the files of a segment containing all the trigrams of
+// i_searchfor, or 0 if every file is a candidate (string shorter than a trigram). With
+// DERRICK_NAME_TRIGRAM as i_key, the trigrams are those of the file names instead.
+uint32_t* derrick_internal_Candidates(const struct Derrick_Segment_s* i_segment, const char* i_searchfor, size_t i_length, uint32_t i_key, size_t* o_count)
+{
+    (*o_count) = 0;
+    if (i_length < 3) return 0;
+
+    // Look up the trigrams of the string
+    size_t number_of_lists = 0;
+    const struct Derrick_Trigram_s** lists = malloc((i_length - 2) * sizeof(struct Derrick_Trigram_s*));
+    for (size_t i = 0; i + 2 < i_length; ++i)
+    {
+        uint32_t trigram = i_key | ((uint32_t)derrick_internal_fold[(unsigned char)i_searchfor[i]] << 16)
+                | ((uint32_t)derrick_internal_fold[(unsigned char)i_searchfor[i + 1]] << 8)
+                | (uint32_t)derrick_internal_fold[(unsigned char)i_searchfor[i + 2]];
+        const struct Derrick_Trigram_s* found = derrick_internal_FindTrigram(i_segment, trigram);
+        if (found == 0)
+        {
+            // No file contains this trigram
+            free(lists);
+            return malloc(sizeof(uint32_t));
+        }
+        lists[number_of_lists++] = found;
+    }
+
+    // Start with the shortest list, so that the candidate set is small from the beginning
+    qsort(lists, number_of_lists, sizeof(struct Derrick_Trigram_s*), &derrick_internal_CompareCounts);
+
+    size_t count = lists[0]->count;
+    uint32_t* candidates = malloc((count + 1) * sizeof(uint32_t));
+    const unsigned char* cur = i_segment->postings + lists[0]->postings;
+    uint32_t id = (uint32_t)-1;
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint32_t delta;
+        cur = derrick_internal_GetVarint(cur, &delta);
+        id += delta + 1;
+        candidates[i] = id;
+    }
+
+    for (size_t l = 1; l < number_of_lists && count > 0; ++l)
+    {
+        cur = i_segment->postings + lists[l]->postings;
+        id = (uint32_t)-1;
+        size_t kept = 0;
+        size_t c = 0;
+        for (size_t i = 0; i < lists[l]->count && c < count; ++i)
+        {
+            uint32_t delta;
+            cur = derrick_internal_GetVarint(cur, &delta);
+            id += delta + 1;
+            while (c < count && candidates[c] < id) c++;
+            if (c < count && candidates[c] == id)
+            {
+                candidates[kept++] = id;
+                c++;
+            }
+        }
+        count = kept;
+    }
+
+    free(lists);
+    (*o_count) = count;
+    return candidates;
+}
+
+struct Derrick_LookupSlot_s* derrick_internal_LookupSlot(DerrickIndex i_index, const char* i_name)
+{
+    struct Derrick_Lookup_s* lookup = i_index->lookup;
+    size_t length = strlen(i_name);
+    size_t slot = (size_t)derrick_internal_Checksum(i_name, length) & (lookup->capacity - 1);
+    while (lookup->slots[slot].segment != DERRICK_EMPTY_SLOT)
+    {
+        if (derrick_internal_EntryIs(&i_index->segments[lookup->slots[slot].segment], lookup->slots[slot].entry, i_name, length))
+        {
+            break;
+        }
+        slot = (slot + 1) & (lookup->capacity - 1);
+    }
+    return &lookup->slots[slot];
+}
+
+// Return the entry of a file name, or 0 if the file is not in the index
+struct Derrick_LookupSlot_s* derrick_internal_LookupFind(DerrickIndex i_index, const char* i_name)
+{
+    struct Derrick_LookupSlot_s* slot = derrick_internal_LookupSlot(i_index, i_name);
+    if (slot->segment == DERRICK_EMPTY_SLOT) return 0;
+    if (derrick_internal_IsDeleted(&i_index->segments[slot->segment], slot->entry)) return 0;
+    return slot;
+}
+
+void derrick_internal_LookupSet(DerrickIndex io_index, size_t i_segment, size_t i_entry)
+{
+    struct Derrick_Lookup_s* lookup = io_index->lookup;
+    const struct Derrick_Segment_s* segment = &io_index->segments[i_segment];
+    const char* path = derrick_internal_EntryPath(segment, i_entry, &lookup->path, &lookup->path_capacity);
+    struct Derrick_LookupSlot_s* slot = derrick_internal_LookupSlot(io_index, path);
+    if (slot->segment == DERRICK_EMPTY_SLOT) lookup->used++;
+    slot->segment = (uint32_t)i_segment;
+    slot->entry = (uint32_t)i_entry;
+}
+
+void derrick_internal_LookupFree(DerrickIndex io_index)
+{
+    if (io_index->lookup == 0) return;
+    free(io_index->lookup->slots);
+    free(io_index->lookup->path);
+    free(io_index->lookup);
+    io_index->lookup = 0;
+}
+
+// (Re)build the table giving the entry of every file name
+void derrick_internal_LookupBuild(DerrickIndex io_index, size_t i_extra)
+{
+    derrick_internal_LookupFree(io_index);
+    struct Derrick_Lookup_s* lookup = malloc(sizeof(struct Derrick_Lookup_s));
+    lookup->used = 0;
+    lookup->path = 0;
+    lookup->path_capacity = 0;
+    lookup->capacity = 1024;
+    while (lookup->capacity < (io_index->number_of_entries + i_extra) * 2)
+    {
+        lookup->capacity *= 2;
+    }
+    lookup->slots = malloc(lookup->capacity * sizeof(struct Derrick_LookupSlot_s));
+    for (size_t i = 0; i < lookup->capacity; ++i)
+    {
+        lookup->slots[i].segment = DERRICK_EMPTY_SLOT;
+    }
+    io_index->lookup = lookup;
+
+    for (size_t s = 0; s < io_index->number_of_segments; ++s)
+    {
+        for (size_t e = 0; e < io_index->segments[s].number_of_entries; ++e)
+        {
+            if (!derrick_internal_IsDeleted(&io_index->segments[s], e))
+            {
+                derrick_internal_LookupSet(io_index, s, e);
+            }
+        }
+    }
+}
+
+// Merge the selected segments of an index into a single one without deleted entries, which
+// takes the place of the first of them, and return its position, or DERRICK_EMPTY_SLOT if
+// there is no memory for it: the index is left as it was
+size_t derrick_internal_Merge(DerrickIndex io_index, const unsigned char* i_selected)
+{
+    struct Derrick_Builder_s builder;
+    derrick_internal_BuilderInit(&builder, io_index->large_pages);
+    char* path = 0;
+    size_t path_capacity = 0;
+
+    // Copy the remaining entries, giving them consecutive ids. When the first of the copies of
+    // a file is gone, the next one remaining takes its place, and its postings. The directories
+    // and the trigrams of the names are added again with the entries.
+    uint32_t** remap = calloc(io_index->number_of_segments, sizeof(uint32_t*));
+    for (size_t s = 0; s < io_index->number_of_segments; ++s)
+    {
+        if (!i_selected[s]) continue;
+        const struct Derrick_Segment_s* segment = &io_index->segments[s];
+        remap[s] = malloc((segment->number_of_entries + 1) * sizeof(uint32_t));
+        uint64_t* lines = malloc((segment->number_of_entries + 1) * sizeof(uint64_t));
+        for (size_t e = 0; e < segment->number_of_entries; ++e)
+        {
+            remap[s][e] = DERRICK_EMPTY_SLOT;
+        }
+        for (size_t e = 0; e < segment->number_of_entries; ++e)
+        {
+            const struct Derrick_Entry_s* entry = &segment->entries[e];
+            uint64_t kept = e;
+            if (derrick_internal_IsDeleted(segment, e))
+            {
+                if (entry->copy_of != e) continue;
+                kept = entry->next_copy;
+                while (kept != DERRICK_NO_COPY && derrick_internal_IsDeleted(segment, (size_t)kept)) kept = segment->entries[kept].next_copy;
+                if (kept == DERRICK_NO_COPY) continue;
+            }
+            else if (remap[s][e] != DERRICK_EMPTY_SLOT)
+            {
+                continue;   // already in place of the first copy
+            }
+            const struct Derrick_Entry_s* copy = &segment->entries[kept];
+            uint32_t copy_of = DERRICK_EMPTY_SLOT;
+            if (entry->copy_of == e)
+            {
+                lines[e] = copy->lines;
+                if (lines[e] != DERRICK_NO_LINES)
+                {
+                    lines[e] = derrick_internal_LinesCopy(&builder, (const struct Derrick_Lines_s*)(segment->lines + copy->lines));
+                }
+            }
+            else
+            {
+                lines[e] = lines[entry->copy_of];
+                copy_of = remap[s][entry->copy_of];
+            }
+            derrick_internal_EntryPath(segment, (size_t)kept, &path, &path_capacity);
+            remap[s][e] = derrick_internal_AddEntry(&builder, path, copy->size, copy->mtime, copy->inode, lines[e], copy_of);
+            remap[s][kept] = remap[s][e];
+        }
+        free(lines);
+    }
+    free(path);
+
+    // Segments are visited in order, so the new ids stay sorted in every list
+    for (size_t s = 0; s < io_index->number_of_segments; ++s)
+    {
+        if (!i_selected[s]) continue;
+        const struct Derrick_Segment_s* segment = &io_index->segments[s];
+        for (size_t t = 0; t < segment->number_of_trigrams; ++t)
+        {
+            if (segment->trigrams[t].trigram & DERRICK_NAME_TRIGRAM) continue;    // added with the entries
+            struct Derrick_Posting_s* posting = derrick_internal_GetPosting(&builder, segment->trigrams[t].trigram);
+            const unsigned char* cur = segment->postings + segment->trigrams[t].postings;
+            uint32_t id = (uint32_t)-1;
+            for (uint32_t i = 0; i < segment->trigrams[t].count; ++i)
+            {
+                uint32_t delta;
+                cur = derrick_internal_GetVarint(cur, &delta);
+                id += delta + 1;
+                if (remap[s][id] == DERRICK_EMPTY_SLOT) continue;
+                derrick_internal_PutVarint(&builder, posting, remap[s][id] - posting->last - 1);
+                posting->last = remap[s][id];
+                posting->count++;
+            }
+        }
+        free(remap[s]);
+    }
+    free(remap);
+
+    struct Derrick_Segment_s merged;
+    int rc = derrick_internal_Seal(&builder, &merged);
+    derrick_internal_BuilderFree(&builder);
+    if (rc != DERRICK_OK) return DERRICK_EMPTY_SLOT;
+
+    // The other segments keep their order
+    size_t kept = 0;
+    size_t position = DERRICK_EMPTY_SLOT;
+    io_index->number_of_entries = 0;
+    for (size_t s = 0; s < io_index->number_of_segments; ++s)
+    {
+        if (i_selected[s])
+        {
+            derrick_internal_SegmentFree(&io_index->segments[s]);
+            if (position != DERRICK_EMPTY_SLOT) continue;
+            position = kept;
+            io_index->segments[kept] = merged;
+        }
+        else
+        {
+            io_index->segments[kept] = io_index->segments[s];
+        }
+        io_index->number_of_entries += io_index->segments[kept].number_of_entries - io_index->segments[kept].number_of_deleted;
+        kept++;
+    }
+    io_index->number_of_segments = kept;
+
+    if (io_index->lookup)
+    {
+        derrick_internal_LookupBuild(io_index, 0);
+    }
+    return position;
+}
+
+// Merge all the segments of an index into a single one without deleted entries
+void derrick_internal_Compact(DerrickIndex io_index)
+{
+    unsigned char* selected = malloc(io_index->number_of_segments + 1);
+    memset(selected, 1, io_index->number_of_segments + 1);
+    derrick_internal_Merge(io_index, selected);
+    free(selected);
+}
+
+// Select the segments with the fewest files, so that merging them leaves at most
+// i_max_segments, and return the number of segments selected
+size_t derrick_internal_SelectSmallest(DerrickIndex i_index, size_t i_max_segments, unsigned char* o_selected)
+{
+    size_t count = i_index->number_of_segments;
+    memset(o_selected, 0, count + 1);
+    if (i_max_segments == 0) i_max_segments = 1;
+    if (count <= i_max_segments) return 0;
+
+    size_t number_of_selected = count - i_max_segments + 1;
+    for (size_t n = 0; n < number_of_selected; ++n)
+    {
+        size_t smallest = DERRICK_EMPTY_SLOT;
+        for (size_t s = 0; s < count; ++s)
+        {
+            if (o_selected[s]) continue;
+            const struct Derrick_Segment_s* segment = &i_index->segments[s];
+            if (smallest == DERRICK_EMPTY_SLOT || segment->number_of_entries - segment->number_of_deleted
+                    < i_index->segments[smallest].number_of_entries - i_index->segments[smallest].number_of_deleted)
+            {
+                smallest = s;
+            }
+        }
+        o_selected[smallest] = 1;
+    }
+    return number_of_selected;
+}
+
+// Merge the segments with the fewest files until at most i_max_segments are left
+void derrick_internal_MergeSmallest(DerrickIndex io_index, size_t i_max_segments)
+{
+    unsigned char* selected = malloc(io_index->number_of_segments + 1);
+    if (derrick_internal_SelectSmallest(io_index, i_max_segments, selected) > 0)
+    {
+        derrick_internal_Merge(io_index, selected);
+    }
+    free(selected);
+}
+
+// Append a sealed segment to an index. The previous versions of its files, if any, are deleted.
+void derrick_internal_AddSegment(DerrickIndex io_index, const struct Derrick_Segment_s* i_segment)
+{
+    size_t s = io_index->number_of_segments;
+    io_index->segments = realloc(io_index->segments, (s + 1) * sizeof(struct Derrick_Segment_s));
+    io_index->segments[s] = (*i_segment);
+    io_index->number_of_segments++;
+    io_index->number_of_entries += i_segment->number_of_entries;
+    for (size_t e = 0; e < i_segment->number_of_entries; ++e)
+    {
+        const char* path = derrick_internal_EntryPath(i_segment, e, &io_index->lookup->path, &io_index->lookup->path_capacity);
+        struct Derrick_LookupSlot_s* slot = derrick_internal_LookupFind(io_index, path);
+        if (slot != 0)
+        {
+            derrick_internal_Delete(io_index, slot->segment, slot->entry);
+        }
+    }
+
+    if ((io_index->lookup->used + i_segment->number_of_entries) * 2 > io_index->lookup->capacity)
+    {
+        derrick_internal_LookupBuild(io_index, i_segment->number_of_entries);
+    }
+    else
+    {
+        for (size_t e = 0; e < i_segment->number_of_entries; ++e)
+        {
+            derrick_internal_LookupSet(io_index, s, e);
+        }
+    }
+}
+
+// Merge the segments of an index after an update: too many segments or deleted entries slow the searches down
+void derrick_internal_Tidy(DerrickIndex io_index)
+{
+    size_t number_of_deleted = 0;
+    for (size_t s = 0; s < io_index->number_of_segments; ++s)
+    {
+        number_of_deleted += io_index->segments[s].number_of_deleted;
+    }
+    if (number_of_deleted > io_index->number_of_entries)
+    {
+        derrick_internal_Compact(io_index);
+    }
+    else if (io_index->number_of_segments > DERRICK_MAX_SEGMENTS)
+    {
+        derrick_internal_MergeSmallest(io_index, DERRICK_MAX_SEGMENTS);
+    }
+}
+
+// Read a file again if it is new or changed. Its previous version is deleted when the new one is put in.
+int derrick_internal_VisitRefresh(void* io_context, const char* i_path, const WIN32_FIND_DATAA* i_find)
+{
+    struct Derrick_Refresh_s* refresh = (struct Derrick_Refresh_s*)io_context;
+    DerrickIndex index = refresh->index;
+    struct Derrick_LookupSlot_s* slot = derrick_internal_LookupFind(index, i_path);
+    if (slot != 0)
+    {
+        // The stamps of the directory listing are enough to detect a change
+        const struct Derrick_Entry_s* entry = &index->segments[slot->segment].entries[slot->entry];
+        uint64_t size = ((uint64_t)i_find->nFileSizeHigh << 32) | i_find->nFileSizeLow;
+        uint64_t mtime = ((uint64_t)i_find->ftLastWriteTime.dwHighDateTime << 32) | i_find->ftLastWriteTime.dwLowDateTime;
+        refresh->seen[slot->segment][slot->entry >> 3] |= (unsigned char)(1 << (slot->entry & 7));
+        if (entry->size == size && entry->mtime == mtime)
+        {
+            return DERRICK_OK;
+        }
+    }
+    derrick_internal_AddFile(&refresh->builder, i_path, i_find);
+    return DERRICK_OK;
+}
+
+int derrick_internal_RefreshWalk(const char *sDir, struct Derrick_Refresh_s* io_refresh)
+{
+    struct Derrick_Walk_s walk;
+    derrick_internal_WalkInit(&walk, 0, &derrick_internal_VisitRefresh, io_refresh);
+    walk.exclude = io_refresh->index->exclude;
+    walk.exclude_dir = io_refresh->index->exclude_dir;
+    walk.ctx_exclude = io_refresh->index->ctx_exclude;
+    walk.filter = io_refresh->index->filter;
+    return derrick_internal_Walk(sDir, &walk);
+}
+
+// Report a match to the caller, and return non-zero if the caller wants the search to stop
+int derrick_internal_Found(Derrick_Parameters io_cb, const char* i_in, const char* i_what, size_t i_pattern)
+{
+    if (io_cb->cd_found_pattern)
+    {
+        return io_cb->cd_found_pattern(io_cb->ctx_found, i_in, i_what, i_pattern);
+    }
+    else if (io_cb->cd_found)
+    {
+        return io_cb->cd_found(io_cb->ctx_found, i_in, i_what);
+    }
+    return 0;
+}
+
+// When a search stops, and how far it went, shared by its threads
+struct Derrick_Control_s
+{
+    Derrick_Parameters params;
+    volatile LONG stop;                 // DERRICK_OK while the search goes on
+    uint64_t reported;                  // matches reported, under the lock of the callbacks
+    ULONGLONG deadline;                 // tick count at which the search stops, 0 for none
+    volatile LONGLONG files;            // files and bytes read
+    volatile LONGLONG bytes;
+    volatile LONGLONG next_progress;    // tick count of the next call of cb_progress
+    ULONGLONG progress_period;
+};
+
+void derrick_internal_ControlInit(struct Derrick_Control_s* o_control, Derrick_Parameters i_cb)
+{
+    memset(o_control, 0, sizeof(struct Derrick_Control_s));
+    o_control->params = i_cb;
+    ULONGLONG now = GetTickCount64();
+    if (i_cb->param_timeout) o_control->deadline = now + i_cb->param_timeout;
+    o_control->progress_period = i_cb->param_progress_period ? i_cb->param_progress_period : DERRICK_PROGRESS_PERIOD;
+    o_control->next_progress = (LONGLONG)(now + o_control->progress_period);
+}
+
+// Stop the search, unless it was already stopped for another reason
+void derrick_internal_Stop(struct Derrick_Control_s* io_control, LONG i_reason)
+{
+    InterlockedCompareExchange(&io_control->stop, i_reason, DERRICK_OK);
+}
+
+// Return non-zero if the search must stop, checking the cancellation flag and the deadline
+int derrick_internal_Stopped(struct Derrick_Control_s* io_control)
+{
+    if (io_control->stop != DERRICK_OK) return 1;
+    if (io_control->params->param_cancel && *io_control->params->param_cancel)
+    {
+        derrick_internal_Stop(io_control, DERRICK_STOPPED);
+    }
+    else if (io_control->deadline && GetTickCount64() >= io_control->deadline)
+    {
+        derrick_internal_Stop(io_control, DERRICK_TIMEOUT);
+    }
+    return io_control->stop != DERRICK_OK;
+}
+
+// Count files and bytes read, and call cb_progress when it is time. The thread that moves the
+// time of the next call forward is the one making it.
+void derrick_internal_Progress(struct Derrick_Control_s* io_control, uint64_t i_files, uint64_t i_bytes, CRITICAL_SECTION* i_lock)
+{
+    Derrick_Parameters io_cb = io_control->params;
+    if (i_files) InterlockedExchangeAdd64(&io_control->files, (LONGLONG)i_files);
+    if (i_bytes) InterlockedExchangeAdd64(&io_control->bytes, (LONGLONG)i_bytes);
+    if (io_cb->cb_progress == 0) return;
+
+    LONGLONG next = io_control->next_progress;
+    ULONGLONG now = GetTickCount64();
+    if ((LONGLONG)now < next) return;
+    if (InterlockedCompareExchange64(&io_control->next_progress, (LONGLONG)(now + io_control->progress_period), next) != next) return;
+    if (i_lock) EnterCriticalSection(i_lock);
+    if (io_cb->cb_progress(io_cb->ctx_progress, (uint64_t)io_control->files, (uint64_t)io_control->bytes))
+    {
+        derrick_internal_Stop(io_control, DERRICK_STOPPED);
+    }
+    if (i_lock) LeaveCriticalSection(i_lock);
+}
+
+// Return code of a search that went to its end or was stopped: reaching the maximum number
+// of matches is not an error
+int derrick_internal_ControlResult(const struct Derrick_Control_s* i_control, int i_rc)
+{
+    return i_control->stop < 0 ? (int)i_control->stop : i_rc;
+}
+
+// Results of one thread waiting to be reported, and the line breaks counted so far in the
+// file they belong to. Records point into the data of the file: a batch is flushed before
+// that data goes away.
+struct Derrick_Batch_s
+{
+    struct Derrick_Result_s* results;
+    size_t capacity;
+    size_t count;
+    int owned;                  // results allocated here rather than given by the caller
+    const char* path;           // file of the results
+    const char* data;           // the byte at offset base of the file
+    uint64_t base;
+    uint64_t counted;           // offset up to which the line breaks were counted
+    uint64_t lines;             // line breaks before counted
+    const struct Derrick_Lines_s* newlines; // newline table of the file, if the index has an up to date one
+    const char* line;           // last line reported, and its number
+    const char* line_end;
+    uint64_t line_number;
+    const char* context;        // lines around it, and the number of the first one
+    const char* context_end;
+    uint64_t context_line;
+    char* copy;                 // zero-terminated line given to cd_found
+    size_t copy_capacity;
+    char* name;                 // path of the file of an index being searched
+    size_t name_capacity;
+    struct Derrick_Control_s* control;
+    struct Derrick_Stats_s* stats;  // if set, the matches and the time of the callbacks are counted
+};
+
+void derrick_internal_BatchInit(struct Derrick_Batch_s* o_batch, struct Derrick_Result_s* i_results, size_t i_capacity, struct Derrick_Control_s* io_control)
+{
+    memset(o_batch, 0, sizeof(struct Derrick_Batch_s));
+    o_batch->control = io_control;
+    o_batch->owned = (i_results == 0 || i_capacity == 0);
+    o_batch->capacity = o_batch->owned ? DERRICK_RESULTS_BATCH : i_capacity;
+    o_batch->results = o_batch->owned ? malloc(o_batch->capacity * sizeof(struct Derrick_Result_s)) : i_results;
+}
+
+void derrick_internal_BatchFree(struct Derrick_Batch_s* io_batch)
+{
+    if (io_batch->owned) free(io_batch->results);
+    free(io_batch->copy);
+    free(io_batch->name);
+}
+
+// Start the results of a file, whose data from i_base on is at i_data
+void derrick_internal_BatchFile(struct Derrick_Batch_s* io_batch, const char* i_path, const char* i_data, uint64_t i_base)
+{
+    io_batch->path = i_path;
+    io_batch->data = i_data;
+    io_batch->base = i_base;
+    io_batch->counted = i_base;
+    io_batch->lines = 0;
+    io_batch->newlines = 0;
+    io_batch->line = 0;
+}
+
+// Number of line feeds in [i_begin, i_end)
+uint64_t derrick_internal_CountLines(const char* i_begin, const char* i_end)
+{
+    uint64_t count = 0;
+    while (i_begin < i_end && (i_begin = memchr(i_begin, '\n', i_end - i_begin)) != 0)
+    {
+        count++;
+        i_begin++;
+    }
+    return count;
+}
+
+// Count the line breaks up to i_offset, which must be in the data of the batch, or after the
+// data that was given before
+void derrick_internal_BatchCount(struct Derrick_Batch_s* io_batch, uint64_t i_offset)
+{
+    const char* counted = io_batch->data + (io_batch->counted - io_batch->base);
+    const char* offset = io_batch->data + (i_offset - io_batch->base);
+    if (i_offset >= io_batch->counted) io_batch->lines += derrick_internal_CountLines(counted, offset);
+    else io_batch->lines -= derrick_internal_CountLines(offset, counted);
+    io_batch->counted = i_offset;
+}
+
+// The data of the file now starts at i_data, at offset i_base. The line breaks before i_base
+// must have been counted while the data was still there.
+void derrick_internal_BatchMove(struct Derrick_Batch_s* io_batch, const char* i_data, uint64_t i_base)
+{
+    io_batch->data = i_data;
+    io_batch->base = i_base;
+    io_batch->line = 0;
+}
+
+// Hand the results to the caller, and return non-zero if the search must stop. The callbacks
+// are never called concurrently: i_lock, if any, is held while they run. Once the search is
+// stopped, the results are dropped.
+int derrick_internal_BatchFlush(struct Derrick_Batch_s* io_batch, Derrick_Parameters io_cb, CRITICAL_SECTION* i_lock)
+{
+    struct Derrick_Control_s* control = io_batch->control;
+    if (io_batch->count == 0) return control->stop != DERRICK_OK;
+    uint64_t start = derrick_internal_Now(io_batch->stats);
+    if (i_lock) EnterCriticalSection(i_lock);
+    size_t count = control->stop == DERRICK_OK ? io_batch->count : 0;
+    if (io_cb->param_max_results && control->reported + count >= io_cb->param_max_results)
+    {
+        count = (size_t)(io_cb->param_max_results - control->reported);
+        derrick_internal_Stop(control, 1);
+    }
+    control->reported += count;
+    if (io_batch->stats) io_batch->stats->matches += count;
+    if (io_cb->cb_results)
+    {
+        if (count && io_cb->cb_results(io_cb->ctx_found, io_batch->path, io_batch->results, count))
+        {
+            derrick_internal_Stop(control, DERRICK_STOPPED);
+        }
+    }
+    else
+    {
+        // One call per result, with a copy of the line
+        for (size_t r = 0; r < count; ++r)
+        {
+            const struct Derrick_Result_s* result = &io_batch->results[r];
+            char* line = 0;
+            if (result->text)
+            {
+                if (result->length + 1 > io_batch->copy_capacity)
+                {
+                    io_batch->copy_capacity = (result->length + 1) * 2;
+                    io_batch->copy = realloc(io_batch->copy, io_batch->copy_capacity);
+                }
+                line = io_batch->copy;
+                memcpy(line, result->text, result->length);
+                line[result->length] = '\0';
+            }
+            if (derrick_internal_Found(io_cb, io_batch->path, line, result->pattern))
+            {
+                derrick_internal_Stop(control, DERRICK_STOPPED);
+                break;
+            }
+        }
+    }
+    if (i_lock) LeaveCriticalSection(i_lock);
+    derrick_internal_Elapsed(io_batch->stats, DERRICK_PHASE_CALLBACK, start);
+    io_batch->count = 0;
+    return control->stop != DERRICK_OK;
+}
+
+// Find the i_lines lines before and after the last line reported, within [i_begin, i_end)
+void derrick_internal_BatchContext(struct Derrick_Batch_s* io_batch, const char* i_begin, const char* i_end, uint32_t i_lines)
+{
+    const char* context = io_batch->line;
+    const char* context_end = io_batch->line_end;
+    uint64_t before = 0;
+    const struct Derrick_Lines_s* newlines = io_batch->newlines;
+    if (newlines)
+    {
+        // Line k starts after line feed k - 1 and ends on line feed k
+        uint64_t k = io_batch->line_number - 1;
+        before = k < i_lines ? k : i_lines;
+        if (before > 0)
+        {
+            context = io_batch->data + (k - before == 0 ? 0 : derrick_internal_NewlineAt(newlines, k - before - 1) + 1);
+        }
+        if (k + i_lines < newlines->count)
+        {
+            context_end = io_batch->data + derrick_internal_NewlineAt(newlines, k + i_lines);
+        }
+        else
+        {
+            context_end = i_end;
+        }
+    }
+    else
+    {
+        // Only the line feeds count, as for the line numbers
+        while (context > i_begin && context[-1] != '\n') context--;
+        while (before < i_lines && context > i_begin)
+        {
+            context--;
+            while (context > i_begin && context[-1] != '\n') context--;
+            before++;
+        }
+        for (uint32_t after = 0; after < i_lines && context_end < i_end; ++after)
+        {
+            const char* feed = memchr(context_end, '\n', i_end - context_end);
+            if (feed == 0)
+            {
+                context_end = i_end;
+                break;
+            }
+            const char* next = memchr(feed + 1, '\n', i_end - feed - 1);
+            context_end = next ? next : i_end;
+        }
+    }
+    if (context_end > io_batch->line_end && context_end > context && context_end[-1] == '\r') context_end--;
+    if (context_end < io_batch->line_end) context_end = io_batch->line_end;
+    io_batch->context = context;
+    io_batch->context_end = context_end;
+    io_batch->context_line = io_batch->line_number - before;
+}
+
+// Add a match found at i_where, in data of the file that spans [i_begin, i_end), and return
+// non-zero if the search must stop. Without i_with_line, the match is reported without its
+// line: the file is binary.
+int derrick_internal_BatchAdd(struct Derrick_Batch_s* io_batch, const char* i_begin, const char* i_end, const char* i_where, size_t i_pattern,
+                              int i_with_line, Derrick_Parameters io_cb, CRITICAL_SECTION* i_lock)
+{
+    if (io_batch->count == io_batch->capacity && derrick_internal_BatchFlush(io_batch, io_cb, i_lock)) return 1;
+    struct Derrick_Result_s* result = &io_batch->results[io_batch->count++];
+    result->offset = io_batch->base + (i_where - io_batch->data);
+    result->pattern = (uint32_t)i_pattern;
+    result->text = 0;
+    result->length = 0;
+    result->line = 0;
+    result->column = 0;
+    result->context = 0;
+    result->context_length = 0;
+    result->context_line = 0;
+    if (!i_with_line) return 0;
+
+    // The matches are often on the same line as the previous one
+    if (io_batch->line == 0 || i_where < io_batch->line || i_where > io_batch->line_end)
+    {
+        const char* start = i_where;
+        while (start > i_begin && start[-1] != '\n' && start[-1] != '\r') start--;
+        const char* end = i_where;
+        while (end < i_end && *end != '\n' && *end != '\r') end++;
+        if (io_batch->newlines)
+        {
+            // No need to count the line feeds from the start of the file
+            io_batch->line_number = derrick_internal_NewlinesBefore(io_batch->newlines, start - io_batch->data) + 1;
+        }
+        else
+        {
+            derrick_internal_BatchCount(io_batch, io_batch->base + (start - io_batch->data));
+            io_batch->line_number = io_batch->lines + 1;
+        }
+        io_batch->line = start;
+        io_batch->line_end = end;
+        if (io_cb->param_context > 0)
+        {
+            derrick_internal_BatchContext(io_batch, i_begin, i_end, io_cb->param_context);
+        }
+    }
+    result->text = io_batch->line;
+    result->length = io_batch->line_end - io_batch->line;
+    result->line = io_batch->line_number;
+    result->column = (uint32_t)(i_where - io_batch->line) + 1;
+    if (io_cb->param_context > 0)
+    {
+        result->context = io_batch->context;
+        result->context_length = io_batch->context_end - io_batch->context;
+        result->context_line = io_batch->context_line;
+    }
+    return 0;
+}
+
+// Report a match found in the name of a file, and return non-zero if the search must stop
+int derrick_internal_BatchName(struct Derrick_Batch_s* io_batch, const char* i_path, size_t i_pattern, Derrick_Parameters io_cb, CRITICAL_SECTION* i_lock)
+{
+    derrick_internal_BatchFile(io_batch, i_path, i_path, 0);
+    derrick_internal_BatchAdd(io_batch, i_path, i_path, i_path, i_pattern, 0, io_cb, i_lock);
+    return derrick_internal_BatchFlush(io_batch, io_cb, i_lock);
+}
+
+struct Derrick_Pool_s;
+typedef void (*derrick_task_t)(struct Derrick_Pool_s* io_pool, int i_worker, void* io_arg);
+
+// A unit of work: list a directory, scan a file...
+struct Derrick_Task_s
+{
+    derrick_task_t run;
+    void* arg;
+};
+
+// Tasks of one worker: the owner works at the tail, thieves take from the head
+struct Derrick_Deque_s
+{
+    CRITICAL_SECTION lock;
+    struct Derrick_Task_s* tasks;
+    size_t head;
+    size_t tail;
+    size_t capacity;            // always a power of 2
+};
+
+// Work-stealing thread pool, living for the duration of one call
+struct Derrick_Pool_s
+{
+    int number_of_workers;
+    struct Derrick_Deque_s* deques;
+    volatile LONG pending;      // tasks pushed and not finished yet
+    CRITICAL_SECTION idle_lock;
+    CONDITION_VARIABLE idle;
+    void* context;
+};
+
+// Parameter of a worker thread
+struct Derrick_Worker_s
+{
+    struct Derrick_Pool_s* pool;
+    int worker;
+};
+
+void derrick_internal_PoolPush(struct Derrick_Pool_s* io_pool, int i_worker, derrick_task_t i_run, void* i_arg)
+{
+    struct Derrick_Deque_s* deque = &io_pool->deques[i_worker];
+    InterlockedIncrement(&io_pool->pending);
+
+    EnterCriticalSection(&deque->lock);
+    if (deque->tail - deque->head == deque->capacity)
+    {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : 256;
+        struct Derrick_Task_s* tasks = malloc(capacity * sizeof(struct Derrick_Task_s));
+        for (size_t i = deque->head; i < deque->tail; ++i)
+        {
+            tasks[i - deque->head] = deque->tasks[i & (deque->capacity - 1)];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->tail -= deque->head;
+        deque->head = 0;
+        deque->capacity = capacity;
+    }
+    deque->tasks[deque->tail & (deque->capacity - 1)].run = i_run;
+    deque->tasks[deque->tail & (deque->capacity - 1)].arg = i_arg;
+    deque->tail++;
+    LeaveCriticalSection(&deque->lock);
+
+    WakeConditionVariable(&io_pool->idle);
+}
+
+int derrick_internal_PoolTake(struct Derrick_Pool_s* io_pool, int i_worker, struct Derrick_Task_s* o_task)
+{
+    // Newest task of our own deque first: it is the hottest in cache
+    struct Derrick_Deque_s* deque = &io_pool->deques[i_worker];
+    int found = 0;
+    EnterCriticalSection(&deque->lock);
+    if (deque->tail != deque->head)
+    {
+        deque->tail--;
+        (*o_task) = deque->tasks[deque->tail & (deque->capacity - 1)];
+        found = 1;
+    }
+    LeaveCriticalSection(&deque->lock);
+
+    // Otherwise steal the oldest task of another worker: it is the biggest piece of work
+    for (int i = 1; i < io_pool->number_of_workers && !found; ++i)
+    {
+        deque = &io_pool->deques[(i_worker + i) % io_pool->number_of_workers];
+        if (deque->tail == deque->head) continue;
+        EnterCriticalSection(&deque->lock);
+        if (deque->tail != deque->head)
+        {
+            (*o_task) = deque->tasks[deque->head & (deque->capacity - 1)];
+            deque->head++;
+            found = 1;
+        }
+        LeaveCriticalSection(&deque->lock);
+    }
+    return found;
+}
+
+DWORD WINAPI derrick_internal_PoolWorker(LPVOID io_param)
+{
+    struct Derrick_Worker_s* worker = (struct Derrick_Worker_s*)io_param;
+    struct Derrick_Pool_s* pool = worker->pool;
+    struct Derrick_Task_s task;
+
+    while (1)
+    {
+        if (derrick_internal_PoolTake(pool, worker->worker, &task))
+        {
+            task.run(pool, worker->worker, task.arg);
+            if (InterlockedDecrement(&pool->pending) == 0)
+            {
+                WakeAllConditionVariable(&pool->idle);
+            }
+            continue;
+        }
+
+        // Nothing to do: stop when no task can create more work, otherwise wait a bit
+        if (pool->pending == 0) break;
+        EnterCriticalSection(&pool->idle_lock);
+        if (pool->pending != 0)
+        {
+            SleepConditionVariableCS(&pool->idle, &pool->idle_lock, 1);
+        }
+        LeaveCriticalSection(&pool->idle_lock);
+    }
+    return 0;
+}
+
+int derrick_internal_NumberOfThreads(int i_requested)
+{
+    if (i_requested > 0) return i_requested;
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+// Run i_run(i_arg) and all the tasks it spawns on i_threads threads, including the calling one
+void derrick_internal_PoolRun(int i_threads, void* io_context, derrick_task_t i_run, void* i_arg)
+{
+    struct Derrick_Pool_s pool;
+    pool.number_of_workers = i_threads;
+    pool.pending = 0;
+    pool.context = io_context;
+    pool.deques = calloc(i_threads, sizeof(struct Derrick_Deque_s));
+    InitializeCriticalSection(&pool.idle_lock);
+    InitializeConditionVariable(&pool.idle);
+    for (int i = 0; i < i_threads; ++i)
+    {
+        InitializeCriticalSection(&pool.deques[i].lock);
+    }
+    derrick_internal_PoolPush(&pool, 0, i_run, i_arg);
+
+    HANDLE* threads = malloc(i_threads * sizeof(HANDLE));
+    struct Derrick_Worker_s* workers = malloc(i_threads * sizeof(struct Derrick_Worker_s));
+    for (int i = 0; i < i_threads; ++i)
+    {
+        workers[i].pool = &pool;
+        workers[i].worker = i;
+        threads[i] = (i == 0) ? 0 : CreateThread(NULL, 0, &derrick_internal_PoolWorker, &workers[i], 0, NULL);
+    }
+    derrick_internal_PoolWorker(&workers[0]);
+    for (int i = 1; i < i_threads; ++i)
+    {
+        if (threads[i] == 0) continue;
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+
+    for (int i = 0; i < i_threads; ++i)
+    {
+        DeleteCriticalSection(&pool.deques[i].lock);
+        free(pool.deques[i].tasks);
+    }
+    DeleteCriticalSection(&pool.idle_lock);
+    free(pool.deques);
+    free(threads);
+    free(workers);
+}
+
+// Find the content of a file in a cache, under its lock
+struct Derrick_Cached_s* derrick_internal_CacheFind(struct Derrick_Cache_s* i_cache, const char* i_path)
+{
+    size_t bucket = (size_t)derrick_internal_Checksum(i_path, strlen(i_path)) & (i_cache->number_of_buckets - 1);
+    struct Derrick_Cached_s* cached = i_cache->buckets[bucket];
+    while (cached != 0 && strcmp(cached->path, i_path) != 0) cached = cached->chain;
+    return cached;
+}
+
+void derrick_internal_CacheLink(struct Derrick_Cache_s* io_cache, struct Derrick_Cached_s* io_cached)
+{
+    io_cached->older = io_cache->newest;
+    io_cached->newer = 0;
+    if (io_cache->newest) io_cache->newest->newer = io_cached;
+    else io_cache->oldest = io_cached;
+    io_cache->newest = io_cached;
+}
+
+void derrick_internal_CacheUnlink(struct Derrick_Cache_s* io_cache, struct Derrick_Cached_s* io_cached)
+{
+    if (io_cached->newer) io_cached->newer->older = io_cached->older;
+    else io_cache->newest = io_cached->older;
+    if (io_cached->older) io_cached->older->newer = io_cached->newer;
+    else io_cache->oldest = io_cached->newer;
+}
+
+void derrick_internal_CachedFree(struct Derrick_Cached_s* i_cached)
+{
+    free(i_cached->path);
+    free(i_cached->data);
+    free(i_cached);
+}
+
+// Take the content of a file out of a cache, under its lock. The searches still using it
+// keep it until they release it.
+void derrick_internal_CacheDetach(struct Derrick_Cache_s* io_cache, struct Derrick_Cached_s* io_cached)
+{
+    size_t bucket = (size_t)derrick_internal_Checksum(io_cached->path, strlen(io_cached->path)) & (io_cache->number_of_buckets - 1);
+    struct Derrick_Cached_s** link = &io_cache->buckets[bucket];
+    while (*link != io_cached) link = &(*link)->chain;
+    (*link) = io_cached->chain;
+    derrick_internal_CacheUnlink(io_cache, io_cached);
+    io_cache->used -= io_cached->size;
+    io_cache->count--;
+    io_cached->detached = 1;
+    if (io_cached->refs == 0) derrick_internal_CachedFree(io_cached);
+}
+
+// Evict the least recently used contents until i_size more bytes fit in the budget
+void derrick_internal_CacheEvict(struct Derrick_Cache_s* io_cache, uint64_t i_size)
+{
+    struct Derrick_Cached_s* cached = io_cache->oldest;
+    while (cached != 0 && io_cache->used + i_size > io_cache->budget)
+    {
+        struct Derrick_Cached_s* newer = cached->newer;
+        if (cached->refs == 0) derrick_internal_CacheDetach(io_cache, cached);
+        cached = newer;
+    }
+}
+
+// Return the content of a file from a cache, or 0 if it is not there or the file changed
+// since it was read. The content stays valid until derrick_internal_CacheRelease.
+struct Derrick_Cached_s* derrick_internal_CacheGet(struct Derrick_Cache_s* io_cache, const char* i_path)
+{
+    EnterCriticalSection(&io_cache->lock);
+    struct Derrick_Cached_s* cached = derrick_internal_CacheFind(io_cache, i_path);
+    if (cached)
+    {
+        cached->refs++;
+        derrick_internal_CacheUnlink(io_cache, cached);
+        derrick_internal_CacheLink(io_cache, cached);
+    }
+    LeaveCriticalSection(&io_cache->lock);
+    if (cached == 0) return 0;
+
+    // Getting the attributes of the file costs much less than opening and mapping it
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (GetFileAttributesExA(i_path, GetFileExInfoStandard, &data) != 0
+            && (((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow) == cached->size
+            && (((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime) == cached->mtime)
+    {
+        return cached;
+    }
+    EnterCriticalSection(&io_cache->lock);
+    cached->refs--;
+    if (!cached->detached) derrick_internal_CacheDetach(io_cache, cached);
+    else if (cached->refs == 0) derrick_internal_CachedFree(cached);
+    LeaveCriticalSection(&io_cache->lock);
+    return 0;
+}
+
+// Keep a copy of the content of a file in a cache, evicting the least recently used ones to
+// make room. Return the copy, to release with derrick_internal_CacheRelease, or 0 if the file
+// is not kept.
+struct Derrick_Cached_s* derrick_internal_CachePut(struct Derrick_Cache_s* io_cache, const char* i_path, const char* i_data, size_t i_size, uint64_t i_mtime)
+{
+    if (i_size == 0 || i_size > io_cache->budget / DERRICK_CACHE_SHARE) return 0;
+
+    // Copy before taking the lock, the other searches only wait for the lists to change
+    struct Derrick_Cached_s* cached = malloc(sizeof(struct Derrick_Cached_s));
+    if (cached == 0) return 0;
+    cached->data = malloc(i_size);
+    cached->path = _strdup(i_path);
+    if (cached->data == 0 || cached->path == 0)
+    {
+        derrick_internal_CachedFree(cached);
+        return 0;
+    }
+    memcpy(cached->data, i_data, i_size);
+    cached->size = i_size;
+    cached->mtime = i_mtime;
+    cached->refs = 1;
+    cached->detached = 0;
+
+    EnterCriticalSection(&io_cache->lock);
+    if (i_size > io_cache->budget / DERRICK_CACHE_SHARE || derrick_internal_CacheFind(io_cache, i_path) != 0)
+    {
+        // Another search was faster, or the budget shrank meanwhile
+        LeaveCriticalSection(&io_cache->lock);
+        derrick_internal_CachedFree(cached);
+        return 0;
+    }
+    derrick_internal_CacheEvict(io_cache, i_size);
+    if (io_cache->used + i_size > io_cache->budget)
+    {
+        // What is left is in use
+        LeaveCriticalSection(&io_cache->lock);
+        derrick_internal_CachedFree(cached);
+        return 0;
+    }
+    if (io_cache->count >= io_cache->number_of_buckets)
+    {
+        // Rehash in twice as many buckets
+        size_t number_of_buckets = io_cache->number_of_buckets * 2;
+        struct Derrick_Cached_s** buckets = calloc(number_of_buckets, sizeof(struct Derrick_Cached_s*));
+        for (struct Derrick_Cached_s* cur = io_cache->oldest; cur != 0; cur = cur->newer)
+        {
+            size_t bucket = (size_t)derrick_internal_Checksum(cur->path, strlen(cur->path)) & (number_of_buckets - 1);
+            cur->chain = buckets[bucket];
+            buckets[bucket] = cur;
+        }
+        free(io_cache->buckets);
+        io_cache->buckets = buckets;
+        io_cache->number_of_buckets = number_of_buckets;
+    }
+    size_t bucket = (size_t)derrick_internal_Checksum(i_path, strlen(i_path)) & (io_cache->number_of_buckets - 1);
+    cached->chain = io_cache->buckets[bucket];
+    io_cache->buckets[bucket] = cached;
+    derrick_internal_CacheLink(io_cache, cached);
+    io_cache->used += i_size;
+    io_cache->count++;
+    LeaveCriticalSection(&io_cache->lock);
+    return cached;
+}
+
+void derrick_internal_CacheRelease(struct Derrick_Cache_s* io_cache, struct Derrick_Cached_s* io_cached)
+{
+    EnterCriticalSection(&io_cache->lock);
+    io_cached->refs--;
+    if (io_cached->detached && io_cached->refs == 0) derrick_internal_CachedFree(io_cached);
+    LeaveCriticalSection(&io_cache->lock);
+}
+
+void derrick_internal_CacheFree(struct Derrick_Cache_s* io_cache)
+{
+    if (io_cache == 0) return;
+    struct Derrick_Cached_s* cached = io_cache->oldest;
+    while (cached != 0)
+    {
+        struct Derrick_Cached_s* newer = cached->newer;
+        derrick_internal_CachedFree(cached);
+        cached = newer;
+    }
+    DeleteCriticalSection(&io_cache->lock);
+    free(io_cache->buckets);
+    free(io_cache);
+}
+
+// Map the file of an entry, at i_path, to verify it, or take its content from the cache of the index,
+// counting the time and the failures. The newline table of the entry is given back only if
+// the file was not modified since it was indexed. A content taken from the cache or put in
+// it is given in o_cached, to release with derrick_internal_UnmapCandidate.
+int derrick_internal_MapCandidate(struct Derrick_Cache_s* io_cache, const struct Derrick_Segment_s* i_segment, size_t i_entry, const char* i_path,
+                                  const char** o_data, size_t* o_size, const struct Derrick_Lines_s** o_lines, struct Derrick_Cached_s** o_cached,
+                                  struct Derrick_Stats_s* io_stats)
+{
+    const struct Derrick_Entry_s* entry = &i_segment->entries[i_entry];
+    uint64_t start = derrick_internal_Now(io_stats);
+    uint64_t mtime = 0;
+    (*o_lines) = 0;
+    (*o_cached) = io_cache ? derrick_internal_CacheGet(io_cache, i_path) : 0;
+    if (*o_cached)
+    {
+        (*o_data) = (*o_cached)->data;
+        (*o_size) = (size_t)(*o_cached)->size;
+        mtime = (*o_cached)->mtime;
+        if (io_stats) io_stats->files_cached++;
+    }
+    else
+    {
+        if (derrick_internal_MapFile(i_path, o_data, o_size, 0, &mtime) != DERRICK_OK) return derrick_internal_Failed(io_stats);
+        if (io_stats) io_stats->files_opened++;
+        if (io_cache && ((*o_cached) = derrick_internal_CachePut(io_cache, i_path, *o_data, *o_size, mtime)) != 0)
+        {
+            derrick_internal_UnmapFile(*o_data);
+            (*o_data) = (*o_cached)->data;
+        }
+    }
+    if (entry->lines != DERRICK_NO_LINES && entry->size == (*o_size) && entry->mtime == mtime)
+    {
+        (*o_lines) = (const struct Derrick_Lines_s*)(i_segment->lines + entry->lines);
+    }
+    derrick_internal_Elapsed(io_stats, DERRICK_PHASE_OPEN, start);
+    return DERRICK_OK;
+}
+
+void derrick_internal_UnmapCandidate(struct Derrick_Cache_s* io_cache, struct Derrick_Cached_s* io_cached, const char* i_data)
+{
+    if (io_cached) derrick_internal_CacheRelease(io_cache, io_cached);
+    else derrick_internal_UnmapFile(i_data);
+}
+
+// Return the sorted list of the files of a segment that may contain any of the strings,
+// or 0 if every file is a candidate
+uint32_t* derrick_internal_CandidatesAny(const struct Derrick_Segment_s* i_segment, const char* const* i_searchfor, const size_t* i_lengths, size_t i_count, size_t* o_count)
+{
+    (*o_count) = 0;
+    size_t count = 0;
+    size_t capacity = 64;
+    uint32_t* candidates = malloc(capacity * sizeof(uint32_t));
+    for (size_t p = 0; p < i_count; ++p)
+    {
+        if (i_lengths[p] == 0) continue;
+        size_t number_of_found = 0;
+        uint32_t* found = derrick_internal_Candidates(i_segment, i_searchfor[p], i_lengths[p], 0, &number_of_found);
+        if (found == 0)
+        {
+            free(candidates);
+            return 0;
+        }
+        if (count + number_of_found > capacity)
+        {
+            while (count + number_of_found > capacity) capacity *= 2;
+            candidates = realloc(candidates, capacity * sizeof(uint32_t));
+        }
+        memcpy(candidates + count, found, number_of_found * sizeof(uint32_t));
+        count += number_of_found;
+        free(found);
+    }
+
+    // Union of the lists
+    qsort(candidates, count, sizeof(uint32_t), &derrick_internal_CompareIds);
+    size_t kept = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (kept == 0 || candidates[kept - 1] != candidates[i]) candidates[kept++] = candidates[i];
+    }
+    (*o_count) = kept;
+    return candidates;
+}
+
+// Report the strings found in [i_data, i_data + i_size) that were not reported yet for the
+// current file, and return the number of strings reported so far
+size_t derrick_internal_ReportOnce(const struct Derrick_Automaton_s* i_automaton, const char* i_name, const char* i_data, size_t i_size,
+                                   const struct Derrick_Lines_s* i_lines, int i_with_line, unsigned char* io_reported, size_t* io_touched,
+                                   size_t i_number_of_reported, const char** o_where, struct Derrick_Batch_s* io_batch, Derrick_Parameters io_cb, CRITICAL_SECTION* i_lock)
+{
+    const char* end = i_data + i_size;
+    derrick_internal_BatchFile(io_batch, i_name, i_data, 0);
+    io_batch->newlines = i_lines;
+    const char* cur = i_data;
+    uint32_t row = 0;
+    while (i_number_of_reported < i_automaton->number_of_patterns
+           && (cur = derrick_internal_AutomatonRun(i_automaton, cur, end, &row)) != 0)
+    {
+        for (uint32_t state = row / (uint32_t)i_automaton->number_of_classes; state != DERRICK_EMPTY_SLOT; state = i_automaton->dictionary[state])
+        {
+            for (int32_t p = i_automaton->output[state]; p >= 0; p = i_automaton->next_output[p])
+            {
+                if (io_reported[p]) continue;
+                io_reported[p] = 1;
+                io_touched[i_number_of_reported++] = (size_t)p;
+                if (o_where) o_where[p] = cur + 1 - i_automaton->lengths[p];
+                derrick_internal_BatchAdd(io_batch, i_data, end, cur + 1 - i_automaton->lengths[p], (size_t)p, i_with_line, io_cb, i_lock);
+            }
+        }
+        ++cur;
+    }
+    derrick_internal_BatchFlush(io_batch, io_cb, i_lock);
+    return i_number_of_reported;
+}
+
+// Entries of a segment given to one task of a parallel query
+#define DERRICK_QUERY_BLOCK     256
+
+// A query on an index. The index is only read: each thread has its own DFA, results and
+// counters, and the callbacks are called under the lock when there are several threads.
+struct Derrick_Query_s
+{
+    DerrickIndex index;
+    Derrick_Parameters params;
+    struct Derrick_Literal_s literal;           // the string, or the literal of the regular expression
+    const struct Derrick_Literal_s* prefilter;  // literal that every match of the expression contains, if any
+    struct Derrick_Regex_s* regex;
+    struct Derrick_Dfa_s* dfas;                 // per thread
+    struct Derrick_Automaton_s* automaton;      // several strings at once, instead of the literal
+    unsigned char** reported;                   // per thread, strings reported for the current file
+    size_t** touched;                           // per thread, the indexes of these strings
+    size_t** found;                             // per thread, the strings found in the content shared by copies
+    const char*** where;                        // per thread, where each of them was found
+    uint32_t** candidates;                      // per segment, sorted, 0 if every file is a candidate
+    size_t* number_of_candidates;
+    unsigned char** dir_matches;                // per segment and directory, 1 if its path contains the literal; 0 to match the whole paths
+    unsigned char** named;                      // per segment, one bit per file whose name has all the trigrams of the literal, 0 for all
+    struct Derrick_Batch_s* batches;            // per thread
+    struct Derrick_Stats_s* stats;              // per thread, 0 if the caller does not want them
+    struct Derrick_Control_s control;
+    CRITICAL_SECTION* lock;                     // 0 with a single thread
+    CRITICAL_SECTION lock_storage;
+    int threads;
+};
+
+// Content of a file verified by a query, kept for its copies: the first one verified that did
+// not change since it was indexed, and what was found in it
+struct Derrick_Shared_s
+{
+    const char* data;           // 0 until a copy is verified
+    size_t size;
+    const struct Derrick_Lines_s* lines;
+    struct Derrick_Cached_s* cached;
+    int binary;
+    const char* where;          // the match of the string, or 0
+    int recorded;               // several strings: found lists them all, none being in the name
+    size_t number_of_found;
+};
+
+// Tell whether a file still has the size and last write time it was indexed with
+int derrick_internal_Unchanged(const struct Derrick_Entry_s* i_entry, const char* i_path)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    return GetFileAttributesExA(i_path, GetFileExInfoStandard, &data) != 0
+            && (((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow) == i_entry->size
+            && (((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime) == i_entry->mtime;
+}
+
+// Report the first occurrence of the string in the name of a file, or else in its content.
+// io_shared is 0 for a file without copies.
+void derrick_internal_QueryFile(struct Derrick_Query_s* io_query, int i_worker, size_t i_segment_index, size_t i_entry, int i_candidate,
+                                struct Derrick_Shared_s* io_shared)
+{
+    const struct Derrick_Segment_s* i_segment = &io_query->index->segments[i_segment_index];
+    const struct Derrick_Entry_s* entry = &i_segment->entries[i_entry];
+    Derrick_Parameters io_cb = io_query->params;
+    struct Derrick_Batch_s* batch = &io_query->batches[i_worker];
+    struct Derrick_Stats_s* stats = batch->stats;
+    struct Derrick_Dfa_s* dfa = io_query->regex ? &io_query->dfas[i_worker] : 0;
+
+    // The path is only built when it is matched whole, reported or opened
+    const char* i_name = 0;
+    int name_match;
+    if (io_query->dir_matches)
+    {
+        const char* name = i_segment->names + entry->name;
+        const unsigned char* named = io_query->named[i_segment_index];
+        name_match = (entry->dir != DERRICK_NO_DIR && io_query->dir_matches[i_segment_index][entry->dir])
+                || ((named == 0 || ((named[i_entry >> 3] >> (i_entry & 7)) & 1))
+                    && derrick_internal_LiteralFind(&io_query->literal, name, strlen(name)) != 0);
+    }
+    else
+    {
+        i_name = derrick_internal_EntryPath(i_segment, i_entry, &batch->name, &batch->name_capacity);
+        name_match = (dfa ? derrick_internal_RegexFind(dfa, io_query->prefilter, i_name, i_name + strlen(i_name))
+                          : derrick_internal_LiteralFind(&io_query->literal, i_name, strlen(i_name))) != 0;
+    }
+    if (name_match)
+    {
+        if (i_name == 0) i_name = derrick_internal_EntryPath(i_segment, i_entry, &batch->name, &batch->name_capacity);
+        derrick_internal_BatchName(batch, i_name, 0, io_cb, io_query->lock);
+        return;
+    }
+    if (!i_candidate || !(io_cb->cb_results || io_cb->cd_found || io_cb->cd_found_pattern)) return;
+    if (i_name == 0) i_name = derrick_internal_EntryPath(i_segment, i_entry, &batch->name, &batch->name_capacity);
+
+    // A copy of a content already verified gets the same result
+    if (io_shared && io_shared->data && derrick_internal_Unchanged(entry, i_name))
+    {
+        derrick_internal_Progress(&io_query->control, 1, io_shared->size, io_query->lock);
+        if (io_shared->where != 0)
+        {
+            derrick_internal_BatchFile(batch, i_name, io_shared->data, 0);
+            batch->newlines = io_shared->lines;
+            derrick_internal_BatchAdd(batch, io_shared->data, io_shared->data + io_shared->size, io_shared->where, 0, !io_shared->binary, io_cb, io_query->lock);
+            derrick_internal_BatchFlush(batch, io_cb, io_query->lock);
+        }
+        return;
+    }
+
+    // Verify the candidate against the actual content of the file
+    const char* pBuf = 0;
+    size_t size = 0;
+    const struct Derrick_Lines_s* lines = 0;
+    struct Derrick_Cached_s* cached = 0;
+    struct Derrick_Cache_s* cache = io_query->index->cache;
+    if (derrick_internal_MapCandidate(cache, i_segment, i_entry, i_name, &pBuf, &size, &lines, &cached, stats) != DERRICK_OK) return;
+    derrick_internal_Progress(&io_query->control, 1, size, io_query->lock);
+
+    // A binary file is only reported, without the line, or not searched at all
+    int binary = io_cb->param_binary != DERRICK_BINARY_TEXT && derrick_internal_IsBinary(pBuf, size);
+    const char* where = 0;
+    if (!binary || io_cb->param_binary == DERRICK_BINARY_REPORT)
+    {
+        uint64_t start = derrick_internal_Now(stats);
+        where = dfa ? derrick_internal_RegexFind(dfa, io_query->prefilter, pBuf, pBuf + size)
+                    : derrick_internal_LiteralFind(&io_query->literal, pBuf, size);
+        derrick_internal_Elapsed(stats, DERRICK_PHASE_SCAN, start);
+        if (stats) stats->bytes_scanned += size;
+    }
+    else if (stats)
+    {
+        stats->files_skipped++;
+    }
+    if (where != 0)
+    {
+        derrick_internal_BatchFile(batch, i_name, pBuf, 0);
+        batch->newlines = lines;
+        derrick_internal_BatchAdd(batch, pBuf, pBuf + size, where, 0, !binary, io_cb, io_query->lock);
+        derrick_internal_BatchFlush(batch, io_cb, io_query->lock);
+    }
+
+    // The newline table is only given for a file that did not change since it was indexed,
+    // and the copies all have one
+    if (io_shared && io_shared->data == 0 && lines != 0 && pBuf != 0)
+    {
+        io_shared->data = pBuf;
+        io_shared->size = size;
+        io_shared->lines = lines;
+        io_shared->cached = cached;
+        io_shared->binary = binary;
+        io_shared->where = where;
+        return;
+    }
+    derrick_internal_UnmapCandidate(cache, cached, pBuf);
+}
+
+// Report each of the strings once, found in the name of a file or else in its content.
+// io_shared is 0 for a file without copies.
+void derrick_internal_QueryFileMulti(struct Derrick_Query_s* io_query, int i_worker, size_t i_segment_index, size_t i_entry, int i_candidate,
+                                     struct Derrick_Shared_s* io_shared)
+{
+    const struct Derrick_Segment_s* i_segment = &io_query->index->segments[i_segment_index];
+    Derrick_Parameters io_cb = io_query->params;
+    struct Derrick_Batch_s* batch = &io_query->batches[i_worker];
+    const char* i_name = derrick_internal_EntryPath(i_segment, i_entry, &batch->name, &batch->name_capacity);
+    struct Derrick_Stats_s* stats = batch->stats;
+    const struct Derrick_Automaton_s* automaton = io_query->automaton;
+    unsigned char* reported = io_query->reported[i_worker];
+    size_t* touched = io_query->touched[i_worker];
+
+    // A string found in the name is not looked for in the content
+    size_t number_of_reported = derrick_internal_ReportOnce(automaton, i_name, i_name, strlen(i_name), 0, 0, reported, touched, 0, 0, batch, io_cb, io_query->lock);
+    if (i_candidate && number_of_reported < automaton->number_of_patterns && !derrick_internal_Stopped(&io_query->control))
+    {
+        const char* pBuf = 0;
+        size_t size = 0;
+        const struct Derrick_Lines_s* lines = 0;
+        struct Derrick_Cached_s* cached = 0;
+        struct Derrick_Cache_s* cache = io_query->index->cache;
+        size_t* found = io_query->found[i_worker];
+        const char** where = io_query->where[i_worker];
+        int copy = io_shared && io_shared->data && derrick_internal_Unchanged(&i_segment->entries[i_entry], i_name);
+        if (copy && io_shared->recorded)
+        {
+            // The strings found in the content shared by the copies, but not in the name
+            derrick_internal_Progress(&io_query->control, 1, io_shared->size, io_query->lock);
+            derrick_internal_BatchFile(batch, i_name, io_shared->data, 0);
+            batch->newlines = io_shared->lines;
+            for (size_t i = 0; i < io_shared->number_of_found; ++i)
+            {
+                size_t p = found[i];
+                if (reported[p]) continue;
+                reported[p] = 1;
+                touched[number_of_reported++] = p;
+                derrick_internal_BatchAdd(batch, io_shared->data, io_shared->data + io_shared->size, where[p], p, !io_shared->binary, io_cb, io_query->lock);
+            }
+            derrick_internal_BatchFlush(batch, io_cb, io_query->lock);
+        }
+        else if (copy || derrick_internal_MapCandidate(cache, i_segment, i_entry, i_name, &pBuf, &size, &lines, &cached, stats) == DERRICK_OK)
+        {
+            if (copy)
+            {
+                pBuf = io_shared->data;
+                size = io_shared->size;
+                lines = io_shared->lines;
+            }
+            derrick_internal_Progress(&io_query->control, 1, size, io_query->lock);
+            int binary = io_cb->param_binary != DERRICK_BINARY_TEXT && derrick_internal_IsBinary(pBuf, size);
+
+            // The first copy verified keeps what it found for the others, if nothing was in its name
+            int keep = io_shared && !copy && io_shared->data == 0 && lines != 0 && pBuf != 0;
+            int record = keep && number_of_reported == 0;
+            if (!binary || io_cb->param_binary == DERRICK_BINARY_REPORT)
+            {
+                uint64_t start = derrick_internal_Now(stats);
+                uint64_t callbacks = stats ? stats->nanoseconds[DERRICK_PHASE_CALLBACK] : 0;
+                number_of_reported = derrick_internal_ReportOnce(automaton, i_name, pBuf, size, lines, !binary, reported, touched, number_of_reported,
+                                                                 record ? where : 0, batch, io_cb, io_query->lock);
+                if (stats)
+                {
+                    // The callbacks are timed on their own
+                    uint64_t elapsed = derrick_internal_Since(stats, start);
+                    callbacks = stats->nanoseconds[DERRICK_PHASE_CALLBACK] - callbacks;
+                    derrick_internal_Record(stats, DERRICK_PHASE_SCAN, elapsed > callbacks ? elapsed - callbacks : 0);
+                    stats->bytes_scanned += size;
+                }
+            }
+            else if (stats)
+            {
+                stats->files_skipped++;
+            }
+            if (keep)
+            {
+                io_shared->data = pBuf;
+                io_shared->size = size;
+                io_shared->lines = lines;
+                io_shared->cached = cached;
+                io_shared->binary = binary;
+                io_shared->recorded = record;
+                io_shared->number_of_found = record ? number_of_reported : 0;
+                memcpy(found, touched, io_shared->number_of_found * sizeof(size_t));
+            }
+            else if (!copy)
+            {
+                derrick_internal_UnmapCandidate(cache, cached, pBuf);
+            }
+        }
+    }
+    for (size_t i = 0; i < number_of_reported; ++i)
+    {
+        reported[touched[i]] = 0;
+    }
+}
+
+// Run the query on the entries [i_begin, i_end) of a segment
+void derrick_internal_QueryRange(struct Derrick_Query_s* io_query, int i_worker, size_t i_segment, size_t i_begin, size_t i_end)
+{
+    const struct Derrick_Segment_s* segment = &io_query->index->segments[i_segment];
+    const uint32_t* candidates = io_query->candidates[i_segment];
+    size_t number_of_candidates = io_query->number_of_candidates[i_segment];
+
+    // First candidate of the range
+    size_t low = 0;
+    size_t high = number_of_candidates;
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        if (candidates[middle] < i_begin) low = middle + 1;
+        else high = middle;
+    }
+    size_t next_candidate = low;
+
+    for (size_t cur_idx_cnt = i_begin; cur_idx_cnt < i_end && !derrick_internal_Stopped(&io_query->control); ++cur_idx_cnt)
+    {
+        // Is this file a candidate for content?
+        int candidate = (candidates == 0);
+        if (next_candidate < number_of_candidates && candidates[next_candidate] == cur_idx_cnt)
+        {
+            candidate = 1;
+            next_candidate++;
+        }
+
+        // The copies of a file are searched with the first one, which has the postings, even
+        // if it is gone
+        const struct Derrick_Entry_s* entry = &segment->entries[cur_idx_cnt];
+        if (entry->copy_of != cur_idx_cnt) continue;
+        if (entry->next_copy == DERRICK_NO_COPY)
+        {
+            if (derrick_internal_IsDeleted(segment, cur_idx_cnt)) continue;
+            if (io_query->automaton) derrick_internal_QueryFileMulti(io_query, i_worker, i_segment, cur_idx_cnt, candidate, 0);
+            else derrick_internal_QueryFile(io_query, i_worker, i_segment, cur_idx_cnt, candidate, 0);
+            continue;
+        }
+        struct Derrick_Shared_s shared;
+        memset(&shared, 0, sizeof(shared));
+        for (uint64_t e = cur_idx_cnt; e != DERRICK_NO_COPY && !derrick_internal_Stopped(&io_query->control); e = segment->entries[e].next_copy)
+        {
+            if (derrick_internal_IsDeleted(segment, (size_t)e)) continue;
+            if (io_query->automaton) derrick_internal_QueryFileMulti(io_query, i_worker, i_segment, (size_t)e, candidate, &shared);
+            else derrick_internal_QueryFile(io_query, i_worker, i_segment, (size_t)e, candidate, &shared);
+        }
+        if (shared.data) derrick_internal_UnmapCandidate(io_query->index->cache, shared.cached, shared.data);
+    }
+}
+
+// A block of entries to query
+struct Derrick_QueryArg_s
+{
+    size_t segment;
+    size_t begin;
+    size_t end;
+};
+
+void derrick_internal_QueryTask(struct Derrick_Pool_s* io_pool, int i_worker, void* io_arg)
+{
+    struct Derrick_QueryArg_s* arg = (struct Derrick_QueryArg_s*)io_arg;
+    derrick_internal_QueryRange((struct Derrick_Query_s*)io_pool->context, i_worker, arg->segment, arg->begin, arg->end);
+    free(arg);
+}
+
+// First task of a parallel query: one task per block of entries, which the other threads steal
+void derrick_internal_QuerySplit(struct Derrick_Pool_s* io_pool, int i_worker, void* io_arg)
+{
+    const struct Derrick_Query_s* query = (const struct Derrick_Query_s*)io_pool->context;
+    for (size_t s = 0; s < query->index->number_of_segments; ++s)
+    {
+        size_t number_of_entries = query->index->segments[s].number_of_entries;
+        for (size_t begin = 0; begin < number_of_entries; begin += DERRICK_QUERY_BLOCK)
+        {
+            struct Derrick_QueryArg_s* arg = malloc(sizeof(struct Derrick_QueryArg_s));
+            arg->segment = s;
+            arg->begin = begin;
+            arg->end = begin + DERRICK_QUERY_BLOCK < number_of_entries ? begin + DERRICK_QUERY_BLOCK : number_of_entries;
+            derrick_internal_PoolPush(io_pool, i_worker, &derrick_internal_QueryTask, arg);
+        }
+    }
+}
+
+// Prepare what the threads of a query share and what each one owns. The literal, the
+// regular expression or the automaton must be set.
+void derrick_internal_QueryInit(struct Derrick_Query_s* io_query, DerrickIndex i_index, Derrick_Parameters io_cb)
+{
+    io_query->index = i_index;
+    io_query->params = io_cb;
+    io_query->threads = derrick_internal_NumberOfThreads(io_cb->param_threads);
+    io_query->lock = 0;
+    if (io_query->threads > 1)
+    {
+        InitializeCriticalSection(&io_query->lock_storage);
+        io_query->lock = &io_query->lock_storage;
+    }
+    derrick_internal_ControlInit(&io_query->control, io_cb);
+
+    int threads = io_query->threads;
+    size_t share = io_cb->param_results ? io_cb->param_results_size / threads : 0;
+    io_query->batches = malloc(threads * sizeof(struct Derrick_Batch_s));
+    io_query->stats = io_cb->param_stats ? calloc(threads, sizeof(struct Derrick_Stats_s)) : 0;
+    for (int i = 0; i < threads; ++i)
+    {
+        derrick_internal_BatchInit(&io_query->batches[i], share ? io_cb->param_results + i * share : 0, share, &io_query->control);
+        io_query->batches[i].stats = io_query->stats ? &io_query->stats[i] : 0;
+    }
+    io_query->dfas = 0;
+    if (io_query->regex)
+    {
+        io_query->dfas = malloc(threads * sizeof(struct Derrick_Dfa_s));
+        for (int i = 0; i < threads; ++i) derrick_internal_DfaInit(&io_query->dfas[i], io_query->regex);
+    }
+    io_query->reported = 0;
+    io_query->touched = 0;
+    io_query->found = 0;
+    io_query->where = 0;
+    if (io_query->automaton)
+    {
+        io_query->reported = malloc(threads * sizeof(unsigned char*));
+        io_query->touched = malloc(threads * sizeof(size_t*));
+        io_query->found = malloc(threads * sizeof(size_t*));
+        io_query->where = malloc(threads * sizeof(const char**));
+        for (int i = 0; i < threads; ++i)
+        {
+            io_query->reported[i] = calloc(io_query->automaton->number_of_patterns, 1);
+            io_query->touched[i] = malloc(io_query->automaton->number_of_patterns * sizeof(size_t));
+            io_query->found[i] = malloc(io_query->automaton->number_of_patterns * sizeof(size_t));
+            io_query->where[i] = malloc(io_query->automaton->number_of_patterns * sizeof(const char*));
+        }
+    }
+    io_query->candidates = calloc(i_index->number_of_segments, sizeof(uint32_t*));
+    io_query->number_of_candidates = calloc(i_index->number_of_segments, sizeof(size_t));
+    io_query->dir_matches = 0;
+    io_query->named = 0;
+}
+
+// Run a query on all the segments, serially or with a pool of threads, and release it
+int derrick_internal_QueryRun(struct Derrick_Query_s* io_query)
+{
+    if (io_query->threads <= 1)
+    {
+        for (size_t s = 0; s < io_query->index->number_of_segments && !derrick_internal_Stopped(&io_query->control); ++s)
+        {
+            derrick_internal_QueryRange(io_query, 0, s, 0, io_query->index->segments[s].number_of_entries);
+        }
+    }
+    else
+    {
+        derrick_internal_PoolRun(io_query->threads, io_query, &derrick_internal_QuerySplit, 0);
+    }
+
+    int threads = io_query->threads;
+    for (size_t s = 0; s < io_query->index->number_of_segments; ++s) free(io_query->candidates[s]);
+    free(io_query->candidates);
+    free(io_query->number_of_candidates);
+    if (io_query->dir_matches)
+    {
+        for (size_t s = 0; s < io_query->index->number_of_segments; ++s)
+        {
+            free(io_query->dir_matches[s]);
+            free(io_query->named[s]);
+        }
+        free(io_query->dir_matches);
+        free(io_query->named);
+    }
+    for (int i = 0; i < threads; ++i) derrick_internal_BatchFree(&io_query->batches[i]);
+    free(io_query->batches);
+    if (io_query->stats)
+    {
+        for (int i = 0; i < threads; ++i) derrick_internal_StatsAdd(io_query->params->param_stats, &io_query->stats[i]);
+        free(io_query->stats);
+    }
+    if (io_query->dfas)
+    {
+        for (int i = 0; i < threads; ++i) derrick_internal_DfaFree(&io_query->dfas[i]);
+        free(io_query->dfas);
+    }
+    if (io_query->automaton)
+    {
+        for (int i = 0; i < threads; ++i)
+        {
+            free(io_query->reported[i]);
+            free(io_query->touched[i]);
+            free(io_query->found[i]);
+            free(io_query->where[i]);
+        }
+        free(io_query->reported);
+        free(io_query->touched);
+        free(io_query->found);
+        free(io_query->where);
+    }
+    if (io_query->lock) DeleteCriticalSection(io_query->lock);
+    return derrick_internal_ControlResult(&io_query->control, DERRICK_OK);
+}
+
+// Prepare the matching of the literal in the paths of a segment: it is looked for once in
+// the path of each directory, and the names to look at are those with all its trigrams
+void derrick_internal_QueryNames(struct Derrick_Query_s* io_query, size_t i_segment)
+{
+    const struct Derrick_Segment_s* segment = &io_query->index->segments[i_segment];
+    const struct Derrick_Literal_s* literal = &io_query->literal;
+    struct Derrick_Batch_s* batch = &io_query->batches[0];
+    unsigned char* dir_matches = malloc(segment->number_of_dirs + 1);
+    for (size_t d = 0; d < segment->number_of_dirs; ++d)
+    {
+        size_t length = (size_t)segment->dirs[d].length;
+        char* path = derrick_internal_Reserve(&batch->name, &batch->name_capacity, length);
+        derrick_internal_DirPath(segment, d, path);
+        dir_matches[d] = derrick_internal_LiteralFind(literal, path, length) != 0;
+    }
+    io_query->dir_matches[i_segment] = dir_matches;
+
+    size_t count = 0;
+    uint32_t* names = derrick_internal_Candidates(segment, literal->text, literal->length, DERRICK_NAME_TRIGRAM, &count);
+    if (names == 0) return;
+    unsigned char* named = calloc(segment->number_of_entries / 8 + 1, 1);
+    for (size_t i = 0; i < count; ++i)
+    {
+        named[names[i] >> 3] |= (unsigned char)(1 << (names[i] & 7));
+    }
+    free(names);
+    io_query->named[i_segment] = named;
+}
+
+int derrick_index_search(DerrickIndex i_index, const char* i_searchfor, Derrick_Parameters io_cb)
+{
+    if (io_cb == 0 || i_index == 0 || i_searchfor == 0) return DERRICK_ERROR;
+
+    // A regular expression is verified by its DFA, the files are selected with its literal
+    struct Derrick_Query_s query;
+    struct Derrick_Regex_s regex;
+    query.regex = 0;
+    query.automaton = 0;
+    derrick_internal_Init();
+    if (io_cb->param_regex)
+    {
+        if (derrick_internal_RegexInit(&regex, i_searchfor, io_cb->param_case_sensitive <= 0) != DERRICK_OK)
+        {
+            return DERRICK_BAD_PATTERN;
+        }
+        query.regex = &regex;
+        i_searchfor = regex.literal ? regex.literal : "";
+    }
+
+    derrick_internal_LiteralInit(&query.literal, i_searchfor, io_cb);
+    query.prefilter = (query.regex == 0 || regex.literal != 0) ? &query.literal : 0;
+    AcquireSRWLockShared(DERRICK_INDEX_LOCK(i_index));
+    derrick_internal_QueryInit(&query, i_index, io_cb);
+    for (size_t s = 0; s < i_index->number_of_segments; ++s)
+    {
+        query.candidates[s] = derrick_internal_Candidates(&i_index->segments[s], i_searchfor, query.literal.length, 0, &query.number_of_candidates[s]);
+    }
+
+    // A literal without separator is either in the path of the directory of a file or in its
+    // name. Any other may span both, and is looked for in the whole paths.
+    if (query.regex == 0 && query.literal.length > 0 && strpbrk(i_searchfor, "\\/") == 0)
+    {
+        query.dir_matches = calloc(i_index->number_of_segments, sizeof(unsigned char*));
+        query.named = calloc(i_index->number_of_segments, sizeof(unsigned char*));
+        for (size_t s = 0; s < i_index->number_of_segments; ++s) derrick_internal_QueryNames(&query, s);
+    }
+    int rc = derrick_internal_QueryRun(&query);
+    ReleaseSRWLockShared(DERRICK_INDEX_LOCK(i_index));
+    derrick_internal_LiteralFree(&query.literal);
+    if (query.regex) derrick_internal_RegexFree(&regex);
+    return rc;
+}
+
+int derrick_index_search_multi(DerrickIndex i_index, const char* const* i_searchfor, size_t i_count, Derrick_Parameters io_cb)
+{
+    if (io_cb == 0 || i_index == 0 || i_searchfor == 0 || i_count == 0) return DERRICK_ERROR;
+
+    derrick_internal_Init();
+    struct Derrick_Query_s query;
+    struct Derrick_Automaton_s automaton;
+    derrick_internal_AutomatonInit(&automaton, i_searchfor, i_count, io_cb->param_case_sensitive <= 0);
+    memset(&query.literal, 0, sizeof(query.literal));
+    query.prefilter = 0;
+    query.regex = 0;
+    query.automaton = &automaton;
+    AcquireSRWLockShared(DERRICK_INDEX_LOCK(i_index));
+    derrick_internal_QueryInit(&query, i_index, io_cb);
+    for (size_t s = 0; s < i_index->number_of_segments; ++s)
+    {
+        query.candidates[s] = derrick_internal_CandidatesAny(&i_index->segments[s], i_searchfor, automaton.lengths, i_count, &query.number_of_candidates[s]);
+    }
+    int rc = derrick_internal_QueryRun(&query);
+    ReleaseSRWLockShared(DERRICK_INDEX_LOCK(i_index));
+    derrick_internal_AutomatonFree(&automaton);
+    return rc;
+}
+
+int derrick_index_find_names(DerrickIndex i_index, const char* i_name, Derrick_Parameters io_cb)
+{
+    if (io_cb == 0 || i_index == 0 || i_name == 0) return DERRICK_ERROR;
+
+    // A regular expression is matched by its DFA, the names are selected with its literal
+    struct Derrick_Regex_s regex;
+    struct Derrick_Dfa_s dfa;
+    int use_regex = io_cb->param_regex;
+    derrick_internal_Init();
+    if (use_regex)
+    {
+        if (derrick_internal_RegexInit(&regex, i_name, io_cb->param_case_sensitive <= 0) != DERRICK_OK)
+        {
+            return DERRICK_BAD_PATTERN;
+        }
+        derrick_internal_DfaInit(&dfa, &regex);
+        i_name = regex.literal ? regex.literal : "";
+    }
+    struct Derrick_Literal_s literal;
+    derrick_internal_LiteralInit(&literal, i_name, io_cb);
+    const struct Derrick_Literal_s* prefilter = (!use_regex || regex.literal != 0) ? &literal : 0;
+
+    struct Derrick_Control_s control;
+    struct Derrick_Batch_s batch;
+    struct Derrick_Stats_s stats;
+    memset(&stats, 0, sizeof(stats));
+    derrick_internal_ControlInit(&control, io_cb);
+    derrick_internal_BatchInit(&batch, io_cb->param_results, io_cb->param_results_size, &control);
+    batch.stats = io_cb->param_stats ? &stats : 0;
+
+    AcquireSRWLockShared(DERRICK_INDEX_LOCK(i_index));
+    for (size_t s = 0; s < i_index->number_of_segments && !derrick_internal_Stopped(&control); ++s)
+    {
+        const struct Derrick_Segment_s* segment = &i_index->segments[s];
+        size_t count = 0;
+        uint32_t* candidates = derrick_internal_Candidates(segment, i_name, literal.length, DERRICK_NAME_TRIGRAM, &count);
+        if (candidates == 0) count = segment->number_of_entries;
+        for (size_t i = 0; i < count && !derrick_internal_Stopped(&control); ++i)
+        {
+            size_t e = candidates ? candidates[i] : i;
+            if (derrick_internal_IsDeleted(segment, e)) continue;
+            const char* name = segment->names + segment->entries[e].name;
+            size_t length = strlen(name);
+            const char* match = use_regex ? derrick_internal_RegexFind(&dfa, prefilter, name, name + length)
+                                          : derrick_internal_LiteralFind(&literal, name, length);
+            if (match == 0) continue;
+            const char* path = derrick_internal_EntryPath(segment, e, &batch.name, &batch.name_capacity);
+            derrick_internal_BatchName(&batch, path, 0, io_cb, 0);
+        }
+        free(candidates);
+    }
+    ReleaseSRWLockShared(DERRICK_INDEX_LOCK(i_index));
+
+    derrick_internal_BatchFree(&batch);
+    if (io_cb->param_stats) derrick_internal_StatsAdd(io_cb->param_stats, &stats);
+    derrick_internal_LiteralFree(&literal);
+    if (use_regex)
+    {
+        derrick_internal_DfaFree(&dfa);
+        derrick_internal_RegexFree(&regex);
+    }
+    return derrick_internal_ControlResult(&control, DERRICK_OK);
+}
+
+void derrick_index_list(DerrickIndex i_index)
+{
+    char* path = 0;
+    size_t path_capacity = 0;
+    AcquireSRWLockShared(DERRICK_INDEX_LOCK(i_index));
+    for (size_t s = 0; s < i_index->number_of_segments; ++s)
+    {
+        const struct Derrick_Segment_s* segment = &i_index->segments[s];
+        for (size_t cur_idx_cnt = 0; cur_idx_cnt < segment->number_of_entries; ++cur_idx_cnt)
+        {
+            if (derrick_internal_IsDeleted(segment, cur_idx_cnt)) continue;
+            const struct Derrick_Entry_s* cur_idx = &segment->entries[cur_idx_cnt];
+            derrick_internal_EntryPath(segment, cur_idx_cnt, &path, &path_capacity);
+#ifdef _MSC_VER
+            printf("%s (%zub)\n", path, (size_t)cur_idx->size);
+#else
+            printf("%s (%ub)\n", path, (size_t)cur_idx->size);
+#endif
+        }
+    }
+    ReleaseSRWLockShared(DERRICK_INDEX_LOCK(i_index));
+    free(path);
+}
+
+void derrick_index_free(DerrickIndex i_index)
+{
+    if (i_index == 0) return;
+    for (size_t s = 0; s < i_index->number_of_segments; ++s)
+    {
+        derrick_internal_SegmentFree(&i_index->segments[s]);
+    }
+    free(i_index->segments);
+    derrick_internal_LookupFree(i_index);
+    derrick_internal_CacheFree(i_index->cache);
+    free(i_index);
+}
+
+void derrick_index_set_cache(DerrickIndex io_index, uint64_t i_budget)
+{
+    if (io_index == 0) return;
+
+    // No search is running, so nothing of the cache is in use
+    AcquireSRWLockExclusive(DERRICK_INDEX_LOCK(io_index));
+    if (i_budget == 0)
+    {
+        derrick_internal_CacheFree(io_index->cache);
+        io_index->cache = 0;
+    }
+    else if (io_index->cache == 0)
+    {
+        struct Derrick_Cache_s* cache = calloc(1, sizeof(struct Derrick_Cache_s));
+        InitializeCriticalSection(&cache->lock);
+        cache->number_of_buckets = 1024;
+        cache->buckets = calloc(cache->number_of_buckets, sizeof(struct Derrick_Cached_s*));
+        cache->budget = i_budget;
+        io_index->cache = cache;
+    }
+    else
+    {
+        io_index->cache->budget = i_budget;
+        derrick_internal_CacheEvict(io_index->cache, 0);
+    }
+    ReleaseSRWLockExclusive(DERRICK_INDEX_LOCK(io_index));
+}
+
+void derrick_internal_PathsAdd(struct Derrick_Paths_s* io_paths, const char* i_path)
+{
+    if (io_paths->count == io_paths->capacity)
+    {
+        io_paths->capacity = io_paths->capacity ? io_paths->capacity * 2 : 64;
+        io_paths->paths = realloc(io_paths->paths, io_paths->capacity * sizeof(char*));
+    }
+    io_paths->paths[io_paths->count++] = _strdup(i_path);
+}
+
+void derrick_internal_PathsFree(struct Derrick_Paths_s* io_paths)
+{
+    for (size_t p = 0; p < io_paths->count; ++p)
+    {
+        free(io_paths->paths[p]);
+    }
+    free(io_paths->paths);
+}
+
+// Bring an index up to date with the files below i_path. The tree is walked and the files new or
+// changed are read under the shared lock of the index, so that the searches go on meanwhile: they
+// only wait while the files gone are deleted and the segment of the new versions is put in.
+int derrick_internal_Refresh(DerrickIndex io_index, const char* i_path)
+{
+    AcquireSRWLockShared(DERRICK_INDEX_LOCK(io_index));
+    if (io_index->lookup == 0)
+    {
+        // The files are found by their names, in a table built once
+        ReleaseSRWLockShared(DERRICK_INDEX_LOCK(io_index));
+        AcquireSRWLockExclusive(DERRICK_INDEX_LOCK(io_index));
+        if (io_index->lookup == 0)
+        {
+            derrick_internal_LookupBuild(io_index, 0);
+        }
+        ReleaseSRWLockExclusive(DERRICK_INDEX_LOCK(io_index));
+        AcquireSRWLockShared(DERRICK_INDEX_LOCK(io_index));
+    }
+
+    struct Derrick_Refresh_s refresh;
+    refresh.index = io_index;
+    derrick_internal_BuilderInit(&refresh.builder, io_index->large_pages);
+    refresh.builder.binary = io_index->binary;
+    size_t number_of_seen = io_index->number_of_segments;
+    refresh.seen = malloc((number_of_seen + 1) * sizeof(unsigned char*));
+    for (size_t s = 0; s < number_of_seen; ++s)
+    {
+        refresh.seen[s] = calloc(io_index->segments[s].number_of_entries / 8 + 1, 1);
+    }
+
+    struct Derrick_Paths_s gone;
+    memset(&gone, 0, sizeof(gone));
+    int rc = derrick_internal_RefreshWalk(i_path, &refresh);
+    if (rc == DERRICK_OK)
+    {
+        // The files that were not seen are gone. They are deleted by their paths, since another
+        // update may change the segments before this one holds the exclusive lock.
+        char* path = 0;
+        size_t path_capacity = 0;
+        for (size_t s = 0; s < number_of_seen; ++s)
+        {
+            const struct Derrick_Segment_s* segment = &io_index->segments[s];
+            for (size_t e = 0; e < segment->number_of_entries; ++e)
+            {
+                if (((refresh.seen[s][e >> 3] >> (e & 7)) & 1) == 0 && !derrick_internal_IsDeleted(segment, e))
+                {
+                    derrick_internal_PathsAdd(&gone, derrick_internal_EntryPath(segment, e, &path, &path_capacity));
+                }
+            }
+        }
+        free(path);
+    }
+    ReleaseSRWLockShared(DERRICK_INDEX_LOCK(io_index));
+    for (size_t s = 0; s < number_of_seen; ++s)
+    {
+        free(refresh.seen[s]);
+    }
+    free(refresh.seen);
+
+    if (rc == DERRICK_OK)
+    {
+        // The new versions of the files go to a new segment, which deletes the previous ones
+        struct Derrick_Segment_s segment;
+        int sealed = 0;
+        if (refresh.builder.number_of_entries > 0)
+        {
+            rc = derrick_internal_Seal(&refresh.builder, &segment);
+            sealed = rc == DERRICK_OK;
+        }
+
+        AcquireSRWLockExclusive(DERRICK_INDEX_LOCK(io_index));
+        for (size_t g = 0; g < gone.count; ++g)
+        {
+            const struct Derrick_LookupSlot_s* slot = derrick_internal_LookupFind(io_index, gone.paths[g]);
+            if (slot != 0)
+            {
+                derrick_internal_Delete(io_index, slot->segment, slot->entry);
+            }
+        }
+        if (sealed)
+        {
+            derrick_internal_AddSegment(io_index, &segment);
+        }
+        derrick_internal_Tidy(io_index);
+        ReleaseSRWLockExclusive(DERRICK_INDEX_LOCK(io_index));
+    }
+
+    derrick_internal_PathsFree(&gone);
+    derrick_internal_BuilderFree(&refresh.builder);
+    return rc;
+}
+
+int derrick_index_refresh(DerrickIndex io_index, const char* i_path)
+{
+    if (io_index == 0 || i_path == 0) return DERRICK_ERROR;
+    return derrick_internal_Refresh(io_index, i_path);
+}
+
+// Write a file under a temporary name next to it, then swap it in at once, so that processes
+// which already opened the previous version keep using it
+int derrick_internal_WriteAtomic(const char* i_file, const void* i_data, uint64_t i_size)
+{
+    char sTemp[2048];
+    sprintf(sTemp, "%s.tmp", i_file);
+
+    HANDLE hFile = CreateFileA(sTemp, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return DERRICK_PATH_NOT_FOUND;
+    }
+
+    const char* cur = (const char*)i_data;
+    uint64_t remaining = i_size;
+    while (remaining > 0)
+    {
+        DWORD chunk = remaining > 0x40000000 ? 0x40000000 : (DWORD)remaining;
+        DWORD written = 0;
+        if (WriteFile(hFile, cur, chunk, &written, NULL) == 0 || written == 0)
+        {
+            CloseHandle(hFile);
+            DeleteFileA(sTemp);
+            return DERRICK_ERROR;
+        }
+        cur += written;
+        remaining -= written;
+    }
+
+    FlushFileBuffers(hFile);
+    CloseHandle(hFile);
+
+    if (MoveFileExA(sTemp, i_file, MOVEFILE_REPLACE_EXISTING) == 0)
+    {
+        DeleteFileA(sTemp);
+        return DERRICK_ERROR;
+    }
+    return DERRICK_OK;
+}
+
+// Map an image written by derrick_internal_WriteAtomic
+int derrick_internal_MapImage(const char* i_file, struct Derrick_IndexHeader_s** o_image)
+{
+    (*o_image) = 0;
+
+    // Sharing delete lets a writer replace the file while it is mapped here
+    HANDLE hFile = CreateFileA(i_file, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return DERRICK_PATH_NOT_FOUND;
+    }
+
+    LARGE_INTEGER this_size;
+    this_size.QuadPart = 0;
+    if (GetFileSizeEx(hFile, &this_size) == 0 || (uint64_t)this_size.QuadPart < sizeof(struct Derrick_IndexHeader_s))
+    {
+        CloseHandle(hFile);
+        return DERRICK_BAD_FORMAT;
+    }
+
+    HANDLE hMapFile = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hFile);
+    if (hMapFile == NULL || hMapFile == INVALID_HANDLE_VALUE)
+    {
+        return DERRICK_ERROR;
+    }
+
+    struct Derrick_IndexHeader_s* image = (struct Derrick_IndexHeader_s*)MapViewOfFile(hMapFile, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hMapFile);
+    if (image == NULL)
+    {
+        return DERRICK_ERROR;
+    }
+
+    // Check the header only: the content is paged in on demand
+    struct Derrick_IndexHeader_s header = *image;
+    header.header_checksum = 0;
+    if (memcmp(image->magic, DERRICK_INDEX_MAGIC, sizeof(DERRICK_INDEX_MAGIC)) != 0
+            || image->version != DERRICK_INDEX_VERSION
+            || image->total_size > (uint64_t)this_size.QuadPart
+            || image->header_checksum != (uint32_t)derrick_internal_Checksum(&header, sizeof(header)))
+    {
+        UnmapViewOfFile(image);
+        return DERRICK_BAD_FORMAT;
+    }
+
+    (*o_image) = image;
+    return DERRICK_OK;
+}
+
+int derrick_index_save(DerrickIndex i_index, const char* i_file)
+{
+    if (i_index == 0 || i_file == 0) return DERRICK_ERROR;
+
+    // A single file holds a single segment
+    AcquireSRWLockExclusive(DERRICK_INDEX_LOCK(i_index));
+    if (i_index->number_of_segments != 1 || i_index->segments[0].number_of_deleted != 0)
+    {
+        derrick_internal_Compact(i_index);
+    }
+    int rc = derrick_internal_WriteAtomic(i_file, i_index->segments[0].image, i_index->segments[0].image->total_size);
+    ReleaseSRWLockExclusive(DERRICK_INDEX_LOCK(i_index));
+    return rc;
+}
+
+int derrick_index_open(DerrickIndex* io_index, const char* i_file)
+{
+    (*io_index) = 0;
+    if (i_file == 0) return DERRICK_ERROR;
+
+    struct Derrick_IndexHeader_s* image;
+    int rc = derrick_internal_MapImage(i_file, &image);
+    if (rc != DERRICK_OK)
+    {
+        return rc;
+    }
+
+    (*io_index) = (struct DerrickIndex_s*)calloc(1, sizeof(struct DerrickIndex_s));
+    (*io_index)->segments = calloc(1, sizeof(struct Derrick_Segment_s));
+    (*io_index)->number_of_segments = 1;
+    derrick_internal_Attach(&(*io_index)->segments[0], image);
+    (*io_index)->segments[0].mapped = 1;
+    (*io_index)->number_of_entries = (*io_index)->segments[0].number_of_entries;
+    return DERRICK_OK;
+}
+
+int derrick_index_verify(DerrickIndex i_index)
+{
+    if (i_index == 0) return DERRICK_ERROR;
+    int rc = DERRICK_OK;
+    AcquireSRWLockShared(DERRICK_INDEX_LOCK(i_index));
+    for (size_t s = 0; s < i_index->number_of_segments && rc == DERRICK_OK; ++s)
+    {
+        const struct Derrick_IndexHeader_s* image = i_index->segments[s].image;
+        if (image->checksum != derrick_internal_Checksum(image + 1, image->total_size - sizeof(struct Derrick_IndexHeader_s)))
+        {
+            rc = DERRICK_BAD_FORMAT;
+        }
+    }
+    ReleaseSRWLockShared(DERRICK_INDEX_LOCK(i_index));
+    return rc;
+}
+
+int derrick_index_build(DerrickIndex* io_index, const char* i_path)
+{
+    struct Derrick_Parameters_s params;
+    derrick_init_parameters(&params);
+    return derrick_index_build_ex(io_index, i_path, &params);
+}
+
+// Allocate an empty index that remembers the parameters of its build
+DerrickIndex derrick_internal_NewIndex(Derrick_Parameters i_cb)
+{
+    DerrickIndex index = (struct DerrickIndex_s*)calloc(1, sizeof(struct DerrickIndex_s));
+    index->large_pages = i_cb->param_large_pages;
+    index->binary = i_cb->param_binary;
+    index->exclude = i_cb->cb_exclude;
+    index->exclude_dir = i_cb->cb_exclude_dir;
+    index->ctx_exclude = i_cb->ctx_exclude;
+    index->filter = i_cb->param_filter;
+    return index;
+}
+
+void derrick_internal_BuilderSetup(struct Derrick_Builder_s* o_builder, Derrick_Parameters i_cb)
+{
+    derrick_internal_BuilderInit(o_builder, i_cb->param_large_pages);
+    if (i_cb->param_stream_size) o_builder->stream_size = i_cb->param_stream_size;
+    o_builder->unbuffered = i_cb->param_unbuffered;
+    o_builder->binary = i_cb->param_binary;
+}
+
+// A part of the tree that a segmented build indexes into a segment of its own
+struct Derrick_Unit_s
+{
+    int recursive;                      // 0 for the files directly in the directory only
+    struct Derrick_Ignore_s* ignore;    // ignore files of the parents of the directory
+    uint32_t file;                      // number of the file of its segment in the store, 0 until written
+    char* path;
+};
+
+// Shared state of a segmented build
+struct Derrick_SegmentedBuild_s
+{
+    Derrick_Parameters params;
+    const char* store;                  // directory of the segment files and of their manifest, 0 for none
+    size_t root_length;                 // length of the path indexed
+    struct Derrick_Unit_s* units;
+    size_t number_of_units;
+    size_t units_capacity;
+    struct Derrick_Segment_s* segments; // per unit, image 0 if the unit has none: not built, or sharing the file of another unit
+    uint32_t next_file;                 // number of the next file written to the store
+    CRITICAL_SECTION lock;              // manifest, and exclude callbacks
+    int rc;
+};
+
+// A directory whose subdirectories are being listed by a segmented build
+struct Derrick_Split_s
+{
+    struct Derrick_SegmentedBuild_s* build;
+    int depth;
+};
+
+void derrick_internal_AddUnit(struct Derrick_SegmentedBuild_s* io_build, const char* i_path, struct Derrick_Ignore_s* i_ignore, int i_recursive)
+{
+    if (io_build->number_of_units == io_build->units_capacity)
+    {
+        io_build->units_capacity = io_build->units_capacity ? io_build->units_capacity * 2 : 64;
+        io_build->units = realloc(io_build->units, io_build->units_capacity * sizeof(struct Derrick_Unit_s));
+    }
+    struct Derrick_Unit_s* unit = &io_build->units[io_build->number_of_units++];
+    unit->recursive = i_recursive;
+    unit->ignore = derrick_internal_IgnoreKeep(i_ignore);
+    unit->file = 0;
+    unit->path = _strdup(i_path);
+}
+
+int derrick_internal_VisitNothing(void* io_context, const char* i_path, const WIN32_FIND_DATAA* i_find)
+{
+    return DERRICK_OK;
+}
+
+int derrick_internal_VisitNoDirectory(void* io_context, const char* i_path, struct Derrick_Ignore_s* i_ignore)
+{
+    return DERRICK_OK;
+}
+
+int derrick_internal_SplitUnits(struct Derrick_SegmentedBuild_s* io_build, const char* i_path, struct Derrick_Ignore_s* i_ignore, int i_depth);
+
+int derrick_internal_VisitSplit(void* io_context, const char* i_path, struct Derrick_Ignore_s* i_ignore)
+{
+    const struct Derrick_Split_s* split = (const struct Derrick_Split_s*)io_context;
+    if (split->depth + 1 < DERRICK_SPLIT_DEPTH)
+    {
+        derrick_internal_SplitUnits(split->build, i_path, i_ignore, split->depth + 1);
+    }
+    else
+    {
+        derrick_internal_AddUnit(split->build, i_path, i_ignore, 1);
+    }
+    return DERRICK_OK;
+}
+
+// Cut a directory into units: its own files, and each of its subdirectories, split in turn
+// down to DERRICK_SPLIT_DEPTH. The units only depend on the tree, so that a build that
+// resumes finds the same ones.
+int derrick_internal_SplitUnits(struct Derrick_SegmentedBuild_s* io_build, const char* i_path, struct Derrick_Ignore_s* i_ignore, int i_depth)
+{
+    struct Derrick_Split_s split;
+    split.build = io_build;
+    split.depth = i_depth;
+
+    struct Derrick_Walk_s walk;
+    derrick_internal_WalkInit(&walk, io_build->params, &derrick_internal_VisitNothing, &split);
+    walk.visit_directory = &derrick_internal_VisitSplit;
+    walk.recursive = 0;
+    walk.root_length = io_build->root_length;
+    walk.ignore = i_ignore;
+    derrick_internal_AddUnit(io_build, i_path, i_ignore, 0);
+    return derrick_internal_Walk(i_path, &walk);
+}
+
+// Append a line to the manifest of the store. A line cut by a failure is ignored when the
+// manifest is read back.
+int derrick_internal_StoreAppend(const char* i_store, const char* i_line)
+{
+    char sManifest[2048];
+    sprintf(sManifest, "%s\\manifest", i_store);
+    HANDLE hFile = CreateFileA(sManifest, FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return DERRICK_PATH_NOT_FOUND;
+    }
+    DWORD written = 0;
+    BOOL ok = WriteFile(hFile, i_line, (DWORD)strlen(i_line), &written, NULL);
+    FlushFileBuffers(hFile);
+    CloseHandle(hFile);
+    return (ok && written == strlen(i_line)) ? DERRICK_OK : DERRICK_ERROR;
+}
+
+// Rewrite the whole manifest, after a merge replaced some segment files
+int derrick_internal_StoreRewrite(const struct Derrick_SegmentedBuild_s* i_build)
+{
+    size_t size = 0;
+    for (size_t u = 0; u < i_build->number_of_units; ++u)
+    {
+        size += strlen(i_build->units[u].path) + 16;
+    }
+    char* manifest = malloc(size + 1);
+    size_t length = 0;
+    for (size_t u = 0; u < i_build->number_of_units; ++u)
+    {
+        const struct Derrick_Unit_s* unit = &i_build->units[u];
+        if (unit->file == 0) continue;
+        length += sprintf(manifest + length, "%u %c %s\n", unit->file, unit->recursive ? 'R' : 'F', unit->path);
+    }
+
+    char sManifest[2048];
+    sprintf(sManifest, "%s\\manifest", i_build->store);
+    int rc = derrick_internal_WriteAtomic(sManifest, manifest, length);
+    free(manifest);
+    return rc;
+}
+
+// Map the segments that the manifest of the store lists for the units found again, and return
+// the number of these units
+size_t derrick_internal_StoreLoad(struct Derrick_SegmentedBuild_s* io_build)
+{
+    char sFile[2048];
+    sprintf(sFile, "%s\\manifest", io_build->store);
+    const char* data = 0;
+    size_t size = 0;
+    size_t loaded = 0;
+    if (derrick_internal_MapFile(sFile, &data, &size, 0, 0) != DERRICK_OK) return 0;
+
+    // Each line is "<file> <R|F> <path>": R for a subtree, F for the files of a directory
+    const char* end = data + size;
+    const char* line = data;
+    const char* eol;
+    while (line < end && (eol = memchr(line, '\n', end - line)) != 0)
+    {
+        unsigned int file = 0;
+        char kind = 0;
+        int consumed = 0;
+        char sLine[2048];
+        size_t length = (size_t)(eol - line) < sizeof(sLine) - 1 ? (size_t)(eol - line) : sizeof(sLine) - 1;
+        memcpy(sLine, line, length);
+        sLine[length] = '\0';
+        line = eol + 1;
+        if (sscanf(sLine, "%u %c %n", &file, &kind, &consumed) != 2 || consumed == 0 || file == 0) continue;
+        if (file >= io_build->next_file) io_build->next_file = file + 1;
+
+        const char* path = sLine + consumed;
+        for (size_t u = 0; u < io_build->number_of_units; ++u)
+        {
+            struct Derrick_Unit_s* unit = &io_build->units[u];
+            if (unit->file != 0 || unit->recursive != (kind == 'R') || strcmp(unit->path, path) != 0) continue;
+
+            // Several units share the file of a merged segment, it is only mapped once
+            int mapped = 0;
+            for (size_t v = 0; v < io_build->number_of_units && !mapped; ++v)
+            {
+                mapped = (io_build->units[v].file == file);
+            }
+            struct Derrick_IndexHeader_s* image;
+            sprintf(sFile, "%s\\%08u.seg", io_build->store, file);
+            if (!mapped && derrick_internal_MapImage(sFile, &image) == DERRICK_OK)
+            {
+                derrick_internal_Attach(&io_build->segments[u], image);
+                io_build->segments[u].mapped = 1;
+                mapped = 1;
+            }
+            if (mapped)
+            {
+                unit->file = file;
+                loaded++;
+            }
+            break;
+        }
+    }
+    derrick_internal_UnmapFile(data);
+    return loaded;
+}
+
+// Write the segment of a unit to the store, then record it in the manifest
+int derrick_internal_StoreAdd(struct Derrick_SegmentedBuild_s* io_build, size_t i_unit)
+{
+    struct Derrick_Unit_s* unit = &io_build->units[i_unit];
+    const struct Derrick_IndexHeader_s* image = io_build->segments[i_unit].image;
+    EnterCriticalSection(&io_build->lock);
+    uint32_t file = io_build->next_file++;
+    LeaveCriticalSection(&io_build->lock);
+
+    char sFile[2048];
+    sprintf(sFile, "%s\\%08u.seg", io_build->store, file);
+    int rc = derrick_internal_WriteAtomic(sFile, image, image->total_size);
+    if (rc == DERRICK_OK)
+    {
+        char* line = malloc(strlen(unit->path) + 16);
+        sprintf(line, "%u %c %s\n", file, unit->recursive ? 'R' : 'F', unit->path);
+        EnterCriticalSection(&io_build->lock);
+        rc = derrick_internal_StoreAppend(io_build->store, line);
+        LeaveCriticalSection(&io_build->lock);
+        free(line);
+    }
+    if (rc == DERRICK_OK) unit->file = file;
+    return rc;
+}
+
+// State of the check of the segments loaded from a store against the tree
+struct Derrick_StoreCheck_s
+{
+    DerrickIndex index;         // the segments loaded, one per file of the store
+    size_t* matched;            // per segment, the entries found unchanged in the tree
+    unsigned char* stale;       // per segment, 1 if a file was added or changed since it was written
+    size_t segment;             // segment of the unit being walked
+};
+
+// Count a file of a unit as unchanged if a loaded segment holds it with the same stamps
+int derrick_internal_VisitStoreCheck(void* io_context, const char* i_path, const WIN32_FIND_DATAA* i_find)
+{
+    struct Derrick_StoreCheck_s* check = (struct Derrick_StoreCheck_s*)io_context;
+    const struct Derrick_LookupSlot_s* slot = derrick_internal_LookupFind(check->index, i_path);
+    if (slot == 0)
+    {
+        check->stale[check->segment] = 1;
+        return DERRICK_OK;
+    }
+    const struct Derrick_Entry_s* entry = &check->index->segments[slot->segment].entries[slot->entry];
+    uint64_t size = ((uint64_t)i_find->nFileSizeHigh << 32) | i_find->nFileSizeLow;
+    uint64_t mtime = ((uint64_t)i_find->ftLastWriteTime.dwHighDateTime << 32) | i_find->ftLastWriteTime.dwLowDateTime;
+    if (entry->size == size && entry->mtime == mtime) check->matched[slot->segment]++;
+    else check->stale[slot->segment] = 1;
+    return DERRICK_OK;
+}
+
+// The segments of the store describe the tree as it was when they were written. Drop those with
+// a file added, changed or removed since, so that their units are indexed again and written back,
+// and return their files in o_stale, to remove once the manifest no longer lists them.
+size_t derrick_internal_StoreCheck(struct Derrick_SegmentedBuild_s* io_build, uint32_t* o_stale)
+{
+    // The loaded segments are looked up as the segments of an index, without being copied
+    DerrickIndex index = derrick_internal_NewIndex(io_build->params);
+    index->segments = malloc((io_build->number_of_units + 1) * sizeof(struct Derrick_Segment_s));
+    size_t* owner = malloc((io_build->number_of_units + 1) * sizeof(size_t));
+    for (size_t u = 0; u < io_build->number_of_units; ++u)
+    {
+        if (io_build->segments[u].image == 0) continue;
+        owner[index->number_of_segments] = u;
+        index->segments[index->number_of_segments++] = io_build->segments[u];
+        index->number_of_entries += io_build->segments[u].number_of_entries;
+    }
+    derrick_internal_LookupBuild(index, 0);
+
+    struct Derrick_StoreCheck_s check;
+    check.index = index;
+    check.matched = calloc(index->number_of_segments + 1, sizeof(size_t));
+    check.stale = calloc(index->number_of_segments + 1, 1);
+    for (size_t u = 0; u < io_build->number_of_units; ++u)
+    {
+        const struct Derrick_Unit_s* unit = &io_build->units[u];
+        if (unit->file == 0) continue;
+        for (check.segment = 0; io_build->units[owner[check.segment]].file != unit->file; ++check.segment);
+
+        struct Derrick_Walk_s walk;
+        derrick_internal_WalkInit(&walk, io_build->params, &derrick_internal_VisitStoreCheck, &check);
+        walk.visit_directory = &derrick_internal_VisitNoDirectory;
+        walk.recursive = unit->recursive;
+        walk.root_length = io_build->root_length;
+        walk.ignore = unit->ignore;
+        walk.lock = &io_build->lock;
+        if (derrick_internal_Walk(unit->path, &walk) != DERRICK_OK) check.stale[check.segment] = 1;
+    }
+
+    // A segment whose units found fewer files than it holds has files removed since
+    size_t number_of_stale = 0;
+    for (size_t s = 0; s < index->number_of_segments; ++s)
+    {
+        if (!check.stale[s] && check.matched[s] == index->segments[s].number_of_entries) continue;
+        uint32_t file = io_build->units[owner[s]].file;
+        o_stale[number_of_stale++] = file;
+        derrick_internal_SegmentFree(&io_build->segments[owner[s]]);
+        for (size_t u = 0; u < io_build->number_of_units; ++u)
+        {
+            if (io_build->units[u].file == file) io_build->units[u].file = 0;
+        }
+    }
+
+    free(check.matched);
+    free(check.stale);
+    free(owner);
+    derrick_internal_LookupFree(index);
+    free(index->segments);
+    free(index);
+    return number_of_stale;
+}
+
+// Index a unit into its segment, and write it to the store if any
+void derrick_internal_BuildUnit(struct Derrick_SegmentedBuild_s* io_build, size_t i_unit)
+{
+    const struct Derrick_Unit_s* unit = &io_build->units[i_unit];
+    struct Derrick_Builder_s builder;
+    derrick_internal_BuilderSetup(&builder, io_build->params);
+
+    // A directory removed since it was listed gives an empty segment
+    struct Derrick_Walk_s walk;
+    derrick_internal_WalkInit(&walk, io_build->params, &derrick_internal_VisitBuild, &builder);
+    walk.visit_directory = &derrick_internal_VisitNoDirectory;
+    walk.recursive = unit->recursive;
+    walk.root_length = io_build->root_length;
+    walk.ignore = unit->ignore;
+    walk.lock = &io_build->lock;
+    derrick_internal_Walk(unit->path, &walk);
+    int rc = derrick_internal_Seal(&builder, &io_build->segments[i_unit]);
+    derrick_internal_BuilderFree(&builder);
+
+    if (rc == DERRICK_OK && io_build->store) rc = derrick_internal_StoreAdd(io_build, i_unit);
+    if (rc != DERRICK_OK)
+    {
+        InterlockedCompareExchange((volatile LONG*)&io_build->rc, DERRICK_ERROR, DERRICK_OK);
+    }
+}
+
+void derrick_internal_UnitTask(struct Derrick_Pool_s* io_pool, int i_worker, void* io_arg)
+{
+    struct Derrick_SegmentedBuild_s* build = (struct Derrick_SegmentedBuild_s*)io_pool->context;
+    derrick_internal_BuildUnit(build, (struct Derrick_Unit_s*)io_arg - build->units);
+}
+
+// First task of a parallel build: one task per unit left to build, which the other threads steal
+void derrick_internal_BuildSplit(struct Derrick_Pool_s* io_pool, int i_worker, void* io_arg)
+{
+    struct Derrick_SegmentedBuild_s* build = (struct Derrick_SegmentedBuild_s*)io_pool->context;
+    for (size_t u = 0; u < build->number_of_units; ++u)
+    {
+        if (build->units[u].file == 0)
+        {
+            derrick_internal_PoolPush(io_pool, i_worker, &derrick_internal_UnitTask, &build->units[u]);
+        }
+    }
+}
+
+// Merge the smallest segments of a new index. With a store, the merged segment replaces their
+// files: it is written first, then the manifest, and the old files are removed last.
+void derrick_internal_BuildMerge(struct Derrick_SegmentedBuild_s* io_build, DerrickIndex io_index, uint32_t* io_files)
+{
+    unsigned char* selected = malloc(io_index->number_of_segments + 1);
+    if (derrick_internal_SelectSmallest(io_index, DERRICK_MAX_SEGMENTS, selected) == 0)
+    {
+        free(selected);
+        return;
+    }
+
+    size_t number_of_segments = io_index->number_of_segments;
+    size_t position = derrick_internal_Merge(io_index, selected);
+    if (position == DERRICK_EMPTY_SLOT)
+    {
+        free(selected);
+        return;
+    }
+    uint32_t* merged_files = malloc((number_of_segments + 1) * sizeof(uint32_t));
+    size_t number_of_merged = 0;
+    size_t kept = 0;
+    for (size_t s = 0; s < number_of_segments; ++s)
+    {
+        if (selected[s]) merged_files[number_of_merged++] = io_files[s];
+        else io_files[kept++] = io_files[s];
+    }
+    memmove(io_files + position + 1, io_files + position, (kept - position) * sizeof(uint32_t));
+    io_files[position] = 0;
+
+    char sFile[2048];
+    const struct Derrick_IndexHeader_s* image = io_index->segments[position].image;
+    uint32_t file = io_build->next_file;
+    if (io_build->store)
+    {
+        sprintf(sFile, "%s\\%08u.seg", io_build->store, file);
+    }
+    if (io_build->store && derrick_internal_WriteAtomic(sFile, image, image->total_size) == DERRICK_OK)
+    {
+        io_build->next_file++;
+        io_files[position] = file;
+        for (size_t u = 0; u < io_build->number_of_units; ++u)
+        {
+            for (size_t m = 0; m < number_of_merged; ++m)
+            {
+                if (io_build->units[u].file == merged_files[m]) io_build->units[u].file = file;
+            }
+        }
+        if (derrick_internal_StoreRewrite(io_build) == DERRICK_OK)
+        {
+            for (size_t m = 0; m < number_of_merged; ++m)
+            {
+                sprintf(sFile, "%s\\%08u.seg", io_build->store, merged_files[m]);
+                DeleteFileA(sFile);
+            }
+        }
+    }
+    free(merged_files);
+    free(selected);
+}
+
+int derrick_internal_BuildSegments(DerrickIndex* io_index, const char* i_path, const char* i_store, Derrick_Parameters io_cb)
+{
+    (*io_index) = 0;
+    if (i_path == 0 || io_cb == 0) return DERRICK_ERROR;
+
+    struct Derrick_SegmentedBuild_s build;
+    memset(&build, 0, sizeof(build));
+    build.params = io_cb;
+    build.store = i_store;
+    build.root_length = strlen(i_path);
+    build.next_file = 1;
+    build.rc = DERRICK_OK;
+    InitializeCriticalSection(&build.lock);
+    if (i_store) CreateDirectoryA(i_store, NULL);
+
+    uint32_t* stale = 0;
+    size_t number_of_stale = 0;
+    int rc = derrick_internal_SplitUnits(&build, i_path, 0, 0);
+    if (rc == DERRICK_OK)
+    {
+        build.segments = calloc(build.number_of_units, sizeof(struct Derrick_Segment_s));
+        if (i_store && derrick_internal_StoreLoad(&build) > 0)
+        {
+            stale = malloc((build.number_of_units + 1) * sizeof(uint32_t));
+            number_of_stale = derrick_internal_StoreCheck(&build, stale);
+        }
+
+        int threads = derrick_internal_NumberOfThreads(io_cb->param_threads);
+        if (threads <= 1)
+        {
+            for (size_t u = 0; u < build.number_of_units; ++u)
+            {
+                if (build.units[u].file == 0) derrick_internal_BuildUnit(&build, u);
+            }
+        }
+        else
+        {
+            derrick_internal_PoolRun(threads, &build, &derrick_internal_BuildSplit, 0);
+        }
+        rc = build.rc;
+    }
+
+    // The files of the stale segments are removed once the manifest lists the new ones instead
+    if (rc == DERRICK_OK && number_of_stale > 0 && derrick_internal_StoreRewrite(&build) == DERRICK_OK)
+    {
+        char sFile[2048];
+        for (size_t s = 0; s < number_of_stale; ++s)
+        {
+            sprintf(sFile, "%s\\%08u.seg", i_store, stale[s]);
+            DeleteFileA(sFile);
+        }
+    }
+    free(stale);
+
+    if (rc == DERRICK_OK)
+    {
+        // The segments keep the order of the units, the empty ones are left out
+        DerrickIndex index = derrick_internal_NewIndex(io_cb);
+        index->segments = malloc((build.number_of_units + 1) * sizeof(struct Derrick_Segment_s));
+        uint32_t* files = malloc((build.number_of_units + 1) * sizeof(uint32_t));
+        for (size_t u = 0; u < build.number_of_units; ++u)
+        {
+            struct Derrick_Segment_s* segment = &build.segments[u];
+            if (segment->image == 0) continue;
+            if (segment->number_of_entries == 0)
+            {
+                derrick_internal_SegmentFree(segment);
+                continue;
+            }
+            files[index->number_of_segments] = build.units[u].file;
+            index->segments[index->number_of_segments++] = (*segment);
+            index->number_of_entries += segment->number_of_entries;
+        }
+
+        // Many small segments slow the searches down
+        derrick_internal_BuildMerge(&build, index, files);
+        free(files);
+        (*io_index) = index;
+    }
+    else if (build.segments)
+    {
+        for (size_t u = 0; u < build.number_of_units; ++u)
+        {
+            if (build.segments[u].image) derrick_internal_SegmentFree(&build.segments[u]);
+        }
+    }
+
+    for (size_t u = 0; u < build.number_of_units; ++u)
+    {
+        derrick_internal_IgnoreRelease(build.units[u].ignore);
+        free(build.units[u].path);
+    }
+    free(build.units);
+    free(build.segments);
+    DeleteCriticalSection(&build.lock);
+    return rc;
+}
+
+int derrick_index_build_ex(DerrickIndex* io_index, const char* i_path, Derrick_Parameters io_cb)
+{
+    (*io_index) = 0;
+
+    // Several threads index the subdirectories into segments of their own
+    if (derrick_internal_NumberOfThreads(io_cb->param_threads) > 1)
+    {
+        return derrick_internal_BuildSegments(io_index, i_path, 0, io_cb);
+    }
+
+    // Single pass: every file is read once, entries and posting lists grow chunk by chunk
+    struct Derrick_Builder_s builder;
+    derrick_internal_BuilderSetup(&builder, io_cb);
+    int rc = derrick_internal_FillBuffer(i_path, &builder, io_cb);
+    if (rc != DERRICK_OK)
+    {
+        derrick_internal_BuilderFree(&builder);
+        return rc;
+    }
+
+    struct Derrick_Segment_s segment;
+    rc = derrick_internal_Seal(&builder, &segment);
+    derrick_internal_BuilderFree(&builder);
+    if (rc != DERRICK_OK) return rc;
+
+    // Allocate base structure
+    (*io_index) = derrick_internal_NewIndex(io_cb);
+    (*io_index)->segments = calloc(1, sizeof(struct Derrick_Segment_s));
+    (*io_index)->number_of_segments = 1;
+    (*io_index)->segments[0] = segment;
+    (*io_index)->number_of_entries = segment.number_of_entries;
+    return DERRICK_OK;
+}
+
+int derrick_index_build_segments(DerrickIndex* io_index, const char* i_path, const char* i_store, Derrick_Parameters io_cb)
+{
+    if (io_index == 0) return DERRICK_ERROR;
+    if (i_store == 0)
+    {
+        (*io_index) = 0;
+        return DERRICK_ERROR;
+    }
+    return derrick_internal_BuildSegments(io_index, i_path, i_store, io_cb);
+}
+
+void derrick_index_merge(DerrickIndex io_index, size_t i_max_segments)
+{
+    if (io_index == 0) return;
+    AcquireSRWLockExclusive(DERRICK_INDEX_LOCK(io_index));
+    derrick_internal_MergeSmallest(io_index, i_max_segments);
+    ReleaseSRWLockExclusive(DERRICK_INDEX_LOCK(io_index));
+}
+
+// A file or directory named by a change notification
+struct Derrick_Change_s
+{
+    int added;          // created or moved into the tree: a directory is indexed with all it contains
+    char path[1];
+};
+
+// Watcher keeping an index up to date
+struct Derrick_Watch_s
+{
+    DerrickIndex index;
+    char* root;
+    size_t root_length;
+    uint32_t delay;                     // milliseconds without notifications before they are applied
+    HANDLE directory;
+    HANDLE thread;
+    HANDLE stop;                        // set by derrick_watch_stop
+    OVERLAPPED overlapped;
+    DWORD* buffer;                      // notifications, aligned on a DWORD as they must be
+    struct Derrick_Change_s** changes;  // since the last update
+    size_t number_of_changes;
+    size_t changes_capacity;
+    int overflow;                       // notifications were lost, the whole tree is refreshed
+};
+
+// What an update does to the index: the paths gone, and the segment of the new versions
+struct Derrick_Update_s
+{
+    struct Derrick_Watch_s* watch;
+    struct Derrick_Builder_s builder;   // files added or changed
+    struct Derrick_Paths_s removed;     // files and directories
+    struct Derrick_Paths_s walked;      // directories added with all they contain
+};
+
+// 1 if the exclusions of the index leave out a path below the root, or one of its directories.
+// The ignore files are read on the way, as a walk from the root would do; if the path is not
+// excluded and o_ignore is set, it receives those of its directory.
+int derrick_internal_WatchExcluded(const struct Derrick_Watch_s* i_watch, const char* i_path, int i_directory, struct Derrick_Ignore_s** o_ignore)
 {
-    const char* start = i_where;
-    char c = *start;
-    while (c != 0 && c != '\n' && c != '\r')
+    DerrickIndex index = i_watch->index;
+    size_t length = strlen(i_path);
+    char* path = malloc(length + DERRICK_WALK_ROOM + 1);
+    memcpy(path, i_path, i_watch->root_length);
+    struct Derrick_Ignore_s* ignore = derrick_internal_IgnoreEnter(index->filter, 0, path, i_watch->root_length);
+
+    int excluded = 0;
+    size_t name = i_watch->root_length + 1;
+    for (size_t i = name; i <= length && !excluded; ++i)
+    {
+        if (i_path[i] != '\\' && i_path[i] != '\0') continue;
+        int directory = (i_path[i] != '\0') || i_directory;
+        memcpy(path, i_path, i);
+        path[i] = '\0';
+        if (index->filter && derrick_internal_FilterExcludes(index->filter, ignore, path, i_watch->root_length, name, directory))
+        {
+            excluded = 1;
+        }
+        derrick_cb_exclude_t exclude = directory ? index->exclude_dir : index->exclude;
+        if (!excluded && exclude && exclude(index->ctx_exclude, path) == 1)
+        {
+            excluded = 1;
+        }
+        if (!excluded && i_path[i] != '\0')
+        {
+            struct Derrick_Ignore_s* parent = ignore;
+            ignore = derrick_internal_IgnoreEnter(index->filter, parent, path, i);
+            derrick_internal_IgnoreRelease(parent);
+        }
+        name = i + 1;
+    }
+    if (o_ignore && !excluded)
     {
-        start--;
-        c = *(start);
+        (*o_ignore) = derrick_internal_IgnoreKeep(ignore);
     }
-    start++;
+    derrick_internal_IgnoreRelease(ignore);
+    free(path);
+    return excluded;
+}
 
-    const char* end = i_where;
-    c = *end;
-    while (c != 0 && c != '\n' && c != '\r')
+// 1 if the i_length first bytes of i_name are one of the paths
+int derrick_internal_PathsHas(const struct Derrick_Paths_s* i_paths, const char* i_name, size_t i_length)
+{
+    size_t low = 0;
+    size_t high = i_paths->count;
+    while (low < high)
     {
-        end++;
-        c = *(end);
+        size_t mid = low + (high - low) / 2;
+        const char* path = i_paths->paths[mid];
+        int c = strncmp(path, i_name, i_length);
+        if (c == 0 && path[i_length] != '\0') c = 1;
+        if (c < 0) low = mid + 1;
+        else high = mid;
     }
-    end--;
-
-    size_t length = end - start + 1;
-    char* result = malloc(sizeof(char)*(length + 1));
-    strncpy(result, start, length);
-    result[length] = 0;
-    return result;
+    return low < i_paths->count && strncmp(i_paths->paths[low], i_name, i_length) == 0 && i_paths->paths[low][i_length] == '\0';
 }
 
-int derrick_internal_CalculateBufferSize(const char *sDir, LARGE_INTEGER* total_size, size_t* o_number_of_entries)
+// 1 if one of the directories of a path is among the paths
+int derrick_internal_PathsHasParent(const struct Derrick_Paths_s* i_paths, const char* i_name, size_t i_root)
 {
-    WIN32_FIND_DATAA fdFile;
-    HANDLE hFind = NULL;
-
-    char sPath[2048];
-
-    //Specify a file mask. *.* = We want everything!
-    sprintf(sPath, "%s\\*.*", sDir);
-
-    if((hFind = FindFirstFileA(sPath, (LPWIN32_FIND_DATAA)&fdFile)) == INVALID_HANDLE_VALUE)
+    if (i_paths->count == 0) return 0;
+    for (size_t i = 0; i_name[i] != '\0'; ++i)
     {
-        return DERRICK_PATH_NOT_FOUND;
+        if (i_name[i] == '\\' && i > i_root && derrick_internal_PathsHas(i_paths, i_name, i))
+        {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    do
+// Read a file again if it is new or changed. Its previous version is deleted when the new one is put in.
+int derrick_internal_VisitUpdate(void* io_context, const char* i_path, const WIN32_FIND_DATAA* i_find)
+{
+    struct Derrick_Update_s* update = (struct Derrick_Update_s*)io_context;
+    DerrickIndex index = update->watch->index;
+    const struct Derrick_LookupSlot_s* slot = derrick_internal_LookupFind(index, i_path);
+    if (slot != 0)
     {
-        //Find first file will always return "."
-        //    and ".." as the first two directories.
-        if(strcmp(fdFile.cFileName, ".") != 0
-                && strcmp(fdFile.cFileName, "..") != 0)
+        const struct Derrick_Entry_s* entry = &index->segments[slot->segment].entries[slot->entry];
+        uint64_t size = ((uint64_t)i_find->nFileSizeHigh << 32) | i_find->nFileSizeLow;
+        uint64_t mtime = ((uint64_t)i_find->ftLastWriteTime.dwHighDateTime << 32) | i_find->ftLastWriteTime.dwLowDateTime;
+        if (entry->size == size && entry->mtime == mtime)
         {
-            //Build up our file path using the passed in
-            //  [sDir] and the file/foldername we just found:
-            sprintf(sPath, "%s\\%s", sDir, fdFile.cFileName);
-
-            //Is the entity a File or Folder?
-            if(fdFile.dwFileAttributes &FILE_ATTRIBUTE_DIRECTORY)
-            {
-                derrick_internal_CalculateBufferSize(sPath, total_size, o_number_of_entries); //Recursion, I love it!
-            }
-            else
-            {
-                HANDLE hFile = CreateFileA(sPath,           // name of the file
-                                   GENERIC_READ,           // open for reading
-                                   0,                      // do not share
-                                   NULL,                   // default security
-                                   OPEN_EXISTING,          // create new file only
-                                   FILE_ATTRIBUTE_NORMAL,  // normal file
-                                   NULL);                  // no attr. template
-                LARGE_INTEGER this_size;
-                this_size.QuadPart = 0;
-                if (GetFileSizeEx(hFile, &this_size) == 0)
-                { 
-                    return DERRICK_ERROR;
-                }
-
-                CloseHandle(hFile);
-                total_size->QuadPart += this_size.QuadPart + sizeof(struct Derrick_EntryHeader_s) + strlen(sPath) + 1;
-                (*o_number_of_entries)++;
-            }
+            return DERRICK_OK;
         }
     }
-    while(FindNextFileA(hFind, &fdFile)); //Find the next file.
-
-    FindClose(hFind); //Always, Always, clean things up!
-
+    derrick_internal_AddFile(&update->builder, i_path, i_find);
     return DERRICK_OK;
 }
 
-int derrick_internal_FillBuffer(const char *sDir, size_t* offset, DerrickIndex io_index)
+// Look at the path of a change as it is now. The changes come in order, so those below a
+// directory added come after it.
+void derrick_internal_UpdateChange(struct Derrick_Update_s* io_update, const struct Derrick_Change_s* i_change)
 {
-    if (sDir == 0 || io_index == 0) return DERRICK_ERROR;
-
-    WIN32_FIND_DATAA fdFile;
-    HANDLE hFind = NULL;
+    const struct Derrick_Watch_s* watch = io_update->watch;
+    if (derrick_internal_PathsHasParent(&io_update->walked, i_change->path, watch->root_length)) return;
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (GetFileAttributesExA(i_change->path, GetFileExInfoStandard, &data) == 0)
+    {
+        // Removed or moved away: a file, or a directory and all it contained
+        derrick_internal_PathsAdd(&io_update->removed, i_change->path);
+        return;
+    }
 
-    char sPath[2048];
+    int directory = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    if (directory && !i_change->added) return;  // a file inside changed, it has a notification of its own
+    struct Derrick_Ignore_s* ignore = 0;
+    if (derrick_internal_WatchExcluded(watch, i_change->path, directory, &ignore)) return;
+    if (directory)
+    {
+        struct Derrick_Walk_s walk;
+        derrick_internal_WalkInit(&walk, 0, &derrick_internal_VisitUpdate, io_update);
+        walk.exclude = watch->index->exclude;
+        walk.exclude_dir = watch->index->exclude_dir;
+        walk.ctx_exclude = watch->index->ctx_exclude;
+        walk.filter = watch->index->filter;
+        walk.root_length = watch->root_length;
+        walk.ignore = ignore;
+        derrick_internal_Walk(i_change->path, &walk);
+        derrick_internal_PathsAdd(&io_update->walked, i_change->path);
+    }
+    else
+    {
+        WIN32_FIND_DATAA find;
+        memset(&find, 0, sizeof(find));
+        find.dwFileAttributes = data.dwFileAttributes;
+        find.ftLastWriteTime = data.ftLastWriteTime;
+        find.nFileSizeHigh = data.nFileSizeHigh;
+        find.nFileSizeLow = data.nFileSizeLow;
+        derrick_internal_VisitUpdate(io_update, i_change->path, &find);
+    }
+    derrick_internal_IgnoreRelease(ignore);
+}
 
-    //Specify a file mask. *.* = We want everything!
-    sprintf(sPath, "%s\\*.*", sDir);
+int derrick_internal_CompareChanges(const void* i_a, const void* i_b)
+{
+    return strcmp((*(const struct Derrick_Change_s* const*)i_a)->path, (*(const struct Derrick_Change_s* const*)i_b)->path);
+}
 
-    if((hFind = FindFirstFileA(sPath, &fdFile)) == INVALID_HANDLE_VALUE)
+// Apply the changes notified since the last update. The files are read while the index is
+// still searched; the searches only wait while the result is put in.
+void derrick_internal_WatchApply(struct Derrick_Watch_s* io_watch)
+{
+    DerrickIndex index = io_watch->index;
+    if (io_watch->overflow)
     {
-        return DERRICK_PATH_NOT_FOUND;
+        derrick_internal_Refresh(index, io_watch->root);
     }
-
-    do
+    else
     {
-        //Find first file will always return "."
-        //    and ".." as the first two directories.
-        if(strcmp(fdFile.cFileName, ".") != 0
-                && strcmp(fdFile.cFileName, "..") != 0)
+        // A path changed several times is looked at once
+        qsort(io_watch->changes, io_watch->number_of_changes, sizeof(struct Derrick_Change_s*), &derrick_internal_CompareChanges);
+        struct Derrick_Update_s update;
+        memset(&update, 0, sizeof(update));
+        update.watch = io_watch;
+        derrick_internal_BuilderInit(&update.builder, index->large_pages);
+        update.builder.binary = index->binary;
+
+        AcquireSRWLockShared(DERRICK_INDEX_LOCK(index));
+        for (size_t c = 0; c < io_watch->number_of_changes; ++c)
         {
-            //Build up our file path using the passed in
-            //  [sDir] and the file/foldername we just found:
-            sprintf(sPath, "%s\\%s", sDir, fdFile.cFileName);
+            struct Derrick_Change_s* change = io_watch->changes[c];
+            while (c + 1 < io_watch->number_of_changes && strcmp(io_watch->changes[c + 1]->path, change->path) == 0)
+            {
+                change->added |= io_watch->changes[++c]->added;
+            }
+            derrick_internal_UpdateChange(&update, change);
+        }
+        ReleaseSRWLockShared(DERRICK_INDEX_LOCK(index));
+
+        // Without memory for the segment, the files created or changed are left as they were
+        struct Derrick_Segment_s segment;
+        int sealed = update.builder.number_of_entries > 0 && derrick_internal_Seal(&update.builder, &segment) == DERRICK_OK;
 
-            //Is the entity a File or Folder?
-            if(fdFile.dwFileAttributes &FILE_ATTRIBUTE_DIRECTORY)
+        AcquireSRWLockExclusive(DERRICK_INDEX_LOCK(index));
+        size_t number_of_directories = 0;
+        for (size_t r = 0; r < update.removed.count; ++r)
+        {
+            const struct Derrick_LookupSlot_s* slot = derrick_internal_LookupFind(index, update.removed.paths[r]);
+            if (slot != 0)
             {
-                derrick_internal_FillBuffer(sPath, offset, io_index);
+                derrick_internal_Delete(index, slot->segment, slot->entry);
             }
             else
             {
-                HANDLE hFile = CreateFileA(sPath,           // name of the write
-                                   GENERIC_READ,           // open for writing
-                                   0,                      // do not share
-                                   NULL,                   // default security
-                                   OPEN_EXISTING,          // create new file only
-                                   0,  // normal file
-                                   0);                  // no attr. template
-
-                LARGE_INTEGER this_size;
-                this_size.QuadPart = 0;
-                if (GetFileSizeEx(hFile, &this_size) == 0)
-                {
-                    return DERRICK_ERROR;
-                }
-
-                HANDLE hMapFile = CreateFileMapping(
-                    hFile,
-                    NULL,                    // default security
-                    PAGE_READONLY,          // read/write access
-                    0,                       // max. object size
-                    0,                // buffer size
-                    NULL);                 // name of mapping object
-
-                if (hMapFile == NULL || hMapFile == INVALID_HANDLE_VALUE)
+                number_of_directories++;
+            }
+        }
+        if (number_of_directories > 0)
+        {
+            // The files below a directory that is gone: one pass looks for all the directories at
+            // once, in the path of each directory of the index rather than of each file
+            for (size_t s = 0; s < index->number_of_segments; ++s)
+            {
+                const struct Derrick_Segment_s* segment = &index->segments[s];
+                unsigned char* gone = malloc(segment->number_of_dirs + 1);
+                for (size_t d = 0; d < segment->number_of_dirs; ++d)
                 {
-                    return DERRICK_ERROR;
+                    size_t length = (size_t)segment->dirs[d].length;
+                    char* path = derrick_internal_Reserve(&index->lookup->path, &index->lookup->path_capacity, length + 1);
+                    derrick_internal_DirPath(segment, d, path);
+                    path[length] = '\0';
+                    gone[d] = (unsigned char)derrick_internal_PathsHasParent(&update.removed, path, io_watch->root_length);
                 }
-
-                LPCTSTR pBuf = (LPTSTR) MapViewOfFile(hMapFile,   // handle to map object
-                    FILE_MAP_READ, // read/write permission
-                    0,
-                    0,
-                    0);
-
-                if (pBuf == NULL)
+                for (size_t e = 0; e < segment->number_of_entries; ++e)
                 {
-                    return DERRICK_ERROR;
+                    if (segment->entries[e].dir != DERRICK_NO_DIR && gone[segment->entries[e].dir])
+                    {
+                        derrick_internal_Delete(index, s, e);
+                    }
                 }
-
-                struct Derrick_EntryHeader_s* header = (struct Derrick_EntryHeader_s*)((BYTEP*)(io_index->index) + (*offset));
-                header->size = this_size.QuadPart;
-                strcpy(header->name, sPath);
-                header->name[strlen(sPath)] = 0;
-                size_t header_offset = sizeof(struct Derrick_EntryHeader_s) + strlen(sPath) + 1;
-                CopyMemory((PVOID)((BYTEP*)(io_index->index) + (*offset) + header_offset), pBuf, this_size.QuadPart);
-                (*offset) += this_size.QuadPart + header_offset;
-                (io_index->number_of_entries)++;
-
-
-                UnmapViewOfFile(pBuf);
-                CloseHandle(hFile);
+                free(gone);
             }
         }
-    }
-    while(FindNextFileA(hFind, &fdFile)); //Find the next file.
+        if (sealed)
+        {
+            derrick_internal_AddSegment(index, &segment);
+        }
+        derrick_internal_Tidy(index);
+        ReleaseSRWLockExclusive(DERRICK_INDEX_LOCK(index));
 
-    FindClose(hFind); //Always, Always, clean things up!
+        derrick_internal_PathsFree(&update.removed);
+        derrick_internal_PathsFree(&update.walked);
+        derrick_internal_BuilderFree(&update.builder);
+    }
 
-    return DERRICK_OK;
+    for (size_t c = 0; c < io_watch->number_of_changes; ++c)
+    {
+        free(io_watch->changes[c]);
+    }
+    io_watch->number_of_changes = 0;
+    io_watch->overflow = 0;
 }
 
-char* Entry_File(struct Derrick_EntryHeader_s* i_header)
+// Wait for the next notifications
+int derrick_internal_WatchListen(struct Derrick_Watch_s* io_watch)
 {
-    // Jump to end of current descriptor
-    return (char*)((BYTEP*)i_header + sizeof(struct Derrick_EntryHeader_s) + strlen(i_header->name) + 1);
+    DWORD filter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+    ResetEvent(io_watch->overlapped.hEvent);
+    return ReadDirectoryChangesW(io_watch->directory, io_watch->buffer, DERRICK_WATCH_BUFFER, TRUE, filter, NULL, &io_watch->overlapped, NULL) != 0;
 }
 
-struct Derrick_EntryHeader_s* Entry_Next(struct Derrick_EntryHeader_s* i_header)
+// Record the paths named by a buffer of notifications
+void derrick_internal_WatchCollect(struct Derrick_Watch_s* io_watch)
 {
-    // Jump to next entry descriptor
-    return (struct Derrick_EntryHeader_s*)((BYTEP*)(Entry_File(i_header)) + i_header->size);
+    const unsigned char* cur = (const unsigned char*)io_watch->buffer;
+    for (;;)
+    {
+        const FILE_NOTIFY_INFORMATION* notification = (const FILE_NOTIFY_INFORMATION*)cur;
+        char sName[MAX_PATH * 4];
+        int length = WideCharToMultiByte(CP_ACP, 0, notification->FileName, (int)(notification->FileNameLength / sizeof(WCHAR)),
+                                         sName, sizeof(sName) - 1, NULL, NULL);
+        if (length > 0)
+        {
+            if (io_watch->number_of_changes == io_watch->changes_capacity)
+            {
+                io_watch->changes_capacity = io_watch->changes_capacity ? io_watch->changes_capacity * 2 : 256;
+                io_watch->changes = realloc(io_watch->changes, io_watch->changes_capacity * sizeof(struct Derrick_Change_s*));
+            }
+            struct Derrick_Change_s* change = malloc(sizeof(struct Derrick_Change_s) + io_watch->root_length + 1 + length);
+            change->added = (notification->Action == FILE_ACTION_ADDED || notification->Action == FILE_ACTION_RENAMED_NEW_NAME);
+            memcpy(change->path, io_watch->root, io_watch->root_length);
+            change->path[io_watch->root_length] = '\\';
+            memcpy(change->path + io_watch->root_length + 1, sName, length);
+            change->path[io_watch->root_length + 1 + length] = '\0';
+            io_watch->changes[io_watch->number_of_changes++] = change;
+        }
+        if (notification->NextEntryOffset == 0) break;
+        cur += notification->NextEntryOffset;
+    }
 }
 
-void derrick_index_search(DerrickIndex i_index, const char* i_searchfor, Derrick_Parameters io_cb)
+DWORD WINAPI derrick_internal_WatchThread(LPVOID io_arg)
 {
-    if (io_cb == 0 || i_index == 0 || i_searchfor == 0) return;
-
-    size_t cur_idx_cnt = 0;
-    struct Derrick_EntryHeader_s* cur_idx = i_index->index;
-
-    while (cur_idx_cnt < i_index->number_of_entries)
+    struct Derrick_Watch_s* watch = (struct Derrick_Watch_s*)io_arg;
+    HANDLE events[2] = { watch->stop, watch->overlapped.hEvent };
+    int listening = derrick_internal_WatchListen(watch);
+    ULONGLONG first = 0;    // first notification not applied yet
+    ULONGLONG last = 0;     // last one
+    for (;;)
     {
-        // Check for substring
-        char* where = 0;
-        if(strstr(cur_idx->name, i_searchfor) !=0)
+        // Apply once the notifications stop coming, or when they have waited too long
+        DWORD timeout = INFINITE;
+        if (watch->number_of_changes > 0 || watch->overflow)
         {
-            io_cb->cd_found(io_cb->ctx_found, cur_idx->name, 0);
+            ULONGLONG now = GetTickCount64();
+            ULONGLONG due = last + watch->delay;
+            if (due > first + (ULONGLONG)watch->delay * DERRICK_WATCH_LATENCY) due = first + (ULONGLONG)watch->delay * DERRICK_WATCH_LATENCY;
+            timeout = due > now ? (DWORD)(due - now) : 0;
         }
-        else
-        if ((where = strstr(Entry_File(cur_idx), i_searchfor)) != 0)
+        DWORD wait = WaitForMultipleObjects(listening ? 2 : 1, events, FALSE, timeout);
+        if (wait == WAIT_OBJECT_0)
         {
-            if (io_cb->cd_found)
+            break;
+        }
+        if (wait == WAIT_OBJECT_0 + 1)
+        {
+            // No data means that the buffer was too small for all the notifications
+            DWORD bytes = 0;
+            if (GetOverlappedResult(watch->directory, &watch->overlapped, &bytes, FALSE) && bytes > 0)
+            {
+                derrick_internal_WatchCollect(watch);
+            }
+            else
             {
-                char* line = derrick_internal_find_line(where);
-                io_cb->cd_found(io_cb->ctx_found, cur_idx->name, line);
-                free(line);
+                watch->overflow = 1;
             }
+            last = GetTickCount64();
+            if (first == 0) first = last;
+            listening = derrick_internal_WatchListen(watch);
+            continue;
         }
-        cur_idx = Entry_Next(cur_idx);
-        cur_idx_cnt++;
+        derrick_internal_WatchApply(watch);
+        first = 0;
     }
-}
 
-void derrick_index_list(DerrickIndex i_index)
-{
-    size_t cur_idx_cnt = 0;
-    struct Derrick_EntryHeader_s* cur_idx = (struct Derrick_EntryHeader_s*)(i_index->index);
-    while (cur_idx_cnt < i_index->number_of_entries)
+    if (listening)
     {
-#ifdef _MSC_VER
-        printf("%s (%zub)\n", cur_idx->name, cur_idx->size);
-#else
-        printf("%s (%ub)\n", cur_idx->name, cur_idx->size);
-#endif
-        cur_idx = Entry_Next(cur_idx);
-        cur_idx_cnt++;
+        DWORD bytes = 0;
+        CancelIo(watch->directory);
+        GetOverlappedResult(watch->directory, &watch->overlapped, &bytes, TRUE);
     }
+    return 0;
 }
 
-int derrick_index_build(DerrickIndex* io_index, const char* i_path)
+int derrick_watch_start(DerrickWatch* o_watch, DerrickIndex io_index, const char* i_path, uint32_t i_delay)
 {
-    // Allocate base structure
-    (*io_index) = (struct DerrickIndex_s*)malloc(sizeof(struct DerrickIndex_s));
-    (*io_index)->number_of_entries = 0;
+    (*o_watch) = 0;
+    if (io_index == 0 || i_path == 0) return DERRICK_ERROR;
 
-    LARGE_INTEGER total_size;
-    total_size.QuadPart= 0;
-    size_t found_entries = 0;
-    int rc = derrick_internal_CalculateBufferSize(i_path, &total_size, &found_entries);
-    if (rc != DERRICK_OK) return rc;
-    (*io_index)->index = malloc(total_size.QuadPart);
-    size_t offset = 0;
-    derrick_internal_FillBuffer(i_path, &offset, *io_index);
+    HANDLE hDirectory = CreateFileA(i_path, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                                    OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    if (hDirectory == INVALID_HANDLE_VALUE)
+    {
+        return DERRICK_PATH_NOT_FOUND;
+    }
+
+    // The updates find the entries of the files by their names
+    AcquireSRWLockExclusive(DERRICK_INDEX_LOCK(io_index));
+    if (io_index->lookup == 0)
+    {
+        derrick_internal_LookupBuild(io_index, 0);
+    }
+    ReleaseSRWLockExclusive(DERRICK_INDEX_LOCK(io_index));
 
+    struct Derrick_Watch_s* watch = calloc(1, sizeof(struct Derrick_Watch_s));
+    watch->index = io_index;
+    watch->root = _strdup(i_path);
+    watch->root_length = strlen(i_path);
+    watch->delay = i_delay ? i_delay : DERRICK_WATCH_DELAY;
+    watch->directory = hDirectory;
+    watch->buffer = malloc(DERRICK_WATCH_BUFFER);
+    watch->stop = CreateEventA(NULL, TRUE, FALSE, NULL);
+    watch->overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    watch->thread = CreateThread(NULL, 0, &derrick_internal_WatchThread, watch, 0, NULL);
+    if (watch->thread == NULL)
+    {
+        watch->thread = 0;
+        derrick_watch_stop(watch);
+        return DERRICK_ERROR;
+    }
+    (*o_watch) = watch;
     return DERRICK_OK;
 }
 
-int derrick_deep_search(const char* i_searchfor, const char *i_searchin, Derrick_Parameters io_cb)
+void derrick_watch_stop(DerrickWatch i_watch)
 {
-    if (io_cb == 0 || i_searchin == 0 || i_searchfor == 0) return DERRICK_ERROR;
-
-    WIN32_FIND_DATAA fdFile;
-    HANDLE hFind = NULL;
+    if (i_watch == 0) return;
+    if (i_watch->thread)
+    {
+        SetEvent(i_watch->stop);
+        WaitForSingleObject(i_watch->thread, INFINITE);
+        CloseHandle(i_watch->thread);
+    }
+    for (size_t c = 0; c < i_watch->number_of_changes; ++c)
+    {
+        free(i_watch->changes[c]);
+    }
+    free(i_watch->changes);
+    CloseHandle(i_watch->overlapped.hEvent);
+    CloseHandle(i_watch->stop);
+    CloseHandle(i_watch->directory);
+    free(i_watch->buffer);
+    free(i_watch->root);
+    free(i_watch);
+}
 
-    char sPath[2048];
+// Shared state of a deep search
+struct Derrick_DeepSearch_s
+{
+    struct Derrick_Literal_s literal;
+    struct Derrick_Automaton_s* automaton;  // several strings at once, instead of the literal
+    struct Derrick_Regex_s* regex;          // regular expression, the literal is the one it contains
+    struct Derrick_Dfa_s* dfas;             // one per thread
+    char** streams;                         // per thread, buffer of the files read by chunks
+    struct Derrick_Batch_s* batches;        // per thread, results not reported yet
+    struct Derrick_Stats_s* stats;          // per thread, 0 if the caller does not want them
+    int report;                             // 1 if the caller wants the results
+    size_t overlap;                         // longest occurrence - 1
+    uint64_t stream_size;                   // files from this size on are read by chunks
+    size_t root_length;                     // length of the path searched in
+    Derrick_Parameters params;
+    struct Derrick_Control_s control;
+    CRITICAL_SECTION lock;      // callbacks are never called concurrently
+    int rc;
+};
 
-    //Specify a file mask. *.* = We want everything!
-    sprintf(sPath, "%s\\*.*", i_searchin);
+// Report the matches of [i_begin, i_end) that end after i_fresh: the data before was
+// already searched, it is only there for the context of the lines. The matches of a binary
+// file are not reported: the file is, once. 1 is returned when the rest of the file does not
+// need to be read: after the first match of a binary file or with param_first_match, and
+// when the search stops. The results go to the batch of the thread, which the caller flushes.
+int derrick_internal_ScanBlock(const char* i_path, int i_worker, const char* i_begin, const char* i_fresh, const char* i_end, int i_binary, struct Derrick_DeepSearch_s* io_search)
+{
+    Derrick_Parameters io_cb = io_search->params;
+    struct Derrick_Batch_s* batch = &io_search->batches[i_worker];
+    int once = i_binary || io_cb->param_first_match;
+    const char* from = (size_t)(i_fresh - i_begin) > io_search->overlap ? i_fresh - io_search->overlap : i_begin;
 
-    if((hFind = FindFirstFileA(sPath, &fdFile)) == INVALID_HANDLE_VALUE)
+    if (io_search->automaton)
     {
-        return DERRICK_PATH_NOT_FOUND;
+        // One pass, reporting every string ending at each position
+        const struct Derrick_Automaton_s* automaton = io_search->automaton;
+        const char* offset = from;
+        uint32_t row = 0;
+        while ((offset = derrick_internal_AutomatonRun(automaton, offset, i_end, &row)) != 0)
+        {
+            for (uint32_t state = row / (uint32_t)automaton->number_of_classes; state != DERRICK_EMPTY_SLOT && offset >= i_fresh; state = automaton->dictionary[state])
+            {
+                for (int32_t p = automaton->output[state]; p >= 0; p = automaton->next_output[p])
+                {
+                    if (derrick_internal_BatchAdd(batch, i_begin, i_end, offset + 1 - automaton->lengths[p], (size_t)p, !i_binary, io_cb, &io_search->lock) || once) return 1;
+                }
+            }
+            ++offset;
+        }
+    }
+    else if (io_search->regex && io_search->report)
+    {
+        // Report each line matching the expression once
+        struct Derrick_Dfa_s* dfa = &io_search->dfas[i_worker];
+        const struct Derrick_Literal_s* literal = io_search->regex->literal ? &io_search->literal : 0;
+        const char* offset = from;
+        const char* where;
+        while (offset < i_end && (where = derrick_internal_RegexFind(dfa, literal, offset, i_end)) != 0)
+        {
+            if (derrick_internal_BatchAdd(batch, i_begin, i_end, where, 0, !i_binary, io_cb, &io_search->lock) || once) return 1;
+            offset = derrick_internal_NextLine(where, i_end);
+        }
+    }
+    else if (io_search->report)
+    {
+        // Jump from one occurrence to the next with the search kernel
+        const char* offset = from;
+        while ((offset = derrick_internal_LiteralFind(&io_search->literal, offset, i_end - offset)) != 0)
+        {
+            if (derrick_internal_BatchAdd(batch, i_begin, i_end, offset, 0, !i_binary, io_cb, &io_search->lock) || once) return 1;
+            ++offset;
+        }
     }
+    return 0;
+}
+
+// Scan a block, adding the time it took to *io_nanoseconds but not the time of the callbacks
+int derrick_internal_TimedScan(const char* i_path, int i_worker, const char* i_begin, const char* i_fresh, const char* i_end, int i_binary,
+                               struct Derrick_DeepSearch_s* io_search, uint64_t* io_nanoseconds)
+{
+    struct Derrick_Stats_s* stats = io_search->batches[i_worker].stats;
+    if (stats == 0) return derrick_internal_ScanBlock(i_path, i_worker, i_begin, i_fresh, i_end, i_binary, io_search);
+
+    uint64_t callbacks = stats->nanoseconds[DERRICK_PHASE_CALLBACK];
+    uint64_t start = derrick_internal_Now(stats);
+    int stop = derrick_internal_ScanBlock(i_path, i_worker, i_begin, i_fresh, i_end, i_binary, io_search);
+    uint64_t elapsed = derrick_internal_Since(stats, start);
+    callbacks = stats->nanoseconds[DERRICK_PHASE_CALLBACK] - callbacks;
+    (*io_nanoseconds) += elapsed > callbacks ? elapsed - callbacks : 0;
+    return stop;
+}
+
+// Search a file read by chunks. The lines are never cut between two chunks, unless they are
+// longer than DERRICK_STREAM_CARRY: the end of each chunk after its last line break is moved
+// in front of the next one, with the bytes that may start an occurrence going on after.
+int derrick_internal_SearchStream(const char* i_path, int i_worker, struct Derrick_DeepSearch_s* io_search)
+{
+    struct Derrick_Stats_s* stats = io_search->batches[i_worker].stats;
+    uint64_t start = derrick_internal_Now(stats);
+    HANDLE hFile = derrick_internal_StreamOpen(i_path, io_search->params->param_unbuffered, 0);
+    if (hFile == INVALID_HANDLE_VALUE) return derrick_internal_Failed(stats);
+    derrick_internal_Elapsed(stats, DERRICK_PHASE_OPEN, start);
+    if (stats) stats->files_opened++;
+    uint64_t read_time = 0;
+    uint64_t scan_time = 0;
+    if (io_search->streams[i_worker] == 0) io_search->streams[i_worker] = derrick_internal_StreamBuffer();
+    char* chunk = io_search->streams[i_worker] + DERRICK_STREAM_CARRY;
 
+    int rc;
+    size_t read;
+    size_t carry = 0;       // bytes kept in front of the chunk
+    size_t fresh = 0;       // among them, bytes already searched
+    uint64_t position = 0;  // offset of the chunk in the file
+    int binary = -1;        // not known before the first chunk
+    struct Derrick_Batch_s* batch = &io_search->batches[i_worker];
+    derrick_internal_BatchFile(batch, i_path, chunk, 0);
     do
     {
-        //Find first file will always return "."
-        //    and ".." as the first two directories.
-        if(strcmp(fdFile.cFileName, ".") != 0
-                && strcmp(fdFile.cFileName, "..") != 0)
+        if (derrick_internal_Stopped(&io_search->control)) break;
+        start = derrick_internal_Now(stats);
+        rc = derrick_internal_StreamRead(hFile, chunk, &read);
+        read_time += derrick_internal_Since(stats, start);
+        derrick_internal_Progress(&io_search->control, 0, read, &io_search->lock);
+        const char* begin = chunk - carry;
+        const char* end = chunk + read;
+        derrick_internal_BatchMove(batch, begin, position - carry);
+        if (binary < 0)
         {
-            //Build up our file path using the passed in
-            //  [sDir] and the file/foldername we just found:
-            sprintf(sPath, "%s\\%s", i_searchin, fdFile.cFileName);
-
-            //Is the entity a File or Folder?
-            if(fdFile.dwFileAttributes &FILE_ATTRIBUTE_DIRECTORY)
+            binary = io_search->params->param_binary != DERRICK_BINARY_TEXT && derrick_internal_IsBinary(chunk, read);
+            if (binary && io_search->params->param_binary == DERRICK_BINARY_SKIP)
             {
-                derrick_deep_search(i_searchfor, sPath, io_cb);
+                if (stats) stats->files_skipped++;
+                break;
             }
-            else
-            {
-                // Verify that file shall not be excluded
-                if (io_cb->cb_exclude)
-                {
-                    if(io_cb->cb_exclude(io_cb->ctx_exclude, sPath) == 1)
-                    {
-                        continue;
-                    }
-                }
+        }
+        if (stats) stats->bytes_scanned += read;
 
-                // Let's check that file
-                HANDLE hFile = CreateFileA(sPath,           // name of the write
-                                   GENERIC_READ,           // open for writing
-                                   0,                      // do not share
-                                   NULL,                   // default security
-                                   OPEN_EXISTING,          // create new file only
-                                   0,  // normal file
-                                   0);                  // no attr. template
-
-                LARGE_INTEGER this_size;
-                this_size.QuadPart = 0;
-                if (GetFileSizeEx(hFile, &this_size) == 0)
-                {
-                    return DERRICK_ERROR;
-                }
+        // Search up to the last line break, or up to the end if the line is too long
+        const char* limit = end;
+        if (read > 0)
+        {
+            while (limit > begin && limit[-1] != '\n' && limit[-1] != '\r') limit--;
+            if ((size_t)(end - limit) + io_search->overlap > DERRICK_STREAM_CARRY) limit = end;
+        }
+        if (limit > begin + fresh)
+        {
+            int stop = derrick_internal_TimedScan(i_path, i_worker, begin, begin + fresh, limit, binary, io_search, &scan_time);
+            derrick_internal_BatchFlush(batch, io_search->params, &io_search->lock);
+            if (stop) break;
+            fresh = limit - begin;
+        }
 
-                HANDLE hMapFile = CreateFileMapping(
-                    hFile,
-                    NULL,                    // default security
-                    PAGE_READONLY,          // read/write access
-                    0,                       // max. object size
-                    0,                // buffer size
-                    NULL);                 // name of mapping object
+        // Keep what was not searched, and the bytes before that may start an occurrence
+        const char* kept = fresh > io_search->overlap ? begin + fresh - io_search->overlap : begin;
+        uint64_t kept_offset = position - carry + (kept - begin);
+        if (batch->counted < kept_offset) derrick_internal_BatchCount(batch, kept_offset);
+        fresh = begin + fresh - kept;
+        carry = end - kept;
+        position += read;
+        memmove(chunk - carry, kept, carry);
+    }
+    while (rc == DERRICK_OK && read > 0);
 
-                if (hMapFile == NULL || hMapFile == INVALID_HANDLE_VALUE)
-                {
-                    return DERRICK_ERROR;
-                }
+    CloseHandle(hFile);
+    if (rc != DERRICK_OK) derrick_internal_Failed(stats);
+    derrick_internal_Record(stats, DERRICK_PHASE_READ, read_time);
+    derrick_internal_Record(stats, DERRICK_PHASE_SCAN, scan_time);
+    derrick_internal_Progress(&io_search->control, 1, 0, &io_search->lock);
+    return rc;
+}
 
-                LPCTSTR pBuf = (LPTSTR) MapViewOfFile(hMapFile,   // handle to map object
-                    FILE_MAP_READ, // read/write permission
-                    0,
-                    0,
-                    0);
+int derrick_internal_SearchFile(const char* i_path, uint64_t i_size, int i_worker, struct Derrick_DeepSearch_s* io_search)
+{
+    // Large files are read by chunks so that they do not fill the address space, and so
+    // are the files that cannot be mapped
+    int streamable = io_search->overlap * 2 <= DERRICK_STREAM_CARRY;
+    if (i_size >= io_search->stream_size && streamable)
+    {
+        return derrick_internal_SearchStream(i_path, i_worker, io_search);
+    }
 
-                if (pBuf == NULL)
-                {
-                    return DERRICK_ERROR;
-                }
+    struct Derrick_Stats_s* stats = io_search->batches[i_worker].stats;
+    uint64_t start = derrick_internal_Now(stats);
+    const char* pBuf = 0;
+    size_t size = 0;
+    if (derrick_internal_MapFile(i_path, &pBuf, &size, 0, 0) != DERRICK_OK)
+    {
+        return streamable ? derrick_internal_SearchStream(i_path, i_worker, io_search) : derrick_internal_Failed(stats);
+    }
+    derrick_internal_Elapsed(stats, DERRICK_PHASE_OPEN, start);
+    if (stats) stats->files_opened++;
 
+    derrick_internal_Progress(&io_search->control, 1, size, &io_search->lock);
+    int binary = io_search->params->param_binary != DERRICK_BINARY_TEXT && derrick_internal_IsBinary(pBuf, size);
+    if (!binary || io_search->params->param_binary == DERRICK_BINARY_REPORT)
+    {
+        uint64_t scan_time = 0;
+        if (stats) stats->bytes_scanned += size;
+        derrick_internal_BatchFile(&io_search->batches[i_worker], i_path, pBuf, 0);
+        derrick_internal_TimedScan(i_path, i_worker, pBuf, pBuf, pBuf + size, binary, io_search, &scan_time);
+        derrick_internal_BatchFlush(&io_search->batches[i_worker], io_search->params, &io_search->lock);
+        derrick_internal_Record(stats, DERRICK_PHASE_SCAN, scan_time);
+    }
+    else if (stats)
+    {
+        stats->files_skipped++;
+    }
+    derrick_internal_UnmapFile(pBuf);
+    return DERRICK_OK;
+}
 
-                // Compare memory
-                void* offset = (void*)pBuf;                                
-                for (size_t i = 0; i < (this_size.QuadPart - strlen(i_searchfor)); ++i)
-                {
-                    // Comparison function changes depending on case sensitivity
-                    if (io_cb->cd_found &&
-                        (
-                         (io_cb->param_case_sensitive <= 0 && 0 == _strnicmp(offset, i_searchfor, strlen(i_searchfor)))
-                         ||
-                         (0 == memcmp(offset, i_searchfor, strlen(i_searchfor)))
-                        )
-                       )
-                    {
-                        char* line = derrick_internal_find_line((const char*)offset);
-                        io_cb->cd_found(io_cb->ctx_found, sPath, line);
-                        free(line);
-                    }
-#ifdef _MSC_VER
-                    ++((BYTEP*)offset);
-#else
-                    ++offset;
-#endif
-                }
+// A file to search, with its size
+struct Derrick_FileArg_s
+{
+    uint64_t size;
+    char path[1];
+};
 
-                UnmapViewOfFile(pBuf);
-                CloseHandle(hFile);
-            }
-        }
+struct Derrick_FileArg_s* derrick_internal_FileArg(const char* i_path, const WIN32_FIND_DATAA* i_find)
+{
+    struct Derrick_FileArg_s* arg = malloc(sizeof(struct Derrick_FileArg_s) + strlen(i_path));
+    arg->size = ((uint64_t)i_find->nFileSizeHigh << 32) | i_find->nFileSizeLow;
+    strcpy(arg->path, i_path);
+    return arg;
+}
+
+void derrick_internal_FileTask(struct Derrick_Pool_s* io_pool, int i_worker, void* io_arg)
+{
+    struct Derrick_DeepSearch_s* search = (struct Derrick_DeepSearch_s*)io_pool->context;
+    const struct Derrick_FileArg_s* file = (const struct Derrick_FileArg_s*)io_arg;
+    if (!derrick_internal_Stopped(&search->control) && derrick_internal_SearchFile(file->path, file->size, i_worker, search) != DERRICK_OK)
+    {
+        // Keep going with the other files, but let the caller know
+        InterlockedCompareExchange((volatile LONG*)&search->rc, DERRICK_ERROR, DERRICK_OK);
     }
-    while(FindNextFileA(hFind, &fdFile)); //Find the next file.
+    free(io_arg);
+}
 
-    FindClose(hFind); //Always, Always, clean things up!
+void derrick_internal_DirectoryTask(struct Derrick_Pool_s* io_pool, int i_worker, void* io_arg);
 
+int derrick_internal_VisitPushFile(void* io_context, const char* i_path, const WIN32_FIND_DATAA* i_find)
+{
+    const struct Derrick_Worker_s* worker = (const struct Derrick_Worker_s*)io_context;
+    struct Derrick_DeepSearch_s* search = (struct Derrick_DeepSearch_s*)worker->pool->context;
+    if (derrick_internal_Stopped(&search->control)) return DERRICK_STOPPED;
+    derrick_internal_PoolPush(worker->pool, worker->worker, &derrick_internal_FileTask, derrick_internal_FileArg(i_path, i_find));
     return DERRICK_OK;
 }
 
-int derrick_count_files(const char* i_searchin, Derrick_Parameters io_cb)
+// A directory to list, with the ignore files of its parents
+struct Derrick_DirectoryArg_s
 {
-    if (io_cb == 0 || i_searchin == 0) return DERRICK_ERROR;
+    struct Derrick_Ignore_s* ignore;
+    char path[1];
+};
 
-    HANDLE hFind = NULL;
-    WIN32_FIND_DATAA fdFile;
-    char sPath[2048];
-    int number_of_files = 0;
+struct Derrick_DirectoryArg_s* derrick_internal_DirectoryArg(const char* i_path, struct Derrick_Ignore_s* i_ignore)
+{
+    struct Derrick_DirectoryArg_s* arg = malloc(sizeof(struct Derrick_DirectoryArg_s) + strlen(i_path));
+    arg->ignore = derrick_internal_IgnoreKeep(i_ignore);
+    strcpy(arg->path, i_path);
+    return arg;
+}
+
+int derrick_internal_VisitPushDirectory(void* io_context, const char* i_path, struct Derrick_Ignore_s* i_ignore)
+{
+    const struct Derrick_Worker_s* worker = (const struct Derrick_Worker_s*)io_context;
+    struct Derrick_DeepSearch_s* search = (struct Derrick_DeepSearch_s*)worker->pool->context;
+    if (derrick_internal_Stopped(&search->control)) return DERRICK_STOPPED;
+    derrick_internal_PoolPush(worker->pool, worker->worker, &derrick_internal_DirectoryTask, derrick_internal_DirectoryArg(i_path, i_ignore));
+    return DERRICK_OK;
+}
+
+// List one directory: its files and subdirectories become tasks of their own
+void derrick_internal_DirectoryTask(struct Derrick_Pool_s* io_pool, int i_worker, void* io_arg)
+{
+    struct Derrick_DeepSearch_s* search = (struct Derrick_DeepSearch_s*)io_pool->context;
+    struct Derrick_DirectoryArg_s* directory = (struct Derrick_DirectoryArg_s*)io_arg;
+    struct Derrick_Worker_s worker;
+    worker.pool = io_pool;
+    worker.worker = i_worker;
 
-    //Specify a file mask. *.* = We want everything!
-    sprintf(sPath, "%s\\*.*", i_searchin);
+    struct Derrick_Walk_s walk;
+    derrick_internal_WalkInit(&walk, search->params, &derrick_internal_VisitPushFile, &worker);
+    walk.visit_directory = &derrick_internal_VisitPushDirectory;
+    walk.recursive = 0;
+    walk.root_length = search->root_length;
+    walk.ignore = directory->ignore;
+    walk.lock = &search->lock;
+    walk.stats = search->batches[i_worker].stats;
+    if (!derrick_internal_Stopped(&search->control)) derrick_internal_Walk(directory->path, &walk);
+    derrick_internal_IgnoreRelease(directory->ignore);
+    free(io_arg);
+}
 
-    if((hFind = FindFirstFileA(sPath, &fdFile)) == INVALID_HANDLE_VALUE)
+int derrick_internal_VisitSearch(void* io_context, const char* i_path, const WIN32_FIND_DATAA* i_find)
+{
+    // A file that cannot be read does not stop the search
+    struct Derrick_DeepSearch_s* search = (struct Derrick_DeepSearch_s*)io_context;
+    if (derrick_internal_Stopped(&search->control)) return DERRICK_STOPPED;
+    uint64_t size = ((uint64_t)i_find->nFileSizeHigh << 32) | i_find->nFileSizeLow;
+    if (derrick_internal_SearchFile(i_path, size, 0, search) != DERRICK_OK)
     {
-        return DERRICK_PATH_NOT_FOUND;
+        search->rc = DERRICK_ERROR;
     }
+    return DERRICK_OK;
+}
 
-    do
+int derrick_internal_DeepSearch(const char *i_searchin, struct Derrick_DeepSearch_s* io_search)
+{
+    struct Derrick_Walk_s walk;
+    derrick_internal_WalkInit(&walk, io_search->params, &derrick_internal_VisitSearch, io_search);
+    walk.lock = &io_search->lock;
+    walk.stats = io_search->batches[0].stats;
+    return derrick_internal_Walk(i_searchin, &walk);
+}
+
+// Walk the tree serially or with a pool of threads
+void derrick_internal_RunDeepSearch(const char *i_searchin, struct Derrick_DeepSearch_s* io_search)
+{
+    InitializeCriticalSection(&io_search->lock);
+    io_search->rc = DERRICK_OK;
+    derrick_internal_ControlInit(&io_search->control, io_search->params);
+    io_search->root_length = strlen(i_searchin);
+
+    int threads = derrick_internal_NumberOfThreads(io_search->params->param_threads);
+    io_search->stream_size = io_search->params->param_stream_size ? io_search->params->param_stream_size : DERRICK_STREAM_SIZE;
+    io_search->streams = calloc(threads, sizeof(char*));
+
+    // The buffer of the caller, if any, is shared out between the threads
+    Derrick_Parameters io_cb = io_search->params;
+    io_search->report = (io_cb->cb_results || io_cb->cd_found || io_cb->cd_found_pattern);
+    io_search->batches = malloc(threads * sizeof(struct Derrick_Batch_s));
+    size_t share = io_cb->param_results ? io_cb->param_results_size / threads : 0;
+    for (int i = 0; i < threads; ++i)
     {
-        //Find first file will always return "."
-        //    and ".." as the first two directories.
-        if(strcmp(fdFile.cFileName, ".") != 0
-                && strcmp(fdFile.cFileName, "..") != 0)
-        {
-            //Build up our file path using the passed in
-            //  [sDir] and the file/foldername we just found:
-            sprintf(sPath, "%s\\%s", i_searchin, fdFile.cFileName);
+        derrick_internal_BatchInit(&io_search->batches[i], share ? io_cb->param_results + i * share : 0, share, &io_search->control);
+    }
+    io_search->stats = io_cb->param_stats ? calloc(threads, sizeof(struct Derrick_Stats_s)) : 0;
+    for (int i = 0; i < threads; ++i) io_search->batches[i].stats = io_search->stats ? &io_search->stats[i] : 0;
+    io_search->dfas = 0;
+    if (io_search->regex)
+    {
+        io_search->dfas = malloc(threads * sizeof(struct Derrick_Dfa_s));
+        for (int i = 0; i < threads; ++i) derrick_internal_DfaInit(&io_search->dfas[i], io_search->regex);
+    }
 
-            //Is the entity a File or Folder?
-            if(fdFile.dwFileAttributes &FILE_ATTRIBUTE_DIRECTORY)
-            {
-                number_of_files += derrick_count_files(sPath, io_cb);
-            }
-            else
-            {
-                // Verify that file shall not be excluded
-                if (io_cb->cb_exclude)
-                {
-                    if(io_cb->cb_exclude(io_cb->ctx_exclude, sPath) == 1)
-                    {
-                        continue;
-                    }
-                }
+    if (threads <= 1)
+    {
+        int rc = derrick_internal_DeepSearch(i_searchin, io_search);
+        if (rc != DERRICK_OK && io_search->control.stop == DERRICK_OK) io_search->rc = rc;
+    }
+    else if (GetFileAttributesA(i_searchin) == INVALID_FILE_ATTRIBUTES)
+    {
+        io_search->rc = DERRICK_PATH_NOT_FOUND;
+    }
+    else
+    {
+        derrick_internal_PoolRun(threads, io_search, &derrick_internal_DirectoryTask, derrick_internal_DirectoryArg(i_searchin, 0));
+    }
 
-                number_of_files++;
-            }
+    if (io_search->dfas)
+    {
+        for (int i = 0; i < threads; ++i) derrick_internal_DfaFree(&io_search->dfas[i]);
+        free(io_search->dfas);
+    }
+    for (int i = 0; i < threads; ++i) derrick_internal_FreePages(io_search->streams[i]);
+    free(io_search->streams);
+    for (int i = 0; i < threads; ++i) derrick_internal_BatchFree(&io_search->batches[i]);
+    free(io_search->batches);
+    if (io_search->stats)
+    {
+        for (int i = 0; i < threads; ++i) derrick_internal_StatsAdd(io_cb->param_stats, &io_search->stats[i]);
+        free(io_search->stats);
+    }
+    io_search->rc = derrick_internal_ControlResult(&io_search->control, io_search->rc);
+    DeleteCriticalSection(&io_search->lock);
+}
+
+int derrick_deep_search(const char* i_searchfor, const char *i_searchin, Derrick_Parameters io_cb)
+{
+    if (io_cb == 0 || i_searchin == 0 || i_searchfor == 0) return DERRICK_ERROR;
+
+    struct Derrick_DeepSearch_s search;
+    struct Derrick_Regex_s regex;
+    search.automaton = 0;
+    search.regex = 0;
+    search.params = io_cb;
+    derrick_internal_Init();
+    if (io_cb->param_regex)
+    {
+        if (derrick_internal_RegexInit(&regex, i_searchfor, io_cb->param_case_sensitive <= 0) != DERRICK_OK)
+        {
+            return DERRICK_BAD_PATTERN;
         }
+        search.regex = &regex;
+        i_searchfor = regex.literal ? regex.literal : "";
+    }
+    derrick_internal_LiteralInit(&search.literal, i_searchfor, io_cb);
+    search.overlap = (search.regex || search.literal.length == 0) ? 0 : search.literal.length - 1;
+    derrick_internal_RunDeepSearch(i_searchin, &search);
+    derrick_internal_LiteralFree(&search.literal);
+    if (search.regex) derrick_internal_RegexFree(&regex);
+    return search.rc;
+}
+
+int derrick_deep_search_multi(const char* const* i_searchfor, size_t i_count, const char* i_searchin, Derrick_Parameters io_cb)
+{
+    if (io_cb == 0 || i_searchin == 0 || i_searchfor == 0) return DERRICK_ERROR;
+
+    // A single string is better served by the substring kernel
+    if (i_count == 1 && !io_cb->param_regex) return derrick_deep_search(i_searchfor[0], i_searchin, io_cb);
+
+    struct Derrick_DeepSearch_s search;
+    struct Derrick_Automaton_s automaton;
+    derrick_internal_Init();
+    derrick_internal_AutomatonInit(&automaton, i_searchfor, i_count, io_cb->param_case_sensitive <= 0);
+    memset(&search.literal, 0, sizeof(search.literal));
+    search.automaton = &automaton;
+    search.regex = 0;
+    search.params = io_cb;
+    search.overlap = 0;
+    for (size_t p = 0; p < i_count; ++p)
+    {
+        if (automaton.lengths[p] > search.overlap + 1) search.overlap = automaton.lengths[p] - 1;
     }
-    while(FindNextFileA(hFind, &fdFile)); //Find the next file.
+    derrick_internal_RunDeepSearch(i_searchin, &search);
+    derrick_internal_AutomatonFree(&automaton);
+    return search.rc;
+}
 
-    FindClose(hFind); //Always, Always, clean things up!
+int derrick_internal_VisitCount(void* io_context, const char* i_path, const WIN32_FIND_DATAA* i_find)
+{
+    (*(int*)io_context)++;
+    return DERRICK_OK;
+}
+
+int derrick_count_files(const char* i_searchin, Derrick_Parameters io_cb)
+{
+    if (io_cb == 0 || i_searchin == 0) return DERRICK_ERROR;
 
-    return number_of_files;
+    int number_of_files = 0;
+    struct Derrick_Walk_s walk;
+    derrick_internal_WalkInit(&walk, io_cb, &derrick_internal_VisitCount, &number_of_files);
+    walk.stats = io_cb->param_stats;
+    int rc = derrick_internal_Walk(i_searchin, &walk);
+    return rc == DERRICK_OK ? number_of_files : rc;
 }
 
 void derrick_init_parameters(Derrick_Parameters io_cb)
 {
     io_cb->cb_exclude = 0;
+    io_cb->cb_exclude_dir = 0;
     io_cb->cd_found = 0;
+    io_cb->cd_found_pattern = 0;
     io_cb->ctx_exclude = 0;
     io_cb->ctx_found = 0;
     io_cb->param_case_sensitive = 1;
+    io_cb->param_threads = 1;
+    io_cb->param_large_pages = 0;
+    io_cb->param_regex = 0;
+    io_cb->param_stream_size = 0;
+    io_cb->param_unbuffered = 0;
+    io_cb->param_filter = 0;
+    io_cb->param_binary = DERRICK_BINARY_SKIP;
+    io_cb->cb_results = 0;
+    io_cb->param_results = 0;
+    io_cb->param_results_size = 0;
+    io_cb->param_first_match = 0;
+    io_cb->param_max_results = 0;
+    io_cb->param_timeout = 0;
+    io_cb->param_cancel = 0;
+    io_cb->cb_progress = 0;
+    io_cb->ctx_progress = 0;
+    io_cb->param_progress_period = 0;
+    io_cb->param_stats = 0;
+    io_cb->param_context = 0;
 }
@@ -15,8 +15,36 @@
 #define DERRICK_NO_INPUT        -2
 #define DERRICK_TOO_LONG        -3
 #define DERRICK_PATH_NOT_FOUND  -4
+#define DERRICK_BAD_FORMAT      -5
+#define DERRICK_BAD_PATTERN     -6
+#define DERRICK_STOPPED         -7  // stopped by a callback or by io_cb->param_cancel
+#define DERRICK_TIMEOUT         -8  // io_cb->param_timeout elapsed
 #define DERRICK_ERROR           -1
 
+// Substring search kernels, see derrick_set_kernel
+#define DERRICK_KERNEL_AUTO     0
+#define DERRICK_KERNEL_SCALAR   1
+#define DERRICK_KERNEL_SSE2     2
+#define DERRICK_KERNEL_AVX2     3
+#define DERRICK_KERNEL_AVX512   4
+
+// Flags of derrick_filter_compile
+#define DERRICK_FILTER_IGNORE_FILES 1
+
+// What to do with the binary files, the files whose first bytes contain a NUL or are not text
+#define DERRICK_BINARY_SKIP     0   // leave them out: the index only keeps their name
+#define DERRICK_BINARY_REPORT   1   // report the files that match, without the lines
+#define DERRICK_BINARY_TEXT     2   // search them like the other files
+
+// Phases of a search timed by Derrick_Stats_s
+#define DERRICK_PHASE_WALK      0   // listing the directories
+#define DERRICK_PHASE_OPEN      1   // opening and mapping the files
+#define DERRICK_PHASE_READ      2   // reading the files read by chunks
+#define DERRICK_PHASE_SCAN      3   // looking for the matches, including the page faults of the mapped files
+#define DERRICK_PHASE_CALLBACK  4   // waiting for and calling the callbacks of the results
+#define DERRICK_PHASES          5
+#define DERRICK_HISTOGRAM_SIZE  32
+
 // Some compiler dependent stuffs
 #ifdef _MSC_VER
 # define BYTEP char
@@ -29,6 +57,13 @@
 # define DERRICK_EXPORT __attribute__ ((dllexport) 
 #endif
 
+#include <stddef.h>
+#include <stdint.h>
+
+// Version of the index layout, stored in saved index files
+#define DERRICK_INDEX_MAGIC     "DERRICK"
+#define DERRICK_INDEX_VERSION   6
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -40,33 +75,201 @@ extern "C" {
     typedef int(*derrick_cb_exclude_t)(void* context, const char* file);
 
     // Callback called when a match is found
-    typedef void(*derrick_cb_found_t)  (void* context, const char* in, const char* what);
+    // return 0 -> go on
+    // return != 0 -> stop the search
+    typedef int(*derrick_cb_found_t)  (void* context, const char* in, const char* what);
+
+    // Callback called when a match is found, with the index of the string that matched
+    // (0 for the searches of a single string); it stops the search the same way
+    typedef int(*derrick_cb_found_pattern_t)  (void* context, const char* in, const char* what, size_t pattern);
+
+    // One match, in the file given to derrick_cb_results_t
+    struct Derrick_Result_s
+    {
+        uint64_t offset;    // of the match in the file; for a regular expression, where its line was recognized
+        uint64_t line;      // number of the line, from 1
+        uint32_t column;    // of the match in the line, from 1
+        uint32_t pattern;   // index of the string that matched (0 for the searches of a single string)
+        const char* text;   // the line, not zero-terminated, in the data of the file
+        size_t length;      // of the line
+        const char* context;    // with param_context, the line with up to param_context lines before and after it
+        size_t context_length;
+        uint64_t context_line;  // number of the first line of context
+    };
+    // text, line, column and context are 0 for a match in the name of a file, or in a binary file
+
+    // Callback called with the matches of one file, by batches. The lines point into the data
+    // of the file: they are only valid during the call. It stops the search the same way.
+    typedef int(*derrick_cb_results_t)  (void* context, const char* in, const struct Derrick_Result_s* results, size_t count);
+
+    // Callback called from time to time during a search, with the number of files and bytes
+    // read so far; it stops the search the same way
+    typedef int(*derrick_cb_progress_t)  (void* context, uint64_t files, uint64_t bytes);
+
+    // Counters of a search, see param_stats. Each file, directory or batch of results adds the
+    // time it took to the histogram of the phase: bucket 0 counts the durations under 1 us,
+    // bucket i those from 2^(i-1) to 2^i us.
+    struct Derrick_Stats_s
+    {
+        uint64_t directories;       // directories listed
+        uint64_t files_opened;
+        uint64_t files_cached;      // verified from the content cache of the index, without opening them
+        uint64_t files_skipped;     // left out by the filters and callbacks, or because they are binary
+        uint64_t files_failed;      // files that could not be opened or read
+        uint32_t last_error;        // system error code of the last file that failed
+        uint64_t bytes_scanned;
+        uint64_t matches;           // results given to the callbacks
+        uint64_t nanoseconds[DERRICK_PHASES];
+        uint64_t histogram[DERRICK_PHASES][DERRICK_HISTOGRAM_SIZE];
+    };
+
+    // Compiled set of patterns selecting the files to search, see derrick_filter_compile
+    typedef struct Derrick_Filter_s * DerrickFilter;
 
     // Structure containing the parameters for some function calls
     struct Derrick_Parameters_s
     {
         derrick_cb_exclude_t cb_exclude;
+        derrick_cb_exclude_t cb_exclude_dir;         // if set, called for each directory: excluding it skips everything it contains
         derrick_cb_found_t cd_found;
+        derrick_cb_found_pattern_t cd_found_pattern; // if set, called instead of cd_found
         void* ctx_exclude;
         void* ctx_found;
-        int param_case_sensitive; // Not used, reserved
+        int param_case_sensitive; // 1 to match the exact string, 0 to ignore the case of ASCII letters
+        int param_threads;        // threads used by the search: 1 for the calling thread only, 0 for one per processor
+        int param_large_pages;    // 1 to back the index with large pages when the process is allowed to
+        int param_regex;          // 1 if the string to look for is a regular expression, matched line by line
+        uint64_t param_stream_size; // files from this size on are read by chunks instead of being mapped, 0 for 16 MB
+        int param_unbuffered;     // 1 to bypass the system cache for the files read by chunks
+        DerrickFilter param_filter; // if set, applied before cb_exclude and cb_exclude_dir
+        int param_binary;         // DERRICK_BINARY_SKIP, DERRICK_BINARY_REPORT or DERRICK_BINARY_TEXT
+        derrick_cb_results_t cb_results;             // if set, called instead of cd_found and cd_found_pattern
+        struct Derrick_Result_s* param_results;      // if set, buffer for the batches of cb_results, shared by the threads
+        size_t param_results_size;                   // number of records of param_results
+        int param_first_match;    // 1 to report only the first match of each file
+        uint64_t param_max_results; // the search stops after reporting this number of matches, 0 for no limit
+        uint32_t param_timeout;   // the search stops after this number of milliseconds, 0 for no limit
+        volatile long* param_cancel;                 // if set, the search stops as soon as another thread makes it non-zero
+        derrick_cb_progress_t cb_progress;
+        void* ctx_progress;
+        uint32_t param_progress_period; // milliseconds between two calls of cb_progress, 0 for 100
+        struct Derrick_Stats_s* param_stats;         // if set, the searches add their counters to it
+        uint32_t param_context;   // lines of context given to cb_results before and after the line of each match
     };
     typedef struct Derrick_Parameters_s * Derrick_Parameters;
 
-    // Structure containing the index for index-based funtions
-    struct DerrickIndex_s
+    // This structure is for internal use: one file of the index
+    struct Derrick_Entry_s
+    {
+        uint64_t size;
+        uint64_t name;      // offset of the file name, without its directory, in the names pool
+        uint64_t dir;       // its directory in the directory table, DERRICK_NO_DIR if the name has none
+        uint64_t mtime;     // last write time, as a FILETIME
+        uint64_t inode;     // file index on its volume
+        uint64_t lines;     // offset of the newline table of the file in the lines pool, DERRICK_NO_LINES if its content was left out
+        uint64_t copy_of;   // first entry of the segment with the same content, which holds the postings; the entry itself if none
+        uint64_t next_copy; // next entry of the segment with the same content, DERRICK_NO_COPY if none
+    };
+
+    // This structure is for internal use: newline table of a file
+    // Offsets of the line feeds of the file, by blocks of DERRICK_LINES_BLOCK: a mark
+    // gives the offset of the first line feed of each block, and where the varint-encoded
+    // gaps to the next ones start. The table is the header, the marks and the gaps.
+    struct Derrick_Lines_s
+    {
+        uint64_t count;     // number of line feeds
+        uint64_t size;      // of the gaps, in bytes
+    };
+    struct Derrick_LineMark_s
+    {
+        uint64_t offset;
+        uint64_t gaps;
+    };
+
+    // This structure is for internal use: one directory of the directory table
+    // A directory is stored once for all its files: its path is the path of its parent followed
+    // by its name, which ends with the separator. Parents come before their subdirectories.
+    struct Derrick_Dir_s
+    {
+        uint64_t parent;    // DERRICK_NO_DIR for the first component of a path
+        uint64_t name;      // offset of its name in the names pool
+        uint64_t length;    // of its whole path
+    };
+
+    // This structure is for internal use: one line of the trigram table
+    // The trigrams of the file names, without their directories, have their own lines, with
+    // the bit DERRICK_NAME_TRIGRAM set, so that looking for a name does not read the content lists.
+    struct Derrick_Trigram_s
+    {
+        uint32_t trigram;   // three bytes in ASCII lower case, packed as 0x00AABBCC
+        uint32_t count;     // number of files in the posting list
+        uint64_t postings;  // offset of the posting list in the postings pool
+    };
+
+    // This structure is for internal use: header of an index image
+    // An image is the header followed by the file table, the names pool, the directory table,
+    // the trigram table, the postings pool and the lines pool, each section aligned on 8 bytes. It only
+    // contains offsets, so that a saved index can be mapped and searched in place.
+    struct Derrick_IndexHeader_s
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_checksum;   // checksum of this header, computed with this field set to 0
+        uint64_t checksum;          // checksum of everything after the header
+        uint64_t total_size;
+        uint64_t number_of_entries;
+        uint64_t entries;
+        uint64_t names;
+        uint64_t number_of_dirs;
+        uint64_t dirs;
+        uint64_t number_of_trigrams;
+        uint64_t trigrams;
+        uint64_t postings;
+        uint64_t lines;
+    };
+
+    // This structure is for internal use: one immutable part of an index
+    // The content of the files is not stored: each file is described by the sorted
+    // list of trigrams (sequences of 3 bytes) it contains. A search only opens the
+    // files that contain every trigram of the string to look for.
+    struct Derrick_Segment_s
     {
         size_t number_of_entries;
-        struct Derrick_EntryHeader_s* index;
+        struct Derrick_Entry_s* entries;     // file table, indexed by file id
+        char* names;                          // pool of zero-terminated names of files and directories
+        size_t number_of_dirs;
+        struct Derrick_Dir_s* dirs;           // directory table, indexed by directory id
+        size_t number_of_trigrams;
+        struct Derrick_Trigram_s* trigrams;  // sorted by trigram value
+        unsigned char* postings;              // delta-encoded lists of file ids
+        unsigned char* lines;                 // newline tables of the files
+        struct Derrick_IndexHeader_s* image;  // the sections above point into this image
+        int mapped;                           // image is a view of a file rather than allocated
+        unsigned char* deleted;               // one bit per entry, set when the file is gone or changed
+        size_t number_of_deleted;
     };
-    typedef struct DerrickIndex_s * DerrickIndex;
 
-    // This structure is for internal use
-    struct Derrick_EntryHeader_s
+    // Structure containing the index for index-based funtions
+    // A refresh does not modify the existing segments: it marks the entries of the changed
+    // and removed files as deleted and adds the new versions in a new segment.
+    struct DerrickIndex_s
     {
-        size_t size;
-        char name[];
+        size_t number_of_entries;             // files currently in the index
+        size_t number_of_segments;
+        struct Derrick_Segment_s* segments;
+        struct Derrick_Lookup_s* lookup;      // file name to entry, built by the first refresh
+        int large_pages;                      // segments added later use large pages too
+        int binary;                           // DERRICK_BINARY_SKIP if the content of binary files is left out
+        derrick_cb_exclude_t exclude;         // exclusions of the build, applied by the refreshes too
+        derrick_cb_exclude_t exclude_dir;
+        void* ctx_exclude;
+        DerrickFilter filter;
+        void* lock;                           // SRWLOCK, taken shared by the searches and exclusive by the updates
+        struct Derrick_Cache_s* cache;        // contents of the files verified by the searches, see derrick_index_set_cache
     };
+    typedef struct DerrickIndex_s * DerrickIndex;
+
+    typedef struct Derrick_Watch_s * DerrickWatch;
 
     /**
      * @brief Initialize a parameter structure with neutral values
@@ -74,6 +277,28 @@ extern "C" {
      */
     DERRICK_EXPORT void derrick_init_parameters(Derrick_Parameters io_cb);
 
+    /**
+     * @brief Compile the patterns selecting the files to search, for Derrick_Parameters::param_filter.
+     * Patterns are given one per line, with the syntax of .gitignore files: * ? [] and ** wildcards,
+     * "!" to take a file back, a trailing "/" for the directories only, and a "/" elsewhere to match a
+     * path from the directory searched in rather than a name at any depth. Names are compared without
+     * regard to the case. Plain names and extensions ("*.obj") cost a hash lookup, the other patterns
+     * are matched all at once.
+     * @param o_filter Address of pointer where the filter will be created
+     * @param i_exclude patterns of the files and directories to leave out, 0 for none
+     * @param i_include patterns of the files to search, 0 for all of them
+     * @param i_flags DERRICK_FILTER_IGNORE_FILES to also apply the .gitignore and .ignore files found in
+     * the directories walked, the closest one taking precedence over the others and over i_exclude
+     * @return DERRICK_OK if no error, DERRICK_BAD_PATTERN if a pattern is not valid
+     */
+    DERRICK_EXPORT int derrick_filter_compile(DerrickFilter* o_filter, const char* i_exclude, const char* i_include, int i_flags);
+
+    /**
+     * @brief free a filter
+     * @param i_filter the filter previously compiled with derrick_filter_compile
+     */
+    DERRICK_EXPORT void derrick_filter_free(DerrickFilter i_filter);
+
     /**
      * @brief Build an in-memory index from the files contained in a given directory i_path
      * @param io_index Address of pointer where the structure will be created
@@ -82,39 +307,265 @@ extern "C" {
      */
     DERRICK_EXPORT int derrick_index_build(DerrickIndex* io_index, const char* i_path);
 
+    /**
+     * @brief Same as derrick_index_build, with parameters. Each file is read once; the index grows in
+     * chunks of memory that can be backed by large pages (io_cb->param_large_pages), which requires the
+     * SeLockMemoryPrivilege: without it, normal pages are used. The files and directories rejected by
+     * io_cb->param_filter, io_cb->cb_exclude and io_cb->cb_exclude_dir are left out, by this build and by
+     * the later refreshes: the filter must live as long as the index.
+     * Files with the same content, up to io_cb->param_stream_size, are indexed once: the copies found by a
+     * build share the postings and the newline table of the first one, and the searches verify them together.
+     * With io_cb->param_threads other than 1, the tree is cut into parts indexed in parallel into
+     * segments of their own, as derrick_index_build_segments does, but in memory only.
+     * @param io_index Address of pointer where the structure will be created
+     * @param i_path Path to index
+     * @param io_cb parameters of the build
+     * @return DERRICK_OK if no error
+     */
+    DERRICK_EXPORT int derrick_index_build_ex(DerrickIndex* io_index, const char* i_path, Derrick_Parameters io_cb);
+
+    /**
+     * @brief Build an index as a set of segments written to the directory i_store, so that a build that
+     * failed resumes where it stopped. The files directly in i_path, the files directly in each of its
+     * subdirectories, and each directory two levels below i_path with everything it contains, are indexed
+     * into segments of their own by io_cb->param_threads threads. Each segment is written to i_store as soon
+     * as it is complete, then recorded in the manifest of i_store: when called again, the parts of the tree
+     * that the manifest lists are mapped as derrick_index_open does instead of being read, and only the
+     * others are indexed. Finally the smallest segments are merged, see derrick_index_merge, and their files
+     * replaced by the merged one. A segment mapped from i_store with a file added, changed or removed since
+     * it was written is indexed again, and written back in place of the stale one.
+     * @param io_index Address of pointer where the structure will be created
+     * @param i_path Path to index
+     * @param i_store directory of the segment files, created if needed
+     * @param io_cb parameters of the build, as for derrick_index_build_ex
+     * @return DERRICK_OK if no error, DERRICK_ERROR if a segment could not be written
+     */
+    DERRICK_EXPORT int derrick_index_build_segments(DerrickIndex* io_index, const char* i_path, const char* i_store, Derrick_Parameters io_cb);
+
+    /**
+     * @brief merge the segments of an index holding the fewest files into one, leaving out the files removed
+     * or changed since they were indexed, so that the index has at most i_max_segments segments. The largest
+     * segments are left alone, which keeps repeated merges cheap: a refresh merges this way above 8
+     * segments. The searches running on the index wait for the merge to end.
+     * @param io_index the index to merge
+     * @param i_max_segments segments left, 0 or 1 to merge them all
+     */
+    DERRICK_EXPORT void derrick_index_merge(DerrickIndex io_index, size_t i_max_segments);
+
+    /**
+     * @brief keep an index up to date with the changes notified by the system for the files below i_path,
+     * instead of calling derrick_index_refresh. The notifications are gathered by a thread of the watcher
+     * and applied once none came for i_delay milliseconds, or at the latest 20 delays after the first one:
+     * the files created or changed are read while the index is still searched, which only waits while the
+     * result is put in, as a new segment. If the system lost notifications, because too many came at once,
+     * the whole tree is refreshed. The exclusions of the build apply, but a change to a .gitignore or
+     * .ignore file only applies to the files changed after it.
+     * @param o_watch Address of pointer where the watcher will be created
+     * @param io_index the index of i_path, which must live until the watcher is stopped
+     * @param i_path Path that was indexed
+     * @param i_delay milliseconds, 0 for 50
+     * @return DERRICK_OK if no error, DERRICK_PATH_NOT_FOUND if i_path cannot be watched
+     */
+    DERRICK_EXPORT int derrick_watch_start(DerrickWatch* o_watch, DerrickIndex io_index, const char* i_path, uint32_t i_delay);
+
+    /**
+     * @brief stop and release a watcher, after the update in progress if any. The changes not applied yet are lost.
+     * @param i_watch the watcher to stop, may be 0
+     */
+    DERRICK_EXPORT void derrick_watch_stop(DerrickWatch i_watch);
+
     /**
      * @brief list on standard output the files contained in a given index
      * @param i_index the index previously built with derrick_index_build
      */
     DERRICK_EXPORT void derrick_index_list(DerrickIndex i_index);
 
+    /**
+     * @brief bring an index up to date with the files contained in i_path. Only the files whose
+     * size or last write time changed, and the new files, are read again. The index is still searched
+     * meanwhile: the searches only wait while the result is put in, as a new segment.
+     * @param io_index the index previously built with derrick_index_build or opened with derrick_index_open
+     * @param i_path Path that was indexed
+     * @return DERRICK_OK if no error
+     */
+    DERRICK_EXPORT int derrick_index_refresh(DerrickIndex io_index, const char* i_path);
+
+    /**
+     * @brief write an index to a file, in a format that derrick_index_open can map without loading it.
+     * The file is written under a temporary name then renamed, so that processes which already opened
+     * the previous version keep using it. The segments of a refreshed index are merged first.
+     * @param i_index the index previously built with derrick_index_build
+     * @param i_file path of the file to write
+     * @return DERRICK_OK if no error
+     */
+    DERRICK_EXPORT int derrick_index_save(DerrickIndex i_index, const char* i_file);
+
+    /**
+     * @brief map an index file written by derrick_index_save. Only the header is checked, the
+     * content is read by the system on demand and shared with other processes using the same file.
+     * @param io_index Address of pointer where the structure will be created
+     * @param i_file path of the index file
+     * @return DERRICK_OK if no error, DERRICK_BAD_FORMAT if the file is not a compatible index
+     */
+    DERRICK_EXPORT int derrick_index_open(DerrickIndex* io_index, const char* i_file);
+
+    /**
+     * @brief keep in memory the content of the files that the searches of an index verify, up to i_budget
+     * bytes, so that the searches repeated on the same files do not open and read them again. The least
+     * recently used contents are evicted first, and a file larger than an eighth of the budget is not kept.
+     * A content is only used while the size and last write time of its file are unchanged, which costs the
+     * searches a call to GetFileAttributesEx per file instead of mapping it. The memory of the index is
+     * then its segments and the budget, plus the names of the files kept. Waits for the searches running.
+     * @param io_index the index
+     * @param i_budget bytes of file content, 0 to release the cache (the default)
+     */
+    DERRICK_EXPORT void derrick_index_set_cache(DerrickIndex io_index, uint64_t i_budget);
+
+    /**
+     * @brief check the integrity of the whole content of an index, which requires reading all of it
+     * @param i_index the index to check
+     * @return DERRICK_OK if the content matches its checksum, DERRICK_BAD_FORMAT otherwise
+     */
+    DERRICK_EXPORT int derrick_index_verify(DerrickIndex i_index);
+
+    /**
+     * @brief release an index previously built with derrick_index_build or opened with derrick_index_open
+     * @param i_index the index to release, may be 0
+     */
+    DERRICK_EXPORT void derrick_index_free(DerrickIndex i_index);
+
     /**
      * @brief search for the file(s) containing a given string within the given index.
-     * Indexed search is very fast but consumes a lot of memory and not synchronized with hard drive.
+     * Only the files containing all the trigrams of i_searchfor are opened and verified, so the
+     * result reflects the current content of these files, but files added since the index was
+     * built are not searched.
+     * A file whose path contains i_searchfor is reported by its name, without reading it. Each directory
+     * is looked at once for all its files, and the names only when they contain all the trigrams.
+     * With io_cb->param_regex, i_searchfor is a regular expression: the files are selected with the
+     * longest string that every match contains, and the first matching line of each is reported.
+     * With io_cb->param_threads other than 1, the entries of the index are split in blocks shared by a
+     * pool of threads, and the files are reported in no particular order.
+     * The copies of a file that the build found are verified once, and reported after it: those whose size
+     * and last write time did not change since are given the results of the first one without being read.
+     * The index is only read: any number of searches may run at the same time on the same index,
+     * from different threads. A refresh, a merge or the update of a watcher waits for the searches
+     * running, and the searches started meanwhile wait for it.
      * @param i_index the index previously built with derrick_index_build
      * @param i_searchfor the string the look for
      * @param io_cb the callbacks and parameters, see definition
+     * @return DERRICK_OK if no error, DERRICK_BAD_PATTERN if the regular expression is not valid,
+     * DERRICK_STOPPED or DERRICK_TIMEOUT if the search was stopped before the end
      */
-    DERRICK_EXPORT void derrick_index_search(DerrickIndex i_index, const char* i_searchfor, Derrick_Parameters io_cb);
+    DERRICK_EXPORT int derrick_index_search(DerrickIndex i_index, const char* i_searchfor, Derrick_Parameters io_cb);
+
+    /**
+     * @brief search for the file(s) whose name, without its directory, contains a given string within
+     * the given index. The content of the files is not read: the names are selected with their own
+     * trigrams, so the search only looks at the names that contain all the trigrams of i_name.
+     * Each file is reported as a match in its name, with its whole path; files added or removed since
+     * the index was built or refreshed are not taken into account.
+     * With io_cb->param_regex, i_name is a regular expression matched against the names, so that ^ and $
+     * anchor it to their beginning and end. io_cb->param_case_sensitive, param_max_results, param_timeout,
+     * param_cancel and param_stats are used as by derrick_index_search; the search runs on the calling thread.
+     * @param i_index the index previously built with derrick_index_build
+     * @param i_name the string to look for in the names
+     * @param io_cb the callbacks and parameters, see definition
+     * @return DERRICK_OK if no error, DERRICK_BAD_PATTERN if the regular expression is not valid,
+     * DERRICK_STOPPED or DERRICK_TIMEOUT if the search was stopped before the end
+     */
+    DERRICK_EXPORT int derrick_index_find_names(DerrickIndex i_index, const char* i_name, Derrick_Parameters io_cb);
+
+    /**
+     * @brief search for the file(s) containing any of several strings within the given index.
+     * The candidate files are those that may contain at least one of the strings; each of them is
+     * read once. Every string is reported at most once per file, through io_cb->cd_found_pattern
+     * when it is set. The strings are never regular expressions.
+     * io_cb->param_threads is used the same way as by derrick_index_search.
+     * @param i_index the index previously built with derrick_index_build
+     * @param i_searchfor the strings to look for
+     * @param i_count number of strings in i_searchfor
+     * @param io_cb the callbacks and parameters, see definition
+     * @return DERRICK_OK if no error, DERRICK_STOPPED or DERRICK_TIMEOUT if the search was stopped
+     * before the end
+     */
+    DERRICK_EXPORT int derrick_index_search_multi(DerrickIndex i_index, const char* const* i_searchfor, size_t i_count, Derrick_Parameters io_cb);
 
     /**
      * @brief count the files that would be searched, the same way as derrick_deep_search would do
      * but without actually looking inside the file
      * @param i_searchin the root path to search in
-     * @return the total number of files that matches the criteria of io_cb->cb_exclude, or -1 in case of error
+     * @return the total number of files that matches the criteria of io_cb->param_filter, io_cb->cb_exclude
+     * and io_cb->cb_exclude_dir, or a negative error code
      */
     DERRICK_EXPORT int derrick_count_files(const char* i_searchin, Derrick_Parameters io_cb);
 
     /**
      * @brief search for the file(s) containing a given string i_searchfor in directory i_searchin by
      * examining all the files on the disk. The actual content of every file is scanned.
+     * With io_cb->param_threads other than 1, directories and files are processed in parallel by a pool of
+     * threads; the callbacks are still called one at a time, but from any of these threads.
+     * With io_cb->param_regex, i_searchfor is a regular expression and each matching line is reported
+     * once. The syntax is the usual one: . [] [^] * + ? {m,n} | () ^ $ and the escapes \d \w \s and
+     * their negations; a match never spans several lines.
+     * The search stops early when a callback returns non-zero, when io_cb->param_max_results matches
+     * were reported, when io_cb->param_timeout elapses or when *io_cb->param_cancel becomes non-zero.
      * @param i_searchfor the string to look for
      * @param i_searchin the root path to search in
      * @param io_cb the callbacks and parameters, see definition
-     * @return DERRICK_OK if no error
+     * @return DERRICK_OK if no error or if the search reached io_cb->param_max_results, DERRICK_BAD_PATTERN
+     * if the regular expression is not valid, DERRICK_STOPPED or DERRICK_TIMEOUT if it was stopped before the end
      */
     DERRICK_EXPORT int derrick_deep_search(const char* i_searchfor, const char* i_searchin, Derrick_Parameters io_cb);
 
+    /**
+     * @brief same as derrick_deep_search, but looking for several strings at once. They are compiled
+     * into an automaton that reads each file only once, so the cost hardly depends on their number.
+     * Every occurrence is reported through io_cb->cd_found_pattern, with the index of the string,
+     * or through io_cb->cd_found if it is not set. The strings are never regular expressions.
+     * @param i_searchfor the strings to look for
+     * @param i_count number of strings in i_searchfor
+     * @param i_searchin the root path to search in
+     * @param io_cb the callbacks and parameters, see definition
+     * @return DERRICK_OK if no error
+     */
+    DERRICK_EXPORT int derrick_deep_search_multi(const char* const* i_searchfor, size_t i_count, const char* i_searchin, Derrick_Parameters io_cb);
+
+    /**
+     * @brief select the substring search kernel used by all the search functions. By default the fastest
+     * kernel supported by the processor is selected on first use.
+     * @param i_kernel one of DERRICK_KERNEL_*, DERRICK_KERNEL_AUTO selecting the fastest supported one
+     * @return the kernel selected, or DERRICK_ERROR if the processor does not support i_kernel
+     */
+    DERRICK_EXPORT int derrick_set_kernel(int i_kernel);
+
+    /**
+     * @brief get the substring search kernel in use
+     * @return one of DERRICK_KERNEL_*
+     */
+    DERRICK_EXPORT int derrick_get_kernel(void);
+
+    /**
+     * @brief get the name of a substring search kernel
+     * @param i_kernel one of DERRICK_KERNEL_*
+     * @return a static string
+     */
+    DERRICK_EXPORT const char* derrick_kernel_name(int i_kernel);
+
+    /**
+     * @brief find the first occurrence of a string in a memory block with the current kernel
+     * @param i_data the memory block, which does not need to be zero-terminated
+     * @param i_size size of the memory block
+     * @param i_searchfor the string to look for
+     * @param i_length length of i_searchfor
+     * @return the address of the first occurrence in i_data, or 0 if not found
+     */
+    DERRICK_EXPORT const char* derrick_find(const char* i_data, size_t i_size, const char* i_searchfor, size_t i_length);
+
+    /**
+     * @brief same as derrick_find, but ignoring the case of ASCII letters
+     */
+    DERRICK_EXPORT const char* derrick_find_nocase(const char* i_data, size_t i_size, const char* i_searchfor, size_t i_length);
+
 #ifdef __cplusplus
 }
 #endif
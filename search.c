@@ -24,23 +24,134 @@
 #define CMD_DFS   "search"
 #define CMD_BASE  "base"
 #define CMD_COUNT "count"
+#define CMD_SAVE  "save"
+#define CMD_OPEN  "open"
+#define CMD_REFRESH "refresh"
+#define CMD_THREADS "threads"
+#define CMD_MULTI "multi"
+#define CMD_MFIND "mfind"
+#define CMD_FILTER "filter"
+#define CMD_BINARY "binary"
+#define CMD_LIMIT "limit"
+#define CMD_TIMEOUT "timeout"
+#define CMD_STATS "stats"
+#define CMD_WATCH "watch"
+#define CMD_UNWATCH "unwatch"
+#define CMD_CONTEXT "context"
+#define CMD_CACHE "cache"
+#define CMD_NAMES "names"
+#define OPT_NOCASE "-i "
+#define OPT_REGEX "-r "
 
-int Callback_Exclude(void* ctx, const char* file)
+int Callback_Found(void* ctx, const char* in, const char* where)
 {
-    // exclude files containing ".git" in their name
-    if (strstr(file, ".git") != NULL) return 1;
-    // some other rules
-    if (strstr(file, ".sqlite") != NULL) return 1;
-    // OK keep it
+    if (where)
+        printf("%s\n[%s]\n", in, where);
+    else
+        printf("%s\n", in);
     return 0;
 }
 
-void Callback_Found(void* ctx, const char* in, const char* where)
+int Callback_Found_Pattern(void* ctx, const char* in, const char* where, size_t pattern)
 {
+    const char** words = (const char**)ctx;
     if (where)
-        printf("%s\n[%s]\n", in, where);
+        printf("%s\n(%s) [%s]\n", in, words[pattern], where);
     else
-        printf("%s\n", in);
+        printf("%s\n(%s)\n", in, words[pattern]);
+    return 0;
+}
+
+// Print the matches with the lines around them, the line of the match marked with '>'
+int Callback_Results(void* ctx, const char* in, const struct Derrick_Result_s* results, size_t count)
+{
+    printf("%s\n", in);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const struct Derrick_Result_s* result = &results[i];
+        if (result->context == 0) continue;
+        const char* cur = result->context;
+        const char* end = result->context + result->context_length;
+        for (uint64_t number = result->context_line; cur < end || number == result->context_line; ++number)
+        {
+            const char* eol = memchr(cur, '\n', end - cur);
+            if (eol == 0) eol = end;
+            size_t length = eol - cur;
+            if (length > 0 && cur[length - 1] == '\r') length--;
+            printf("%6llu%c %.*s\n", (unsigned long long)number, number == result->line ? '>' : ':', (int)length, cur);
+            cur = eol + 1;
+        }
+        printf("--\n");
+    }
+    return 0;
+}
+
+// Tell why a search did not go to its end
+void PrintStopped(int rc)
+{
+    if (rc == DERRICK_TIMEOUT) printf("Timeout, the results are not complete\n");
+    else if (rc == DERRICK_STOPPED) printf("Stopped, the results are not complete\n");
+}
+
+// Print the counters of the last search, and for each phase its time and the number of
+// files, directories or batches by duration
+void PrintStats(const struct Derrick_Stats_s* i_stats)
+{
+    static const char* phases[DERRICK_PHASES] = { "walk", "open", "read", "scan", "callback" };
+    printf("Directories: %llu\n", (unsigned long long)i_stats->directories);
+    printf("Files opened: %llu, cached: %llu, skipped: %llu, failed: %llu", (unsigned long long)i_stats->files_opened,
+           (unsigned long long)i_stats->files_cached, (unsigned long long)i_stats->files_skipped, (unsigned long long)i_stats->files_failed);
+    if (i_stats->files_failed) printf(" (last error %u)", (unsigned)i_stats->last_error);
+    printf("\nBytes scanned: %llu\nMatches: %llu\n", (unsigned long long)i_stats->bytes_scanned, (unsigned long long)i_stats->matches);
+    for (int p = 0; p < DERRICK_PHASES; ++p)
+    {
+        printf("%-8s %10.3f ms |", phases[p], i_stats->nanoseconds[p] / 1e6);
+        for (int b = 0; b < DERRICK_HISTOGRAM_SIZE; ++b)
+        {
+            if (i_stats->histogram[p][b] == 0) continue;
+            printf(" <%lluus:%llu", 1ULL << b, (unsigned long long)i_stats->histogram[p][b]);
+        }
+        printf("\n");
+    }
+}
+
+// Split a list of words separated by spaces, in place
+size_t SplitWords(char* io_param, const char** o_words, size_t i_max)
+{
+    size_t count = 0;
+    char* word = strtok(io_param, " ");
+    while (word != 0 && count < i_max)
+    {
+        o_words[count++] = word;
+        word = strtok(0, " ");
+    }
+    return count;
+}
+
+// Files left out of the searches: the git files, the sqlite databases, and what the
+// .gitignore files found on the way say
+#define EXCLUDED ".git*\n*.sqlite*"
+
+// Skip the case-insensitive and regular expression options in front of the string to look for
+const char* ParseNeedle(const char* i_param, int* o_case_sensitive, int* o_regex)
+{
+    (*o_case_sensitive) = 1;
+    (*o_regex) = 0;
+    for (;;)
+    {
+        if (!strncmp(i_param, OPT_NOCASE, strlen(OPT_NOCASE)))
+        {
+            (*o_case_sensitive) = 0;
+            i_param += strlen(OPT_NOCASE);
+        }
+        else if (!strncmp(i_param, OPT_REGEX, strlen(OPT_REGEX)))
+        {
+            (*o_regex) = 1;
+            i_param += strlen(OPT_REGEX);
+        }
+        else break;
+    }
+    return i_param;
 }
 
 void PrintLastErrorMessage()
@@ -92,6 +203,21 @@ int main(int argc, char *argv[])
     char buff[100];
     char* base = 0;
     DerrickIndex pIndexBuffer = 0;
+    DerrickWatch watch = 0;
+    int threads = 1;
+    DerrickFilter filter = 0;
+    DerrickFilter excluded = 0;
+    int binary = DERRICK_BINARY_SKIP;
+    uint64_t limit = 0;
+    uint32_t context = 0;
+    uint64_t cache = 0;
+    uint32_t timeout = 0;
+    struct Derrick_Stats_s stats;
+    memset(&stats, 0, sizeof(stats));
+    derrick_filter_compile(&filter, EXCLUDED, 0, DERRICK_FILTER_IGNORE_FILES);
+    // The exclusions of the index, kept by its refreshes and its watcher: unlike filter, they
+    // never change, since the index must not outlive them
+    derrick_filter_compile(&excluded, EXCLUDED, 0, DERRICK_FILTER_IGNORE_FILES);
 
     // Main command loop
     while (strcmp(buff, CMD_QUIT))
@@ -116,7 +242,164 @@ int main(int argc, char *argv[])
         {
             if (base != 0)
             {
-                derrick_index_build(&pIndexBuffer, base);
+                struct Derrick_Parameters_s cb;
+                derrick_init_parameters(&cb);
+                cb.param_filter = excluded;
+                cb.param_threads = threads;
+                derrick_watch_stop(watch);
+                watch = 0;
+                derrick_index_free(pIndexBuffer);
+                if (strlen(buff) > strlen(CMD_INDEX) + 1)
+                {
+                    // index <directory>: segments written to the directory, resumed if it has some
+                    if (derrick_index_build_segments(&pIndexBuffer, base, buff + strlen(CMD_INDEX) + 1, &cb) != DERRICK_OK)
+                    {
+                        printf("Could not write the segments\n");
+                    }
+                }
+                else
+                {
+                    derrick_index_build_ex(&pIndexBuffer, base, &cb);
+                }
+                derrick_index_set_cache(pIndexBuffer, cache);
+            }
+        }
+        else if (strlen(buff) > strlen(CMD_CACHE) && !strncmp(buff, CMD_CACHE, strlen(CMD_CACHE)))
+        {
+            cache = strtoull(buff + strlen(CMD_CACHE) + 1, 0, 10) << 20;
+            printf("Cache [%lluMB]\n", (unsigned long long)(cache >> 20));
+            derrick_index_set_cache(pIndexBuffer, cache);
+        }
+        else if (strlen(buff) > strlen(CMD_THREADS) && !strncmp(buff, CMD_THREADS, strlen(CMD_THREADS)))
+        {
+            threads = atoi(buff + strlen(CMD_THREADS) + 1);
+            printf("Threads [%d]\n", threads);
+        }
+        else if (strlen(buff) >= strlen(CMD_REFRESH) && !strncmp(buff, CMD_REFRESH, strlen(CMD_REFRESH)))
+        {
+            if (base != 0 && pIndexBuffer != 0)
+            {
+                derrick_index_refresh(pIndexBuffer, base);
+            }
+        }
+        else if (strlen(buff) >= strlen(CMD_WATCH) && !strncmp(buff, CMD_WATCH, strlen(CMD_WATCH)))
+        {
+            if (base != 0 && pIndexBuffer != 0 && watch == 0)
+            {
+                rc = derrick_watch_start(&watch, pIndexBuffer, base, 0);
+                if (rc != DERRICK_OK) printf("Cannot watch [%s] (%d)\n", base, rc);
+            }
+        }
+        else if (strlen(buff) >= strlen(CMD_UNWATCH) && !strncmp(buff, CMD_UNWATCH, strlen(CMD_UNWATCH)))
+        {
+            derrick_watch_stop(watch);
+            watch = 0;
+        }
+        else if (strlen(buff) > strlen(CMD_SAVE) && !strncmp(buff, CMD_SAVE, strlen(CMD_SAVE)))
+        {
+            if (pIndexBuffer != 0)
+            {
+                rc = derrick_index_save(pIndexBuffer, buff + strlen(CMD_SAVE) + 1);
+                if (rc != DERRICK_OK) printf("Cannot save index (%d)\n", rc);
+            }
+        }
+        else if (strlen(buff) > strlen(CMD_OPEN) && !strncmp(buff, CMD_OPEN, strlen(CMD_OPEN)))
+        {
+            derrick_watch_stop(watch);
+            watch = 0;
+            derrick_index_free(pIndexBuffer);
+            rc = derrick_index_open(&pIndexBuffer, buff + strlen(CMD_OPEN) + 1);
+            if (rc != DERRICK_OK) printf("Cannot open index (%d)\n", rc);
+            else derrick_index_set_cache(pIndexBuffer, cache);
+        }
+        else if (strlen(buff) > strlen(CMD_LIMIT) && !strncmp(buff, CMD_LIMIT, strlen(CMD_LIMIT)))
+        {
+            limit = strtoull(buff + strlen(CMD_LIMIT) + 1, 0, 10);
+            printf("Limit [%llu]\n", (unsigned long long)limit);
+        }
+        else if (strlen(buff) > strlen(CMD_CONTEXT) && !strncmp(buff, CMD_CONTEXT, strlen(CMD_CONTEXT)))
+        {
+            context = (uint32_t)atoi(buff + strlen(CMD_CONTEXT) + 1);
+            printf("Context [%u]\n", (unsigned)context);
+        }
+        else if (strlen(buff) > strlen(CMD_TIMEOUT) && !strncmp(buff, CMD_TIMEOUT, strlen(CMD_TIMEOUT)))
+        {
+            timeout = (uint32_t)atoi(buff + strlen(CMD_TIMEOUT) + 1);
+            printf("Timeout [%ums]\n", (unsigned)timeout);
+        }
+        else if (strlen(buff) >= strlen(CMD_STATS) && !strncmp(buff, CMD_STATS, strlen(CMD_STATS)))
+        {
+            PrintStats(&stats);
+        }
+        else if (strlen(buff) > strlen(CMD_BINARY) && !strncmp(buff, CMD_BINARY, strlen(CMD_BINARY)))
+        {
+            const char* mode = buff + strlen(CMD_BINARY) + 1;
+            if (!strcmp(mode, "skip")) binary = DERRICK_BINARY_SKIP;
+            else if (!strcmp(mode, "report")) binary = DERRICK_BINARY_REPORT;
+            else if (!strcmp(mode, "text")) binary = DERRICK_BINARY_TEXT;
+            else printf("UNKNOWN [%s]\n", mode);
+        }
+        else if (strlen(buff) >= strlen(CMD_FILTER) && !strncmp(buff, CMD_FILTER, strlen(CMD_FILTER)))
+        {
+            // The patterns of the files to search, one per line
+            char* include = _strdup(buff + strlen(CMD_FILTER));
+            for (char* c = include; *c; ++c)
+            {
+                if (*c == ' ') *c = '\n';
+            }
+            DerrickFilter compiled;
+            rc = derrick_filter_compile(&compiled, EXCLUDED, include, DERRICK_FILTER_IGNORE_FILES);
+            if (rc == DERRICK_OK)
+            {
+                derrick_filter_free(filter);
+                filter = compiled;
+            }
+            else printf("Invalid pattern\n");
+            free(include);
+        }
+        else if (strlen(buff) > strlen(CMD_MULTI) && !strncmp(buff, CMD_MULTI, strlen(CMD_MULTI)))
+        {
+            int case_sensitive, regex;
+            const char* words[50];
+            char* needles = (char*)ParseNeedle(buff + strlen(CMD_MULTI) + 1, &case_sensitive, &regex);
+            size_t count = SplitWords(needles, words, sizeof(words) / sizeof(words[0]));
+            if (count > 0 && base != 0)
+            {
+                struct Derrick_Parameters_s cb;
+                derrick_init_parameters(&cb);
+                cb.param_filter = filter;
+                cb.param_binary = binary;
+                cb.cd_found_pattern = &Callback_Found_Pattern;
+                cb.ctx_found = words;
+                cb.param_threads = threads;
+                cb.param_case_sensitive = case_sensitive;
+                cb.param_max_results = limit;
+                cb.param_timeout = timeout;
+                cb.param_stats = &stats;
+                memset(&stats, 0, sizeof(stats));
+                PrintStopped(derrick_deep_search_multi(words, count, base, &cb));
+            }
+        }
+        else if (strlen(buff) > strlen(CMD_MFIND) && !strncmp(buff, CMD_MFIND, strlen(CMD_MFIND)))
+        {
+            int case_sensitive, regex;
+            const char* words[50];
+            char* needles = (char*)ParseNeedle(buff + strlen(CMD_MFIND) + 1, &case_sensitive, &regex);
+            size_t count = SplitWords(needles, words, sizeof(words) / sizeof(words[0]));
+            if (count > 0 && pIndexBuffer != 0)
+            {
+                struct Derrick_Parameters_s cb;
+                derrick_init_parameters(&cb);
+                cb.cd_found_pattern = &Callback_Found_Pattern;
+                cb.ctx_found = words;
+                cb.param_case_sensitive = case_sensitive;
+                cb.param_binary = binary;
+                cb.param_threads = threads;
+                cb.param_max_results = limit;
+                cb.param_timeout = timeout;
+                cb.param_stats = &stats;
+                memset(&stats, 0, sizeof(stats));
+                PrintStopped(derrick_index_search_multi(pIndexBuffer, words, count, &cb));
             }
         }
         else if (strlen(buff) >= strlen(CMD_PRINT) && !strncmp(buff, CMD_PRINT, strlen(CMD_PRINT)))
@@ -133,17 +416,52 @@ int main(int argc, char *argv[])
                 derrick_index_list(pIndexBuffer);
             }
         }
+        else if (strlen(buff) > strlen(CMD_NAMES) && !strncmp(buff, CMD_NAMES, strlen(CMD_NAMES)))
+        {
+            int case_sensitive, regex;
+            const char* needle = ParseNeedle(buff + strlen(CMD_NAMES) + 1, &case_sensitive, &regex);
+            if (needle != 0 && pIndexBuffer != 0)
+            {
+                struct Derrick_Parameters_s cb;
+                derrick_init_parameters(&cb);
+                cb.cd_found = &Callback_Found;
+                cb.param_case_sensitive = case_sensitive;
+                cb.param_regex = regex;
+                cb.param_max_results = limit;
+                cb.param_timeout = timeout;
+                cb.param_stats = &stats;
+                memset(&stats, 0, sizeof(stats));
+                rc = derrick_index_find_names(pIndexBuffer, needle, &cb);
+                if (rc == DERRICK_BAD_PATTERN) printf("Invalid regular expression\n");
+                PrintStopped(rc);
+            }
+        }
         else if (strlen(buff) >= strlen(CMD_FIND) && !strncmp(buff, CMD_FIND, strlen(CMD_FIND)))
         {
-            const char* needle = buff + strlen(CMD_FIND) + 1;
+            int case_sensitive, regex;
+            const char* needle = ParseNeedle(buff + strlen(CMD_FIND) + 1, &case_sensitive, &regex);
             if (needle != 0)
             {
                 struct Derrick_Parameters_s cb;
-                cb.cb_exclude = &Callback_Exclude;
+                derrick_init_parameters(&cb);
+                cb.param_filter = filter;
+                cb.param_binary = binary;
                 cb.cd_found = &Callback_Found;
-                cb.ctx_exclude = 0;
-                cb.ctx_found = 0;
-                derrick_index_search(pIndexBuffer, needle, &cb);
+                cb.param_threads = threads;
+                cb.param_case_sensitive = case_sensitive;
+                cb.param_regex = regex;
+                cb.param_max_results = limit;
+                cb.param_timeout = timeout;
+                if (context > 0)
+                {
+                    cb.cb_results = &Callback_Results;
+                    cb.param_context = context;
+                }
+                cb.param_stats = &stats;
+                memset(&stats, 0, sizeof(stats));
+                rc = derrick_index_search(pIndexBuffer, needle, &cb);
+                if (rc == DERRICK_BAD_PATTERN) printf("Invalid regular expression\n");
+                PrintStopped(rc);
             }
         }
         else if (strlen(buff) >= strlen(CMD_BASE) && !strncmp(buff, CMD_BASE, strlen(CMD_BASE)))
@@ -162,15 +480,30 @@ int main(int argc, char *argv[])
         }
         else if (strlen(buff) >= strlen(CMD_DFS) && !strncmp(buff, CMD_DFS, strlen(CMD_DFS)))
         {
-            const char* needle = buff + strlen(CMD_DFS) + 1;
+            int case_sensitive, regex;
+            const char* needle = ParseNeedle(buff + strlen(CMD_DFS) + 1, &case_sensitive, &regex);
             if (needle != 0 && base !=0)
             {
                 struct Derrick_Parameters_s cb;
-                cb.cb_exclude = &Callback_Exclude;
+                derrick_init_parameters(&cb);
+                cb.param_filter = filter;
+                cb.param_binary = binary;
                 cb.cd_found = &Callback_Found;
-                cb.ctx_exclude = 0;
-                cb.ctx_found = 0;
-                derrick_deep_search(needle, base, &cb);
+                cb.param_threads = threads;
+                cb.param_case_sensitive = case_sensitive;
+                cb.param_regex = regex;
+                cb.param_max_results = limit;
+                cb.param_timeout = timeout;
+                if (context > 0)
+                {
+                    cb.cb_results = &Callback_Results;
+                    cb.param_context = context;
+                }
+                cb.param_stats = &stats;
+                memset(&stats, 0, sizeof(stats));
+                rc = derrick_deep_search(needle, base, &cb);
+                if (rc == DERRICK_BAD_PATTERN) printf("Invalid regular expression\n");
+                PrintStopped(rc);
             }
         }
         else if (strlen(buff) >= strlen(CMD_COUNT) && !strncmp(buff, CMD_COUNT, strlen(CMD_COUNT)))
@@ -178,10 +511,11 @@ int main(int argc, char *argv[])
             if (base !=0)
             {
                 struct Derrick_Parameters_s cb;
-                cb.cb_exclude = &Callback_Exclude;
+                derrick_init_parameters(&cb);
+                cb.param_filter = filter;
+                cb.param_binary = binary;
                 cb.cd_found = &Callback_Found;
-                cb.ctx_exclude = 0;
-                cb.ctx_found = 0;
+                cb.param_threads = threads;
                 printf("Number of files: %d\n", derrick_count_files(base, &cb));
             }
         }
@@ -191,5 +525,6 @@ int main(int argc, char *argv[])
         }
     }
 
+    derrick_watch_stop(watch);
     return 0;
 }
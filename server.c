@@ -0,0 +1,434 @@
+/**
+ * @file        server.c
+ * @author      Mathieu Allory
+ * @date        February 2018
+ * @brief       Derrick DFS: deep file search and indexing library
+ * @ref         https://github.com/thew44/derrick
+ *
+ * @details     Resident program holding one index, kept up to date by a watcher, and serving
+ *              the searches of any number of clients over a named pipe
+ *
+ * @license     MIT License
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "derrick.h"
+
+#define PIPE_DEFAULT    "derrick"
+// Size of the buffers of the pipe, per client and per direction
+#define PIPE_BUFFER     (64 << 10)
+// Results waiting to be sent are queued for the writer of the client once they fill this many bytes
+#define SEND_CHUNK      (16 << 10)
+// Bytes of results a client may have queued: a search that finds more waits for the writer
+#define SEND_QUEUE      (1 << 20)
+// Milliseconds a client may leave its results unread before it is dropped
+#define SEND_STALL      10000
+// Longest request line
+#define REQUEST_MAX     (64 << 10)
+#define MAX_WORDS       64
+
+#define CMD_FIND  "find "
+#define CMD_MFIND "mfind "
+#define CMD_NAMES "names "
+#define OPT_NOCASE "-i "
+#define OPT_REGEX "-r "
+#define OPT_LIMIT "-n "
+
+// Files left out of the index, as in search.c
+#define EXCLUDED ".git*\n*.sqlite*"
+
+// What the server shares with all its clients
+struct Server_s
+{
+    DerrickIndex index;
+    int threads;            // per search
+};
+
+// A connected client. Its requests are served one after the other, in the order they came.
+// The responses are written to the pipe by a thread of their own, so that a search holding
+// the index never waits on a client that reads slowly, unless its queue is full.
+struct Client_s
+{
+    struct Server_s* server;
+    HANDLE pipe;
+    OVERLAPPED overlapped;  // of the reads
+    char* request;          // bytes received, the last line may not be complete
+    size_t request_size;
+    char* send;             // bytes of the current response not queued yet
+    size_t send_size;
+    size_t send_capacity;
+    uint64_t matches;       // of the current request
+
+    // Shared with the writer, under the lock
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE queued;  // bytes were queued, or the client is closing
+    CONDITION_VARIABLE room;    // bytes were written
+    char* queue;                // bytes waiting for the writer
+    size_t queue_size;
+    size_t queue_capacity;
+    uint64_t written;           // bytes written so far
+    int closing;                // no more requests, the writer ends once the queue is sent
+    volatile LONG broken;       // the client is gone or stalled, its searches stop
+
+    HANDLE writer;
+    OVERLAPPED write;           // of the writer
+};
+
+// Complete an overlapped read or write on the pipe of a client, waiting at most i_timeout milliseconds
+BOOL WaitPipe(struct Client_s* io_client, OVERLAPPED* io_overlapped, BOOL i_started, DWORD i_timeout, DWORD* o_bytes)
+{
+    if (!i_started && GetLastError() != ERROR_IO_PENDING) return FALSE;
+    if (WaitForSingleObject(io_overlapped->hEvent, i_timeout) != WAIT_OBJECT_0)
+    {
+        CancelIo(io_client->pipe);
+        GetOverlappedResult(io_client->pipe, io_overlapped, o_bytes, TRUE);
+        return FALSE;
+    }
+    return GetOverlappedResult(io_client->pipe, io_overlapped, o_bytes, FALSE);
+}
+
+// The writer of a client: send what is queued, until the client is closing and all is sent.
+// A write blocks while the client does not read, which holds back its searches once its queue
+// is full.
+DWORD WINAPI Write(LPVOID arg)
+{
+    struct Client_s* client = (struct Client_s*)arg;
+    char* data = 0;
+    size_t capacity = 0;
+    EnterCriticalSection(&client->lock);
+    for (;;)
+    {
+        while (client->queue_size == 0 && !client->closing)
+        {
+            SleepConditionVariableCS(&client->queued, &client->lock, INFINITE);
+        }
+        if (client->queue_size == 0) break;
+
+        // Take the queue, and leave the buffer of the previous one in its place
+        char* taken = client->queue;
+        size_t size = client->queue_size;
+        client->queue = data;
+        client->queue_size = 0;
+        data = taken;
+        size_t swap = client->queue_capacity;
+        client->queue_capacity = capacity;
+        capacity = swap;
+
+        size_t sent = 0;
+        while (!client->broken && sent < size)
+        {
+            LeaveCriticalSection(&client->lock);
+            DWORD bytes = 0;
+            DWORD piece = (DWORD)((size - sent < PIPE_BUFFER) ? size - sent : PIPE_BUFFER);
+            ResetEvent(client->write.hEvent);
+            BOOL started = WriteFile(client->pipe, data + sent, piece, NULL, &client->write);
+            BOOL done = WaitPipe(client, &client->write, started, SEND_STALL, &bytes) && bytes > 0;
+            EnterCriticalSection(&client->lock);
+            if (!done) client->broken = 1;
+            sent += bytes;
+            client->written += bytes;
+            WakeAllConditionVariable(&client->room);
+        }
+    }
+    LeaveCriticalSection(&client->lock);
+    free(data);
+    return 0;
+}
+
+// Queue the bytes of the current response for the writer. Beyond SEND_QUEUE, wait while the
+// writer sends: a client that takes nothing for SEND_STALL milliseconds is broken. Returns
+// whether the client is broken, its bytes are then dropped.
+int Queue(struct Client_s* io_client)
+{
+    EnterCriticalSection(&io_client->lock);
+    while (!io_client->broken && io_client->queue_size > 0 && io_client->queue_size + io_client->send_size > SEND_QUEUE)
+    {
+        uint64_t written = io_client->written;
+        if (!SleepConditionVariableCS(&io_client->room, &io_client->lock, SEND_STALL) && io_client->written == written)
+        {
+            io_client->broken = 1;
+        }
+    }
+    if (!io_client->broken)
+    {
+        if (io_client->queue_size + io_client->send_size > io_client->queue_capacity)
+        {
+            io_client->queue_capacity = io_client->queue_size + io_client->send_size;
+            if (io_client->queue_capacity < SEND_QUEUE) io_client->queue_capacity = SEND_QUEUE;
+            io_client->queue = realloc(io_client->queue, io_client->queue_capacity);
+        }
+        memcpy(io_client->queue + io_client->queue_size, io_client->send, io_client->send_size);
+        io_client->queue_size += io_client->send_size;
+        WakeConditionVariable(&io_client->queued);
+    }
+    int broken = io_client->broken;
+    LeaveCriticalSection(&io_client->lock);
+    io_client->send_size = 0;
+    return broken;
+}
+
+void Send(struct Client_s* io_client, const char* i_data, size_t i_size)
+{
+    if (io_client->send_size + i_size > io_client->send_capacity)
+    {
+        io_client->send_capacity = (io_client->send_size + i_size) * 2;
+        io_client->send = realloc(io_client->send, io_client->send_capacity);
+    }
+    memcpy(io_client->send + io_client->send_size, i_data, i_size);
+    io_client->send_size += i_size;
+}
+
+// A match, sent as "M <tab> pattern <tab> file <tab> line". Names of files cannot hold a tab,
+// and the line runs until the newline.
+int Callback_Found_Pattern(void* ctx, const char* in, const char* where, size_t pattern)
+{
+    struct Client_s* client = (struct Client_s*)ctx;
+    char sHead[32];
+    int length = sprintf(sHead, "M\t%u\t", (unsigned)pattern);
+    Send(client, sHead, (size_t)length);
+    Send(client, in, strlen(in));
+    Send(client, "\t", 1);
+    if (where) Send(client, where, strlen(where));
+    Send(client, "\n", 1);
+    client->matches++;
+    if (client->send_size >= SEND_CHUNK) return Queue(client);
+    return client->broken;
+}
+
+// Skip the options in front of the string to look for
+const char* ParseOptions(const char* i_param, Derrick_Parameters io_cb)
+{
+    for (;;)
+    {
+        if (!strncmp(i_param, OPT_NOCASE, strlen(OPT_NOCASE)))
+        {
+            io_cb->param_case_sensitive = 0;
+            i_param += strlen(OPT_NOCASE);
+        }
+        else if (!strncmp(i_param, OPT_REGEX, strlen(OPT_REGEX)))
+        {
+            io_cb->param_regex = 1;
+            i_param += strlen(OPT_REGEX);
+        }
+        else if (!strncmp(i_param, OPT_LIMIT, strlen(OPT_LIMIT)))
+        {
+            char* end = 0;
+            io_cb->param_max_results = strtoull(i_param + strlen(OPT_LIMIT), &end, 10);
+            i_param = (*end == ' ') ? end + 1 : end;
+        }
+        else break;
+    }
+    return i_param;
+}
+
+// Serve a request line, and end its response with "E <tab> return code <tab> matches <tab> microseconds"
+void Execute(struct Client_s* io_client, char* io_line)
+{
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    struct Derrick_Parameters_s cb;
+    derrick_init_parameters(&cb);
+    cb.cd_found_pattern = &Callback_Found_Pattern;
+    cb.ctx_found = io_client;
+    cb.param_threads = io_client->server->threads;
+    io_client->matches = 0;
+
+    int rc = DERRICK_OK;
+    if (!strncmp(io_line, CMD_FIND, strlen(CMD_FIND)))
+    {
+        const char* needle = ParseOptions(io_line + strlen(CMD_FIND), &cb);
+        rc = derrick_index_search(io_client->server->index, needle, &cb);
+    }
+    else if (!strncmp(io_line, CMD_MFIND, strlen(CMD_MFIND)))
+    {
+        // Split the words in place, strtok is not safe with a thread per client
+        const char* words[MAX_WORDS];
+        size_t count = 0;
+        for (char* cur = io_line + strlen(CMD_MFIND); *cur != '\0' && count < MAX_WORDS; )
+        {
+            if (*cur == ' ') { cur++; continue; }
+            words[count++] = cur;
+            while (*cur != '\0' && *cur != ' ') cur++;
+            if (*cur == ' ') *cur++ = '\0';
+        }
+        rc = derrick_index_search_multi(io_client->server->index, words, count, &cb);
+    }
+    else if (!strncmp(io_line, CMD_NAMES, strlen(CMD_NAMES)))
+    {
+        const char* needle = ParseOptions(io_line + strlen(CMD_NAMES), &cb);
+        rc = derrick_index_find_names(io_client->server->index, needle, &cb);
+    }
+    else
+    {
+        rc = DERRICK_ERROR;
+    }
+
+    QueryPerformanceCounter(&end);
+    char sEnd[96];
+    int length = sprintf(sEnd, "E\t%d\t%llu\t%llu\n", rc, (unsigned long long)io_client->matches,
+                         (unsigned long long)((end.QuadPart - start.QuadPart) * 1000000 / frequency.QuadPart));
+    Send(io_client, sEnd, (size_t)length);
+    Queue(io_client);
+}
+
+// Read the requests of a client until it disconnects. Several requests may come at once: they
+// are answered in order, without waiting for the client to read the previous responses.
+DWORD WINAPI Serve(LPVOID arg)
+{
+    struct Client_s* client = (struct Client_s*)arg;
+    client->request = malloc(REQUEST_MAX + 1);
+    InitializeCriticalSection(&client->lock);
+    InitializeConditionVariable(&client->queued);
+    InitializeConditionVariable(&client->room);
+    client->write.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    client->writer = CreateThread(NULL, 0, &Write, client, 0, NULL);
+    while (client->writer != NULL && !client->broken)
+    {
+        DWORD bytes = 0;
+        ResetEvent(client->overlapped.hEvent);
+        BOOL started = ReadFile(client->pipe, client->request + client->request_size, (DWORD)(REQUEST_MAX - client->request_size), NULL, &client->overlapped);
+        if (!WaitPipe(client, &client->overlapped, started, INFINITE, &bytes) || bytes == 0) break;
+        client->request_size += bytes;
+
+        size_t begin = 0;
+        for (size_t i = client->request_size - bytes; i < client->request_size && !client->broken; ++i)
+        {
+            if (client->request[i] != '\n') continue;
+            size_t end = (i > begin && client->request[i - 1] == '\r') ? i - 1 : i;
+            client->request[end] = '\0';
+            Execute(client, client->request + begin);
+            begin = i + 1;
+        }
+        memmove(client->request, client->request + begin, client->request_size - begin);
+        client->request_size -= begin;
+        if (client->request_size == REQUEST_MAX)
+        {
+            Send(client, "E\t-1\t0\t0\n", 9);
+            Queue(client);
+            break;
+        }
+    }
+
+    // Let the writer send the responses queued before the pipe is closed
+    EnterCriticalSection(&client->lock);
+    client->closing = 1;
+    WakeConditionVariable(&client->queued);
+    LeaveCriticalSection(&client->lock);
+    if (client->writer != NULL)
+    {
+        WaitForSingleObject(client->writer, INFINITE);
+        CloseHandle(client->writer);
+    }
+
+    DisconnectNamedPipe(client->pipe);
+    CloseHandle(client->pipe);
+    CloseHandle(client->overlapped.hEvent);
+    CloseHandle(client->write.hEvent);
+    DeleteCriticalSection(&client->lock);
+    free(client->request);
+    free(client->send);
+    free(client->queue);
+    free(client);
+    return 0;
+}
+
+void Usage(void)
+{
+    printf("usage: server <directory> [pipe=NAME] [threads=N] [store=DIRECTORY] [cache=MB]\n"
+           "Indexes the directory, then serves the searches on \\\\.\\pipe\\NAME (default: " PIPE_DEFAULT ").\n"
+           "Requests, one per line:  find [-i] [-r] [-n MAX] STRING  |  mfind WORD WORD...\n"
+           "Responses: M<tab>pattern<tab>file<tab>line per match, then E<tab>code<tab>matches<tab>microseconds.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char* pipe = PIPE_DEFAULT;
+    const char* store = 0;
+    uint64_t cache = 0;
+    struct Server_s server;
+    server.index = 0;
+    server.threads = 1;
+    if (argc < 2)
+    {
+        Usage();
+        return 1;
+    }
+    for (int a = 2; a < argc; ++a)
+    {
+        const char* value = strchr(argv[a], '=');
+        if (value == 0) { Usage(); return 1; }
+        value++;
+        if (!strncmp(argv[a], "pipe=", 5)) pipe = value;
+        else if (!strncmp(argv[a], "threads=", 8)) server.threads = atoi(value);
+        else if (!strncmp(argv[a], "store=", 6)) store = value;
+        else if (!strncmp(argv[a], "cache=", 6)) cache = strtoull(value, 0, 10) << 20;
+        else { Usage(); return 1; }
+    }
+
+    const char* root = argv[1];
+    DerrickFilter filter = 0;
+    derrick_filter_compile(&filter, EXCLUDED, 0, DERRICK_FILTER_IGNORE_FILES);
+    struct Derrick_Parameters_s cb;
+    derrick_init_parameters(&cb);
+    cb.param_filter = filter;
+    cb.param_threads = 0;
+    int rc = store ? derrick_index_build_segments(&server.index, root, store, &cb) : derrick_index_build_ex(&server.index, root, &cb);
+    if (rc != DERRICK_OK)
+    {
+        fprintf(stderr, "Cannot index %s (%d)\n", root, rc);
+        return 1;
+    }
+    derrick_index_set_cache(server.index, cache);
+    DerrickWatch watch = 0;
+    rc = derrick_watch_start(&watch, server.index, root, 0);
+    if (rc != DERRICK_OK)
+    {
+        fprintf(stderr, "Cannot watch %s (%d), the index will not follow the changes\n", root, rc);
+    }
+
+    char sPipe[MAX_PATH];
+    snprintf(sPipe, sizeof(sPipe), "\\\\.\\pipe\\%s", pipe);
+    fprintf(stderr, "%llu files indexed, serving on %s\n", (unsigned long long)server.index->number_of_entries, sPipe);
+
+    // An instance of the pipe per client, each served by a thread of its own
+    for (;;)
+    {
+        HANDLE hPipe = CreateNamedPipeA(sPipe, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                                        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                        PIPE_UNLIMITED_INSTANCES, PIPE_BUFFER, PIPE_BUFFER, 0, NULL);
+        if (hPipe == INVALID_HANDLE_VALUE)
+        {
+            fprintf(stderr, "Cannot create the pipe %s (%u)\n", sPipe, (unsigned)GetLastError());
+            break;
+        }
+
+        struct Client_s* client = calloc(1, sizeof(struct Client_s));
+        client->server = &server;
+        client->pipe = hPipe;
+        client->overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+        DWORD bytes = 0;
+        BOOL connected = ConnectNamedPipe(hPipe, &client->overlapped);
+        if (!connected && GetLastError() == ERROR_PIPE_CONNECTED) connected = TRUE;
+        else if (!connected) connected = WaitPipe(client, &client->overlapped, FALSE, INFINITE, &bytes);
+
+        HANDLE hThread = connected ? CreateThread(NULL, 0, &Serve, client, 0, NULL) : NULL;
+        if (hThread == NULL)
+        {
+            CloseHandle(hPipe);
+            CloseHandle(client->overlapped.hEvent);
+            free(client);
+            continue;
+        }
+        CloseHandle(hThread);
+    }
+
+    derrick_watch_stop(watch);
+    derrick_index_free(server.index);
+    derrick_filter_free(filter);
+    return 1;
+}